@@ -76,6 +76,8 @@ parser.add_option("--keypool",         dest="keypool",     default=100, type="in
 parser.add_option("--rebuild",         dest="rebuild",     default=False,     action="store_true", help="Rebuild blockchain database and rescan")
 parser.add_option("--rescan",          dest="rescan",      default=False,     action="store_true", help="Rescan existing blockchain DB")
 parser.add_option("--maxfiles",        dest="maxOpenFiles",default=0,         type="int",          help="Set maximum allowed open files for LevelDB databases")
+parser.add_option("--ingestthreads",   dest="ingestThreads",default=1,        type="int",          help="Threads used to parse blocks when building the DB (0 for one per core)")
+parser.add_option("--scanthreads",     dest="scanThreads", default=1,        type="int",          help="Threads used to scan the DB for wallet transactions (0 for one per core)")
 
 # These are arguments passed by running unit-tests that need to be handled
 parser.add_option("--port", dest="port", default=None, type="int", help="Unit Test Argument - Do not consume")
@@ -13028,6 +13030,11 @@ class BlockDataManagerThread(threading.Thread):
       # still need to be scanned to collect the wallet ledger and UTXO sets
       self.bdm.scanBlockchainForTx(self.masterCppWallet)
 
+      # From here on, readBlkFileUpdate only reads blocks the watcher found,
+      # and callers can block on waitForBlkFileUpdate.  Returns False (and we
+      # keep polling the blk files) if it's not supported on this OS.
+      self.bdm.startBlkFileWatcher()
+
       TimerStop('__startLoadBlockchain')
 
       
@@ -13529,6 +13536,14 @@ else:
       LOGINFO('Overriding max files via command-line arg')
       TheBDM.setMaxOpenFiles( CLI_OPTIONS.maxOpenFiles )
 
+   if not CLI_OPTIONS.ingestThreads == 1:
+      LOGINFO('Setting block-ingest threads via command-line arg')
+      TheBDM.setNumIngestThreads( CLI_OPTIONS.ingestThreads )
+
+   if not CLI_OPTIONS.scanThreads == 1:
+      LOGINFO('Setting wallet-scan threads via command-line arg')
+      TheBDM.setNumScanThreads( CLI_OPTIONS.scanThreads )
+
    #LOGINFO('LevelDB max-open-files is %d', TheBDM.getMaxOpenFiles())
 
    # Also load the might-be-needed SatoshiDaemonManager
@@ -12,6 +12,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 BinaryData::BinaryData(BinaryDataRef const & bdRef) 
 { 
+   init();
    copyFrom(bdRef.getPtr(), bdRef.getSize());
 }
 
@@ -34,14 +35,7 @@ BinaryDataRef BinaryData::getRef(void) const
 ////////////////////////////////////////////////////////////////////////////////
 BinaryData & BinaryData::append(BinaryDataRef const & bd2)
 {
-   if(bd2.getSize()==0) 
-      return (*this);
-   
-   if(getSize()==0) 
-      copyFrom(bd2.getPtr(), bd2.getSize());
-   else
-      data_.insert(data_.end(), bd2.getPtr(), bd2.getPtr()+bd2.getSize());
-
+   appendBytes(bd2.getPtr(), bd2.getSize());
    return (*this);
 }
 
@@ -62,12 +56,12 @@ int32_t BinaryData::find(BinaryDataRef const & matchStr, uint32_t startPos)
 
    for(int32_t i=startPos; i<=(int32_t)getSize()-(int32_t)matchStr.getSize(); i++)
    {
-      if(matchStr[0] != data_[i])
+      if(matchStr[0] != ptr_[i])
          continue;
 
       for(uint32_t j=0; j<matchStr.getSize(); j++)
       {
-         if(matchStr[j] != data_[i+j])
+         if(matchStr[j] != ptr_[i+j])
             break;
 
          // If we are at this instruction and is the last index, it's a match
@@ -43,6 +43,11 @@
 
 #define DEFAULT_BUFFER_SIZE 32*1048576
 
+// BinaryData objects up to this size keep their bytes inside the object and
+// never touch the heap.  This covers hashes, hash160s, scrAddrs and DB keys,
+// which are the overwhelming majority of the BinaryData objects we create.
+#define BINARYDATA_INLINE_SIZE 40
+
 #include "UniversalTimer.h"
 
 
@@ -101,19 +106,28 @@ public:
 
 
    /////////////////////////////////////////////////////////////////////////////
-   BinaryData(void) : data_(0)                 {                         }
-   explicit BinaryData(size_t sz)              { alloc(sz);              }
+   BinaryData(void)                            { init();                 }
+   explicit BinaryData(size_t sz)              { init(); alloc(sz);      }
    BinaryData(uint8_t const * inData, size_t sz)      
-                                               { copyFrom(inData, sz);   }
+                                               { init(); copyFrom(inData, sz);   }
    BinaryData(uint8_t const * dstart, uint8_t const * dend ) 
-                                               { copyFrom(dstart, dend); }
-   BinaryData(string const & str)              { copyFrom(str);          }
-   BinaryData(BinaryData const & bd)           { copyFrom(bd);           }
+                                               { init(); copyFrom(dstart, dend); }
+   BinaryData(string const & str)              { init(); copyFrom(str);  }
+   BinaryData(BinaryData const & bd)           { init(); copyFrom(bd);   }
 
    BinaryData(BinaryDataRef const & bdRef);
-   size_t getSize(void) const               { return data_.size(); }
+   ~BinaryData(void)                           { freeHeap();             }
+
+   BinaryData & operator=(BinaryData const & bd)
+   {
+      if(this != &bd)
+         copyFrom(bd);
+      return (*this);
+   }
+
+   size_t getSize(void) const               { return size_; }
 
-   bool isNull(void) { return (data_.size()==0);}
+   bool isNull(void) { return (size_==0);}
 
    /////////////////////////////////////////////////////////////////////////////
    uint8_t const * getPtr(void) const       
@@ -121,7 +135,7 @@ public:
       if(getSize()==0)
          return NULL;
       else
-         return &(data_[0]); 
+         return ptr_; 
    }
 
    /////////////////////////////////////////////////////////////////////////////
@@ -130,11 +144,11 @@ public:
       if(getSize()==0)
          return NULL;
       else
-         return &(data_[0]); 
+         return ptr_; 
    }  
 
    BinaryDataRef getRef(void) const;
-   //uint8_t const * getConstPtr(void) const  { return &(data_[0]); }
+   //uint8_t const * getConstPtr(void) const  { return ptr_; }
    
    /////////////////////////////////////////////////////////////////////////////
    // We allocate space as necesssary
@@ -151,29 +165,35 @@ public:
          alloc(0);
       else
       {
-         alloc(sz); 
-         memcpy( &(data_[0]), inData, sz);
+         // No need to zero it first, and inData may be in our own buffer
+         if(sz > capacity_)
+         {
+            uint8_t* newPtr = new uint8_t[sz];
+            memcpy(newPtr, inData, sz);
+            setHeap(newPtr, sz);
+         }
+         else
+            memmove(ptr_, inData, sz);
+         size_ = sz;
       }
    }
 
    /////////////////////////////////////////////////////////////////////////////
    // UNSAFE -- you don't know if outData holds enough space for this
-   void copyTo(uint8_t* outData) const { memcpy( outData, &(data_[0]), getSize()); }
-   void copyTo(uint8_t* outData, size_t sz) const { memcpy( outData, &(data_[0]), (size_t)sz); }
-   void copyTo(uint8_t* outData, size_t offset, size_t sz) const { memcpy( outData, &(data_[offset]), (size_t)sz); }
+   void copyTo(uint8_t* outData) const { memcpy( outData, ptr_, getSize()); }
+   void copyTo(uint8_t* outData, size_t sz) const { memcpy( outData, ptr_, (size_t)sz); }
+   void copyTo(uint8_t* outData, size_t offset, size_t sz) const { memcpy( outData, ptr_+offset, (size_t)sz); }
    void copyTo(BinaryData & bd) const 
    {
-      bd.resize(data_.size());
-#ifdef _MSC_VER 
-	  if(data_.size())
-#endif
-	  memcpy( bd.getPtr(), &data_[0], data_.size());
+      bd.resize(size_);
+	  if(size_)
+	     memcpy( bd.getPtr(), ptr_, size_);
    }
 
    void fill(uint8_t ch) { if(getSize()>0) memset(getPtr(), ch, getSize()); }
                
-   uint8_t & operator[](int32_t i)       { return (i<0 ? data_[getSize()+i] : data_[i]); }
-   uint8_t   operator[](int32_t i) const { return (i<0 ? data_[getSize()+i] : data_[i]); } 
+   uint8_t & operator[](int32_t i)       { return (i<0 ? ptr_[getSize()+i] : ptr_[i]); }
+   uint8_t   operator[](int32_t i) const { return (i<0 ? ptr_[getSize()+i] : ptr_[i]); } 
 
    /////////////////////////////////////////////////////////////////////////////
    friend ostream& operator<<(ostream& os, BinaryData const & bd)
@@ -196,13 +216,7 @@ public:
    // This is about as efficient as we're going to get...
    BinaryData & append(BinaryData const & bd2)
    {
-      if(bd2.getSize()==0) 
-         return (*this);
-   
-      if(getSize()==0) 
-         copyFrom(bd2.getPtr(), bd2.getSize());
-      else
-         data_.insert(data_.end(), bd2.data_.begin(), bd2.data_.end());
+      appendBytes(bd2.getPtr(), bd2.getSize());
       return (*this);
    }
 
@@ -215,7 +229,7 @@ public:
    /////////////////////////////////////////////////////////////////////////////
    BinaryData & append(uint8_t byte)
    {
-      data_.insert(data_.end(), byte);
+      appendBytes(&byte, 1);
       return (*this);
    }
 
@@ -252,9 +266,9 @@ public:
       int minLen = min(getSize(), bd2.getSize());
       for(int i=0; i<minLen; i++)
       {
-         if( data_[i] == bd2.data_[i] )
+         if( ptr_[i] == bd2.ptr_[i] )
             continue;
-         return data_[i] < bd2.data_[i];
+         return ptr_[i] < bd2.ptr_[i];
       }
       return (getSize() < bd2.getSize());
 
@@ -280,7 +294,7 @@ public:
 
       // Why did I do this before?
       //for(unsigned int i=0; i<getSize(); i++)
-         //if( data_[i] != bd2.data_[i] )
+         //if( ptr_[i] != bd2.ptr_[i] )
             //return false;
       //return true;
    }
@@ -300,9 +314,9 @@ public:
       int minLen = min(getSize(), bd2.getSize());
       for(int i=0; i<minLen; i++)
       {
-         if( data_[i] == bd2.data_[i] )
+         if( ptr_[i] == bd2.ptr_[i] )
             continue;
-         return data_[i] > bd2.data_[i];
+         return ptr_[i] > bd2.ptr_[i];
       }
       return (getSize() > bd2.getSize());
    }
@@ -313,7 +327,7 @@ public:
 #ifdef _MSC_VER
 	if(getSize())
 #endif
-	   str.assign( (char const *)(&(data_[0])), getSize()); 
+	   str.assign( (char const *)ptr_, getSize()); 
    }
 
    /////////////////////////////////////////////////////////////////////////////
@@ -331,11 +345,24 @@ public:
          return string((char const *)(getPtr()), getSize());
    }
 
-   char* toCharPtr(void) const  { return  (char*)(&(data_[0])); }
-   unsigned char* toUCharPtr(void) const { return (unsigned char*)(&(data_[0])); }
+   char* toCharPtr(void) const  { return  (char*)ptr_; }
+   unsigned char* toUCharPtr(void) const { return (unsigned char*)ptr_; }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Same as vector::resize:  keeps the existing bytes, new bytes are zero
+   void resize(size_t sz) 
+   { 
+      if(sz > capacity_)
+         grow(sz);
+      if(sz > size_)
+         memset(ptr_+size_, 0, sz-size_);
+      size_ = sz;
+   }
 
-   void resize(size_t sz) { data_.resize(sz); }
-   void reserve(size_t sz) { data_.reserve(sz); }
+   void reserve(size_t sz) { if(sz > capacity_) grow(sz); }
+
+   // True if the bytes are inside this object rather than on the heap
+   bool isInline(void) const { return ptr_ == inline_; }
 
    /////////////////////////////////////////////////////////////////////////////
    // Swap endianness of the bytes in the index range [pos1, pos2)
@@ -350,9 +377,9 @@ public:
       size_t totalBytes = pos2-pos1;
       for(size_t i=0; i<(totalBytes/2); i++)
       {
-         uint8_t d1    = data_[pos1+i];
-         data_[pos1+i] = data_[pos2-(i+1)];
-         data_[pos2-(i+1)] = d1;
+         uint8_t d1    = ptr_[pos1+i];
+         ptr_[pos1+i] = ptr_[pos2-(i+1)];
+         ptr_[pos2-(i+1)] = d1;
       }
       return (*this);
    }
@@ -383,7 +410,7 @@ public:
       vector<int8_t> outStr(2*getSize());
       for( size_t i=0; i<getSize(); i++)
       {
-         uint8_t nextByte = bdToHex.data_[i];
+         uint8_t nextByte = bdToHex.ptr_[i];
          outStr[2*i  ] = hexLookupTable[ (nextByte >> 4) & 0x0F ];
          outStr[2*i+1] = hexLookupTable[ (nextByte     ) & 0x0F ];
       }
@@ -510,7 +537,7 @@ public:
       {
          uint8_t char1 = binLookupTable[ (uint8_t)str[2*i  ] ];
          uint8_t char2 = binLookupTable[ (uint8_t)str[2*i+1] ];
-         data_[i] = (char1 << 4) | char2;
+         ptr_[i] = (char1 << 4) | char2;
       }
    }
 
@@ -536,28 +563,85 @@ public:
       uint32_t filesize = (size_t)is.tellg();
       is.seekg(0, ios::beg);
       
-      data_.resize(getSize());
+      resize(getSize());
       is.read((char*)getPtr(), getSize());
       return getSize();
    }
 
    // For deallocating all the memory that is currently used by this BD
-   void clear(void) { data_.clear(); }
+   void clear(void) { freeHeap(); init(); }
 
 private:
-   vector<uint8_t> data_;
+   // ptr_ points at inline_ until we need more than BINARYDATA_INLINE_SIZE
+   // bytes, then at a heap buffer of capacity_ bytes that we own
+   uint8_t*  ptr_;
+   uint32_t  size_;
+   uint32_t  capacity_;
+   uint8_t   inline_[BINARYDATA_INLINE_SIZE];
 
 private:
+   void init(void)
+   {
+      ptr_      = inline_;
+      size_     = 0;
+      capacity_ = BINARYDATA_INLINE_SIZE;
+   }
+
+   void freeHeap(void)
+   {
+      if(ptr_ != inline_)
+         delete [] ptr_;
+   }
+
+   // Replace the current buffer with a new heap buffer
+   void setHeap(uint8_t* newPtr, size_t newCap)
+   {
+      freeHeap();
+      ptr_      = newPtr;
+      capacity_ = (uint32_t)newCap;
+   }
+
+   void grow(size_t newCap)
+   {
+      uint8_t* newPtr = new uint8_t[newCap];
+      if(size_ > 0)
+         memcpy(newPtr, ptr_, size_);
+      setHeap(newPtr, newCap);
+   }
+
+   // Zero-filled, like it was with vector<uint8_t>
    void alloc(size_t sz) 
    { 
       if(sz != getSize())
       {
-         data_.clear();
-         data_.resize(sz);
+         size_ = 0;
+         resize(sz);
       }
 
    }
 
+   // inData may point into our own buffer, so don't free it until we've
+   // copied from it
+   void appendBytes(uint8_t const * inData, size_t sz)
+   {
+      if(sz == 0)
+         return;
+
+      size_t newSize = size_ + sz;
+      if(newSize > capacity_)
+      {
+         size_t newCap = max(newSize, 2*(size_t)capacity_);
+         uint8_t* newPtr = new uint8_t[newCap];
+         memcpy(newPtr, ptr_, size_);
+         memcpy(newPtr+size_, inData, sz);
+         setHeap(newPtr, newCap);
+      }
+      else
+         memmove(ptr_+size_, inData, sz);
+
+      size_ = newSize;
+   }
+
 };
 
 
@@ -0,0 +1,339 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// BlkFileWatcher
+//
+// Helper thread that watches the blocks/ directory with inotify, and finds
+// new blocks as soon as bitcoind writes them.  Without it, new blocks only
+// show up when Python gets around to calling readBlkFileUpdate(), which then
+// re-opens the last blk file and walks the magic bytes looking for new data.
+//
+// The watcher keeps its own cursor (file index + offset of the next magic
+// bytes), starting where the BDM left off.  Every time bitcoind touches a
+// blk*.dat file, it walks forward from the cursor, and queues the location
+// of every complete block it finds.  When it reaches the end of the real
+// data in a file and blk(N+1).dat exists, it moves on to that one:  this is
+// how splits are detected.  A block whose size header is there but whose
+// data isn't all there yet is left alone until the next write event.
+//
+// The BDM pops the queued ranges in readBlkFileUpdate(), and only ever reads
+// those bytes.  Anyone who wants to react to new blocks right away (like
+// armoryd) can block in waitForBlocks() instead of polling.
+//
+// This is Linux-only.  Everywhere else, start() returns false and the BDM
+// goes on polling like it always has.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _BLKFILEWATCHER_H_
+#define _BLKFILEWATCHER_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#ifdef __linux__
+   #include <errno.h>
+   #include <fcntl.h>
+   #include <poll.h>
+   #include <unistd.h>
+   #include <sys/stat.h>
+   #include <sys/inotify.h>
+#endif
+
+#include "BinaryData.h"
+#include "BtcUtils.h"
+#include "ThreadUtils.h"
+
+// If an event ever gets lost, we still notice the new data within this long
+#define BLKFILEWATCHER_RESCAN_MS  10000
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// One block in a blk file:  offset_ is where the magic bytes are, and the
+// block itself is the size_ bytes after the 8-byte magic+size prefix
+class BlkFileRange
+{
+public:
+   BlkFileRange(void) : fnum_(0), offset_(0), size_(0) {}
+   BlkFileRange(uint32_t fnum, uint64_t offset, uint32_t size) :
+      fnum_(fnum), offset_(offset), size_(size) {}
+
+   uint32_t fnum_;
+   uint64_t offset_;
+   uint32_t size_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+class BlkFileWatcher
+{
+public:
+   BlkFileWatcher(void) : isRunning_(false), fnum_(0), offset_(0)
+   {
+      #ifdef __linux__
+         inotifyFd_ = -1;
+         stopPipe_[0] = stopPipe_[1] = -1;
+      #endif
+   }
+
+   ~BlkFileWatcher(void) { stop(); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool isSupported(void)
+   {
+      #ifdef __linux__
+         return true;
+      #else
+         return false;
+      #endif
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Start looking for blocks at the given offset of blk file fnum.  Anything
+   // that's already there is found right away.  Returns false if the watcher
+   // couldn't be started, in which case the caller should keep polling.
+   bool start(string const & blkFileDir,
+              BinaryData const & magicBytes,
+              uint32_t fnum,
+              uint64_t offset)
+   {
+      stop();
+
+      #ifdef __linux__
+         inotifyFd_ = inotify_init();
+         if(inotifyFd_ < 0)
+            return false;
+
+         if(inotify_add_watch(inotifyFd_, blkFileDir.c_str(),
+                              IN_MODIFY | IN_CLOSE_WRITE |
+                              IN_CREATE | IN_MOVED_TO) < 0 ||
+            pipe(stopPipe_) != 0)
+         {
+            closeFds();
+            return false;
+         }
+
+         blkFileDir_ = blkFileDir;
+         magicBytes_ = magicBytes;
+         fnum_       = fnum;
+         offset_     = offset;
+         pending_.clear();
+         isRunning_  = true;
+
+         if(!thread_.start(watchThread, this))
+         {
+            isRunning_ = false;
+            closeFds();
+            return false;
+         }
+         return true;
+      #else
+         return false;
+      #endif
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Anything still queued is dropped
+   void stop(void)
+   {
+      if(!isRunning_)
+         return;
+
+      #ifdef __linux__
+         char c = 0;
+         if(write(stopPipe_[1], &c, 1) != 1)
+            LOGERR << "Could not signal the blk file watcher to stop";
+         thread_.waitForAll();
+         closeFds();
+      #endif
+
+      ScopedLock lock(mu_);
+      pending_.clear();
+      isRunning_ = false;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool isRunning(void) const { return isRunning_; }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Blocks until there is at least one new block, or ms milliseconds pass.
+   // Safe to call from any thread.
+   bool waitForBlocks(uint32_t ms)
+   {
+      ScopedLock lock(mu_);
+      #ifdef __linux__
+         if(isRunning_ && pending_.size() == 0)
+            newBlocks_.waitFor(mu_, ms);
+      #endif
+      return pending_.size() > 0;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Hands over everything found so far, in the order it is in the files
+   void popAll(vector<BlkFileRange> & ranges)
+   {
+      ScopedLock lock(mu_);
+      ranges.assign(pending_.begin(), pending_.end());
+      pending_.clear();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Puts ranges[from..] back at the front of the queue, for when the BDM 
+   // couldn't read them.  They'll come out of the next popAll() first.
+   void requeue(vector<BlkFileRange> const & ranges, uint32_t from)
+   {
+      ScopedLock lock(mu_);
+      if(!isRunning_ || from >= ranges.size())
+         return;
+
+      pending_.insert(pending_.begin(), ranges.begin()+from, ranges.end());
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint32_t getNumPending(void)
+   {
+      ScopedLock lock(mu_);
+      return pending_.size();
+   }
+
+private:
+   #ifdef __linux__
+   /////////////////////////////////////////////////////////////////////////////
+   static void watchThread(void* ptr) { ((BlkFileWatcher*)ptr)->watchLoop(); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void watchLoop(void)
+   {
+      scanForBlocks();
+
+      // Room for a few dozen events, which are coalesced into one scan
+      char buf[4096];
+      while(true)
+      {
+         struct pollfd fds[2];
+         fds[0].fd = inotifyFd_;    fds[0].events = POLLIN;  fds[0].revents = 0;
+         fds[1].fd = stopPipe_[0];  fds[1].events = POLLIN;  fds[1].revents = 0;
+
+         int n = poll(fds, 2, BLKFILEWATCHER_RESCAN_MS);
+         if(n < 0 && errno == EINTR)
+            continue;
+         if(n < 0 || fds[1].revents != 0)
+            break;
+
+         // Writes to the rev*.dat undo files show up here, too, so only
+         // bother scanning if it was one of the blk files
+         bool blkFileTouched = (n == 0);
+         if(fds[0].revents & POLLIN)
+         {
+            ssize_t len = read(inotifyFd_, buf, sizeof(buf));
+            ssize_t pos = 0;
+            while(pos < len)
+            {
+               struct inotify_event* ev = (struct inotify_event*)(buf+pos);
+               if((ev->mask & IN_Q_OVERFLOW) ||
+                  (ev->len > 0 && strncmp(ev->name, "blk", 3) == 0))
+                  blkFileTouched = true;
+               pos += sizeof(struct inotify_event) + ev->len;
+            }
+         }
+
+         if(blkFileTouched)
+            scanForBlocks();
+      }
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Walk from the cursor to the end of the real data, following splits.
+   // Only the watcher thread touches fnum_ and offset_.
+   void scanForBlocks(void)
+   {
+      vector<BlkFileRange> found;
+      uint8_t prefix[8];
+      while(true)
+      {
+         string filename = BtcUtils::getBlkFilename(blkFileDir_, fnum_);
+         int fd = open(filename.c_str(), O_RDONLY);
+         if(fd < 0)
+            break;
+
+         struct stat st;
+         uint64_t filesize = (fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0);
+
+         // Past 0.8, blk files are padded with zeros, so the end of the real
+         // data is wherever the magic bytes stop showing up
+         bool partialBlock = false;
+         while(filesize >= offset_ + 8)
+         {
+            if(pread(fd, prefix, 8, (off_t)offset_) != 8 ||
+               memcmp(prefix, magicBytes_.getPtr(), 4) != 0)
+               break;
+
+            uint32_t blkSize = READ_UINT32_LE(prefix+4);
+            if(offset_ + 8 + blkSize > filesize)
+            {
+               partialBlock = true;
+               break;
+            }
+
+            found.push_back(BlkFileRange(fnum_, offset_, blkSize));
+            offset_ += 8 + blkSize;
+         }
+         close(fd);
+
+         // bitcoind only starts a new file once a block doesn't fit in this
+         // one, so if the next one exists, there's nothing more coming here
+         string nextFile = BtcUtils::getBlkFilename(blkFileDir_, fnum_+1);
+         if(partialBlock ||
+            BtcUtils::GetFileSize(nextFile) == FILE_DOES_NOT_EXIST)
+            break;
+
+         fnum_++;
+         offset_ = 0;
+      }
+
+      if(found.size() == 0)
+         return;
+
+      ScopedLock lock(mu_);
+      pending_.insert(pending_.end(), found.begin(), found.end());
+      newBlocks_.broadcast();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void closeFds(void)
+   {
+      if(inotifyFd_ >= 0)    close(inotifyFd_);
+      if(stopPipe_[0] >= 0)  close(stopPipe_[0]);
+      if(stopPipe_[1] >= 0)  close(stopPipe_[1]);
+      inotifyFd_ = -1;
+      stopPipe_[0] = stopPipe_[1] = -1;
+   }
+
+   int                    inotifyFd_;
+   int                    stopPipe_[2];
+   #endif
+
+   bool                   isRunning_;
+   string                 blkFileDir_;
+   BinaryData             magicBytes_;
+   uint32_t               fnum_;
+   uint64_t               offset_;
+
+   Mutex                  mu_;
+   CondVar                newBlocks_;
+   deque<BlkFileRange>    pending_;
+   ThreadGroup            thread_;
+
+   BlkFileWatcher(BlkFileWatcher const &);
+   BlkFileWatcher & operator=(BlkFileWatcher const &);
+};
+
+
+#endif
@@ -22,9 +22,19 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 void BlockHeader::unserialize(uint8_t const * ptr)
+{
+   unserializeWithHash(ptr, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockHeader::unserializeWithHash(uint8_t const * ptr, 
+                                      uint8_t const * hash32)
 {
    dataCopy_.copyFrom(ptr, HEADER_SIZE);
-   BtcUtils::getHash256(dataCopy_.getPtr(), HEADER_SIZE, thisHash_);
+   if(hash32 == NULL)
+      BtcUtils::getHash256(dataCopy_.getPtr(), HEADER_SIZE, thisHash_);
+   else
+      thisHash_.copyFrom(hash32, 32);
    difficultyDbl_ = BtcUtils::convertDiffBitsToDouble( 
                               BinaryDataRef(dataCopy_.getPtr()+72, 4));
    isInitialized_ = true;
@@ -465,10 +475,19 @@ Tx::Tx(TxRef  txref)
 
 /////////////////////////////////////////////////////////////////////////////
 void Tx::unserialize(uint8_t const * ptr)
+{
+   unserializeWithHash(ptr, NULL);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void Tx::unserializeWithHash(uint8_t const * ptr, uint8_t const * hash32)
 {
    uint32_t nBytes = BtcUtils::TxCalcLength(ptr, &offsetsTxIn_, &offsetsTxOut_);
    dataCopy_.copyFrom(ptr, nBytes);
-   BtcUtils::getHash256(ptr, nBytes, thisHash_);
+   if(hash32 == NULL)
+      BtcUtils::getHash256(ptr, nBytes, thisHash_);
+   else
+      thisHash_.copyFrom(hash32, 32);
 
    uint32_t numTxOut = offsetsTxOut_.size()-1;
    version_  = READ_UINT32_LE(ptr);
@@ -491,6 +510,10 @@ bool Tx::isMainBranch(void) const
 /////////////////////////////////////////////////////////////////////////////
 BinaryData Tx::getThisHash(void) const
 {
+   // Already computed in unserialize, unless this was never initialized
+   if(thisHash_.getSize() == 32)
+      return thisHash_;
+
    return BtcUtils::getHash256(dataCopy_.getPtr(), dataCopy_.getSize());
 }
 
@@ -19,6 +19,7 @@
 
 #include "BinaryData.h"
 #include "BtcUtils.h"
+#include "FixedBinary.h"
 
 
 
@@ -87,6 +88,8 @@ public:
    void           setBlockFile(string filename)     {blkFile_       = filename;}
    void           setBlockFileNum(uint32_t fnum)    {blkFileNum_    = fnum;}
    void           setBlockFileOffset(uint64_t offs) {blkFileOffset_ = offs;}
+   uint32_t       getBlockFileNum(void) const       {return blkFileNum_;}
+   uint64_t       getBlockFileOffset(void) const    {return blkFileOffset_;}
 
    /////////////////////////////////////////////////////////////////////////////
    void          pprint(ostream & os=cout, int nIndent=0, bool pBigendian=true) const;
@@ -106,6 +109,9 @@ public:
    void unserialize(BinaryDataRef const & str);
    void unserialize(BinaryRefReader & brr);
 
+   // For when the hash was already computed, like in a batch
+   void unserializeWithHash(uint8_t const * ptr, uint8_t const * hash32);
+
    void unserialize_swigsafe_(BinaryData const & rawHead) { unserialize(rawHead); }
 
    uint8_t getDuplicateID(void) const { return duplicateID_; }
@@ -241,6 +247,9 @@ public:
    void setTxHash(BinaryData const & hash) { txHash_.copyFrom(hash); }
    void setTxOutIndex(uint32_t idx) { txOutIndex_ = idx; }
 
+   // Same 36 bytes as serialize(), but inline, for use as a map/set key
+   OutPointKey getKey(void) const { return getOutPointKey(txHash_, txOutIndex_); }
+
    // Define these operators so that we can use OutPoint as a map<> key
    bool operator<(OutPoint const & op2) const;
    bool operator==(OutPoint const & op2) const;
@@ -513,6 +522,9 @@ public:
    void unserialize(BinaryData const & str) { unserialize(str.getPtr()); }
    void unserialize(BinaryDataRef const & str) { unserialize(str.getPtr()); }
    void unserialize(BinaryRefReader & brr);
+
+   // For when the hash was already computed, like in a batch
+   void unserializeWithHash(uint8_t const * ptr, uint8_t const * hash32);
    //void unserialize_no_txout(BinaryRefReader & brr);
    void unserialize_swigsafe_(BinaryData const & rawTx) { unserialize(rawTx); }
 
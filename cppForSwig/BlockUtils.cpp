@@ -10,6 +10,7 @@
 #include <time.h>
 #include <stdio.h>
 #include "BlockUtils.h"
+#include "MappedFile.h"
 
 
 
@@ -303,6 +304,7 @@ void BtcWallet::addScrAddress(HashString    scrAddr,
    *addrPtr = ScrAddrObj(scrAddr, firstTimestamp, firstBlockNum,
                                   lastTimestamp,  lastBlockNum);
    scrAddrPtrs_.push_back(addrPtr);
+   scrAddrFilter_.insert(scrAddr);
 
    // Default behavior is "don't know, must rescan" if no firstBlk is spec'd
    if(bdmPtr_!=NULL)
@@ -319,6 +321,7 @@ void BtcWallet::addNewScrAddress(BinaryData scrAddr)
    ScrAddrObj* addrPtr = &(scrAddrMap_[scrAddr]);
    *addrPtr = ScrAddrObj(scrAddr, 0,0, 0,0); 
    scrAddrPtrs_.push_back(addrPtr);
+   scrAddrFilter_.insert(scrAddr);
 
    if(bdmPtr_!=NULL)
       bdmPtr_->registerNewScrAddr(scrAddr);
@@ -336,6 +339,7 @@ void BtcWallet::addScrAddress(ScrAddrObj const & newScrAddr)
       ScrAddrObj * addrPtr = &(scrAddrMap_[newScrAddr.getScrAddr()]);
       *addrPtr = newScrAddr;
       scrAddrPtrs_.push_back(addrPtr);
+      scrAddrFilter_.insert(newScrAddr.getScrAddr());
    }
 
    if(bdmPtr_!=NULL)
@@ -381,10 +385,20 @@ void BtcWallet::addScrAddress_5_(HashString    scrAddr,
 /////////////////////////////////////////////////////////////////////////////
 bool BtcWallet::hasScrAddress(HashString const & scrAddr)
 {
+   if(ScrAddrFilter::isFilterable(scrAddr))
+      return scrAddrFilter_.contains(scrAddr);
+
    //return scrAddrMap_.find(scrAddr) != scrAddrMap_.end();
    return KEY_IN_MAP(scrAddr, scrAddrMap_);
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// Same thing, without building the scrAddr first
+bool BtcWallet::hasScrAddress(uint8_t prefix, uint8_t const * hash160) const
+{
+   return scrAddrFilter_.contains(prefix, hash160);
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx, 
@@ -397,7 +411,7 @@ pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx,
 // Determine, as fast as possible, whether this tx is relevant to us
 // Return  <IsOurs, InputIsOurs>
 pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx, 
-                                            map<OutPoint, TxIOPair> & txiomap,
+                                            map<OutPointKey, TxIOPair> & txiomap,
                                             bool withMultiSig)
 {
    // Since 99.999%+ of all transactions are not ours, let's do the 
@@ -409,10 +423,10 @@ pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx,
    uint8_t const * txStartPtr = tx.getPtr();
    for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
    {
-      // We have the txin, now check if it contains one of our TxOuts
-      static OutPoint op;
-      op.unserialize(txStartPtr + tx.getTxInOffset(iin));
-      if(KEY_IN_MAP(op, txiomap))
+      // We have the txin, now check if it contains one of our TxOuts.
+      // The first 36 bytes of the TxIn are the OutPoint.
+      OutPointKey opKey(txStartPtr + tx.getTxInOffset(iin));
+      if(KEY_IN_MAP(opKey, txiomap))
          return pair<bool,bool>(true,true);
    }
 
@@ -429,31 +443,27 @@ pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx,
       if(scriptLenFirstByte == 25)
       {
          // Std TxOut with 25-byte script
-         scrAddr.copyFrom(ptr+4, 20);
-         if( hasScrAddress(HASH160PREFIX + scrAddr) )
+         if( hasScrAddress(SCRIPT_PREFIX_HASH160, ptr+4) )
             return pair<bool,bool>(true,false);
       }
       if(scriptLenFirstByte == 23)
       {
          // Std P2SH with 23-byte script
-         scrAddr.copyFrom(ptr+3, 20);
-         if( hasScrAddress(P2SHPREFIX + scrAddr) )
+         if( hasScrAddress(SCRIPT_PREFIX_P2SH, ptr+3) )
             return pair<bool,bool>(true,false);
       }
       else if(scriptLenFirstByte==67)
       {
          // Std spend-coinbase TxOut script
-         static HashString scrAddr(20);
          BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, scrAddr);
-         if( hasScrAddress(HASH160PREFIX + scrAddr) )
+         if( hasScrAddress(SCRIPT_PREFIX_HASH160, scrAddr.getPtr()) )
             return pair<bool,bool>(true,false);
       }
       else if(scriptLenFirstByte==35)
       {
          // Std spend-coinbase TxOut script
-         static HashString scrAddr(20);
          BtcUtils::getHash160_NoSafetyCheck(ptr+2, 33, scrAddr);
-         if( hasScrAddress(HASH160PREFIX + scrAddr) )
+         if( hasScrAddress(SCRIPT_PREFIX_HASH160, scrAddr.getPtr()) )
             return pair<bool,bool>(true,false);
       }
       else if(withMultiSig)
@@ -478,8 +488,11 @@ pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx,
             uint8_t M = brrmsig.get_uint8_t();
             uint8_t N = brrmsig.get_uint8_t();
             for(uint8_t a=0; a<N; a++)
-               if(hasScrAddress(HASH160PREFIX + brr.get_BinaryDataRef(20)))
+            {
+               BinaryDataRef addr160 = brrmsig.get_BinaryDataRef(20);
+               if(hasScrAddress(SCRIPT_PREFIX_HASH160, addr160.getPtr()))
                   return pair<bool,bool>(true,false);
+            }
          }
       }
 
@@ -522,7 +535,7 @@ void BtcWallet::pprintAlot(uint32_t topBlk, bool withAddr)
       ledgerAllAddrZC_[i].pprintOneLine();
 
    cout << "TxioMap:" << endl;
-   map<OutPoint, TxIOPair>::iterator iter;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -550,7 +563,6 @@ void BtcWallet::pprintAlot(uint32_t topBlk, bool withAddr)
             addr.ledgerZC_[i].pprintOneLine();
       
          cout << "   TxioPtrs (Blockchain):" << endl;
-         map<OutPoint, TxIOPair>::iterator iter;
          for(uint32_t t=0; t<addr.relevantTxIOPtrs_.size(); t++)
          {
             addr.relevantTxIOPtrs_[t]->pprintOneLine();
@@ -673,9 +685,8 @@ void BlockDataManager_LevelDB::registeredScrAddrScan(
    for(uint32_t iin=0; iin<nTxIn; iin++)
    {
       // We have the txin, now check if it contains one of our TxOuts
-      static OutPoint op;
-      op.unserialize(txStartPtr + (*txInOffsets)[iin]);
-      if(registeredOutPoints_.count(op) > 0)
+      OutPointKey opKey(txStartPtr + (*txInOffsets)[iin]);
+      if(registeredOutPoints_.count(opKey) > 0)
       {
          insertRegisteredTxIfNew(BtcUtils::getHash256(txptr, txSize));
          break; // we only care if ANY txIns are ours, not which ones
@@ -695,23 +706,22 @@ void BlockDataManager_LevelDB::registeredScrAddrScan(
       if(scriptLenFirstByte == 25)
       {
          // Std TxOut with 25-byte script
-         addr160.copyFrom(ptr+4, 20);
-         if( scrAddrIsRegistered(HASH160PREFIX + addr160) )
+         if( scrAddrIsRegistered(SCRIPT_PREFIX_HASH160, ptr+4) )
          {
             HashString txHash = BtcUtils::getHash256(txptr, txSize);
             insertRegisteredTxIfNew(txHash);
-            registeredOutPoints_.insert(OutPoint(txHash, iout));
+            registeredOutPoints_.insert(getOutPointKey(txHash, iout));
          }
       }
       else if(scriptLenFirstByte==67)
       {
          // Std spend-coinbase TxOut script
          BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, addr160);
-         if( scrAddrIsRegistered(HASH160PREFIX + addr160) )
+         if( scrAddrIsRegistered(SCRIPT_PREFIX_HASH160, addr160.getPtr()) )
          {
             HashString txHash = BtcUtils::getHash256(txptr, txSize);
             insertRegisteredTxIfNew(txHash);
-            registeredOutPoints_.insert(OutPoint(txHash, iout));
+            registeredOutPoints_.insert(getOutPointKey(txHash, iout));
          }
       }
       else
@@ -733,6 +743,55 @@ void BlockDataManager_LevelDB::registeredScrAddrScan(
    }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Get the hash160 of a standard pay-to-pubkey(-hash) TxOut straight from the
+// serialized tx, so the scrAddr is HASH160PREFIX + addr160.  Returns false for
+// non-std scripts, which we don't scan for yet.  addr160 must already be 20
+// bytes, so nothing gets allocated.  Nothing is kept between calls, so the
+// wallet-scan threads can all use this at once.
+static bool getStdTxOutHash160(uint8_t const * txOutPtr, BinaryData & addr160)
+{
+   uint8_t const * ptr = txOutPtr + 8;
+   uint8_t scriptLenFirstByte = *ptr;
+   if(scriptLenFirstByte == 25)
+   {
+      // Std TxOut with 25-byte script
+      addr160.copyFrom(ptr+4, 20);
+   }
+   else if(scriptLenFirstByte==67)
+   {
+      // Std spend-coinbase TxOut script
+      BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, addr160);
+   }
+   else if(scriptLenFirstByte==35)
+   {
+      // Compressed public key
+      BtcUtils::getHash160_NoSafetyCheck(ptr+2, 33, addr160);
+   }
+   else
+   {
+      /* TODO:  Right now we will just ignoring non-std tx
+                I don't do anything with them right now, anyway
+      scrAddr = getTxOutScrAddr(stx.stxoMap_[iout].getScript());
+
+      // Old code for scanning non-std txout... 
+      TxOut txout = tx.getTxOutCopy(iout);
+      for(uint32_t i=0; i<scrAddrPtrs_.size(); i++)
+      {
+         ScrAddrObj & thisAddr = *(scrAddrPtrs_[i]);
+         HashString const & scraddr = thisAddr.getScrAddr();
+         if(txout.getScriptRef().find(thisAddr.getScrAddr()) > -1)
+            scanNonStdTx(0, 0, tx, iout, thisAddr);
+         continue;
+      }
+      //break;
+      */
+      return false;
+   }
+
+   return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Ugh: back to that design inefficiency.  Sincee we are 
@@ -778,9 +837,8 @@ void BlockDataManager_LevelDB::registeredScrAddrScan_IterSafe(
    for(uint32_t iin=0; iin<nTxIn; iin++)
    {
       // We have the txin, now check if it spends one of our TxOuts
-      static OutPoint op;
-      op.unserialize(txStartPtr + (*txInOffsets)[iin]);
-      if(registeredOutPoints_.count(op) > 0)
+      OutPointKey opKey(txStartPtr + (*txInOffsets)[iin]);
+      if(registeredOutPoints_.count(opKey) > 0)
       {
          insertRegisteredTxIfNew(tx.getTxRef(),
                                  stx.thisHash_,
@@ -795,57 +853,18 @@ void BlockDataManager_LevelDB::registeredScrAddrScan_IterSafe(
    // ours on future to-be-scanned transactions
    for(uint32_t iout=0; iout<nTxOut; iout++)
    {
-      static uint8_t scriptLenFirstByte;
       static HashString addr160(20);
-      static HashString scrAddr;
-
-      uint8_t const * ptr = (txStartPtr + (*txOutOffsets)[iout] + 8);
-      scriptLenFirstByte = *(uint8_t*)ptr;
-      if(scriptLenFirstByte == 25)
-      {
-         // Std TxOut with 25-byte script
-         addr160.copyFrom(ptr+4, 20);
-         scrAddr = HASH160PREFIX + addr160;
-      }
-      else if(scriptLenFirstByte==67)
-      {
-         // Std spend-coinbase TxOut script
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, addr160);
-         scrAddr = HASH160PREFIX + addr160;
-      }
-      else if(scriptLenFirstByte==35)
-      {
-         // Compressed public key
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 33, addr160);
-         scrAddr = HASH160PREFIX + addr160;
-      }
-      else
-      {
-         /* TODO:  Right now we will just ignoring non-std tx
-                   I don't do anything with them right now, anyway
-         scrAddr = getTxOutScrAddr(stx.stxoMap_[iout].getScript());
-
-         // Old code for scanning non-std txout... 
-         TxOut txout = tx.getTxOutCopy(iout);
-         for(uint32_t i=0; i<scrAddrPtrs_.size(); i++)
-         {
-            ScrAddrObj & thisAddr = *(scrAddrPtrs_[i]);
-            HashString const & scraddr = thisAddr.getScrAddr();
-            if(txout.getScriptRef().find(thisAddr.getScrAddr()) > -1)
-               scanNonStdTx(0, 0, tx, iout, thisAddr);
-            continue;
-         }
-         //break;
-         */
-      }
+      uint8_t const * ptr = (txStartPtr + (*txOutOffsets)[iout]);
+      if(!getStdTxOutHash160(ptr, addr160))
+         continue;
 
-      if(scrAddrIsRegistered(scrAddr))
+      if(scrAddrIsRegistered(SCRIPT_PREFIX_HASH160, addr160.getPtr()))
       {
          insertRegisteredTxIfNew(tx.getTxRef(),
                                  stx.thisHash_,
                                  stx.blockHeight_,
                                  stx.txIndex_);
-         registeredOutPoints_.insert(OutPoint(stx.thisHash_, iout));
+         registeredOutPoints_.insert(getOutPointKey(stx.thisHash_, iout));
       }
    }
 }
@@ -914,7 +933,8 @@ void BtcWallet::scanTx(Tx & tx,
          }
 
          // We have the txin, now check if it contains one of our TxOuts
-         map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
+         map<OutPointKey, TxIOPair>::iterator txioIter = 
+                                               txioMap_.find(outpt.getKey());
          //bool txioWasInMapAlready = (txioIter != txioMap_.end());
          bool txioWasInMapAlready = ITER_IN_MAP(txioIter, txioMap_);
          if(txioWasInMapAlready)
@@ -1028,7 +1048,8 @@ void BtcWallet::scanTx(Tx & tx,
             totalLedgerAmt += thisVal;
 
             OutPoint outpt(tx.getThisHash(), iout);      
-            map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
+            map<OutPointKey, TxIOPair>::iterator txioIter = 
+                                               txioMap_.find(outpt.getKey());
             //bool txioWasInMapAlready = (txioIter != txioMap_.end());
             bool txioWasInMapAlready = ITER_IN_MAP(txioIter, txioMap_);
             bool doAddLedgerEntry = false;
@@ -1075,7 +1096,8 @@ void BtcWallet::scanTx(Tx & tx,
                else
                   newTxio.setTxOut(tx.getTxRef(), iout);
    
-               pair<OutPoint, TxIOPair> toBeInserted(outpt, newTxio);
+               pair<OutPointKey, TxIOPair> toBeInserted(outpt.getKey(), 
+                                                        newTxio);
                txioIter = txioMap_.insert(toBeInserted).first;
                thisAddrPtr->addTxIO( txioIter->second, isZeroConf);
                doAddLedgerEntry = true;
@@ -1169,17 +1191,17 @@ LedgerEntry BtcWallet::calcLedgerEntryForTx(Tx & tx)
    for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
    {
       // We have the txin, now check if it contains one of our TxOuts
-      static OutPoint op;
-      op.unserialize(txStartPtr + tx.getTxInOffset(iin));
+      OutPointKey opKey(txStartPtr + tx.getTxInOffset(iin));
 
-      if(op.getTxHashRef() == BtcUtils::EmptyHash_)
+      if(opKey.getRef().getSliceRef(0,32) == BtcUtils::EmptyHash_)
          isCoinbaseTx = true;
 
       //if(txioMap_.find(op) != txioMap_.end())
-      if(KEY_IN_MAP(op, txioMap_))
+      map<OutPointKey, TxIOPair>::iterator txioIter = txioMap_.find(opKey);
+      if(ITER_IN_MAP(txioIter, txioMap_))
       {
          anyTxInIsOurs = true;
-         totalValue -= txioMap_[op].getValue();
+         totalValue -= txioIter->second.getValue();
       }
    }
 
@@ -1264,6 +1286,7 @@ void BtcWallet::clearBlkData(void)
    txioMap_.clear();
    ledgerAllAddr_.clear();
    ledgerAllAddrZC_.clear();
+   resetZeroConfScan();
    nonStdTxioMap_.clear();
    nonStdUnspentOutPoints_.clear();
 
@@ -1328,7 +1351,7 @@ void BtcWallet::scanNonStdTx(uint32_t blknum,
 uint64_t BtcWallet::getSpendableBalance(uint32_t currBlk)
 {
    uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -1343,7 +1366,7 @@ uint64_t BtcWallet::getSpendableBalance(uint32_t currBlk)
 uint64_t BtcWallet::getUnconfirmedBalance(uint32_t currBlk)
 {
    uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -1358,7 +1381,7 @@ uint64_t BtcWallet::getUnconfirmedBalance(uint32_t currBlk)
 uint64_t BtcWallet::getFullBalance(void)
 {
    uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -1373,7 +1396,7 @@ uint64_t BtcWallet::getFullBalance(void)
 vector<UnspentTxOut> BtcWallet::getSpendableTxOutList(uint32_t blkNum)
 {
    vector<UnspentTxOut> utxoList(0);
-   map<OutPoint, TxIOPair>::iterator iter;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -1393,7 +1416,7 @@ vector<UnspentTxOut> BtcWallet::getSpendableTxOutList(uint32_t blkNum)
 vector<UnspentTxOut> BtcWallet::getFullTxOutList(uint32_t blkNum)
 {
    vector<UnspentTxOut> utxoList(0);
-   map<OutPoint, TxIOPair>::iterator iter;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -1439,9 +1462,8 @@ void BtcWallet::sortLedger(void)
 ////////////////////////////////////////////////////////////////////////////////
 bool BtcWallet::isOutPointMine(HashString const & hsh, uint32_t idx)
 {
-   OutPoint op(hsh, idx);
    //return (txioMap_.find(op)!=txioMap_.end());
-   return KEY_IN_MAP(op, txioMap_);
+   return KEY_IN_MAP(getOutPointKey(hsh, idx), txioMap_);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1471,19 +1493,26 @@ vector<AddressBookEntry> BtcWallet::createAddressBook(void)
    set<HashString> allTxList;
    set<HashString> perTxAddrSet;
 
-   // Go through all TxIO for this wallet, collect outgoing transactions
-   map<OutPoint, TxIOPair>::iterator txioIter;
+   // Go through all TxIO for this wallet, collect outgoing transactions.
+   // It's only outgoing if it has a TxIn.  Read them all in one batch
+   // instead of seeking to each one.
+   vector<BinaryData> txKeys;
+   map<OutPointKey, TxIOPair>::iterator txioIter;
    for(txioIter  = txioMap_.begin();  
        txioIter != txioMap_.end();  
        txioIter++)
    {
       TxIOPair & txio = txioIter->second;
+      if( txio.hasTxIn() )
+         txKeys.push_back(txio.getTxRefOfInput().getDBKey());
+   }
 
-      // It's only outgoing if it has a TxIn
-      if( !txio.hasTxIn() )
-         continue;
+   vector<Tx> txList;
+   LevelDBWrapper::GetInterfacePtr()->getFullTxCopyBatch(txKeys, txList);
 
-      Tx thisTx = txio.getTxRefOfInput().getTxCopy();
+   for(uint32_t i=0; i<txList.size(); i++)
+   {
+      Tx & thisTx = txList[i];
       HashString txHash = thisTx.getThisHash();
 
       if(allTxList.count(txHash) > 0)
@@ -1537,6 +1566,18 @@ vector<AddressBookEntry> BtcWallet::createAddressBook(void)
 ////////////////////////////////////////////////////////////////////////////////
 BlockDataManager_LevelDB::BlockDataManager_LevelDB(void) 
 {
+   // These are tuning parameters, not blockchain state, so Reset() leaves them
+   numIngestThreads_     = 1;
+   numScanThreads_       = 1;
+   updateBytesThresh_    = UPDATE_BYTES_THRESH;
+   doubleBufferedCommit_ = true;
+   pruneDepth_           = DEFAULT_PRUNE_DEPTH;
+   verifyMerkleOnIngest_ = true;
+   bulkLoadOnRebuild_    = true;
+   zcCompactMinDead_     = ZC_FILE_COMPACT_MIN_DEAD;
+
+   // Wallets remember the last ZC seq they scanned, so this never goes back
+   zcNextSeq_            = 1;
    Reset();
 }
 
@@ -1729,6 +1770,7 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
       startApplyBlkFile_  = 0;
       startApplyOffset_   = 0;
       headerMap_.clear();
+      clearHeadersToOrganize();
       topBlockPtr_ = NULL;
       genBlockPtr_ = NULL;
       lastTopBlock_ = UINT32_MAX;;
@@ -1752,6 +1794,7 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
 
    map<HashString, StoredHeader> sbhMap;
    headerMap_.clear();
+   clearHeadersToOrganize();
    iface_->readAllHeaders(headerMap_, sbhMap);
 
 
@@ -1774,6 +1817,7 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
       startApplyBlkFile_  = 0;
       startApplyOffset_   = 0;
       headerMap_.clear();
+      clearHeadersToOrganize();
       headersByHeight_.clear();
       topBlockPtr_ = NULL;
       prevTopBlockPtr_ = NULL;
@@ -2133,15 +2177,16 @@ bool BlockDataManager_LevelDB::addHeadersFirst(vector<StoredHeader> const & head
    headersToDB.reserve(headVect.size());
    for(uint32_t h=0; h<headVect.size(); h++)
    {
-      pair<HashString, BlockHeader>                      bhInputPair;
-      pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
+      pair<HashKey, BlockHeader>                      bhInputPair;
+      pair<map<HashKey, BlockHeader>::iterator, bool> bhInsResult;
 
       // Actually insert it.  Take note of whether it was already there.
       bhInputPair.second.unserialize(headVect[h].dataCopy_);
-      bhInputPair.first = bhInputPair.second.getThisHash();
+      bhInputPair.first = HashKey(bhInputPair.second.getThisHash());
       bhInsResult       = headerMap_.insert(bhInputPair);
       if(!bhInsResult.second)
          bhInsResult.first->second = bhInputPair.second;
+      addHeaderToOrganize(bhInsResult.first->second, bhInsResult.second);
 
       //if(bhInsResult.second) // true means didn't exist before
       headersToDB.push_back(&(bhInsResult.first->second));
@@ -2215,12 +2260,17 @@ void BlockDataManager_LevelDB::Reset(void)
 {
    SCOPED_TIMER("BDM::Reset");
 
+   blkFileWatcher_.stop();
+
    // Clear out all the "real" data in the blkfile
    blkFileDir_ = "";
    headerMap_.clear();
+   clearHeadersToOrganize();
 
-   zeroConfRawTxList_.clear();
    zeroConfMap_.clear();
+   zeroConfSeqMap_.clear();
+   zeroConfSpentIndex_.clear();
+   zcFileDeadRecords_ = 0;
    zcEnabled_ = false;
    zcFilename_ = "";
 
@@ -2233,6 +2283,13 @@ void BlockDataManager_LevelDB::Reset(void)
    numBlkFiles_ = UINT32_MAX;
 
    dbUpdateSize_ = 0;
+   stxInFlight_.clear();
+   sshInFlight_.clear();
+   stxoToModify_.clear();
+   stxoInFlight_.clear();
+   utxoTrieMods_.clear();
+   utxoCache_.clear();
+   utxoCache_.resetCounters();
    endOfLastBlockByte_ = 0;
 
    startHeaderHgt_ = 0;
@@ -2270,6 +2327,10 @@ void BlockDataManager_LevelDB::Reset(void)
    bytesReadSoFar_ = 0;
    blocksReadSoFar_ = 0;
    filesReadSoFar_ = 0;
+   numCorruptBlocks_ = 0;
+   corruptBlocks_.clear();
+   corruptDescendants_.clear();
+   rewoundToHgt_ = UINT32_MAX;
 
    isInitialized_ = false;
    corruptHeadersDB_ = false;
@@ -2279,6 +2340,7 @@ void BlockDataManager_LevelDB::Reset(void)
 
    registeredWallets_.clear();
    registeredScrAddrMap_.clear();
+   registeredScrAddrFilter_.clear();
    registeredTxSet_.clear();
    registeredTxList_.clear(); 
    registeredOutPoints_.clear(); 
@@ -2325,7 +2387,7 @@ BlockHeader & BlockDataManager_LevelDB::getTopBlockHeader(void)
 BlockHeader & BlockDataManager_LevelDB::getGenesisBlock(void) 
 {
    if(genBlockPtr_ == NULL)
-      genBlockPtr_ = &(headerMap_[GenesisHash_]);
+      genBlockPtr_ = &(headerMap_[HashKey(GenesisHash_)]);
    return *genBlockPtr_;
 }
 
@@ -2344,7 +2406,7 @@ BlockHeader * BlockDataManager_LevelDB::getHeaderByHeight(int index)
 // The most common access method is to get a block by its hash
 BlockHeader * BlockDataManager_LevelDB::getHeaderByHash(HashString const & blkHash)
 {
-   map<HashString, BlockHeader>::iterator it = headerMap_.find(blkHash);
+   map<HashKey, BlockHeader>::iterator it = headerMap_.find(HashKey(blkHash));
    //if(it==headerMap_.end())
    if(ITER_NOT_IN_MAP(it, headerMap_))
       return NULL;
@@ -2372,7 +2434,7 @@ Tx BlockDataManager_LevelDB::getTxByHash(HashString const & txhash)
    else
    {
       // It's not in the blockchain, but maybe in the zero-conf tx list
-      map<HashString, ZeroConfData>::const_iterator iter = zeroConfMap_.find(txhash);
+      map<HashKey, ZeroConfData>::const_iterator iter = zeroConfMap_.find(HashKey(txhash));
       //if(iter==zeroConfMap_.end())
       if(ITER_NOT_IN_MAP(iter, zeroConfMap_))
          return Tx();
@@ -2388,7 +2450,7 @@ TX_AVAILABILITY BlockDataManager_LevelDB::getTxHashAvail(BinaryDataRef txHash)
    if(getTxRefByHash(txHash).isNull())
    {
       //if(zeroConfMap_.find(txHash)==zeroConfMap_.end())
-      if(KEY_NOT_IN_MAP(txHash, zeroConfMap_))
+      if(KEY_NOT_IN_MAP(HashKey(txHash), zeroConfMap_))
          return TX_DNE;  // No tx at all
       else
          return TX_ZEROCONF;  // Zero-conf tx
@@ -2409,14 +2471,14 @@ bool BlockDataManager_LevelDB::hasTxWithHash(BinaryData const & txHash)
    if(iface_->getTxRef(txHash).isInitialized())
       return true;
    else
-      return KEY_IN_MAP(txHash, zeroConfMap_);
+      return KEY_IN_MAP(HashKey(txHash), zeroConfMap_);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::hasHeaderWithHash(BinaryData const & txHash) const
 {
    //return (headerMap_.find(txHash) != headerMap_.end());
-   return KEY_IN_MAP(txHash, headerMap_);
+   return KEY_IN_MAP(HashKey(txHash), headerMap_);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -2441,7 +2503,7 @@ vector<BlockHeader*> BlockDataManager_LevelDB::prefixSearchHeaders(BinaryData co
       searchHigh[i] = 255;
    }
 
-   map<HashString, BlockHeader>::iterator iter;
+   map<HashKey, BlockHeader>::iterator iter;
    for(iter  = headerMap_.lower_bound(searchLow);
        iter != headerMap_.upper_bound(searchHigh);
        iter++)
@@ -2552,6 +2614,7 @@ bool BlockDataManager_LevelDB::registerScrAddr(HashString scraddr,
       firstBlk = getTopBlockHeight() + 1;
 
    registeredScrAddrMap_[scraddr] = RegisteredScrAddr(scraddr, firstBlk);
+   registeredScrAddrFilter_.insert(scraddr);
    allScannedUpToBlk_  = min(firstBlk, allScannedUpToBlk_);
    return true;
 }
@@ -2566,6 +2629,7 @@ bool BlockDataManager_LevelDB::registerNewScrAddr(HashString scraddr)
 
    uint32_t currBlk = getTopBlockHeight();
    registeredScrAddrMap_[scraddr] = RegisteredScrAddr(scraddr, currBlk);
+   registeredScrAddrFilter_.insert(scraddr);
 
    // New address cannot affect allScannedUpToBlk_, so don't bother
    //allScannedUpToBlk_  = min(currBlk, allScannedUpToBlk_);
@@ -2585,6 +2649,7 @@ bool BlockDataManager_LevelDB::registerImportedScrAddr(HashString scraddr,
       createBlk = 0;
 
    registeredScrAddrMap_[scraddr] = RegisteredScrAddr(scraddr, createBlk);
+   registeredScrAddrFilter_.insert(scraddr);
    allScannedUpToBlk_ = min(createBlk, allScannedUpToBlk_);
    return true;
 }
@@ -2599,6 +2664,7 @@ bool BlockDataManager_LevelDB::unregisterScrAddr(HashString scraddr)
       return false;
    
    registeredScrAddrMap_.erase(scraddr);
+   rebuildRegisteredScrAddrFilter();
    allScannedUpToBlk_ = evalLowestBlockNextScan();
    return true;
 }
@@ -2758,12 +2824,39 @@ bool BlockDataManager_LevelDB::walletIsRegistered(BtcWallet & wlt)
 }
 
 /////////////////////////////////////////////////////////////////////////////
-bool BlockDataManager_LevelDB::scrAddrIsRegistered(HashString scraddr)
+bool BlockDataManager_LevelDB::scrAddrIsRegistered(
+                                             HashString const & scraddr) const
 {
+   if(ScrAddrFilter::isFilterable(scraddr))
+      return registeredScrAddrFilter_.contains(scraddr);
+
    //return (registeredScrAddrMap_.find(scraddr)!=registeredScrAddrMap_.end());
    return KEY_IN_MAP(scraddr, registeredScrAddrMap_);
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// For the scan loops:  check HASH160PREFIX+addr160 (or any other 21-byte
+// scrAddr) without building it first.  This doesn't modify anything, so the
+// wallet-scan threads can call it at the same time.
+bool BlockDataManager_LevelDB::scrAddrIsRegistered(uint8_t prefix,
+                                                   uint8_t const * hash160) const
+{
+   return registeredScrAddrFilter_.contains(prefix, hash160);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The filter can't remove keys, so rebuild it from the map after removing any
+void BlockDataManager_LevelDB::rebuildRegisteredScrAddrFilter(void)
+{
+   registeredScrAddrFilter_.clear();
+
+   map<BinaryData, RegisteredScrAddr>::iterator iter;
+   for(iter  = registeredScrAddrMap_.begin();
+       iter != registeredScrAddrMap_.end();
+       iter++)
+      registeredScrAddrFilter_.insert(iter->first);
+}
+
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -2853,14 +2946,20 @@ void BlockDataManager_LevelDB::applyBlockRangeToDB(uint32_t blk0, uint32_t blk1)
 
    blk1 = min(blk1, getTopBlockHeight()+1);
 
+   // This loop gets its own iterator, so that applyBlockToDB can do whatever
+   // it wants with the shared one.  Its snapshot won't see the updates we
+   // make along the way, but those only touch blocks we've already passed
+   // (spent TxOuts), or other prefixes (SSH, undo data, hints).
+   LDBIter ldbIter(*iface_, BLKDATA);
    BinaryData startKey = DBUtils.getBlkDataKey(blk0, 0);
-   BinaryData endKey   = DBUtils.getBlkDataKey(blk1, 0);
-   iface_->seekTo(BLKDATA, startKey);
+   ldbIter.seekTo(startKey);
+   if(!ldbIter.isValid(DB_PREFIX_TXDATA))
+      return;
 
    // Start scanning and timer
    //bool doBatches = (blk1-blk0 > NUM_BLKS_BATCH_THRESH);
    bool doBatches = true;
-   map<BinaryData, StoredTx>             stxToModify;
+   map<HashKey, StoredTx>             stxToModify;
    map<BinaryData, StoredScriptHistory>  sshToModify;
    set<BinaryData>                       keysToDelete;
 
@@ -2870,7 +2969,7 @@ void BlockDataManager_LevelDB::applyBlockRangeToDB(uint32_t blk0, uint32_t blk1)
    {
       
       StoredHeader sbh;
-      iface_->readStoredBlockAtIter(sbh);
+      iface_->readStoredBlockAtIter(ldbIter, sbh);
       hgt = sbh.blockHeight_;
       dup = sbh.duplicateID_;
       if(blk0 > hgt || hgt >= blk1)
@@ -2883,55 +2982,46 @@ void BlockDataManager_LevelDB::applyBlockRangeToDB(uint32_t blk0, uint32_t blk1)
       if(dup != iface_->getValidDupIDForHeight(hgt))
          continue;
 
-      // Ugh!  Design inefficiency: this loop and applyToBlockDB both use
-      // the same iterator, which means that applyBlockToDB will usually 
-      // leave us with the iterator in a different place than we started.
-      // I'm not clear how inefficient it is to keep re-seeking (given that
-      // there's a lot of caching going on under-the-hood).  It may be better
-      // to have each method create its own iterator... TODO:  profile/test
-      // this idea.  For now we will just save the current DB key, and 
-      // re-seek to it afterwards.
-      BinaryData prevIterKey(0);
-      if(iface_->dbIterIsValid(BLKDATA))
-         prevIterKey = iface_->getIterKeyCopy();
-
+      // We already have the whole block, no need to have applyBlockToDB
+      // read it again
+      bytesReadSoFar_ += sbh.numBytes_;
       if(!doBatches)
-         applyBlockToDB(hgt, dup); 
+         applyBlockToDB(sbh); 
       else
       {
-         bool commit = (dbUpdateSize_ > UPDATE_BYTES_THRESH);
+         bool commit = (dbUpdateSize_ > updateBytesThresh_);
          if(commit)
             LOGINFO << "Flushing DB cache after this block: " << hgt;
-         applyBlockToDB(hgt, dup, stxToModify, sshToModify, keysToDelete, commit);
-      }
-
-      // If we had a valid iter position before applyBlockToDB, restore it
-      if(prevIterKey.getSize() > 0)
-         iface_->seekTo(BLKDATA, prevIterKey);
+         applyBlockToDB(sbh, stxToModify, sshToModify, keysToDelete, false);
 
+         if(commit)
+         {
+            applyModsToDB(stxToModify, sshToModify, keysToDelete, 
+                          doubleBufferedCommit_);
 
-      bytesReadSoFar_ += sbh.numBytes_;
-
-      // TODO:  Check whether this is needed and if there is a performance
-      //        improvement to removing it.  For now, I'm including to be
-      //        absolutely sure that the DB updates properly (not reading
-      //        from an iterator that was created before the DB was last 
-      //        updated).  But it may slow down the process considerably,
-      //        since LevelDB has optimized the hell out of key-order 
-      //        traversal.
-      iface_->resetIterator(BLKDATA, true);
+            // Don't hold on to the old snapshot after we've written a batch
+            ldbIter.refresh();
+         }
+      }
 
       // Will write out about once every 5 sec
       writeProgressFile(DB_BUILD_APPLY, blkProgressFile_, "applyBlockRangeToDB");
 
-   } while(iface_->advanceToNextBlock(false));
+   } while(iface_->advanceToNextBlock(ldbIter, false));
 
 
    // If we're batching, we probably haven't commited the last batch.  Hgt 
-   // and dup vars are still in scope.  
+   // and dup vars are still in scope.  This one isn't written in the 
+   // background, so everything is in the DB by the time we return.
    if(doBatches)
       applyModsToDB(stxToModify, sshToModify, keysToDelete);
 
+   pruneBlkData();
+
+   LOGINFO << "UTXO cache: " << utxoCache_.getNumHits() << " hits, "
+           << utxoCache_.getNumMisses() << " misses, "
+           << utxoCache_.size() << " TxOuts cached";
+
 }
 
 
@@ -3049,35 +3139,53 @@ void BlockDataManager_LevelDB::scanRegisteredTxForWallet( BtcWallet & wlt,
    registeredTxList_.sort();
 
    ///// LOOP OVER ALL RELEVANT TX ////
-   for(txIter  = registeredTxList_.begin();
-       txIter != registeredTxList_.end();
-       txIter++)
-   {
-      // Pull the tx from disk and check it for the supplied wallet
-      Tx theTx = txIter->getTxCopy();
-      if( !theTx.isInitialized() )
+   // The list is sorted by height and index, which is also DB key order, so
+   // pull the tx from disk a batch at a time instead of one seek each
+   vector<list<RegisteredTx>::iterator> batchIters;
+   vector<BinaryData> batchKeys;
+   vector<Tx> batchTx;
+   txIter = registeredTxList_.begin();
+   while(txIter != registeredTxList_.end())
+   {
+      batchIters.clear();
+      batchKeys.clear();
+      for( ; txIter != registeredTxList_.end() && 
+             batchKeys.size() < TX_BATCH_READ_SIZE; txIter++)
       {
-         LOGWARN << "***WARNING: How did we get a NULL tx?";
-         continue;
+         BinaryData dbKey = txIter->txRefObj_.getDBKey();
+         batchIters.push_back(txIter);
+         batchKeys.push_back(dbKey.getSize()==6 ? dbKey : txIter->txHash_);
       }
+      iface_->getFullTxCopyBatch(batchKeys, batchTx, numScanThreads_);
 
-      BlockHeader* bhptr = getHeaderPtrForTx(theTx);
-      // This condition happens on invalid Tx (like invalid P2Pool coinbases)
-      if( bhptr==NULL )
-         continue;
+      for(uint32_t i=0; i<batchTx.size(); i++)
+      {
+         // Check the tx for the supplied wallet
+         Tx & theTx = batchTx[i];
+         if( !theTx.isInitialized() )
+         {
+            LOGWARN << "***WARNING: How did we get a NULL tx?";
+            continue;
+         }
 
-      if( !bhptr->isMainBranch() )
-         continue;
+         BlockHeader* bhptr = getHeaderPtrForTx(theTx);
+         // This condition happens on invalid Tx (like invalid P2Pool coinbases)
+         if( bhptr==NULL )
+            continue;
 
-      uint32_t thisBlk = bhptr->getBlockHeight();
-      if(thisBlk < blkStart  ||  thisBlk >= blkEnd)
-         continue;
+         if( !bhptr->isMainBranch() )
+            continue;
 
-      if( !isTxFinal(theTx) )
-         continue;
+         uint32_t thisBlk = bhptr->getBlockHeight();
+         if(thisBlk < blkStart  ||  thisBlk >= blkEnd)
+            continue;
+
+         if( !isTxFinal(theTx) )
+            continue;
 
-      // If we made it here, we want to scan this tx!
-      wlt.scanTx(theTx, txIter->txIndex_, bhptr->getTimestamp(), thisBlk);
+         // If we made it here, we want to scan this tx!
+         wlt.scanTx(theTx, batchIters[i]->txIndex_, bhptr->getTimestamp(), thisBlk);
+      }
    }
  
    wlt.sortLedger();
@@ -3096,6 +3204,13 @@ uint64_t BlockDataManager_LevelDB::getDBBalanceForHash160(
 {
    StoredScriptHistory ssh;
 
+   if(iface_->utxoTrieIsAvailable())
+   {
+      StoredTrieNode top;
+      iface_->getUTXOTrieSubtree(HASH160PREFIX + addr160, top);
+      return top.getValueSum();
+   }
+
    iface_->getStoredScriptHistory(ssh, HASH160PREFIX + addr160);
    if(!ssh.isInitialized())
       return 0;
@@ -3123,6 +3238,15 @@ vector<UnspentTxOut> BlockDataManager_LevelDB::getUTXOVectForHash160(
    StoredScriptHistory ssh;
    vector<UnspentTxOut> outVect(0);
 
+   // The trie has the UTXOs of each script in one subtree, so we don't need
+   // the history at all.  Like the balance, it only has the TxOuts that pay
+   // to this address, not the multisig scripts that include it.
+   if(iface_->utxoTrieIsAvailable())
+   {
+      iface_->getUTXOsFromTrie(HASH160PREFIX + addr160, outVect);
+      return outVect;
+   }
+
    iface_->getStoredScriptHistory(ssh, HASH160PREFIX + addr160);
    if(!ssh.isInitialized())
       return outVect;
@@ -3203,6 +3327,22 @@ vector<TxIOPair> BlockDataManager_LevelDB::getHistoryForScrAddr(
    return outVect;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_LevelDB::getHistoryPageForScrAddr(
+                                                BinaryDataRef uniqKey,
+                                                uint32_t fromHeight,
+                                                uint32_t toHeight,
+                                                uint32_t maxTxio,
+                                                BinaryData const & cursor,
+                                                vector<TxIOPair> & txioList,
+                                                BinaryData & nextCursor,
+                                                bool withMultisig)
+{
+   return iface_->getScriptHistoryPage(uniqKey, fromHeight, toHeight, maxTxio,
+                                       cursor.getRef(), txioList, nextCursor, 
+                                       withMultisig);
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 /*  This is not currently being used, and is actually likely to change 
@@ -3273,99 +3413,225 @@ vector<TxRef*> BlockDataManager_LevelDB::findAllNonStdTx(void)
 
 
 
-/////////////////////////////////////////////////////////////////////////////
-// With the LevelDB database integration, we now index all blockchain data
-// by block height and index (tx index in block, txout index in tx).  The
-// only way to actually do that is to process the headers first, so that 
-// when we do read the block data the first time, we know how to put it
-// into the DB.  
-//
-// For now, we have no problem holding all the headers in RAM and organizing
-// them all in one shot.  But RAM-limited devices (say, if this was going 
-// to be ported to Android), may not be able to do even that, and may have
-// to read and process the headers in batches.  
-bool BlockDataManager_LevelDB::extractHeadersInBlkFile(uint32_t fnum, 
-                                                       uint64_t startOffset)
+////////////////////////////////////////////////////////////////////////////////
+// Headers read out of one blk file, before they go into the headerMap_.  The
+// extraction threads each fill in their own, and they're merged in file order
+// on the BDM thread.
+class BlkFileHeaderJob
 {
-   SCOPED_TIMER("extractHeadersInBlkFile");
-   string filename = blkFileList_[fnum];
+public:
+   BlkFileHeaderJob(void) : fnum_(0), startOffset_(0), endOffset_(0), 
+                            readFile_(false), isValid_(false), numBadPoW_(0) {}
+
+   string               filename_;
+   uint32_t             fnum_;
+   uint64_t             startOffset_;
+
+   uint64_t             endOffset_;  // where the next block will go
+   bool                 readFile_;   // false if we never got to endOffset_
+   bool                 isValid_;
+   uint32_t             numBadPoW_;
+   vector<BlockHeader>  headers_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+class BlkFileHeaderExtraction
+{
+public:
+   BinaryData                  magicBytes_;
+   vector<BlkFileHeaderJob>    jobs_;
+   BlockingQueue<uint32_t>     jobQueue_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// This doesn't touch the BDM at all, so any number of threads can run it on
+// different files at once.  Every header's proof-of-work is checked here,
+// too, while its hash is still in cache.  A header that fails is dropped.
+static void readHeadersInBlkFile(BinaryData const & magicBytes,
+                                 BlkFileHeaderJob & job)
+{
+   SCOPED_TIMER("readHeadersInBlkFile");
+   string const & filename = job.filename_;
    uint64_t filesize = BtcUtils::GetFileSize(filename);
    if(filesize == FILE_DOES_NOT_EXIST)
    {
       LOGERR << "File does not exist: " << filename.c_str();
-      return false;
+      return;
    }
 
    // This will trigger if this is the last blk file and no new blocks
-   if(filesize < startOffset)
-      return true;
+   job.isValid_ = true;
+   if(filesize < job.startOffset_)
+      return;
    
 
-   ifstream is(filename.c_str(), ios::in | ios::binary);
-   BinaryData fileMagic(4);
-   is.read((char*)(fileMagic.getPtr()), 4);
-   is.seekg(startOffset, ios::beg);
+   MappedFile blkMap;
+   if(!blkMap.open(filename))
+   {
+      LOGERR << "Could not map block file: " << filename.c_str();
+      job.isValid_ = false;
+      return;
+   }
+   blkMap.adviseSequential();
+   filesize = blkMap.getSize();
 
-   if( !(fileMagic == MagicBytes_ ) )
+   uint8_t const * fileData = blkMap.getPtr();
+   if( filesize < 4 || !(BinaryDataRef(fileData, 4) == magicBytes) )
    {
+      BinaryData fileMagic(4);
+      if(filesize >= 4)
+         fileMagic.copyFrom(fileData, 4);
       LOGERR << "Block file is the wrong network!  MagicBytes: "
              << fileMagic.toHexStr().c_str();
-      return false;
+      job.isValid_ = false;
+      return;
    }
 
+   // Usually 100-200 kB per block in recent files, but lots more early on
+   job.headers_.reserve((size_t)(filesize/100000) + 16);
 
-   BinaryData rawHeader(HEADER_SIZE);
-
-   // Some objects to help insert header data efficiently
-   pair<HashString, BlockHeader>                      bhInputPair;
-   pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
-   endOfLastBlockByte_ = startOffset;
+   // Headers are hashed in batches:  find a bunch of them, hash them all at
+   // once, then go through and build the BlockHeader objects
+   vector<uint64_t>        blkOffsets;
+   vector<uint8_t const *> headPtrs;
+   BinaryData              headHashes(32*BLKFILE_HEADER_BATCH_SIZE);
+   blkOffsets.reserve(BLKFILE_HEADER_BATCH_SIZE);
+   headPtrs.reserve(BLKFILE_HEADER_BATCH_SIZE);
 
+   uint64_t offset = job.startOffset_;
    uint32_t const HEAD_AND_NTX_SZ = HEADER_SIZE + 10; // enough
-   BinaryData magic(4), szstr(4), rawHead(HEAD_AND_NTX_SZ);
-   while(!is.eof())
+   bool atEnd = false;
+   while(!atEnd)
    {
-      is.read((char*)magic.getPtr(), 4);
-      if(magic!=MagicBytes_ || is.eof()) 
+      blkOffsets.clear();
+      headPtrs.clear();
+      while(blkOffsets.size() < BLKFILE_HEADER_BATCH_SIZE)
+      {
+         if(offset + 8 + HEAD_AND_NTX_SZ > filesize ||
+            BinaryDataRef(fileData + offset, 4) != magicBytes)
+         {
+            atEnd = true;
+            break;
+         }
+
+         blkOffsets.push_back(offset);
+         headPtrs.push_back(fileData + offset + 8);
+         offset += READ_UINT32_LE(fileData + offset + 4) + 8;
+      }
+
+      if(blkOffsets.size() == 0)
          break;
 
-      is.read((char*)szstr.getPtr(), 4);
-      uint32_t nextBlkSize = READ_UINT32_LE(szstr.getPtr());
-      if(is.eof()) break;
+      BtcUtils::getHash256Batch(&headPtrs[0], HEADER_SIZE, headPtrs.size(),
+                                headHashes.getPtr());
 
-      is.read((char*)rawHead.getPtr(), HEAD_AND_NTX_SZ); // plus #tx var_int
-      if(is.eof()) break;
+      for(uint32_t i=0; i<blkOffsets.size(); i++)
+      {
+         uint8_t const * blkPtr = fileData + blkOffsets[i];
+         uint32_t nextBlkSize = READ_UINT32_LE(blkPtr+4);
+
+         // Read the header and #tx var_int right out of the mapped file
+         BinaryRefReader brr(blkPtr+8, HEAD_AND_NTX_SZ);
+         job.headers_.push_back(BlockHeader());
+         BlockHeader & bh = job.headers_.back();
+         bh.unserializeWithHash(brr.getCurrPtr(), headHashes.getPtr() + 32*i);
+         brr.advance(HEADER_SIZE);
+         uint32_t nTx = (uint32_t)brr.get_var_int();
+
+         if(!BtcUtils::verifyProofOfWork(BinaryDataRef(bh.getPtr(), HEADER_SIZE),
+                                         bh.getThisHashRef()))
+         {
+            LOGERR << "Header fails proof-of-work, skipping it: " 
+                   << bh.getThisHash().toHexStr().c_str();
+            job.headers_.pop_back();
+            job.numBadPoW_++;
+         }
+         else
+         {
+            bh.setBlockFile(filename);
+            bh.setBlockFileNum(job.fnum_);
+            bh.setBlockFileOffset(blkOffsets[i]);
+            bh.setNumTx(nTx);
+            bh.setBlockSize(nextBlkSize);
+         }
+      }
+   }
+
+   job.endOffset_ = offset;
+   job.readFile_  = true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+static void readHeadersInBlkFileThread(void* arg)
+{
+   BlkFileHeaderExtraction & extract = *(BlkFileHeaderExtraction*)arg;
+
+   uint32_t j;
+   while(extract.jobQueue_.pop(j))
+      readHeadersInBlkFile(extract.magicBytes_, extract.jobs_[j]);
+}
 
-      // Create a reader for the entire block, grab header, skip rest
-      BinaryRefReader brr(rawHead);
-      bhInputPair.second.unserialize(brr);
-      uint32_t nTx = (uint32_t)brr.get_var_int();
-      bhInputPair.first = bhInputPair.second.getThisHash();
+
+/////////////////////////////////////////////////////////////////////////////
+// With the LevelDB database integration, we now index all blockchain data
+// by block height and index (tx index in block, txout index in tx).  The
+// only way to actually do that is to process the headers first, so that 
+// when we do read the block data the first time, we know how to put it
+// into the DB.  
+//
+// For now, we have no problem holding all the headers in RAM and organizing
+// them all in one shot.  But RAM-limited devices (say, if this was going 
+// to be ported to Android), may not be able to do even that, and may have
+// to read and process the headers in batches.  
+bool BlockDataManager_LevelDB::extractHeadersInBlkFile(uint32_t fnum, 
+                                                       uint64_t startOffset)
+{
+   SCOPED_TIMER("extractHeadersInBlkFile");
+   BlkFileHeaderJob job;
+   job.filename_    = blkFileList_[fnum];
+   job.fnum_        = fnum;
+   job.startOffset_ = startOffset;
+
+   readHeadersInBlkFile(MagicBytes_, job);
+   addExtractedHeaders(job.headers_);
+   if(job.readFile_)
+      endOfLastBlockByte_ = job.endOffset_;
+
+   return job.isValid_;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Put headers from readHeadersInBlkFile into the headerMap_
+void BlockDataManager_LevelDB::addExtractedHeaders(
+                                       vector<BlockHeader> const & headers)
+{
+   // Some objects to help insert header data efficiently
+   pair<HashKey, BlockHeader>                      bhInputPair;
+   pair<map<HashKey, BlockHeader>::iterator, bool> bhInsResult;
+
+   for(uint32_t i=0; i<headers.size(); i++)
+   {
+      BlockHeader const & bh = headers[i];
+      bhInputPair.first  = HashKey(bh.getThisHash());
+      bhInputPair.second = bh;
       bhInsResult = headerMap_.insert(bhInputPair);
       if(!bhInsResult.second)
       {
          // We exclude the genesis block which is always in the DB here
-         if(fnum!=0 || endOfLastBlockByte_!=0)
+         if(bh.getBlockFileNum()!=0 || bh.getBlockFileOffset()!=0)
          {
             LOGWARN << "Somehow tried to add header that's already in map";
-            LOGWARN << "Header Hash: " << bhInputPair.first.toHexStr().c_str();
+            LOGWARN << "Header Hash: " << bhInputPair.first.copy().toHexStr().c_str();
          }
          // But overwrite the header anyway
-         bhInsResult.first->second = bhInputPair.second;
+         bhInsResult.first->second = bh;
       }
-
-      bhInsResult.first->second.setBlockFile(filename);
-      bhInsResult.first->second.setBlockFileNum(fnum);
-      bhInsResult.first->second.setBlockFileOffset(endOfLastBlockByte_);
-      bhInsResult.first->second.setNumTx(nTx);
-      bhInsResult.first->second.setBlockSize(nextBlkSize);
-      
-      endOfLastBlockByte_ += nextBlkSize+8;
-      is.seekg(nextBlkSize - HEAD_AND_NTX_SZ, ios::cur);
+      addHeaderToOrganize(bhInsResult.first->second, bhInsResult.second);
    }
-
-   is.close();
-   return true;
 }
 
 
@@ -3413,13 +3679,54 @@ bool BlockDataManager_LevelDB::processNewHeadersInBlkFiles(uint32_t fnumStart,
 
    detectAllBlkFiles();
    
-   // In first file, start at supplied offset;  start at beginning for others
+   // One job per file.  In the first file, start at the supplied offset;  
+   // start at the beginning for the others.  The files don't depend on each
+   // other, so they're read in parallel (with numIngestThreads_), and then
+   // added to the headerMap_ here in file order, same as reading them one
+   // at a time.
+   BlkFileHeaderExtraction extract;
+   extract.magicBytes_ = MagicBytes_;
    for(uint32_t fnum=fnumStart; fnum<numBlkFiles_; fnum++)
    {
-      uint64_t useOffset = (fnum==fnumStart ? startOffset : 0);
-      extractHeadersInBlkFile(fnum, useOffset);
+      extract.jobs_.push_back(BlkFileHeaderJob());
+      BlkFileHeaderJob & job = extract.jobs_.back();
+      job.filename_    = blkFileList_[fnum];
+      job.fnum_        = fnum;
+      job.startOffset_ = (fnum==fnumStart ? startOffset : 0);
    }
 
+   for(uint32_t j=0; j<extract.jobs_.size(); j++)
+      extract.jobQueue_.push(j);
+   extract.jobQueue_.close();
+
+   {
+      uint32_t nThreads = min(max(numIngestThreads_, (uint32_t)1), 
+                              (uint32_t)extract.jobs_.size());
+      ThreadGroup threads;
+      for(uint32_t i=1; i<nThreads; i++)
+         threads.start(readHeadersInBlkFileThread, &extract);
+
+      // This thread takes jobs, too
+      readHeadersInBlkFileThread(&extract);
+      threads.waitForAll();
+   }
+
+   uint32_t numBadPoW = 0;
+   for(uint32_t j=0; j<extract.jobs_.size(); j++)
+   {
+      BlkFileHeaderJob & job = extract.jobs_[j];
+      addExtractedHeaders(job.headers_);
+      if(job.readFile_)
+         endOfLastBlockByte_ = job.endOffset_;
+      numBadPoW += job.numBadPoW_;
+
+      // Free each file's headers as soon as they're in the map
+      vector<BlockHeader>().swap(job.headers_);
+   }
+
+   if(numBadPoW > 0)
+      LOGERR << numBadPoW << " headers failed proof-of-work and were skipped";
+
    // This will return true unless genesis block was reorg'd...
    bool prevTopBlkStillValid = organizeChain(true);
    if(!prevTopBlkStillValid)
@@ -3428,7 +3735,7 @@ bool BlockDataManager_LevelDB::processNewHeadersInBlkFiles(uint32_t fnumStart,
       LOGERR << "Did we shut down last time on an orphan block?";
    }
 
-   map<HashString, BlockHeader>::iterator iter;
+   map<HashKey, BlockHeader>::iterator iter;
    for(iter = headerMap_.begin(); iter != headerMap_.end(); iter++)
    {
       StoredHeader sbh;
@@ -3495,27 +3802,46 @@ void BlockDataManager_LevelDB::fetchAllRegisteredScrAddrData(
 {
    vector<TxIOPair> hist = getHistoryForScrAddr(scrAddr);
 
-   BinaryData txKey;
-   StoredTx stx;
-   TxRef txref;
+   // The tx of the arriving coins, and if they were spent, the tx in which 
+   // they were spent.  Only the hash and position are needed, not the 
+   // TxOuts, and they're all read in one batch.
+   vector<TxRef> txrefs;
+   vector<BinaryData> txKeys;
+   for(uint32_t i=0; i<hist.size(); i++)
+   {
+      txrefs.push_back(hist[i].getTxRefOfOutput());
+      txKeys.push_back(txrefs.back().getDBKey());
+
+      TxRef txref = hist[i].getTxRefOfInput();
+      if(txref.isNull())
+         continue;
+
+      txrefs.push_back(txref);
+      txKeys.push_back(txref.getDBKey());
+   }
+
+   vector<StoredTx> stxList;
+   iface_->getStoredTxBatch(txKeys, stxList, false);
+
+   uint32_t t = 0;
    RegisteredTx regTx;
    for(uint32_t i=0; i<hist.size(); i++)
    {
-      // Fetch the full tx of the arriving coins
-      txref = hist[i].getTxRefOfOutput();
-      iface_->getStoredTx(stx, txref.getDBKey());
-      regTx = RegisteredTx(txref, stx.thisHash_, stx.blockHeight_, stx.txIndex_);
+      StoredTx & stxOut = stxList[t];
+      regTx = RegisteredTx(txrefs[t], stxOut.thisHash_, 
+                           stxOut.blockHeight_, stxOut.txIndex_);
       insertRegisteredTxIfNew(regTx);
-      registeredOutPoints_.insert(hist[i].getOutPoint());
+      registeredOutPoints_.insert(hist[i].getOutPoint().getKey());
+      t++;
 
-      txref = hist[i].getTxRefOfInput();
-      if(txref.isNull())
+      if(hist[i].getTxRefOfInput().isNull())
          continue;
 
-      // If the coins were spent, also fetch the tx in which they were spent
-      iface_->getStoredTx(stx, txref.getDBKey());
-      regTx = RegisteredTx(txref, stx.thisHash_, stx.blockHeight_, stx.txIndex_);
+      StoredTx & stxIn = stxList[t];
+      regTx = RegisteredTx(txrefs[t], stxIn.thisHash_, 
+                           stxIn.blockHeight_, stxIn.txIndex_);
       insertRegisteredTxIfNew(regTx);
+      t++;
    }
 }
 
@@ -3527,6 +3853,8 @@ void BlockDataManager_LevelDB::destroyAndResetDatabases(void)
    if(iface_ != NULL)
    {
       LOGWARN << "Destroying databases;  will need to be rebuilt";
+      blkFileWatcher_.stop();
+      utxoCache_.clear();
       iface_->destroyAndResetDatabases();
       return;
    }
@@ -3631,6 +3959,12 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
       skipFetch = true;
       destroyAndResetDatabases();
    }
+   else if(initialLoad)
+   {
+      // A DB from an older version is converted as we load, rather than
+      // making the user rebuild it
+      iface_->upgradeDBFormat();
+   }
 
    // If we're going to be rescanning, reset the wallets
    if(forceRescan)
@@ -3638,6 +3972,11 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
       LOGINFO << "Resetting wallets for rescan";
       skipFetch = true;
       resetRegisteredWallets();
+
+      // The stored histories would otherwise be picked up by the rescan as
+      // already being scanned
+      if(DBUtils.getArmoryDbType() != ARMORY_DB_SUPER)
+         deleteHistories();
    }
 
    // If no rescan is forced, grab the SSH entries from the DB
@@ -3647,16 +3986,10 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
       fetchAllRegisteredScrAddrData();
    }
 
-   if(initialLoad && DBUtils.getArmoryDbType() != ARMORY_DB_SUPER)
-   {
-      // We always delete the histories, regardless of whether we read them or
-      // not.  We only save them on a clean shutdown, so we know they are 
-      // consistent.  Unclean shutdowns/kills will force a rescan simply by
-      // the fetch call (at the top) getting nothing out of the database
-      if(initialLoad)
-         deleteHistories();
-
-   }
+   // The stored histories are not deleted after they're fetched:  they are
+   // checkpointed in the same batch as each scan's results, so after an 
+   // unclean shutdown or kill they are still consistent up to their own 
+   // alreadyScannedUpToBlk_, and only the blocks after that get rescanned
 
 
    // Remove this file
@@ -3687,6 +4020,9 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
    // the headers to the DB before actually processing any block data.  
    if(initialLoad || forceRebuild)
    {
+      // Any corrupt blocks still in the blk files will be found again below
+      corruptBlocks_.clear();
+      corruptDescendants_.clear();
       LOGINFO << "Reading all headers and building chain...";
       processNewHeadersInBlkFiles(startHeaderBlkFile_, startHeaderOffset_);
    }
@@ -3709,20 +4045,59 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
       LOGINFO << "Total blockchain bytes: " 
               << BtcUtils::numToStrWCommas(totalBlockchainBytes_);
       TIMER_START("dumpRawBlocksToDB");
-      for(uint32_t fnum=startRawBlkFile_; fnum<numBlkFiles_; fnum++)
+
+      // BLKDATA was just wiped, so there's nothing to lose by holding off
+      // compaction until all the raw blocks are in
+      bool bulkLoad = forceRebuild && bulkLoadOnRebuild_ && 
+                      iface_->beginBulkLoad();
+
+      // The pipelined reader returns false without touching the DB if it
+      // can't get its threads going, so just do it the old way
+      if(numIngestThreads_ <= 1 ||
+         !readRawBlocksPipelined(startRawBlkFile_, startRawOffset_))
       {
-         string blkfile = blkFileList_[fnum];
-         LOGINFO << "Parsing blockchain file: " << blkfile.c_str();
-   
-         // The supplied offset only applies to the first blockfile we're reading.
-         // After that, the offset is always zero
-         uint32_t startOffset = 0;
-         if(fnum==startRawBlkFile_)
-            startOffset = (uint32_t)startRawOffset_;
+         for(uint32_t fnum=startRawBlkFile_; fnum<numBlkFiles_; fnum++)
+         {
+            string blkfile = blkFileList_[fnum];
+            LOGINFO << "Parsing blockchain file: " << blkfile.c_str();
       
-         readRawBlocksInFile(fnum, startOffset);
+            // The supplied offset only applies to the first blockfile we're 
+            // reading.  After that, the offset is always zero
+            uint32_t startOffset = 0;
+            if(fnum==startRawBlkFile_)
+               startOffset = (uint32_t)startRawOffset_;
+         
+            readRawBlocksInFile(fnum, startOffset);
+         }
+      }
+
+      if(bulkLoad && !iface_->endBulkLoad())
+      {
+         TIMER_STOP("dumpRawBlocksToDB");
+         LOGERR << "Lost the databases after the bulk load!  Aborting...";
+         return;
       }
       TIMER_STOP("dumpRawBlocksToDB");
+
+      // The headers were organized before we saw the corrupt blocks, so the
+      // chain may still run through one.  Pick the best chain without them
+      // so that we never apply or scan past the hole in BLKDATA.
+      if(isOnCorruptBranch(*topBlockPtr_))
+      {
+         uint32_t prevTopHgt = getTopBlockHeight();
+         organizeChain(true);
+         for(uint32_t i=0; i<=prevTopHgt; i++)
+         {
+            if(i < headersByHeight_.size())
+               iface_->setValidDupIDForHeight(i, 
+                                 headersByHeight_[i]->getDuplicateID());
+            else
+               iface_->setValidDupIDForHeight(i, UINT8_MAX);
+         }
+         LOGERR << "Chain stopped at height " << getTopBlockHeight()
+                << " because of a corrupt block, rebuild the DB once the "
+                << "blk*.dat files are fixed";
+      }
    }
 
    double timeElapsed = TIMER_READ_SEC("dumpRawBlocksToDB");
@@ -3747,9 +4122,9 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
       }
       else
       {
+         // No need to rewind:  each history is consistent up to its 
+         // checkpoint, even if the last shutdown wasn't clean
          startScanHgt_     = evalLowestBlockNextScan();
-         // Rewind 4 days, to rescan recent history in case problem last shutdown
-         startScanHgt_ = (startScanHgt_>576 ? startScanHgt_-576 : 0);
          pair<uint32_t, uint32_t> blkLoc = findFileAndOffsetForHgt(startScanHgt_);
          startScanBlkFile_ = blkLoc.first;
          startScanOffset_  = blkLoc.second;
@@ -3811,101 +4186,421 @@ void BlockDataManager_LevelDB::readRawBlocksInFile(uint32_t fnum, uint32_t foffs
    string fsizestr = BtcUtils::numToStrWCommas(filesize);
    LOGINFO << blkfile.c_str() << " is " << fsizestr.c_str() << " bytes";
 
-   // Open the file, and check the magic bytes on the first block
-   ifstream is(blkfile.c_str(), ios::in | ios::binary);
-   BinaryData fileMagic(4);
-   is.read((char*)(fileMagic.getPtr()), 4);
-   if( !(fileMagic == MagicBytes_ ) )
+   // Map the file, and check the magic bytes on the first block
+   MappedFile blkMap;
+   if(!blkMap.open(blkfile))
+   {
+      LOGERR << "Could not map block file: " << blkfile.c_str();
+      return;
+   }
+   blkMap.adviseSequential();
+   filesize = blkMap.getSize();
+
+   uint8_t const * fileData = blkMap.getPtr();
+   if( filesize < 4 || !(BinaryDataRef(fileData, 4) == MagicBytes_) )
    {
+      BinaryData fileMagic(4);
+      if(filesize >= 4)
+         fileMagic.copyFrom(fileData, 4);
       LOGERR << "Block file is the wrong network!  MagicBytes: "
              << fileMagic.toHexStr().c_str();
    }
 
-   // Seek to the supplied offset
-   is.seekg(foffset, ios::beg);
+   // We use this to stop parsing if we exceed the last header that was
+   // processed (a new block was added since we processed headers)
+   uint64_t locInBlkFile = foffset;
 
-   BinaryStreamBuffer bsb;
-   bsb.attachAsStreamBuffer(is, (uint32_t)filesize-foffset);
+   iface_->startBatch(BLKDATA);
 
-   bool alreadyRead8B = false;
-   uint32_t nextBlkSize;
-   bool isEOF = false;
-   BinaryData firstFour(4);
+   // Each block is parsed in place, straight out of the mapped pages
+   while(locInBlkFile + 8 < filesize)
+   {
+      uint8_t const * blkPtr = fileData + locInBlkFile;
+      if(BinaryDataRef(blkPtr, 4) != MagicBytes_)
+         break;
 
-   // We use these two vars to stop parsing if we exceed the last header
-   // that was processed (a new block was added since we processed headers)
-   bool breakbreak = false;
-   uint32_t locInBlkFile = foffset;
+      uint32_t nextBlkSize = READ_UINT32_LE(blkPtr+4);
+      if(locInBlkFile + 8 + nextBlkSize > filesize)
+         break;
 
-   iface_->startBatch(BLKDATA);
+      BinaryRefReader brr = blkMap.getReaderAt(locInBlkFile+8, nextBlkSize);
 
-   // It turns out that this streambuffering is probably not helping, but
-   // it doesn't hurt either, so I'm leaving it alone
-   while(bsb.streamPull())
-   {
-      while(bsb.reader().getSizeRemaining() > 8)
+      addRawBlockToDB(brr);
+      dbUpdateSize_ += nextBlkSize;
+
+      if(dbUpdateSize_>updateBytesThresh_ && iface_->isBatchOn(BLKDATA))
       {
-         
-         if(!alreadyRead8B)
-         {
-            bsb.reader().get_BinaryData(firstFour, 4);
-            if(firstFour!=MagicBytes_)
-            {
-               isEOF = true; 
-               break;
-            }
-            nextBlkSize = bsb.reader().get_uint32_t();
-            bytesReadSoFar_ += 8;
-         }
+         dbUpdateSize_ = 0;
+         iface_->commitBatch(BLKDATA);
+         iface_->startBatch(BLKDATA);
+      }
 
-         if(bsb.reader().getSizeRemaining() < nextBlkSize)
-         {
-            alreadyRead8B = true;
+      blocksReadSoFar_++;
+      bytesReadSoFar_ += nextBlkSize + 8;
+      locInBlkFile += nextBlkSize + 8;
+      blkMap.releaseBefore(locInBlkFile);
+
+      // This is a hack of hacks, but I can't seem to pass this data 
+      // out through getLoadProgress* methods, because they don't 
+      // update properly (from the main python thread) when the BDM 
+      // is actively loading/scanning in a separate thread.
+      // We'll watch for this file from the python code.
+      writeProgressFile(DB_BUILD_ADD_RAW, blkProgressFile_, "dumpRawBlocksToDB");
+
+      // Don't read past the last header we processed (in case new 
+      // blocks were added since we processed the headers
+      if(fnum == numBlkFiles_-1 && locInBlkFile >= endOfLastBlockByte_)
+         break;
+   }
+   
+
+   if(iface_->isBatchOn(BLKDATA))
+      iface_->commitBatch(BLKDATA);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setDBBlockCacheSize(uint32_t db, uint32_t nBytes)
+{
+   if(db >= DB_COUNT)
+      return;
+
+   LDBTuning tune = iface_->getDBTuning((DB_SELECT)db);
+   tune.blockCacheSize_ = nBytes;
+   iface_->setDBTuning((DB_SELECT)db, tune);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setDBBloomFilterBits(uint32_t db, 
+                                                    uint32_t bitsPerKey)
+{
+   if(db >= DB_COUNT)
+      return;
+
+   LDBTuning tune = iface_->getDBTuning((DB_SELECT)db);
+   tune.bloomFilterBits_ = bitsPerKey;
+   iface_->setDBTuning((DB_SELECT)db, tune);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setDBWriteBufferSize(uint32_t db, uint32_t nBytes)
+{
+   if(db >= DB_COUNT)
+      return;
+
+   LDBTuning tune = iface_->getDBTuning((DB_SELECT)db);
+   tune.writeBufferSize_ = nBytes;
+   iface_->setDBTuning((DB_SELECT)db, tune);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setDBBlockSize(uint32_t db, uint32_t nBytes)
+{
+   if(db >= DB_COUNT)
+      return;
+
+   LDBTuning tune = iface_->getDBTuning((DB_SELECT)db);
+   tune.blockSize_ = nBytes;
+   iface_->setDBTuning((DB_SELECT)db, tune);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setDBCompression(uint32_t db, bool useSnappy)
+{
+   if(db >= DB_COUNT)
+      return;
+
+   LDBTuning tune = iface_->getDBTuning((DB_SELECT)db);
+   tune.useCompression_ = useSnappy;
+   iface_->setDBTuning((DB_SELECT)db, tune);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+string BlockDataManager_LevelDB::getDBSettings(uint32_t db)
+{
+   if(db >= DB_COUNT)
+      return string("");
+
+   return iface_->getDBSettingsStr((DB_SELECT)db);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+string BlockDataManager_LevelDB::getDBStats(uint32_t db)
+{
+   if(db >= DB_COUNT)
+      return string("");
+
+   return iface_->getDBStatsStr((DB_SELECT)db);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setNumIngestThreads(uint32_t n)
+{
+   numIngestThreads_ = (n==0 ? ThreadGroup::getNumCores() : n);
+   LOGINFO << "Using " << numIngestThreads_ << " thread(s) to parse raw blocks";
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setNumScanThreads(uint32_t n)
+{
+   numScanThreads_ = (n==0 ? ThreadGroup::getNumCores() : n);
+   LOGINFO << "Using " << numScanThreads_ << " thread(s) to scan for wallet tx";
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipelined raw-block ingestion
+//
+// readRawBlocksInFile() does everything on the calling thread:  read the blk
+// file, parse every block (which hashes the header and every tx), and then
+// write it to the DB.  The parsing is the expensive part and doesn't need the
+// DB or the headerMap_ at all, so readRawBlocksPipelined() splits the job
+// into three stages:
+//
+//    reader  (1 thread):   pulls raw blocks out of the blk*.dat files in order
+//    workers (N threads):  StoredHeader::unserializeFullBlock, in any order
+//    writer  (caller):     looks up hgt & dup and puts the block in the DB
+//
+// The reader pushes every block onto two queues:  the work queue, which the
+// workers drain in whatever order they get to it, and the write queue, which
+// the writer drains strictly in file order, waiting on each block until some
+// worker has finished parsing it.  The write queue is bounded, which is what
+// limits how much block data is sitting in RAM at once.
+//
+// The writer does exactly what readRawBlocksInFile() does after parsing, in
+// the same order and with the same batch-commit points, so the resulting DB
+// is the same as from the single-threaded build.  The commit at the end of 
+// each file matters:  putStoredTx() reads the TXHINTS entries back from the
+// DB, so a tx that appears again in a later file must see the earlier one.
+////////////////////////////////////////////////////////////////////////////////
+class RawBlockJob
+{
+public:
+   RawBlockJob(void) : fnum_(0), isParsed_(false), merkleIsValid_(true) {}
+
+   uint32_t     fnum_;
+   BinaryData   rawBlock_;   // without the magic bytes and size prefix
+   StoredHeader sbh_;
+   bool         isParsed_;   // protected by RawBlockPipeline::parseLock_
+   bool         merkleIsValid_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+class RawBlockPipeline
+{
+public:
+   RawBlockPipeline(uint32_t maxInFlight) : writeQueue_(maxInFlight) {}
+
+   // Set before any threads are started, and only read afterwards
+   vector<string>   blkFiles_;
+   BinaryData       magicBytes_;
+   uint32_t         fnumStart_;
+   uint64_t         startOffset_;
+   uint64_t         endOfLastBlockByte_;
+   bool             verifyMerkle_;
+
+   BlockingQueue<RawBlockJob*>  workQueue_;
+   BlockingQueue<RawBlockJob*>  writeQueue_;
+
+   Mutex            parseLock_;
+   CondVar          parseDone_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reader stage:  same stopping rules as readRawBlocksInFile()
+static void readRawBlocksThread(void* arg)
+{
+   RawBlockPipeline & pipe = *(RawBlockPipeline*)arg;
+   uint32_t numFiles = pipe.blkFiles_.size();
+
+   bool stopReading = false;
+   for(uint32_t fnum=pipe.fnumStart_; fnum<numFiles && !stopReading; fnum++)
+   {
+      MappedFile blkMap;
+      if(!blkMap.open(pipe.blkFiles_[fnum]))
+         break;
+      blkMap.adviseSequential();
+
+      uint64_t filesize = blkMap.getSize();
+      uint64_t locInBlkFile = (fnum==pipe.fnumStart_ ? pipe.startOffset_ : 0);
+
+      while(locInBlkFile + 8 < filesize)
+      {
+         uint8_t const * blkPtr = blkMap.getPtr() + locInBlkFile;
+         if(BinaryDataRef(blkPtr, 4) != pipe.magicBytes_)
             break;
-         }
-         alreadyRead8B = false;
 
-         BinaryRefReader brr(bsb.reader().getCurrPtr(), nextBlkSize);
+         uint32_t nextBlkSize = READ_UINT32_LE(blkPtr+4);
+         if(locInBlkFile + 8 + nextBlkSize > filesize)
+            break;
 
-         addRawBlockToDB(brr);
-         dbUpdateSize_ += nextBlkSize;
+         // The job outlives the mapping, so it gets its own copy
+         RawBlockJob* job = new RawBlockJob;
+         job->fnum_ = fnum;
+         job->rawBlock_.copyFrom(blkPtr+8, nextBlkSize);
 
-         if(dbUpdateSize_>UPDATE_BYTES_THRESH && iface_->isBatchOn(BLKDATA))
-         {
-            dbUpdateSize_ = 0;
-            iface_->commitBatch(BLKDATA);
-            iface_->startBatch(BLKDATA);
-         }
+         // Order matters:  the writer may start waiting on this job as soon
+         // as it's in the write queue, so it must reach the workers, too.
+         pipe.writeQueue_.push(job);
+         pipe.workQueue_.push(job);
 
-         blocksReadSoFar_++;
-         bytesReadSoFar_ += nextBlkSize;
+         // Don't read past the last header we processed (in case new
+         // blocks were added since we processed the headers)
          locInBlkFile += nextBlkSize + 8;
-         bsb.reader().advance(nextBlkSize);
-
-         // This is a hack of hacks, but I can't seem to pass this data 
-         // out through getLoadProgress* methods, because they don't 
-         // update properly (from the main python thread) when the BDM 
-         // is actively loading/scanning in a separate thread.
-         // We'll watch for this file from the python code.
-         writeProgressFile(DB_BUILD_ADD_RAW, blkProgressFile_, "dumpRawBlocksToDB");
-
-         // Don't read past the last header we processed (in case new 
-         // blocks were added since we processed the headers
-         if(fnum == numBlkFiles_-1 && locInBlkFile >= endOfLastBlockByte_)
+         blkMap.releaseBefore(locInBlkFile);
+         if(fnum == numFiles-1 && locInBlkFile >= pipe.endOfLastBlockByte_)
          {
-            breakbreak = true;
+            stopReading = true;
             break;
          }
       }
+   }
 
+   pipe.workQueue_.close();
+   pipe.writeQueue_.close();
+}
 
-      if(isEOF || breakbreak)
-         break;
+
+////////////////////////////////////////////////////////////////////////////////
+// Worker stage:  this touches nothing but the job it's parsing
+static void parseRawBlocksThread(void* arg)
+{
+   RawBlockPipeline & pipe = *(RawBlockPipeline*)arg;
+
+   // Each worker has its own merkle tree buffer, reused for every block
+   BinaryData merkleTreeBuf;
+
+   RawBlockJob* job;
+   while(pipe.workQueue_.pop(job))
+   {
+      BinaryRefReader brr(job->rawBlock_);
+      job->sbh_.unserializeFullBlock(brr, true, false);
+      if(pipe.verifyMerkle_)
+         job->merkleIsValid_ = job->sbh_.verifyMerkleRoot(merkleTreeBuf);
+
+      ScopedLock lock(pipe.parseLock_);
+      job->isParsed_ = true;
+      pipe.parseDone_.broadcast();
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Writer stage runs here, on the BDM thread, since it needs the DB
+// Returns false if the threads couldn't be started, before anything has been
+// written, so the caller can fall back to readRawBlocksInFile()
+bool BlockDataManager_LevelDB::readRawBlocksPipelined(uint32_t fnumStart,
+                                                      uint64_t offset)
+{
+   SCOPED_TIMER("readRawBlocksPipelined");
+   if(fnumStart >= numBlkFiles_)
+      return true;
+
+   uint32_t nWorkers = max(numIngestThreads_, (uint32_t)1);
+   LOGINFO << "Parsing blockchain files " << fnumStart << " to "
+           << numBlkFiles_-1 << " with " << nWorkers << " worker threads";
+
+   // Sanity check the first file, same as readRawBlocksInFile does
+   BinaryData fileMagic(4);
+   ifstream is(blkFileList_[fnumStart].c_str(), ios::in | ios::binary);
+   is.read((char*)(fileMagic.getPtr()), 4);
+   is.close();
+   if( !(fileMagic == MagicBytes_ ) )
+   {
+      LOGERR << "Block file is the wrong network!  MagicBytes: "
+             << fileMagic.toHexStr().c_str();
    }
-   
+
+   RawBlockPipeline pipe(nWorkers * INGEST_QUEUE_BLKS_PER_THREAD);
+   pipe.blkFiles_.assign(blkFileList_.begin(),
+                         blkFileList_.begin() + numBlkFiles_);
+   pipe.magicBytes_         = MagicBytes_;
+   pipe.fnumStart_          = fnumStart;
+   pipe.startOffset_        = offset;
+   pipe.endOfLastBlockByte_ = endOfLastBlockByte_;
+   pipe.verifyMerkle_       = verifyMerkleOnIngest_;
+
+   // The ThreadGroup destructor waits for all threads, so it must be
+   // declared after the pipeline they're using
+   ThreadGroup threads;
+
+   // Without at least one worker, the writer would wait forever for the
+   // first block to be parsed.  Start them before the reader so there's
+   // nothing to unwind if none of them start.
+   uint32_t nStarted = 0;
+   for(uint32_t i=0; i<nWorkers; i++)
+      if(threads.start(parseRawBlocksThread, &pipe))
+         nStarted++;
+
+   if(nStarted == 0)
+   {
+      LOGERR << "Could not start any block parsing threads";
+      return false;
+   }
+   else if(nStarted < nWorkers)
+      LOGWARN << "Only started " << nStarted << " of " << nWorkers
+              << " block parsing threads";
+
+   if(!threads.start(readRawBlocksThread, &pipe))
+   {
+      LOGERR << "Could not start the block file reader thread";
+      pipe.workQueue_.close();
+      threads.waitForAll();
+      return false;
+   }
+
+   iface_->startBatch(BLKDATA);
+
+   RawBlockJob* job;
+   uint32_t currFile = fnumStart;
+   while(pipe.writeQueue_.pop(job))
+   {
+      {
+         ScopedLock lock(pipe.parseLock_);
+         while(!job->isParsed_)
+            pipe.parseDone_.wait(pipe.parseLock_);
+      }
+
+      // readRawBlocksInFile commits at the end of every file, so do we
+      if(job->fnum_ != currFile)
+      {
+         currFile = job->fnum_;
+         LOGINFO << "Parsing blockchain file: " << blkFileList_[currFile].c_str();
+         if(iface_->isBatchOn(BLKDATA))
+            iface_->commitBatch(BLKDATA);
+         iface_->startBatch(BLKDATA);
+      }
+
+      uint32_t blkSize = job->rawBlock_.getSize();
+      if(job->merkleIsValid_)
+         addParsedBlockToDB(job->sbh_);
+      else
+         reportCorruptBlock(job->sbh_);
+      delete job;
+
+      dbUpdateSize_ += blkSize;
+      if(dbUpdateSize_>updateBytesThresh_ && iface_->isBatchOn(BLKDATA))
+      {
+         dbUpdateSize_ = 0;
+         iface_->commitBatch(BLKDATA);
+         iface_->startBatch(BLKDATA);
+      }
+
+      blocksReadSoFar_++;
+      bytesReadSoFar_ += blkSize + 8;
+      writeProgressFile(DB_BUILD_ADD_RAW, blkProgressFile_, "dumpRawBlocksToDB");
+   }
+
+   threads.waitForAll();
 
    if(iface_->isBatchOn(BLKDATA))
       iface_->commitBatch(BLKDATA);
+   return true;
 }
 
 
@@ -3917,6 +4612,16 @@ void BlockDataManager_LevelDB::scanDBForRegisteredTx(uint32_t blk0,
    SCOPED_TIMER("scanDBForRegisteredTx");
    bytesReadSoFar_ = 0;
 
+   // Chunking the range needs a real upper bound, so use the top of the 
+   // organized chain
+   uint32_t endBlk = min(blk1, (uint32_t)headersByHeight_.size());
+   if(numScanThreads_ > 1 && blk0 + 1 < endBlk)
+   {
+      scanDBForRegisteredTxParallel(blk0, endBlk);
+      checkpointRegisteredScrAddrHistories(blk0, endBlk);
+      return;
+   }
+
    bool doScanProgressThing = (blk1-blk0 > NUM_BLKS_IS_DIRTY);
    if(doScanProgressThing)
    {
@@ -3924,15 +4629,16 @@ void BlockDataManager_LevelDB::scanDBForRegisteredTx(uint32_t blk0,
          //remove(bfile.c_str());
    }
 
+   LDBIter ldbIter(*iface_, BLKDATA);
    BinaryData firstKey = DBUtils.getBlkDataKey(blk0, 0);
-   iface_->seekTo(BLKDATA, firstKey);
+   ldbIter.seekTo(firstKey);
 
    TIMER_START("ScanBlockchain");
-   while(iface_->dbIterIsValid(BLKDATA, DB_PREFIX_TXDATA))
+   while(ldbIter.isValid(DB_PREFIX_TXDATA))
    {
       // Get the full block from the DB
       StoredHeader sbh;
-      iface_->readStoredBlockAtIter(sbh);
+      iface_->readStoredBlockAtIter(ldbIter, sbh);
       bytesReadSoFar_ += sbh.numBytes_;
 
       uint32_t hgt     = sbh.blockHeight_;
@@ -3959,6 +4665,291 @@ void BlockDataManager_LevelDB::scanDBForRegisteredTx(uint32_t blk0,
       writeProgressFile(DB_BUILD_SCAN, blkProgressFile_, "ScanBlockchain");
    }
    TIMER_STOP("ScanBlockchain");
+
+   checkpointRegisteredScrAddrHistories(blk0, endBlk);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel wallet scan
+//
+// scanDBForRegisteredTx() walks the blocks in height order on one thread, so
+// that each TxIn can be checked against the registeredOutPoints_ added by all
+// the blocks before it.  scanDBForRegisteredTxParallel() cuts the range into
+// chunks instead.  The scan threads take chunks from a shared queue until it
+// is empty, so a thread stuck with a few big chunks doesn't hold the others
+// up.  Each thread reads through its own LDBIter, and only writes to the
+// results of the chunk it's working on.  Nothing touches the registered lists
+// until all the threads are done.
+//
+// Within a chunk, TxIns are checked against the registeredOutPoints_ from
+// before the scan, plus the outpoints created earlier in that same chunk.
+// That misses any TxIn spending an outpoint that was created in an earlier
+// chunk, so every chunk after the first one that created any outpoints gets
+// a second pass, which only checks TxIns against all the new outpoints.
+// Then the results are added on this thread in height order, which leaves
+// registeredTxList_ and registeredOutPoints_ the same as the serial scan.
+////////////////////////////////////////////////////////////////////////////////
+class RegisteredTxScan
+{
+public:
+   RegisteredTxScan(void) : knownOutPoints_(NULL), chunkQueue_(NULL), 
+                            bytesScanned_(0) {}
+
+   // Set before any threads are started, and only read afterwards
+   BlockDataManager_LevelDB*  bdm_;
+   InterfaceToLDB*            iface_;
+   uint32_t                   blk0_;
+   uint32_t                   blk1_;
+   uint32_t                   chunkSize_;
+
+   // First pass:   the registeredOutPoints_ from before the scan
+   // Second pass:  all the outpoints created during the first pass
+   set<OutPointKey> const *   knownOutPoints_;
+   bool                       isSecondPass_;
+
+   // One entry per chunk, only touched by the thread scanning that chunk
+   vector< vector<RegisteredTx> >  chunkTx_;
+   vector< set<OutPointKey> >      chunkOutPoints_;
+
+   // Chunks left to scan in the current pass
+   BlockingQueue<uint32_t>*   chunkQueue_;
+
+   Mutex                      progressLock_;
+   uint64_t                   bytesScanned_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+static void scanRegisteredTxChunk(RegisteredTxScan & scan, 
+                                  LDBIter & ldbIter, 
+                                  uint32_t chunk)
+{
+   uint32_t hgt0 = scan.blk0_ + chunk*scan.chunkSize_;
+   uint32_t hgt1 = min(hgt0 + scan.chunkSize_, scan.blk1_);
+
+   uint64_t nBytes = scan.bdm_->scanBlocksForRegisteredTx(
+                        ldbIter, 
+                        hgt0, 
+                        hgt1, 
+                        *scan.knownOutPoints_,
+                        scan.isSecondPass_ ? NULL : &scan.chunkOutPoints_[chunk],
+                        scan.chunkTx_[chunk]);
+
+   // Only the first pass counts towards the scan progress
+   if(!scan.isSecondPass_)
+   {
+      ScopedLock lock(scan.progressLock_);
+      scan.bytesScanned_ += nBytes;
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+static void scanRegisteredTxThread(void* arg)
+{
+   RegisteredTxScan & scan = *(RegisteredTxScan*)arg;
+
+   // One-shot scan over most of the DB, don't push everything else out of
+   // the block cache for it
+   LDBIter ldbIter(*scan.iface_, BLKDATA, false);
+
+   uint32_t chunk;
+   while(scan.chunkQueue_->pop(chunk))
+      scanRegisteredTxChunk(scan, ldbIter, chunk);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::scanDBForRegisteredTxParallel(uint32_t blk0,
+                                                             uint32_t blk1)
+{
+   SCOPED_TIMER("scanDBForRegisteredTxParallel");
+   uint32_t nThreads = max(numScanThreads_, (uint32_t)1);
+   uint32_t nBlocks  = blk1 - blk0;
+
+   RegisteredTxScan scan;
+   scan.bdm_       = this;
+   scan.iface_     = iface_;
+   scan.blk0_      = blk0;
+   scan.blk1_      = blk1;
+   scan.chunkSize_ = nBlocks / (nThreads * SCAN_CHUNKS_PER_THREAD);
+   scan.chunkSize_ = max(scan.chunkSize_, (uint32_t)1);
+   scan.chunkSize_ = min(scan.chunkSize_, (uint32_t)SCAN_CHUNK_MAX_BLKS);
+
+   uint32_t nChunks = (nBlocks + scan.chunkSize_ - 1) / scan.chunkSize_;
+   scan.chunkTx_.resize(nChunks);
+   scan.chunkOutPoints_.resize(nChunks);
+
+   LOGINFO << "Scanning blocks " << blk0 << " to " << blk1-1 << " in "
+           << nChunks << " chunks with " << nThreads << " threads";
+
+   // This thread does its share of the chunks, too, and updates the progress
+   // file in between
+   LDBIter ldbIter(*iface_, BLKDATA, false);
+
+   TIMER_START("ScanBlockchain");
+   set<OutPointKey> newOutPoints;
+   for(uint32_t pass=0; pass<2; pass++)
+   {
+      uint32_t firstChunk = 0;
+      if(pass == 0)
+      {
+         scan.knownOutPoints_ = &registeredOutPoints_;
+         scan.isSecondPass_   = false;
+      }
+      else
+      {
+         // Catch TxIns spending outpoints created in earlier chunks.  Nothing
+         // before the first chunk that created outpoints can need it.
+         firstChunk = nChunks;
+         for(uint32_t c=0; c<nChunks; c++)
+         {
+            if(scan.chunkOutPoints_[c].size() == 0)
+               continue;
+
+            firstChunk = min(firstChunk, c+1);
+            newOutPoints.insert(scan.chunkOutPoints_[c].begin(),
+                                scan.chunkOutPoints_[c].end());
+         }
+
+         if(firstChunk >= nChunks)
+            break;
+
+         scan.knownOutPoints_ = &newOutPoints;
+         scan.isSecondPass_   = true;
+      }
+
+      BlockingQueue<uint32_t> chunkQueue;
+      for(uint32_t c=firstChunk; c<nChunks; c++)
+         chunkQueue.push(c);
+      chunkQueue.close();
+      scan.chunkQueue_ = &chunkQueue;
+
+      // The ThreadGroup destructor waits for all threads, so it must be
+      // declared after the queue they're using
+      ThreadGroup threads;
+      for(uint32_t i=1; i<nThreads; i++)
+         threads.start(scanRegisteredTxThread, &scan);
+
+      uint32_t chunk;
+      while(chunkQueue.pop(chunk))
+      {
+         scanRegisteredTxChunk(scan, ldbIter, chunk);
+         if(scan.isSecondPass_)
+            continue;
+
+         {
+            ScopedLock lock(scan.progressLock_);
+            bytesReadSoFar_ = scan.bytesScanned_;
+         }
+         writeProgressFile(DB_BUILD_SCAN, blkProgressFile_, "ScanBlockchain");
+      }
+      threads.waitForAll();
+   }
+   TIMER_STOP("ScanBlockchain");
+
+   // Now add everything we found, in the same order the serial scan would.  
+   // A tx can show up twice if it was found in both passes, but it only gets
+   // inserted once.
+   vector<RegisteredTx> relevantTx;
+   for(uint32_t c=0; c<nChunks; c++)
+      relevantTx.insert(relevantTx.end(), 
+                        scan.chunkTx_[c].begin(),
+                        scan.chunkTx_[c].end());
+   sort(relevantTx.begin(), relevantTx.end());
+
+   for(uint32_t i=0; i<relevantTx.size(); i++)
+      insertRegisteredTxIfNew(relevantTx[i]);
+
+   registeredOutPoints_.insert(newOutPoints.begin(), newOutPoints.end());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// This only reads the registered scrAddrs and the outpoint sets passed in, and
+// only writes to newOutPoints and relevantTx, so any number of scan threads
+// can run it at once, as long as nothing is changing the registered lists.
+// Checks TxIns against knownOutPoints and newOutPoints, and adds the outpoints
+// of any TxOuts to registered scrAddrs to newOutPoints.  If newOutPoints is
+// NULL, only the TxIns are checked.  Returns the number of bytes scanned.
+uint64_t BlockDataManager_LevelDB::scanBlocksForRegisteredTx(
+                                       LDBIter & ldbIter,
+                                       uint32_t hgt0,
+                                       uint32_t hgt1,
+                                       set<OutPointKey> const & knownOutPoints,
+                                       set<OutPointKey> * newOutPoints,
+                                       vector<RegisteredTx> & relevantTx)
+{
+   uint64_t nBytes = 0;
+   vector<uint32_t> offsIn;
+   vector<uint32_t> offsOut;
+   HashString addr160(20);
+
+   ldbIter.seekTo(DBUtils.getBlkDataKey(hgt0, 0));
+   while(ldbIter.isValid(DB_PREFIX_TXDATA))
+   {
+      StoredHeader sbh;
+      if(!iface_->readStoredBlockAtIter(ldbIter, sbh))
+         break;
+
+      uint32_t hgt     = sbh.blockHeight_;
+      uint8_t  dup     = sbh.duplicateID_;
+      if(hgt >= hgt1)
+         break;
+
+      nBytes += sbh.numBytes_;
+      if(!sbh.isMainBranch_ || dup != iface_->getValidDupIDForHeight(hgt))
+         continue;
+
+      map<uint16_t, StoredTx>::iterator iter;
+      for(iter  = sbh.stxMap_.begin();
+          iter != sbh.stxMap_.end();
+          iter++)
+      {
+         StoredTx & stx = iter->second;
+         if(!stx.isInitialized() || !stx.haveAllTxOut())
+         {
+            LOGERR << "Incomplete STX in DB at height " << hgt;
+            continue;
+         }
+
+         BinaryData rawTx = stx.getSerializedTx();
+         uint8_t const * txStartPtr = rawTx.getPtr();
+         BtcUtils::TxCalcLength(txStartPtr, &offsIn, &offsOut);
+
+         bool isRelevant = false;
+         for(uint32_t iin=0; iin<offsIn.size()-1 && !isRelevant; iin++)
+         {
+            OutPointKey opKey(txStartPtr + offsIn[iin]);
+            isRelevant = (knownOutPoints.count(opKey) > 0 || 
+                          (newOutPoints!=NULL && newOutPoints->count(opKey) > 0));
+         }
+
+         if(newOutPoints != NULL)
+         {
+            for(uint32_t iout=0; iout<offsOut.size()-1; iout++)
+            {
+               if(!getStdTxOutHash160(txStartPtr + offsOut[iout], addr160))
+                  continue;
+
+               if(scrAddrIsRegistered(SCRIPT_PREFIX_HASH160, addr160.getPtr()))
+               {
+                  isRelevant = true;
+                  newOutPoints->insert(getOutPointKey(stx.thisHash_, iout));
+               }
+            }
+         }
+
+         if(isRelevant)
+            relevantTx.push_back(RegisteredTx(TxRef(stx.getDBKey(false), iface_),
+                                              stx.thisHash_,
+                                              hgt,
+                                              stx.txIndex_));
+      }
+   }
+
+   return nBytes;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3997,40 +4988,281 @@ void BlockDataManager_LevelDB::deleteHistories(void)
 ////////////////////////////////////////////////////////////////////////////////
 void BlockDataManager_LevelDB::shutdownSaveScrAddrHistories(void)
 {
+   // Outside of supernode, the registered histories were already written 
+   // with each scan (see checkpointRegisteredScrAddrHistories), and the 
+   // wallets' TxIO lists may also have zero-conf TxIOs in them
+   if(DBUtils.getArmoryDbType() != ARMORY_DB_SUPER)
+   {
+      iface_->waitForBackgroundCommit(BLKDATA);
+      return;
+   }
+
    LOGINFO << "Saving wallet history for next load";
 
    iface_->startBatch(BLKDATA);
 
-   uint32_t i=0;
-   set<BtcWallet*>::iterator wltIter;
-   for(wltIter  = registeredWallets_.begin();
-       wltIter != registeredWallets_.end();
-       wltIter++)
+   uint32_t i=0;
+   set<BtcWallet*>::iterator wltIter;
+   for(wltIter  = registeredWallets_.begin();
+       wltIter != registeredWallets_.end();
+       wltIter++)
+   {
+      for(uint32_t a=0; a<(*wltIter)->getNumScrAddr(); a++)
+      { 
+         ScrAddrObj & scrAddr = (*wltIter)->getScrAddrObjByIndex(a);
+         BinaryData uniqKey = scrAddr.getScrAddr();
+
+         if(KEY_NOT_IN_MAP(uniqKey, registeredScrAddrMap_))
+         {
+            LOGERR << "How does the wallet have a non-registered ScrAddr?";
+            continue;
+         }
+
+         RegisteredScrAddr & rsa = registeredScrAddrMap_[uniqKey];
+         vector<TxIOPair*> & txioList = scrAddr.getTxIOList();
+
+         StoredScriptHistory ssh;
+         ssh.uniqueKey_ = scrAddr.getScrAddr();
+         ssh.version_ = ARMORY_DB_VERSION;
+         ssh.alreadyScannedUpToBlk_ = rsa.alreadyScannedUpToBlk_;
+         for(uint32_t t=0; t<txioList.size(); t++)
+            ssh.insertTxio(*(txioList[t]));
+
+         iface_->putStoredScriptHistory(ssh); 
+         
+      }
+   }
+
+   iface_->commitBatch(BLKDATA);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Outside of supernode, the SSH entries of the registered scrAddrs are all we
+// keep of the wallet histories between loads.  After the registered tx of 
+// blocks [blk0, blk1) are found, they're added to the SSH of every registered
+// scrAddr that was already scanned up to somewhere in that range, and its 
+// alreadyScannedUpToBlk_ is moved up to blk1.  All of it goes into one batch,
+// so after a crash or a kill each SSH in the DB is exactly the history up to
+// its own alreadyScannedUpToBlk_, and only the blocks after that need to be
+// scanned again on the next load.
+//
+// A scrAddr that is behind blk0 is left alone until a scan gets to it.
+void BlockDataManager_LevelDB::checkpointRegisteredScrAddrHistories(
+                                                               uint32_t blk0,
+                                                               uint32_t blk1)
+{
+   SCOPED_TIMER("checkpointRegisteredScrAddrHistories");
+
+   if(DBUtils.getArmoryDbType() == ARMORY_DB_SUPER)
+      return;
+
+   blk1 = min(blk1, (uint32_t)headersByHeight_.size());
+   if(blk0 >= blk1 || registeredScrAddrMap_.size() == 0)
+      return;
+
+   // The previous batch may still have the SSH entries we're about to read
+   iface_->waitForBackgroundCommit(BLKDATA);
+
+   map<BinaryData, StoredScriptHistory> sshToModify;
+   map<BinaryData, RegisteredScrAddr>::iterator rsaIter;
+   for(rsaIter  = registeredScrAddrMap_.begin();
+       rsaIter != registeredScrAddrMap_.end();
+       rsaIter++)
+   {
+      // Just the base entry:  the sub-histories we touch are read as we go
+      RegisteredScrAddr & rsa = rsaIter->second;
+      StoredScriptHistory ssh;
+      iface_->getStoredScriptHistorySummary(ssh, rsa.uniqueKey_);
+      if(!ssh.isInitialized())
+      {
+         // Nothing could have happened to it before it was created
+         ssh.uniqueKey_ = rsa.uniqueKey_;
+         ssh.version_ = ARMORY_DB_VERSION;
+         ssh.alreadyScannedUpToBlk_ = rsa.blkCreated_;
+      }
+
+      if(ssh.alreadyScannedUpToBlk_ < blk0 || 
+         ssh.alreadyScannedUpToBlk_ >= blk1)
+         continue;
+
+      sshToModify[rsa.uniqueKey_] = ssh;
+   }
+
+   if(sshToModify.size() == 0)
+      return;
+
+   // The registered tx in this range, in chain order, so TxOuts are always
+   // added before they are spent
+   vector<RegisteredTx> rtxList;
+   list<RegisteredTx>::iterator txIter;
+   for(txIter  = registeredTxList_.begin();
+       txIter != registeredTxList_.end();
+       txIter++)
+   {
+      if(txIter->blkNum_ >= blk0 && txIter->blkNum_ < blk1)
+         rtxList.push_back(*txIter);
+   }
+   sort(rtxList.begin(), rtxList.end());
+
+   map<BinaryData, StoredScriptHistory>::iterator sshIter;
+   for(uint32_t i=0; i<rtxList.size(); i++)
+   {
+      StoredTx stx;
+      if(!iface_->getStoredTx_byDBKey(stx, rtxList[i].txRefObj_.getDBKey()))
+         continue;
+
+      if(stx.duplicateID_ != iface_->getValidDupIDForHeight(stx.blockHeight_))
+         continue;
+
+      // Mark any of our TxOuts spent by this tx
+      Tx tx = stx.getTxCopy();
+      for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
+      {
+         OutPoint op = tx.getTxInCopy(iin).getOutPoint();
+         if(registeredOutPoints_.count(
+               getOutPointKey(op.getTxHashRef(), op.getTxOutIndex())) == 0)
+            continue;
+
+         StoredTx stxPrev;
+         if(!iface_->getStoredTx(stxPrev, op.getTxHashRef()))
+            continue;
+
+         map<uint16_t, StoredTxOut>::iterator stxoIter;
+         stxoIter = stxPrev.stxoMap_.find(op.getTxOutIndex());
+         if(ITER_NOT_IN_MAP(stxoIter, stxPrev.stxoMap_))
+            continue;
+
+         StoredTxOut & stxoSpent = stxoIter->second;
+         sshIter = sshToModify.find(stxoSpent.getScrAddress());
+         if(ITER_NOT_IN_MAP(sshIter, sshToModify) ||
+            stx.blockHeight_ < sshIter->second.alreadyScannedUpToBlk_)
+            continue;
+
+         BinaryData txoKey = stxoSpent.getDBKey(false);
+         iface_->fetchStoredSubHistory(sshIter->second, 
+                                       txoKey.getSliceCopy(0,4), false);
+         sshIter->second.markTxOutSpent(txoKey,
+                                        stx.getDBKeyOfChild(iin, false));
+      }
+
+      // Add any TxOuts that are ours
+      map<uint16_t, StoredTxOut>::iterator stxoIter;
+      for(stxoIter  = stx.stxoMap_.begin();
+          stxoIter != stx.stxoMap_.end();
+          stxoIter++)
+      {
+         StoredTxOut & stxo = stxoIter->second;
+         sshIter = sshToModify.find(stxo.getScrAddress());
+         if(ITER_NOT_IN_MAP(sshIter, sshToModify) ||
+            stx.blockHeight_ < sshIter->second.alreadyScannedUpToBlk_)
+            continue;
+
+         BinaryData txoKey = stxo.getDBKey(false);
+         iface_->fetchStoredSubHistory(sshIter->second, 
+                                       txoKey.getSliceCopy(0,4), true);
+         sshIter->second.markTxOutUnspent(txoKey,
+                                          stxo.getValue(),
+                                          stxo.isCoinbase_,
+                                          false);
+      }
+   }
+
+   // Only the base entries and the sub-histories we read above get written
+   iface_->startBatch(BLKDATA);
+   for(sshIter  = sshToModify.begin();
+       sshIter != sshToModify.end();
+       sshIter++)
+   {
+      sshIter->second.alreadyScannedUpToBlk_ = blk1;
+      iface_->putStoredScriptHistory(sshIter->second);
+   }
+   iface_->commitBatch(BLKDATA);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// After a reorg, take everything from blocks at or above hgt (the first block
+// after the branch point) back out of the registered histories, and move 
+// their checkpoints back to it.  The blocks of the new branch are added by 
+// the next scan that covers them.
+void BlockDataManager_LevelDB::rewindRegisteredScrAddrHistories(uint32_t hgt)
+{
+   SCOPED_TIMER("rewindRegisteredScrAddrHistories");
+
+   if(DBUtils.getArmoryDbType() == ARMORY_DB_SUPER)
+      return;
+
+   // The update that found the reorg only scans from the old top, so tell
+   // it to go back here and bring these histories up to the new top
+   rewoundToHgt_ = min(rewoundToHgt_, hgt);
+
+   iface_->waitForBackgroundCommit(BLKDATA);
+   iface_->startBatch(BLKDATA);
+
+   map<BinaryData, RegisteredScrAddr>::iterator rsaIter;
+   for(rsaIter  = registeredScrAddrMap_.begin();
+       rsaIter != registeredScrAddrMap_.end();
+       rsaIter++)
    {
-      for(uint32_t a=0; a<(*wltIter)->getNumScrAddr(); a++)
-      { 
-         ScrAddrObj & scrAddr = (*wltIter)->getScrAddrObjByIndex(a);
-         BinaryData uniqKey = scrAddr.getScrAddr();
+      StoredScriptHistory ssh;
+      iface_->getStoredScriptHistory(ssh, rsaIter->second.uniqueKey_);
+      if(!ssh.isInitialized() || ssh.alreadyScannedUpToBlk_ <= hgt)
+         continue;
 
-         if(KEY_NOT_IN_MAP(uniqKey, registeredScrAddrMap_))
+      vector<BinaryData> txosToErase;
+      vector<BinaryData> txosToUnspend;
+      map<BinaryData, StoredSubHistory>::iterator iterSub;
+      map<BinaryData, TxIOPair>::iterator iterTxio;
+      for(iterSub  = ssh.subHistMap_.begin(); 
+          iterSub != ssh.subHistMap_.end(); 
+          iterSub++)
+      {
+         StoredSubHistory & subssh = iterSub->second;
+         for(iterTxio  = subssh.txioSet_.begin();
+             iterTxio != subssh.txioSet_.end();
+             iterTxio++)
          {
-            LOGERR << "How does the wallet have a non-registered ScrAddr?";
-            continue;
+            TxIOPair & txio = iterTxio->second;
+            BinaryData txoKey = txio.getDBKeyOfOutput();
+            if(DBUtils.hgtxToHeight(txoKey.getSliceCopy(0,4)) >= hgt)
+            {
+               txosToErase.push_back(txoKey);
+               continue;
+            }
+
+            // Not hasTxInInMain():  putBareHeader may have already moved
+            // the valid dupIDs at these heights over to the new branch
+            if(!txio.hasTxIn())
+               continue;
+
+            BinaryData txiKey = txio.getDBKeyOfInput();
+            if(DBUtils.hgtxToHeight(txiKey.getSliceCopy(0,4)) >= hgt)
+               txosToUnspend.push_back(txoKey);
          }
+      }
 
-         RegisteredScrAddr & rsa = registeredScrAddrMap_[uniqKey];
-         vector<TxIOPair*> & txioList = scrAddr.getTxIOList();
+      for(uint32_t i=0; i<txosToErase.size(); i++)
+         ssh.eraseTxio(txosToErase[i]);
 
-         StoredScriptHistory ssh;
-         ssh.uniqueKey_ = scrAddr.getScrAddr();
-         ssh.version_ = ARMORY_DB_VERSION;
-         ssh.alreadyScannedUpToBlk_ = rsa.alreadyScannedUpToBlk_;
-         for(uint32_t t=0; t<txioList.size(); t++)
-            ssh.insertTxio(*(txioList[t]));
+      // Once an SSH has sub-histories it keeps them (see eraseTxio), but
+      // markTxOutUnspent goes by the TxIO count, which we just brought down
+      bool useMultipleEntries = ssh.useMultipleEntries_;
+      for(uint32_t i=0; i<txosToUnspend.size(); i++)
+         ssh.markTxOutUnspent(txosToUnspend[i]);
+      ssh.useMultipleEntries_ = useMultipleEntries;
 
-         iface_->putStoredScriptHistory(ssh); 
-         
+      // The base entry stays, even if it's empty, so its checkpoint does too
+      for(iterSub  = ssh.subHistMap_.begin(); 
+          iterSub != ssh.subHistMap_.end(); 
+          iterSub++)
+      {
+         if(iterSub->second.txioSet_.size() == 0)
+            iface_->deleteValue(BLKDATA, iterSub->second.getDBKey(true));
       }
+
+      ssh.alreadyScannedUpToBlk_ = hgt;
+      iface_->putStoredScriptHistory(ssh);
    }
 
    iface_->commitBatch(BLKDATA);
@@ -4049,6 +5281,9 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
 {
    SCOPED_TIMER("readBlkFileUpdate");
 
+   if(blkFileWatcher_.isRunning())
+      return readBlkFileUpdateFromWatcher();
+
    // Make sure the file exists and is readable
    string filename = blkFileList_[blkFileList_.size()-1];
 
@@ -4153,7 +5388,6 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
    BinaryRefReader brr(newBlockDataRaw);
    BinaryData fourBytes(4);
    uint32_t nBlkRead = 0;
-   vector<bool> blockAddResults;
    bool keepGoing = true;
    while(keepGoing)
    {
@@ -4176,71 +5410,14 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
          
       uint32_t nextBlockSize = brr.get_uint32_t();
 
-      blockAddResults = addNewBlockData(brr, 
-                                        useFileIndex0Idx,
-                                        bhOffset,
-                                        nextBlockSize);
-
-      bool blockAddSucceeded = blockAddResults[ADD_BLOCK_SUCCEEDED    ];
-      bool blockIsNewTop     = blockAddResults[ADD_BLOCK_NEW_TOP_BLOCK];
-      bool blockchainReorg   = blockAddResults[ADD_BLOCK_CAUSED_REORG ];
-
-      if(blockAddSucceeded)
+      if(processNewBlockData(brr, useFileIndex0Idx, bhOffset, nextBlockSize))
          nBlkRead++;
 
-      if(blockchainReorg)
-      {
-         LOGWARN << "Blockchain Reorganization detected!";
-         reassessAfterReorg(prevTopBlockPtr_, topBlockPtr_, reorgBranchPoint_);
-         purgeZeroConfPool();
-
-         // Update all the registered wallets...
-         updateWalletsAfterReorg(registeredWallets_);
-      }
-      else if(blockIsNewTop)
-      {
-         BlockHeader & bh = getTopBlockHeader();
-         uint32_t hgt = bh.getBlockHeight();
-         uint8_t  dup = bh.getDuplicateID();
-   
-         if(DBUtils.getArmoryDbType() != ARMORY_DB_BARE) 
-         {
-            LOGINFO << "Applying block to DB!";
-            applyBlockToDB(hgt, dup);
-         }
-
-         // Replaced this with the scanDBForRegisteredTx call outside the loop
-         //StoredHeader sbh;
-         //iface_->getStoredHeader(sbh, hgt, dup);
-         //map<uint16_t, StoredTx>::iterator iter;
-         //for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
-         //{
-            //Tx regTx = iter->second.getTxCopy();
-            //registeredScrAddrScan(regTx.getPtr(), regTx.getSize());
-         //}
-      }
-      else
-      {
-         LOGWARN << "Block data did not extend the main chain!";
-         // New block was added -- didn't cause a reorg but it's not the
-         // new top block either (it's a fork block).  We don't do anything
-         // at all until the reorg actually happens
-      }
-      
       if(brr.isEndOfStream() || brr.getSizeRemaining() < 8)
          keepGoing = false;
    }
 
-   lastTopBlock_ = getTopBlockHeight()+1;
-
-   purgeZeroConfPool();
-   scanDBForRegisteredTx(prevTopBlk, lastTopBlock_);
-
-   if(prevRegisteredUpToDate)
-   {
-      allScannedUpToBlk_ = getTopBlockHeight()+1;
-      updateRegisteredScrAddrs(allScannedUpToBlk_);
-   }
+   finishBlkFileUpdate(prevTopBlk, prevRegisteredUpToDate);
 
    // If the blk file split, switch to tracking it
    LOGINFO << "Added new blocks to memory pool: " << nBlkRead;
@@ -4266,6 +5443,188 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Same as readBlkFileUpdate, but the BlkFileWatcher has already found the new
+// blocks, so if there aren't any, we don't even touch the blk files.
+uint32_t BlockDataManager_LevelDB::readBlkFileUpdateFromWatcher(void)
+{
+   vector<BlkFileRange> ranges;
+   blkFileWatcher_.popAll(ranges);
+   if(ranges.size() == 0)
+      return 0;
+
+   uint32_t prevTopBlk = getTopBlockHeight()+1;
+   bool prevRegisteredUpToDate = (allScannedUpToBlk_==prevTopBlk);
+
+   uint32_t nBlkRead = 0;
+   BinaryData blockData;
+   ifstream is;
+   uint32_t openFileIndex = UINT32_MAX;
+   for(uint32_t i=0; i<ranges.size(); i++)
+   {
+      BlkFileRange const & range = ranges[i];
+
+      // The watcher already moved on to the next file, so we do, too
+      while(range.fnum_ >= numBlkFiles_)
+      {
+         string nextFilename = BtcUtils::getBlkFilename(blkFileDir_, 
+                                                        numBlkFiles_);
+         LOGINFO << "New block file split! " << nextFilename.c_str();
+         blkFileList_.push_back(nextFilename);
+         numBlkFiles_ += 1;
+      }
+
+      if(range.fnum_ != openFileIndex)
+      {
+         is.close();
+         is.clear();
+         is.open(blkFileList_[range.fnum_].c_str(), ios::in | ios::binary);
+         openFileIndex = range.fnum_;
+      }
+
+      blockData.resize(range.size_);
+      is.seekg(range.offset_ + 8, ios::beg);
+      is.read((char*)blockData.getPtr(), range.size_);
+      if(!is.good())
+      {
+         // The watcher has already moved past these, so hand them back to
+         // be read on the next update
+         LOGERR << "***ERROR:  Could not read block from " 
+                << blkFileList_[range.fnum_].c_str();
+         blkFileWatcher_.requeue(ranges, i);
+         break;
+      }
+
+      BinaryRefReader brr(blockData);
+      if(processNewBlockData(brr, range.fnum_, 
+                             (uint32_t)(range.offset_ + 8), range.size_))
+         nBlkRead++;
+
+      // Even if the block wasn't added (we already had it), it's been read,
+      // and polling picks up after it if the watcher stops
+      endOfLastBlockByte_ = range.offset_ + 8 + range.size_;
+   }
+
+   finishBlkFileUpdate(prevTopBlk, prevRegisteredUpToDate);
+   LOGINFO << "Added new blocks to memory pool: " << nBlkRead;
+   return nBlkRead;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Add one block from the blk files to RAM and the DB, and deal with whatever
+// it did to the chain.  Returns true if the block was added.
+bool BlockDataManager_LevelDB::processNewBlockData(BinaryRefReader & brrRawBlock, 
+                                                   uint32_t fileIndex0Idx,
+                                                   uint32_t thisHeaderOffset,
+                                                   uint32_t blockSize)
+{
+   vector<bool> blockAddResults = addNewBlockData(brrRawBlock, 
+                                                  fileIndex0Idx,
+                                                  thisHeaderOffset,
+                                                  blockSize);
+
+   bool blockAddSucceeded = blockAddResults[ADD_BLOCK_SUCCEEDED    ];
+   bool blockIsNewTop     = blockAddResults[ADD_BLOCK_NEW_TOP_BLOCK];
+   bool blockchainReorg   = blockAddResults[ADD_BLOCK_CAUSED_REORG ];
+
+   if(blockchainReorg)
+   {
+      LOGWARN << "Blockchain Reorganization detected!";
+
+      // Rewind the stored histories before the reorg is committed.  If we
+      // die in between, they're just behind the blocks and get rescanned.
+      // The other way around, they'd keep the old branch's tx for good.
+      rewindRegisteredScrAddrHistories(reorgBranchPoint_->getBlockHeight()+1);
+      reassessAfterReorg(prevTopBlockPtr_, topBlockPtr_, reorgBranchPoint_);
+      purgeZeroConfPool(reorgBranchPoint_->getBlockHeight()+1, 
+                        getTopBlockHeight()+1);
+
+      // Update all the registered wallets...
+      updateWalletsAfterReorg(registeredWallets_);
+      pruneBlkData();
+   }
+   else if(blockIsNewTop)
+   {
+      BlockHeader & bh = getTopBlockHeader();
+      uint32_t hgt = bh.getBlockHeight();
+      uint8_t  dup = bh.getDuplicateID();
+
+      if(DBUtils.getArmoryDbType() != ARMORY_DB_BARE) 
+      {
+         LOGINFO << "Applying block to DB!";
+         applyBlockToDB(hgt, dup);
+         pruneBlkData();
+      }
+
+      // Replaced this with the scanDBForRegisteredTx call outside the loop
+      //StoredHeader sbh;
+      //iface_->getStoredHeader(sbh, hgt, dup);
+      //map<uint16_t, StoredTx>::iterator iter;
+      //for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      //{
+         //Tx regTx = iter->second.getTxCopy();
+         //registeredScrAddrScan(regTx.getPtr(), regTx.getSize());
+      //}
+   }
+   else
+   {
+      LOGWARN << "Block data did not extend the main chain!";
+      // New block was added -- didn't cause a reorg but it's not the
+      // new top block either (it's a fork block).  We don't do anything
+      // at all until the reorg actually happens
+   }
+
+   return blockAddSucceeded;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// After adding new blocks, scan them for registered tx
+void BlockDataManager_LevelDB::finishBlkFileUpdate(uint32_t prevTopBlk,
+                                                   bool prevRegisteredUpToDate)
+{
+   lastTopBlock_ = getTopBlockHeight()+1;
+
+   // A reorg moved some of the checkpoints back below prevTopBlk, and the
+   // checkpoint only advances the ones inside the range we scan
+   uint32_t scanFrom = min(prevTopBlk, rewoundToHgt_);
+   rewoundToHgt_ = UINT32_MAX;
+
+   purgeZeroConfPool(prevTopBlk, lastTopBlock_);
+   scanDBForRegisteredTx(scanFrom, lastTopBlock_);
+
+   if(prevRegisteredUpToDate)
+   {
+      allScannedUpToBlk_ = getTopBlockHeight()+1;
+      updateRegisteredScrAddrs(allScannedUpToBlk_);
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Start the watcher from wherever we are now
+bool BlockDataManager_LevelDB::startBlkFileWatcher(void)
+{
+   if(numBlkFiles_ == 0 || numBlkFiles_ == UINT32_MAX || 
+      MagicBytes_.getSize() != 4)
+   {
+      LOGERR << "Can't watch blk files before they've been read";
+      return false;
+   }
+
+   if(!blkFileWatcher_.start(blkFileDir_, MagicBytes_,
+                             numBlkFiles_-1, endOfLastBlockByte_))
+   {
+      LOGINFO << "Not watching blk files, will poll for new blocks";
+      return false;
+   }
+
+   LOGINFO << "Watching " << blkFileDir_.c_str() << " for new blocks";
+   return true;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // BDM detects the reorg, but is wallet-agnostic so it can't update any wallets
 // You have to call this yourself after you check whether the last organizeChain
@@ -4274,6 +5633,9 @@ void BlockDataManager_LevelDB::updateWalletAfterReorg(BtcWallet & wlt)
 {
    SCOPED_TIMER("updateWalletAfterReorg");
 
+   // ZC tx may have been mined or orphaned along with the blocks
+   wlt.resetZeroConfScan();
+
    // Fix the wallet's ledger
    vector<LedgerEntry> & ledg = wlt.getTxLedger();
    for(uint32_t i=0; i<ledg.size(); i++)
@@ -4327,7 +5689,7 @@ bool BlockDataManager_LevelDB::verifyBlkFileIntegrity(void)
    PDEBUG("Verifying blk0001.dat integrity");
 
    bool isGood = true;
-   map<HashString, BlockHeader>::iterator headIter;
+   map<HashKey, BlockHeader>::iterator headIter;
    for(headIter  = headerMap_.begin();
        headIter != headerMap_.end();
        headIter++)
@@ -4371,8 +5733,8 @@ bool BlockDataManager_LevelDB::parseNewBlock(BinaryRefReader & brr,
 
    // Create the objects once that will be used for insertion
    // (txInsResult always succeeds--because multimap--so only iterator returns)
-   static pair<HashString, BlockHeader>                      bhInputPair;
-   static pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
+   static pair<HashKey, BlockHeader>                      bhInputPair;
+   static pair<map<HashKey, BlockHeader>::iterator, bool> bhInsResult;
    
    // Read the header and insert it into the map.
    bhInputPair.second.unserialize(brr);
@@ -4381,6 +5743,7 @@ bool BlockDataManager_LevelDB::parseNewBlock(BinaryRefReader & brr,
    BlockHeader * bhptr = &(bhInsResult.first->second);
    if(!bhInsResult.second)
       *bhptr = bhInsResult.first->second; // overwrite it even if insert fails
+   addHeaderToOrganize(*bhptr, bhInsResult.second);
 
    // Then put the bare header into the DB and get its duplicate ID.
    StoredHeader sbh;
@@ -4467,16 +5830,41 @@ vector<bool> BlockDataManager_LevelDB::addNewBlockData(
 
    // Create the objects once that will be used for insertion
    // (txInsResult always succeeds--because multimap--so only iterator returns)
-   static pair<HashString, BlockHeader>                      bhInputPair;
-   static pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
+   static pair<HashKey, BlockHeader>                      bhInputPair;
+   static pair<map<HashKey, BlockHeader>::iterator, bool> bhInsResult;
    
    // Read the header and insert it into the map.
    bhInputPair.second.unserialize(brrRawBlock);
-   bhInputPair.first = bhInputPair.second.getThisHash();
+   bhInputPair.first = HashKey(bhInputPair.second.getThisHash());
    bhInsResult = headerMap_.insert(bhInputPair);
    BlockHeader * bhptr = &(bhInsResult.first->second);
    if(!bhInsResult.second)
       *bhptr = bhInputPair.second; // overwrite it even if insert fails
+   addHeaderToOrganize(*bhptr, bhInsResult.second);
+
+   // The full block is parsed once, here, for both the merkle check and 
+   // the DB.  A corrupt block can't be the top, and neither can anything 
+   // built on it.  Its header still goes in below, so that whatever builds
+   // on it doesn't look like an orphan.  If the same block turns up again
+   // intact, it's good after all.
+   BinaryRefReader brrFull(startPtr, blockSize);
+   StoredHeader sbhFull;
+   sbhFull.unserializeFullBlock(brrFull, true, false);
+   bool blockIsCorrupt = false;
+   if(verifyMerkleOnIngest_)
+   {
+      if(!sbhFull.verifyMerkleRoot(merkleTreeBuf_))
+      {
+         reportCorruptBlock(sbhFull);
+         blockIsCorrupt = true;
+      }
+      else if(corruptBlocks_.erase(HashKey(newHeadHash)) > 0)
+      {
+         LOGINFO << "Got an intact copy of corrupt block "
+                 << newHeadHash.toHexStr(true).c_str();
+         corruptDescendants_.clear();
+      }
+   }
 
    // Finally, let's re-assess the state of the blockchain with the new data
    // Check the lastBlockWasReorg_ variable to see if there was a reorg
@@ -4492,7 +5880,8 @@ vector<bool> BlockDataManager_LevelDB::addNewBlockData(
    // Regardless of whether this was a reorg, we have to add the raw block
    // to the DB, but we don't apply it yet.
    brrRawBlock.rewind(HEADER_SIZE);
-   addRawBlockToDB(brrRawBlock);
+   if(!blockIsCorrupt)
+      addParsedBlockToDB(sbhFull);
 
    // Note where we will start looking for the next block, later
    endOfLastBlockByte_ = thisHeaderOffset + blockSize;
@@ -4586,6 +5975,21 @@ void BlockDataManager_LevelDB::reassessAfterReorg( BlockHeader* oldTopPtr,
    SCOPED_TIMER("reassessAfterReorg");
    LOGINFO << "Reassessing Tx validity after reorg";
 
+   // The whole reorg goes to the DB as one batch:  the undone blocks of the
+   // old branch and the applied blocks of the new one are all accumulated in
+   // the same maps, so a TxOut or SSH touched by several of them is only 
+   // read and written once.  The block headers and undo data are written in
+   // the same batch, so the DB never has half a reorg in it.
+   bool updateDB = (DBUtils.getArmoryDbType() != ARMORY_DB_BARE);
+   map<HashKey, StoredTx>              stxToModify;
+   map<BinaryData, StoredScriptHistory>   sshToModify;
+   set<BinaryData>                        keysToDelete;
+   if(updateDB)
+   {
+      iface_->waitForBackgroundCommit(BLKDATA);
+      iface_->startBatch(BLKDATA);
+   }
+
    // Walk down invalidated chain first, until we get to the branch point
    // Mark transactions as invalid
    txJustInvalidated_.clear();
@@ -4597,13 +6001,16 @@ void BlockDataManager_LevelDB::reassessAfterReorg( BlockHeader* oldTopPtr,
       uint32_t hgt = thisHeaderPtr->getBlockHeight();
       uint8_t  dup = thisHeaderPtr->getDuplicateID();
 
-      if(DBUtils.getArmoryDbType() != ARMORY_DB_BARE)
+      if(updateDB)
       {
          // Added with leveldb... in addition to reversing blocks in RAM, 
-         // we also need to undo the blocks in the DB
+         // we also need to undo the blocks in the DB.  If we're pruning, 
+         // we kept the undo data when the block was applied.
          StoredUndoData sud;
-         createUndoDataFromBlock(hgt, dup, sud);
-         undoBlockFromDB(sud);
+         if(DBUtils.getDbPruneType() != DB_PRUNE_ALL ||
+            !iface_->getStoredUndoData(sud, hgt, dup))
+            createUndoDataFromBlock(hgt, dup, sud);
+         undoBlockFromDB(sud, stxToModify, sshToModify, keysToDelete, false);
       }
       
       StoredHeader sbh;
@@ -4641,8 +6048,8 @@ void BlockDataManager_LevelDB::reassessAfterReorg( BlockHeader* oldTopPtr,
       StoredHeader sbh;
       iface_->getStoredHeader(sbh, hgt, dup, true);
 
-      if(DBUtils.getArmoryDbType() != ARMORY_DB_BARE)
-         applyBlockToDB(sbh);
+      if(updateDB)
+         applyBlockToDB(sbh, stxToModify, sshToModify, keysToDelete, false);
 
       for(uint32_t i=0; i<sbh.numTx_; i++)
       {
@@ -4654,6 +6061,12 @@ void BlockDataManager_LevelDB::reassessAfterReorg( BlockHeader* oldTopPtr,
       }
    }
 
+   if(updateDB)
+   {
+      applyModsToDB(stxToModify, sshToModify, keysToDelete, false);
+      iface_->commitBatch(BLKDATA);
+   }
+
    LOGWARN << "Done reassessing tx validity";
 }
 
@@ -4663,7 +6076,7 @@ vector<BlockHeader*> BlockDataManager_LevelDB::getHeadersNotOnMainChain(void)
    SCOPED_TIMER("getHeadersNotOnMainChain");
    PDEBUG("Getting headers not on main chain");
    vector<BlockHeader*> out(0);
-   map<HashString, BlockHeader>::iterator iter;
+   map<HashKey, BlockHeader>::iterator iter;
    for(iter  = headerMap_.begin(); 
        iter != headerMap_.end(); 
        iter++)
@@ -4676,6 +6089,26 @@ vector<BlockHeader*> BlockDataManager_LevelDB::getHeadersNotOnMainChain(void)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Anything that adds or overwrites a header in headerMap_ should call this,
+// so the next organizeChain() looks at it.
+void BlockDataManager_LevelDB::addHeaderToOrganize(BlockHeader & bh, bool isNew)
+{
+   headersToOrganize_.push_back(&bh);
+   if(isNew)
+      numNewHeaders_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Call this whenever headerMap_ is cleared
+void BlockDataManager_LevelDB::clearHeadersToOrganize(void)
+{
+   headersToOrganize_.clear();
+   numNewHeaders_ = 0;
+   numHeadersOrganized_ = 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // This returns false if our new main branch does not include the previous
 // topBlock.  If this returns false, that probably means that we have
@@ -4699,7 +6132,7 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
    // than a second, anyway.
    if(forceRebuild)
    {
-      map<HashString, BlockHeader>::iterator iter;
+      map<HashKey, BlockHeader>::iterator iter;
       for( iter  = headerMap_.begin(); 
            iter != headerMap_.end(); 
            iter++)
@@ -4731,17 +6164,33 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
    // in the new chain organization
    prevTopBlockPtr_ = topBlockPtr_;
 
-   // Iterate over all blocks, track the maximum difficulty-sum block
-   map<HashString, BlockHeader>::iterator iter;
+   // Only the headers added since the last call can be the new top block
+   // (everything else was already looked at), unless headerMap_ was changed
+   // behind our back, in which case we look at all of them like before.
+   bool checkAllHeaders = forceRebuild || 
+         (headerMap_.size() != numHeadersOrganized_ + numNewHeaders_);
+
+   vector<BlockHeader*> allHeaders;
+   if(checkAllHeaders)
+   {
+      allHeaders.reserve(headerMap_.size());
+      map<HashKey, BlockHeader>::iterator iter;
+      for( iter = headerMap_.begin(); iter != headerMap_.end(); iter ++)
+         allHeaders.push_back(&(iter->second));
+   }
+   vector<BlockHeader*> & toOrganize = (checkAllHeaders ? allHeaders : 
+                                                          headersToOrganize_);
+
+   // Track the maximum difficulty-sum block
    double   maxDiffSum     = prevTopBlockPtr_->getDifficultySum();
-   for( iter = headerMap_.begin(); iter != headerMap_.end(); iter ++)
+   for(uint32_t i=0; i<toOrganize.size(); i++)
    {
       // *** Walk down the chain following prevHash fields, until
       //     you find a "solved" block.  Then walk back up and 
       //     fill in the difficulty-sum values (do not set next-
       //     hash ptrs, as we don't know if this is the main branch)
       //     Method returns instantly if block is already "solved"
-      double thisDiffSum = traceChainDown(iter->second);
+      double thisDiffSum = traceChainDown(*toOrganize[i]);
 
       // If we hit orphans, we flag headers DB corruption
       if(corruptHeadersDB_)
@@ -4750,14 +6199,19 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
 
       
       // Determine if this is the top block.  If it's the same diffsum
-      // as the prev top block, don't do anything
-      if(thisDiffSum > maxDiffSum)
+      // as the prev top block, don't do anything.  Nothing at or above a
+      // corrupt block can be the top, since we don't have its tx.
+      if(thisDiffSum > maxDiffSum && !isOnCorruptBranch(*toOrganize[i]))
       {
          maxDiffSum     = thisDiffSum;
-         topBlockPtr_   = &(iter->second);
+         topBlockPtr_   = toOrganize[i];
       }
    }
 
+   headersToOrganize_.clear();
+   numNewHeaders_ = 0;
+   numHeadersOrganized_ = headerMap_.size();
+
    // Walk down the list one more time, set nextHash fields
    // Also set headersByHeight_;
    bool prevChainStillValid = (topBlockPtr_ == prevTopBlockPtr_);
@@ -4783,7 +6237,7 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
       //}
 
       HashString & childHash    = thisHeaderPtr->thisHash_;
-      thisHeaderPtr             = &(headerMap_[thisHeaderPtr->getPrevHash()]);
+      thisHeaderPtr             = &(headerMap_[HashKey(thisHeaderPtr->getPrevHash())]);
       thisHeaderPtr->nextHash_  = childHash;
 
       if(thisHeaderPtr == prevTopBlockPtr_)
@@ -4795,20 +6249,25 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
    headersByHeight_[thisHeaderPtr->getBlockHeight()] = thisHeaderPtr;
 
 
-   // Force a full rebuild to make sure everything is marked properly
+   // The walk above stopped at the first block that was already on the main
+   // chain.  If that isn't the previous top block, there was a reorg, and it's
+   // the branch point.  Everything from there up to the old top block is off
+   // the main chain now.  Heights and difficulty sums don't change, so there's
+   // no need to rebuild the rest of the chain.
    // On a full rebuild, prevChainStillValid should ALWAYS be true
    if( !prevChainStillValid )
    {
       LOGWARN << "Reorg detected!";
       reorgBranchPoint_ = thisHeaderPtr;
 
-      // There was a dangerous bug -- prevTopBlockPtr_ is set correctly 
-      // RIGHT NOW, but won't be once I make the recursive call to organizeChain
-      // I need to save it now, and re-assign it after the organizeChain call.
-      // (I might consider finding a way to avoid this, but it's fine as-is)
-      BlockHeader* prevtopblk = prevTopBlockPtr_;
-      organizeChain(true); // force-rebuild blockchain (takes less than 1s)
-      prevTopBlockPtr_ = prevtopblk;
+      BlockHeader* oldHeaderPtr = prevTopBlockPtr_;
+      while(oldHeaderPtr != reorgBranchPoint_)
+      {
+         oldHeaderPtr->isMainBranch_   = false;
+         oldHeaderPtr->isFinishedCalc_ = false;
+         oldHeaderPtr->nextHash_       = BtcUtils::EmptyHash_;
+         oldHeaderPtr = &(headerMap_[HashKey(oldHeaderPtr->getPrevHash())]);
+      }
       return false;
    }
 
@@ -4827,24 +6286,17 @@ double BlockDataManager_LevelDB::traceChainDown(BlockHeader & bhpStart)
    if(bhpStart.difficultySum_ > 0)
       return bhpStart.difficultySum_;
 
-   // Prepare some data structures for walking down the chain
-   vector<BlockHeader*>   headerPtrStack(headerMap_.size());
-   vector<double>           difficultyStack(headerMap_.size());
-   uint32_t blkIdx = 0;
-   double thisDiff;
-
    // Walk down the chain of prevHash_ values, until we find a block
-   // that has a definitive difficultySum value (i.e. >0). 
+   // that has a definitive difficultySum value (i.e. >0).  This is usually
+   // just one or two blocks, so don't size the stack for the whole chain.
+   vector<BlockHeader*> headerPtrStack;
    BlockHeader* thisPtr = &bhpStart;
-   map<HashString, BlockHeader>::iterator iter;
+   map<HashKey, BlockHeader>::iterator iter;
    while( thisPtr->difficultySum_ < 0)
    {
-      thisDiff                = thisPtr->difficultyDbl_;
-      difficultyStack[blkIdx] = thisDiff;
-      headerPtrStack[blkIdx]  = thisPtr;
-      blkIdx++;
+      headerPtrStack.push_back(thisPtr);
 
-      iter = headerMap_.find(thisPtr->getPrevHash());
+      iter = headerMap_.find(HashKey(thisPtr->getPrevHash()));
       if(ITER_IN_MAP(iter, headerMap_))
          thisPtr = &(iter->second);
       else
@@ -4870,12 +6322,11 @@ double BlockDataManager_LevelDB::traceChainDown(BlockHeader & bhpStart)
    // (by pointer) and accumulate the difficulty values 
    double   seedDiffSum = thisPtr->difficultySum_;
    uint32_t blkHeight   = thisPtr->blockHeight_;
-   for(int32_t i=blkIdx-1; i>=0; i--)
+   for(int32_t i=(int32_t)headerPtrStack.size()-1; i>=0; i--)
    {
-      seedDiffSum += difficultyStack[i];
-      blkHeight++;
       thisPtr                 = headerPtrStack[i];
-      thisPtr->difficultyDbl_ = difficultyStack[i];
+      seedDiffSum            += thisPtr->difficultyDbl_;
+      blkHeight++;
       thisPtr->difficultySum_ = seedDiffSum;
       thisPtr->blockHeight_   = blkHeight;
    }
@@ -4900,8 +6351,8 @@ void BlockDataManager_LevelDB::markOrphanChain(BlockHeader & bhpStart)
    //        to check the old version of this method if any problems 
    //        crop up.
    LOGWARN << "Marking orphan chain";
-   map<HashString, BlockHeader>::iterator iter;
-   iter = headerMap_.find(bhpStart.getThisHash());
+   map<HashKey, BlockHeader>::iterator iter;
+   iter = headerMap_.find(HashKey(bhpStart.getThisHash()));
    HashStringRef lastHeadHash;
    while( ITER_IN_MAP(iter, headerMap_) )
    {
@@ -4918,9 +6369,9 @@ void BlockDataManager_LevelDB::markOrphanChain(BlockHeader & bhpStart)
       iter->second.isOrphan_ = true;
       iter->second.isMainBranch_ = false;
       lastHeadHash = iter->second.thisHash_.getRef();
-      iter = headerMap_.find(iter->second.getPrevHash());
+      iter = headerMap_.find(HashKey(iter->second.getPrevHash()));
    }
-   orphanChainStartBlocks_.push_back(&(headerMap_[lastHeadHash.copy()]));
+   orphanChainStartBlocks_.push_back(&(headerMap_[HashKey(lastHeadHash)]));
    LOGWARN << "Done marking orphan chain";
 }
 
@@ -5017,6 +6468,8 @@ void BlockDataManager_LevelDB::enableZeroConf(string zcFilename)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// The file is a log:  each record is the tx time and the raw tx, or the 
+// tombstone marker and the hash of a tx that has since left the pool
 void BlockDataManager_LevelDB::readZeroConfFile(string zcFilename)
 {
    SCOPED_TIMER("readZeroConfFile");
@@ -5030,16 +6483,50 @@ void BlockDataManager_LevelDB::readZeroConfFile(string zcFilename)
    zcFile.close();
 
    // We succeeded opening the file...
+   uint32_t numRecords = 0;
+   vector<HashKey> removed;
    BinaryRefReader brr(zcData);
    while(brr.getSizeRemaining() > 8)
    {
       uint64_t txTime = brr.get_uint64_t();
-      uint32_t txSize = BtcUtils::TxCalcLength(brr.getCurrPtr());
-      BinaryData rawtx(txSize);
-      brr.get_BinaryData(rawtx.getPtr(), txSize);
-      addNewZeroConfTx(rawtx, (uint32_t)txTime, false);
+      if(txTime == ZC_FILE_TOMBSTONE)
+      {
+         if(brr.getSizeRemaining() < 32)
+            break;
+
+         removeZeroConfTx(HashKey(brr.getCurrPtr()), false, removed);
+         brr.advance(32);
+      }
+      else
+      {
+         // A record cut short by a crash can only be the last one
+         uint32_t txSize = BtcUtils::TxCalcLengthBounded(brr.getCurrPtr(),
+                                                 brr.getSizeRemaining());
+         if(txSize == UINT32_MAX)
+         {
+            LOGWARN << "Partial tx at the end of the zero-conf file";
+            break;
+         }
+
+         BinaryData rawtx(txSize);
+         brr.get_BinaryData(rawtx.getPtr(), txSize);
+         addNewZeroConfTx(rawtx, (uint32_t)txTime, false);
+      }
+      numRecords++;
    }
+
+   zcFileDeadRecords_ = numRecords - zeroConfMap_.size();
    purgeZeroConfPool();
+
+   // Whatever we append after a partial record would be read as part of it
+   // (and lost) on every load from now on, so get rid of it first
+   if(brr.getSizeRemaining() > 0 && zcFilename_.size() > 0)
+   {
+      LOGWARN << "Compacting the zero-conf file to drop the partial record";
+      rewriteZeroConfFile();
+   }
+   else
+      compactZeroConfFileIfNeeded();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -5072,80 +6559,248 @@ bool BlockDataManager_LevelDB::addNewZeroConfTx(BinaryData const & rawTx,
       return false;
    
    
-   zeroConfMap_[txHash] = ZeroConfData();
-   ZeroConfData & zc = zeroConfMap_[txHash];
-   zc.iter_ = zeroConfRawTxList_.insert(zeroConfRawTxList_.end(), rawTx);
-   zc.txobj_.unserialize(*(zc.iter_));
+   ZeroConfData & zc = zeroConfMap_[HashKey(txHash)];
+   zc.txobj_.unserialize(rawTx);
    zc.txtime_ = txtime;
+   zc.seq_    = zcNextSeq_++;
+   zeroConfSeqMap_[zc.seq_] = HashKey(txHash);
+
+   for(uint32_t i=0; i<zc.txobj_.getNumTxIn(); i++)
+   {
+      OutPointKey opKey = zc.txobj_.getTxInCopy(i).getOutPoint().getKey();
+      zeroConfSpentIndex_.insert(make_pair(opKey, HashKey(txHash)));
+   }
 
    // Record time.  Write to file
    if(writeToFile)
    {
+      BinaryWriter bw(8 + rawTx.getSize());
+      bw.put_uint64_t(zc.txtime_);
+      bw.put_BinaryData(rawTx);
+
       ofstream zcFile(zcFilename_.c_str(), ios::app | ios::binary);
-      zcFile.write( (char*)(&zc.txtime_), sizeof(uint64_t) );
-      zcFile.write( (char*)zc.txobj_.getPtr(),  zc.txobj_.getSize());
+      zcFile.write( (char*)bw.getData().getPtr(), bw.getSize());
       zcFile.close();
    }
    return true;
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Takes the tx out of the pool and the spent index.  withDescendants also 
+// takes out every ZC tx that spends its outputs, for when it was knocked out
+// by a conflict and they can never confirm either.  Everything removed is 
+// added to the list, for writeZeroConfTombstones
+void BlockDataManager_LevelDB::removeZeroConfTx(HashKey const & txHash, 
+                                                bool withDescendants,
+                                                vector<HashKey> & removed)
+{
+   map<HashKey, ZeroConfData>::iterator iter = zeroConfMap_.find(txHash);
+   if(ITER_NOT_IN_MAP(iter, zeroConfMap_))
+      return;
+
+   // The hash may live in one of the containers we're about to erase from
+   HashKey thisHash = txHash;
+   Tx & tx = iter->second.txobj_;
+   for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+   {
+      OutPointKey opKey = tx.getTxInCopy(i).getOutPoint().getKey();
+      multimap<OutPointKey, HashKey>::iterator spent = 
+                                       zeroConfSpentIndex_.lower_bound(opKey);
+      while(spent != zeroConfSpentIndex_.end() && spent->first == opKey)
+      {
+         if(spent->second == thisHash)
+            zeroConfSpentIndex_.erase(spent++);
+         else
+            spent++;
+      }
+   }
+
+   uint32_t numTxOut = tx.getNumTxOut();
+   zeroConfSeqMap_.erase(iter->second.seq_);
+   zeroConfMap_.erase(iter);
+   removed.push_back(thisHash);
+
+   if(!withDescendants)
+      return;
+
+   for(uint32_t i=0; i<numTxOut; i++)
+   {
+      OutPointKey opKey = getOutPointKey(thisHash.getRef(), i);
+      vector<HashKey> spenders;
+      multimap<OutPointKey, HashKey>::iterator spent = 
+                                       zeroConfSpentIndex_.lower_bound(opKey);
+      for(; spent != zeroConfSpentIndex_.end() && spent->first == opKey; spent++)
+         spenders.push_back(spent->second);
+
+      for(uint32_t s=0; s<spenders.size(); s++)
+         removeZeroConfTx(spenders[s], true, removed);
+   }
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
+// Checks every ZC tx against the DB.  This is for when we don't know which
+// blocks came in since the pool was built (i.e. when it's read from file).
+// As blocks come in, use purgeZeroConfPool(blk0, blk1), which only looks at
+// the tx in those blocks.
 void BlockDataManager_LevelDB::purgeZeroConfPool(void)
 {
    SCOPED_TIMER("purgeZeroConfPool");
-   list< map<HashString, ZeroConfData>::iterator > mapRmList;
+   vector<HashKey> mined;
 
    // Find all zero-conf transactions that made it into the blockchain
-   map<HashString, ZeroConfData>::iterator iter;
+   map<HashKey, ZeroConfData>::iterator iter;
    for(iter  = zeroConfMap_.begin();
        iter != zeroConfMap_.end();
        iter++)
    {
-      if(!getTxRefByHash(iter->first).isNull())
-         mapRmList.push_back(iter);
+      if(!getTxRefByHash(iter->first.copy()).isNull())
+         mined.push_back(iter->first);
+   }
+
+   // We've made a list of the zc tx to remove, now let's remove them
+   // I decided this was safer than erasing the data as we were iterating
+   // over it in the previous loop
+   vector<HashKey> removed;
+   for(uint32_t i=0; i<mined.size(); i++)
+      removeZeroConfTx(mined[i], false, removed);
+
+   writeZeroConfTombstones(removed);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Removes the ZC tx that were mined in main-chain blocks [blk0, blk1), and 
+// the ZC tx that double-spend any tx in those blocks (with everything that 
+// spends them).  The ZC pool doesn't get touched beyond the tx it loses.
+void BlockDataManager_LevelDB::purgeZeroConfPool(uint32_t blk0, uint32_t blk1)
+{
+   SCOPED_TIMER("purgeZeroConfPool(blk0,blk1)");
+   vector<HashKey> removed;
+
+   for(uint32_t hgt=blk0; hgt<blk1 && zeroConfMap_.size()>0; hgt++)
+   {
+      StoredHeader sbh;
+      uint8_t dup = iface_->getValidDupIDForHeight(hgt);
+      if(dup==UINT8_MAX || !iface_->getStoredHeader(sbh, hgt, dup, true))
+      {
+         LOGWARN << "Could not read block " << hgt << " to purge ZC pool, "
+                 << "checking the whole pool instead";
+         writeZeroConfTombstones(removed);
+         purgeZeroConfPool();
+         return;
+      }
+
+      map<uint16_t, StoredTx>::iterator stxIter;
+      for(stxIter  = sbh.stxMap_.begin();
+          stxIter != sbh.stxMap_.end();
+          stxIter++)
+      {
+         HashKey txHash(stxIter->second.thisHash_);
+
+         // Mined, so anything spending it is still good
+         removeZeroConfTx(txHash, false, removed);
+
+         // Any other ZC tx spending the same outputs never will be
+         Tx tx = stxIter->second.getTxCopy();
+         for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+         {
+            OutPointKey opKey = tx.getTxInCopy(i).getOutPoint().getKey();
+            vector<HashKey> conflicts;
+            multimap<OutPointKey, HashKey>::iterator spent = 
+                                       zeroConfSpentIndex_.lower_bound(opKey);
+            for(; spent != zeroConfSpentIndex_.end() && spent->first == opKey; 
+                spent++)
+            {
+               if(spent->second != txHash)
+                  conflicts.push_back(spent->second);
+            }
+
+            for(uint32_t c=0; c<conflicts.size(); c++)
+               removeZeroConfTx(conflicts[c], true, removed);
+         }
+      }
    }
 
-   // We've made a list of the zc tx to remove, now let's remove them
-   // I decided this was safer than erasing the data as we were iterating
-   // over it in the previous loop
-   list< map<HashString, ZeroConfData>::iterator >::iterator rmIter;
-   for(rmIter  = mapRmList.begin();
-       rmIter != mapRmList.end();
-       rmIter++)
+   writeZeroConfTombstones(removed);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Appends a tombstone to the ZC file for each tx that left the pool.  Each
+// one makes two dead records in the file (it and the tx it cancels).
+void BlockDataManager_LevelDB::writeZeroConfTombstones(
+                                             vector<HashKey> const & removed)
+{
+   SCOPED_TIMER("writeZeroConfTombstones");
+   if(removed.size() == 0 || zcFilename_.size() == 0)
+      return;
+
+   zcFileDeadRecords_ += 2*removed.size();
+   if(compactZeroConfFileIfNeeded())
+      return;
+
+   BinaryWriter bw(40*removed.size());
+   for(uint32_t i=0; i<removed.size(); i++)
    {
-      zeroConfRawTxList_.erase( (*rmIter)->second.iter_ );
-      zeroConfMap_.erase( *rmIter );
+      bw.put_uint64_t(ZC_FILE_TOMBSTONE);
+      bw.put_BinaryData(removed[i].getPtr(), 32);
    }
 
-   // Rewrite the zero-conf pool file
-   if(mapRmList.size() > 0)
-      rewriteZeroConfFile();
+   ofstream zcFile(zcFilename_.c_str(), ios::app | ios::binary);
+   zcFile.write( (char*)bw.getData().getPtr(), bw.getSize());
+   zcFile.close();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Rewrites the ZC file once there are at least zcCompactMinDead_ dead 
+// records in it and they outnumber the live ones.  Returns true if it did.
+bool BlockDataManager_LevelDB::compactZeroConfFileIfNeeded(void)
+{
+   if(zcFilename_.size() == 0                ||
+      zcFileDeadRecords_ <  zcCompactMinDead_ ||
+      zcFileDeadRecords_ <= zeroConfMap_.size())
+      return false;
 
+   rewriteZeroConfFile();
+   return true;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
+// Compacts the ZC file down to the live tx, in the order they came in.  It's
+// written next to the old one and moved over it, so a crash part way through
+// doesn't lose the pool.
 void BlockDataManager_LevelDB::rewriteZeroConfFile(void)
 {
    SCOPED_TIMER("rewriteZeroConfFile");
-   ofstream zcFile(zcFilename_.c_str(), ios::out | ios::binary);
+   string tempFilename = zcFilename_ + ".tmp";
+   ofstream zcFile(tempFilename.c_str(), ios::out | ios::binary);
 
-   static HashString txHash(32);
-   list<HashString>::iterator iter;
-   for(iter  = zeroConfRawTxList_.begin();
-       iter != zeroConfRawTxList_.end();
+   map<uint32_t, HashKey>::iterator iter;
+   for(iter  = zeroConfSeqMap_.begin();
+       iter != zeroConfSeqMap_.end();
        iter++)
    {
-      BtcUtils::getHash256(*iter, txHash);
-      ZeroConfData & zcd = zeroConfMap_[txHash];
-      zcFile.write( (char*)(&zcd.txtime_), sizeof(uint64_t) );
-      zcFile.write( (char*)(zcd.txobj_.getPtr()),  zcd.txobj_.getSize());
+      ZeroConfData & zcd = zeroConfMap_[iter->second];
+      BinaryWriter bw(8 + zcd.txobj_.getSize());
+      bw.put_uint64_t(zcd.txtime_);
+      bw.put_BinaryData(zcd.txobj_.getPtr(), zcd.txobj_.getSize());
+      zcFile.write( (char*)bw.getData().getPtr(), bw.getSize());
    }
 
    zcFile.close();
 
+   // Windows won't rename over an existing file
+   if(rename(tempFilename.c_str(), zcFilename_.c_str()) != 0)
+   {
+      remove(zcFilename_.c_str());
+      rename(tempFilename.c_str(), zcFilename_.c_str());
+   }
+
+   zcFileDeadRecords_ = 0;
 }
 
 
@@ -5153,27 +6808,66 @@ void BlockDataManager_LevelDB::rewriteZeroConfFile(void)
 void BlockDataManager_LevelDB::rescanWalletZeroConf(BtcWallet & wlt)
 {
    SCOPED_TIMER("rescanWalletZeroConf");
-   // Clear the whole list, rebuild
-   wlt.clearZeroConfPool();
 
-   static HashString txHash(32);
-   list<HashString>::iterator iter;
-   for(iter  = zeroConfRawTxList_.begin();
-       iter != zeroConfRawTxList_.end();
-       iter++)
+   // If a ZC tx the wallet picked up has left the pool (mined or knocked out
+   // by a conflict) or come back with a new seq since, clear the whole list
+   // and rebuild.  Otherwise only scan what came in after the last call.
+   uint32_t scannedUpTo = wlt.getZeroConfScannedUpToSeq();
+   bool fullRescan = wlt.zeroConfScanIsStale();
+   vector<LedgerEntry> & zcLedger = wlt.getZeroConfLedger();
+   for(uint32_t i=0; i<zcLedger.size() && !fullRescan; i++)
+   {
+      map<HashKey, ZeroConfData>::iterator iter = 
+                                 zeroConfMap_.find(HashKey(zcLedger[i].getTxHash()));
+      if(ITER_NOT_IN_MAP(iter, zeroConfMap_) || iter->second.seq_ > scannedUpTo)
+         fullRescan = true;
+   }
+
+   if(fullRescan)
    {
+      wlt.clearZeroConfPool();
+      scannedUpTo = 0;
+   }
 
-      if(iter->getSize() == 0)
-         continue;
+   // The ones that weren't final last time are behind scannedUpTo, so look
+   // at them again.  Once they're final (or gone from the pool) they're
+   // off the list.
+   set<uint32_t> & nonFinalSeqs = wlt.getZeroConfNonFinalSeqs();
+   set<uint32_t>::iterator nfIter = nonFinalSeqs.begin();
+   while(nfIter != nonFinalSeqs.end())
+   {
+      map<uint32_t, HashKey>::iterator seqIter = zeroConfSeqMap_.find(*nfIter);
+      if(ITER_IN_MAP(seqIter, zeroConfSeqMap_))
+      {
+         ZeroConfData & zcd = zeroConfMap_[seqIter->second];
+         if( !isTxFinal(zcd.txobj_) )
+         {
+            nfIter++;
+            continue;
+         }
+
+         wlt.scanTx(zcd.txobj_, 0, (uint32_t)zcd.txtime_, UINT32_MAX);
+      }
+      nonFinalSeqs.erase(nfIter++);
+   }
 
-      BtcUtils::getHash256(*iter, txHash);
-      ZeroConfData & zcd = zeroConfMap_[txHash];
+   map<uint32_t, HashKey>::iterator iter;
+   for(iter  = zeroConfSeqMap_.upper_bound(scannedUpTo);
+       iter != zeroConfSeqMap_.end();
+       iter++)
+   {
+      ZeroConfData & zcd = zeroConfMap_[iter->second];
 
       if( !isTxFinal(zcd.txobj_) )
+      {
+         nonFinalSeqs.insert(iter->first);
          continue;
+      }
 
       wlt.scanTx(zcd.txobj_, 0, (uint32_t)zcd.txtime_, UINT32_MAX);
    }
+
+   wlt.setZeroConfScannedUpToSeq(zcNextSeq_-1);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -5208,14 +6902,12 @@ void BlockDataManager_LevelDB::pprintSSHInfoAboutHash160(BinaryData const & a160
 ////////////////////////////////////////////////////////////////////////////////
 void BlockDataManager_LevelDB::pprintZeroConfPool(void)
 {
-   static HashString txHash(32);
-   list<HashString>::iterator iter;
-   for(iter  = zeroConfRawTxList_.begin();
-       iter != zeroConfRawTxList_.end();
+   map<uint32_t, HashKey>::iterator iter;
+   for(iter  = zeroConfSeqMap_.begin();
+       iter != zeroConfSeqMap_.end();
        iter++)
    {
-      BtcUtils::getHash256(*iter, txHash);
-      ZeroConfData & zcd = zeroConfMap_[txHash];
+      ZeroConfData & zcd = zeroConfMap_[iter->second];
       Tx & tx = zcd.txobj_;
       cout << tx.getThisHash().getSliceCopy(0,8).toHexStr().c_str() << " ";
       for(uint32_t i=0; i<tx.getNumTxOut(); i++)
@@ -5237,14 +6929,15 @@ void ScrAddrObj::clearZeroConfPool(void)
 void BtcWallet::clearZeroConfPool(void)
 {
    SCOPED_TIMER("clearZeroConfPool");
+   resetZeroConfScan();
    ledgerAllAddrZC_.clear();
    for(uint32_t i=0; i<scrAddrMap_.size(); i++)
       scrAddrPtrs_[i]->clearZeroConfPool();
 
 
    // Need to "unlock" the TxIOPairs that were locked with zero-conf txs
-   list< map<OutPoint, TxIOPair>::iterator > rmList;
-   map<OutPoint, TxIOPair>::iterator iter;
+   list< map<OutPointKey, TxIOPair>::iterator > rmList;
+   map<OutPointKey, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
@@ -5258,7 +6951,7 @@ void BtcWallet::clearZeroConfPool(void)
    // remove to ensure that it won't conflict with any logic that only 
    // checks for the *existence* of a TxIOPair, whereas the TxIOPair might 
    // actually be "empty" but would throw off some other logic.
-   list< map<OutPoint, TxIOPair>::iterator >::iterator rmIter;
+   list< map<OutPointKey, TxIOPair>::iterator >::iterator rmIter;
    for(rmIter  = rmList.begin();
        rmIter != rmList.end();
        rmIter++)
@@ -5267,6 +6960,22 @@ void BtcWallet::clearZeroConfPool(void)
    }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+bool BtcWallet::zeroConfScanIsStale(void) const
+{
+   return zcScannedUpToSeq_    == 0                     ||
+          zcScannedLedgerSize_ != ledgerAllAddr_.size() ||
+          zcScannedNumAddr_    != scrAddrMap_.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BtcWallet::setZeroConfScannedUpToSeq(uint32_t seq)
+{
+   zcScannedUpToSeq_    = seq;
+   zcScannedLedgerSize_ = ledgerAllAddr_.size();
+   zcScannedNumAddr_    = scrAddrMap_.size();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 vector<LedgerEntry> & BtcWallet::getTxLedger(HashString const * scraddr)
 {
@@ -5355,7 +7064,7 @@ bool BlockDataManager_LevelDB::isTxFinal(Tx & tx)
 //        block that it is handled correctly, etc.
 bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
                         StoredTx &                             thisSTX,
-                        map<BinaryData, StoredTx> &            stxToModify,
+                        map<HashKey, StoredTx> &            stxToModify,
                         map<BinaryData, StoredScriptHistory> & sshToModify,
                         set<BinaryData> &                      keysToDelete,
                         StoredUndoData *                       sud)
@@ -5365,8 +7074,13 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
    Tx tx = thisSTX.getTxCopy();
 
    // We never expect thisSTX to already be in the map (other tx in the map
-   // may be affected/retrieved multiple times).  
-   if(KEY_IN_MAP(tx.getThisHash(), stxToModify))
+   // may be affected/retrieved multiple times).  The exception is a reorg,
+   // where the same tx may be in a block of the old branch that was undone
+   // in the same batch, under a different dupID.
+   map<HashKey, StoredTx>::iterator iterAdded;
+   iterAdded = stxToModify.find(HashKey(tx.getThisHash()));
+   if(ITER_IN_MAP(iterAdded, stxToModify) && 
+      iterAdded->second.getDBKey() == thisSTX.getDBKey())
       LOGERR << "How did we already add this tx?";
 
    // I just noticed we never set TxOuts to TXOUT_UNSPENT.  Might as well do 
@@ -5381,7 +7095,7 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
    // This tx itself needs to be added to the map, which makes it accessible 
    // to future tx in the same block which spend outputs from this tx, without
    // doing anything crazy in the code here
-   stxToModify[tx.getThisHash()] = thisSTX;
+   stxToModify[HashKey(tx.getThisHash())] = thisSTX;
 
    dbUpdateSize_ += thisSTX.numBytes_;
    
@@ -5399,27 +7113,42 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
       BinaryDataRef opTxHash = op.getTxHashRef();
       uint32_t      opTxoIdx = op.getTxOutIndex();
 
-      // This will fetch the STX from DB and put it in the stxToModify
-      // map if it's not already there.  Or it will do nothing if it's
-      // already part of the map.  In both cases, it returns a pointer
-      // to the STX that will be written to DB that we can modify.
-      StoredTx    * stxptr = makeSureSTXInMap(opTxHash, stxToModify);
-      StoredTxOut & stxo   = stxptr->stxoMap_[opTxoIdx];
-      BinaryData    uniqKey   = stxo.getScrAddress();
-
-      // Update the stxo by marking it spent by this Block:TxIndex:TxInIndex
-      map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(opTxoIdx);
-      
-      // Some sanity checks
-      //if(iter == stxptr->stxoMap_.end())
-      if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
+      // Recently created outputs are usually in the UTXO cache.  Unless the
+      // whole STX is already in the map, we can just mark the one TxOut 
+      // spent and write only that.
+      OutPointKey   opKey = getOutPointKey(opTxHash, opTxoIdx);
+      StoredTxOut   stxoCached;
+      StoredTxOut * stxoPtr;
+      bool inCache = utxoCache_.take(opKey, stxoCached);
+      if(inCache && KEY_NOT_IN_MAP(HashKey(opTxHash), stxToModify))
       {
-         LOGERR << "Needed to get OutPoint for a TxIn, but DNE";
-         continue;
+         stxoPtr = &(stxoToModify_[opKey] = stxoCached);
+         dbUpdateSize_ += UPDATE_BYTES_STXO;
+      }
+      else
+      {
+         // This will fetch the STX from DB and put it in the stxToModify
+         // map if it's not already there.  Or it will do nothing if it's
+         // already part of the map.  In both cases, it returns a pointer
+         // to the STX that will be written to DB that we can modify.
+         StoredTx * stxptr = makeSureSTXInMap(opTxHash, stxToModify);
+
+         // Update the stxo by marking it spent by this Block:TxIndex:TxInIndex
+         map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(opTxoIdx);
+      
+         // Some sanity checks
+         //if(iter == stxptr->stxoMap_.end())
+         if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
+         {
+            LOGERR << "Needed to get OutPoint for a TxIn, but DNE";
+            continue;
+         }
+         stxoPtr = &(iter->second);
       }
 
-      // We're aliasing this because "iter->second" is not clear at all
-      StoredTxOut & stxoSpend = iter->second;
+      // We're aliasing this because "stxoPtr" is not clear at all
+      StoredTxOut & stxoSpend = *stxoPtr;
+      BinaryData    uniqKey   = stxoSpend.getScrAddress();
    
       if(stxoSpend.spentness_ == TXOUT_SPENT)
       {
@@ -5430,7 +7159,10 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
       // Just about to {remove-if-pruning, mark-spent-if-not} STXO
       // Record it in the StoredUndoData object
       if(sud != NULL)
+      {
          sud->stxOutsRemovedByBlock_.push_back(stxoSpend);
+         sud->stxOutsRemovedByBlock_.back().parentHash_ = opTxHash.copy();
+      }
 
       // Need to modify existing UTXOs, so that we can delete or mark as spent
       stxoSpend.spentness_      = TXOUT_SPENT;
@@ -5444,7 +7176,7 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
       ////// Now update the SSH to show this TxIOPair was spent
       // Same story as stxToModify above, except this will actually create a new
       // SSH if it doesn't exist in the map or the DB
-      BinaryData hgtX = stxo.getHgtX();
+      BinaryData hgtX = stxoSpend.getHgtX();
       StoredScriptHistory* sshptr = makeSureSSHInMap(uniqKey, hgtX, sshToModify);
 
       // Assuming supernode, we don't need to worry about removing references
@@ -5452,6 +7184,8 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
       // update the correct SSH TXIO directly
       sshptr->markTxOutSpent(stxoSpend.getDBKey(false),
                              thisSTX.getDBKeyOfChild(iin, false));
+
+      removeUTXOFromTrie(stxoSpend);
    }
 
 
@@ -5491,6 +7225,11 @@ bool BlockDataManager_LevelDB::applyTxToBatchWriteData(
                                     true);
          }
       }
+
+      addUTXOToTrie(stxoToAdd, tx.getThisHash());
+      if(sud != NULL)
+         sud->outPointsAddedByBlock_.push_back(OutPoint(tx.getThisHash(), iout));
+      utxoCache_.insert(getOutPointKey(tx.getThisHash(), iout), stxoToAdd);
    }
 
    return true;
@@ -5519,12 +7258,119 @@ bool BlockDataManager_LevelDB::addRawBlockToDB(BinaryRefReader & brr)
    else
       brr.rewind(4);
 
+   StoredHeader sbh;
+   sbh.unserializeFullBlock(brr, true, false);
+   if(verifyMerkleOnIngest_ && !sbh.verifyMerkleRoot(merkleTreeBuf_))
+   {
+      reportCorruptBlock(sbh);
+      return false;
+   }
+
+   return addParsedBlockToDB(sbh);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Skipping just the one block would leave a hole in the chain, so neither it
+// nor anything built on it goes into BLKDATA or onto the main chain after 
+// this.  That's only for headers we know:  a header that isn't in 
+// headerMap_ (rejected, or mangled by the same corruption) isn't on any
+// chain we'd build, so the block is just skipped.
+void BlockDataManager_LevelDB::reportCorruptBlock(StoredHeader const & sbh)
+{
+   LOGERR << "Block does not match its merkle root, not adding it to the DB: "
+          << sbh.thisHash_.toHexStr(true).c_str();
+   LOGERR << "The blk*.dat files may be corrupt.  Run bitcoind with "
+          << "-reindex to fix them.";
+   numCorruptBlocks_++;
+
+   if(headerMap_.find(HashKey(sbh.thisHash_)) == headerMap_.end())
+      return;
+
+   // Another copy of the same block already went in intact.  headerMap_ 
+   // doesn't have its hgt&dup yet if it was just sent again, the DB does.
+   BinaryRefReader brrHead = iface_->getValueReader(HEADERS, 
+                                       DB_PREFIX_HEADHASH, sbh.thisHash_);
+   if(brrHead.getSize() > 0)
+   {
+      StoredHeader sbhHead;
+      sbhHead.unserializeDBValue(HEADERS, brrHead);
+      BinaryData blkKey = DBUtils.getBlkDataKey(sbhHead.blockHeight_,
+                                                sbhHead.duplicateID_);
+      if(iface_->getValue(BLKDATA, blkKey).getSize() > 0)
+         return;
+   }
+
+   corruptBlocks_.insert(HashKey(sbh.thisHash_));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Walks down from bh until it finds a corrupt block, or gets below all the
+// ones in the chain.  Everything on the way to a corrupt block is on top of
+// it too, so we remember those and the next walk stops there.  Heights are 
+// only good for headers that have been traced (difficultySum_ > 0), which 
+// organizeChain has always done for the ones it asks about.
+bool BlockDataManager_LevelDB::isOnCorruptBranch(BlockHeader & bh)
+{
+   if(corruptBlocks_.size() == 0)
+      return false;
+
+   uint32_t minHgt = UINT32_MAX;
+   set<HashKey>::iterator iter;
+   for(iter = corruptBlocks_.begin(); iter != corruptBlocks_.end(); iter++)
+   {
+      map<HashKey, BlockHeader>::iterator bhIter = headerMap_.find(*iter);
+      if(bhIter != headerMap_.end() && bhIter->second.difficultySum_ > 0)
+         minHgt = min(minHgt, bhIter->second.getBlockHeight());
+   }
+
+   vector<BlockHeader*> path;
+   BlockHeader* thisPtr = &bh;
+   bool onCorruptBranch = false;
+   while(thisPtr->difficultySum_ > 0 && thisPtr->getBlockHeight() >= minHgt)
+   {
+      HashKey thisHash(thisPtr->getThisHash());
+      if(corruptBlocks_.count(thisHash) > 0 ||
+         corruptDescendants_.count(thisHash) > 0)
+      {
+         onCorruptBranch = true;
+         break;
+      }
+
+      path.push_back(thisPtr);
+      map<HashKey, BlockHeader>::iterator prevIter = 
+                                    headerMap_.find(HashKey(thisPtr->getPrevHash()));
+      if(prevIter == headerMap_.end())
+         break;
+      thisPtr = &(prevIter->second);
+   }
+
+   if(onCorruptBranch)
+      for(uint32_t i=0; i<path.size(); i++)
+         corruptDescendants_.insert(HashKey(path[i]->getThisHash()));
+
+   return onCorruptBranch;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Second half of addRawBlockToDB, split out so that the parsing can be done
+// in another thread (see readRawBlocksPipelined).  This is the part that 
+// needs the headerMap_ and the DB, so it must be called from the BDM thread.
+bool BlockDataManager_LevelDB::addParsedBlockToDB(StoredHeader & sbh)
+{
    // Again, we rely on the assumption that the header has already been
    // added to the headerMap and the DB, and we have its correct height 
    // and dupID
-   StoredHeader sbh;
-   sbh.unserializeFullBlock(brr, true, false);
-   BlockHeader & bh = headerMap_[sbh.thisHash_];
+   map<HashKey, BlockHeader>::iterator iter = headerMap_.find(HashKey(sbh.thisHash_));
+   if(iter == headerMap_.end())
+   {
+      LOGERR << "Cannot add raw block to DB without its header";
+      return false;
+   }
+
+   BlockHeader & bh = iter->second;
    sbh.blockHeight_  = bh.getBlockHeight();
    sbh.duplicateID_  = bh.getDuplicateID();
    sbh.isMainBranch_ = bh.isMainBranch();
@@ -5537,6 +7383,10 @@ bool BlockDataManager_LevelDB::addRawBlockToDB(BinaryRefReader & brr)
       return false;
    }
 
+   // Nothing built on a corrupt block goes in (see reportCorruptBlock)
+   if(isOnCorruptBranch(bh))
+      return false;
+
    iface_->putStoredHeader(sbh, true);
    return true;
 }
@@ -5604,7 +7454,7 @@ void BlockDataManager_LevelDB::updateBlkDataHeader(StoredHeader const & sbh)
 ////////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::applyBlockToDB(uint32_t hgt, uint8_t  dup)
 {
-   map<BinaryData, StoredTx>              stxToModify;
+   map<HashKey, StoredTx>              stxToModify;
    map<BinaryData, StoredScriptHistory>   sshToModify;
    set<BinaryData>                        keysToDelete;
    return applyBlockToDB(hgt, dup, stxToModify, sshToModify, keysToDelete, true);
@@ -5613,7 +7463,7 @@ bool BlockDataManager_LevelDB::applyBlockToDB(uint32_t hgt, uint8_t  dup)
 ////////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::applyBlockToDB(StoredHeader & sbh)
 {
-   map<BinaryData, StoredTx>              stxToModify;
+   map<HashKey, StoredTx>              stxToModify;
    map<BinaryData, StoredScriptHistory>   sshToModify;
    set<BinaryData>                        keysToDelete;
 
@@ -5624,7 +7474,7 @@ bool BlockDataManager_LevelDB::applyBlockToDB(StoredHeader & sbh)
 bool BlockDataManager_LevelDB::applyBlockToDB( 
                         uint32_t hgt, 
                         uint8_t  dup,
-                        map<BinaryData, StoredTx> &            stxToModify,
+                        map<HashKey, StoredTx> &            stxToModify,
                         map<BinaryData, StoredScriptHistory> & sshToModify,
                         set<BinaryData> &                      keysToDelete,
                         bool                                   applyWhenDone)
@@ -5643,7 +7493,7 @@ bool BlockDataManager_LevelDB::applyBlockToDB(
 ////////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::applyBlockToDB(
                         StoredHeader & sbh,
-                        map<BinaryData, StoredTx> &            stxToModify,
+                        map<HashKey, StoredTx> &            stxToModify,
                         map<BinaryData, StoredScriptHistory> & sshToModify,
                         set<BinaryData> &                      keysToDelete,
                         bool                                   applyWhenDone)
@@ -5695,9 +7545,9 @@ bool BlockDataManager_LevelDB::applyBlockToDB(
    if(applyWhenDone)
       applyModsToDB(stxToModify, sshToModify, keysToDelete);
 
-   // Only if pruning, we need to store 
-   // TODO: this is going to get run every block, probably should batch it 
-   //       like we do with the other data...when we actually implement pruning
+   // Only if pruning, we need to store the undo data:  the tx it refers to
+   // may be gone by the time we have to undo the block.  pruneBlkData 
+   // deletes it once the block is below the undo window.
    if(DBUtils.getDbPruneType() == DB_PRUNE_ALL)
       iface_->putStoredUndoData(sud);
 
@@ -5782,10 +7632,19 @@ bool BlockDataManager_LevelDB::createUndoDataFromBlock(uint32_t hgt,
 
 ////////////////////////////////////////////////////////////////////////////////
 void BlockDataManager_LevelDB::applyModsToDB(
-                           map<BinaryData, StoredTx> &            stxToModify,
+                           map<HashKey, StoredTx> &            stxToModify,
                            map<BinaryData, StoredScriptHistory> & sshToModify,
-                           set<BinaryData> &                      keysToDelete)
+                           set<BinaryData> &                      keysToDelete,
+                           bool                                   inBackground)
 {
+   // The previous batch has to be in the DB before we start on this one:
+   // putStoredTx reads the tx hints, and we read the SDBI below.  After 
+   // this, the DB is up to date, so we don't need the in-flight maps.
+   iface_->waitForBackgroundCommit(BLKDATA);
+   stxInFlight_.clear();
+   sshInFlight_.clear();
+   stxoInFlight_.clear();
+
    // Before we apply, let's figure out if some DB keys need to be deleted
    findSSHEntriesToDelete(sshToModify, keysToDelete);
 
@@ -5793,7 +7652,21 @@ void BlockDataManager_LevelDB::applyModsToDB(
 
    iface_->startBatch(BLKDATA);
 
-   map<BinaryData, StoredTx>::iterator iter_stx;
+   // All the UTXO trie changes of these blocks, so nodes shared by many of
+   // them are only hashed and written once
+   iface_->updateUTXOTrie(utxoTrieMods_);
+
+   // TxOuts spent straight from the UTXO cache.  If the whole STX is in the
+   // map, too, it already has the same change (see applyStxoModsToStx)
+   map<OutPointKey, StoredTxOut>::iterator iter_stxo;
+   for(iter_stxo  = stxoToModify_.begin();
+       iter_stxo != stxoToModify_.end();
+       iter_stxo++)
+   {
+      iface_->putStoredTxOut(iter_stxo->second);
+   }
+
+   map<HashKey, StoredTx>::iterator iter_stx;
    for(iter_stx  = stxToModify.begin();
        iter_stx != stxToModify.end();
        iter_stx++)
@@ -5837,9 +7710,21 @@ void BlockDataManager_LevelDB::applyModsToDB(
       }
    }
 
-   iface_->commitBatch(BLKDATA);
+   // We only keep copies of the STX and SSH objects around for reads while
+   // the batch is in flight, so deletes have to be written synchronously
+   if(inBackground && keysToDelete.size() == 0)
+   {
+      iface_->commitBatchInBackground(BLKDATA);
+      stxInFlight_.swap(stxToModify);
+      sshInFlight_.swap(sshToModify);
+      stxoInFlight_.swap(stxoToModify_);
+   }
+   else
+      iface_->commitBatch(BLKDATA);
 
    stxToModify.clear();
+   stxoToModify_.clear();
+   utxoTrieMods_.clear();
    sshToModify.clear();
    keysToDelete.clear();
    dbUpdateSize_ = 0;
@@ -5848,6 +7733,23 @@ void BlockDataManager_LevelDB::applyModsToDB(
 
 ////////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::undoBlockFromDB(StoredUndoData & sud)
+{
+   map<HashKey, StoredTx>              stxToModify;
+   map<BinaryData, StoredScriptHistory>   sshToModify;
+   set<BinaryData>                        keysToDelete;
+
+   return undoBlockFromDB(sud, stxToModify, sshToModify, keysToDelete, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same as applyBlockToDB:  the changes are added to the maps, which may 
+// already have the changes of other blocks, and only written if applyWhenDone
+bool BlockDataManager_LevelDB::undoBlockFromDB(
+                        StoredUndoData &                       sud,
+                        map<HashKey, StoredTx> &            stxToModify,
+                        map<BinaryData, StoredScriptHistory> & sshToModify,
+                        set<BinaryData> &                      keysToDelete,
+                        bool                                   applyWhenDone)
 {
    SCOPED_TIMER("undoBlockFromDB");
 
@@ -5859,9 +7761,9 @@ bool BlockDataManager_LevelDB::undoBlockFromDB(StoredUndoData & sud)
       return false;
    }
 
-   map<BinaryData, StoredTx>              stxToModify;
-   map<BinaryData, StoredScriptHistory>   sshToModify;
-   set<BinaryData>                        keysToDelete;
+   // The UTXO cache may have TxOuts created by this block, and doesn't have
+   // the ones it spent.  Reorgs are rare enough to just start over.
+   utxoCache_.clear();
     
    // In the future we will accommodate more user modes
    if(DBUtils.getArmoryDbType() != ARMORY_DB_SUPER)
@@ -5887,43 +7789,33 @@ bool BlockDataManager_LevelDB::undoBlockFromDB(StoredUndoData & sud)
       map<uint16_t,StoredTxOut>::iterator iter;
 
 
-      if(DBUtils.getDbPruneType() == DB_PRUNE_NONE)
+      // Spent TxOuts stay in the DB, marked spent, in both modes:  pruning
+      // only drops a tx once all of its TxOuts were spent below the undo 
+      // window, so its TxOuts spent by this block should still be here.
+      // If one isn't, the undo data has all of it.
+      iter = stxptr->stxoMap_.find(stxoIdx);
+      //if(iter == stxptr->stxoMap_.end())
+      if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
       {
-         // If full/super, we have the TxOut in DB, just need mark it unspent
-         iter = stxptr->stxoMap_.find(stxoIdx);
-         //if(iter == stxptr->stxoMap_.end())
-         if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
+         if(DBUtils.getDbPruneType() == DB_PRUNE_NONE)
          {
             LOGERR << "Expecting to find existing STXO, but DNE";
             continue;
          }
 
-         StoredTxOut & stxoReAdd = iter->second;
-         if(stxoReAdd.spentness_ == TXOUT_UNSPENT || 
-            stxoReAdd.spentByTxInKey_.getSize() == 0 )
-         {
-            LOGERR << "STXO needs to be re-added/marked-unspent but it";
-            LOGERR << "was already declared unspent in the DB";
-         }
-         
-         stxoReAdd.spentness_ = TXOUT_UNSPENT;
-         stxoReAdd.spentByTxInKey_ = BinaryData(0);
+         LOGERR << "TxOut was pruned, re-adding it from the undo data";
+         iter = stxptr->stxoMap_.insert(make_pair(stxoIdx, sudStxo)).first;
       }
-      else
+      else if(iter->second.spentness_ == TXOUT_UNSPENT || 
+              iter->second.spentByTxInKey_.getSize() == 0 )
       {
-         // If we're pruning, we should have the Tx in the DB, but without the
-         // TxOut because it had been pruned by this block on the forward op
-         iter = stxptr->stxoMap_.find(stxoIdx);
-         //if(iter != stxptr->stxoMap_.end())
-         if(ITER_IN_MAP(iter, stxptr->stxoMap_))
-            LOGERR << "Somehow this TxOut had not been pruned!";
-         else
-            iter->second = sudStxo;
-
-         iter->second.spentness_      = TXOUT_UNSPENT;
-         iter->second.spentByTxInKey_ = BinaryData(0);
+         LOGERR << "STXO needs to be re-added/marked-unspent but it";
+         LOGERR << "was already declared unspent in the DB";
       }
 
+      iter->second.spentness_      = TXOUT_UNSPENT;
+      iter->second.spentByTxInKey_ = BinaryData(0);
+
 
       ////// Finished updating STX, now update the SSH in the DB
       // Updating the SSH objects works the same regardless of pruning
@@ -5950,6 +7842,7 @@ bool BlockDataManager_LevelDB::undoBlockFromDB(StoredUndoData & sud)
                                stxoReAdd.getValue(),
                                stxoReAdd.isCoinbase_,
                                false);
+      addUTXOToTrie(stxoReAdd, stxptr->thisHash_);
 
       
       // If multisig, we need to update the SSHs for individual addresses
@@ -6011,6 +7904,7 @@ bool BlockDataManager_LevelDB::undoBlockFromDB(StoredUndoData & sud)
          // If we are tracking that SSH, remove the reference to this OutPoint
          if(sshptr != NULL)
             sshptr->eraseTxio(stxoKey);
+         removeUTXOFromTrie(stxo);
    
          // Now remove any multisig entries that were added due to this TxOut
          if(uniqKey[0] == SCRIPT_PREFIX_MULTISIG)
@@ -6033,21 +7927,199 @@ bool BlockDataManager_LevelDB::undoBlockFromDB(StoredUndoData & sud)
 
 
 
-   // Check for any SSH objects that are now completely empty.  If they exist,
-   // they should be removed from the DB, instead of simply written as empty
-   // objects
-   findSSHEntriesToDelete(sshToModify, keysToDelete);
+   // Any SSH objects that are now completely empty are removed from the DB
+   // by applyModsToDB, instead of simply written as empty objects.  Not 
+   // before then, because another block in the same batch may add to them.
 
+   // The undo data goes with the block
+   if(DBUtils.getDbPruneType() == DB_PRUNE_ALL)
+      keysToDelete.insert(sud.getDBKey());
 
    // Finally, mark this block as UNapplied.
    sbh.blockAppliedToDB_ = false;
    updateBlkDataHeader(sbh);
-   applyModsToDB(stxToModify, sshToModify, keysToDelete);
 
+   if(applyWhenDone)
+      applyModsToDB(stxToModify, sshToModify, keysToDelete);
+
+   return true;
+}
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// A tx can go once every one of its TxOuts was spent at or below pruneHgt:
+// undoing any block above that never needs it again
+static bool txIsPrunable(StoredTx const & stx, uint32_t pruneHgt)
+{
+   if(stx.stxoMap_.size() != stx.numTxOut_)
+      return false;
+
+   map<uint16_t, StoredTxOut>::const_iterator iter;
+   for(iter = stx.stxoMap_.begin(); iter != stx.stxoMap_.end(); iter++)
+   {
+      StoredTxOut const & stxo = iter->second;
+      if(stxo.spentness_ != TXOUT_SPENT || stxo.spentByTxInKey_.getSize() < 4)
+         return false;
+
+      BinaryData hgtX = stxo.spentByTxInKey_.getSliceCopy(0,4);
+      if(DBUtils.hgtxToHeight(hgtX) > pruneHgt)
+         return false;
+   }
    return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// The registered wallets read back every tx that funded or spent one of their
+// TxOuts, so those can never be pruned.  A tx that funded one keeps it, so it
+// stays in the DB, and that's where we look up what each TxIn spent.  If the
+// prev tx is gone, it wasn't one of ours.
+bool BlockDataManager_LevelDB::txTouchesRegisteredScrAddr(StoredTx const & stx)
+{
+   if(registeredScrAddrMap_.size() == 0)
+      return false;
+
+   map<uint16_t, StoredTxOut>::const_iterator iter;
+   for(iter = stx.stxoMap_.begin(); iter != stx.stxoMap_.end(); iter++)
+      if(scrAddrIsRegistered(iter->second.getScrAddress()))
+         return true;
+
+   Tx tx = stx.getTxCopy();
+   for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+   {
+      TxIn txin = tx.getTxInCopy(i);
+      if(txin.isCoinbase())
+         continue;
+
+      OutPoint op = txin.getOutPoint();
+      StoredTx stxPrev;
+      if(!iface_->getStoredTx(stxPrev, op.getTxHash()))
+         continue;
+
+      iter = stxPrev.stxoMap_.find((uint16_t)op.getTxOutIndex());
+      if(ITER_IN_MAP(iter, stxPrev.stxoMap_) &&
+         scrAddrIsRegistered(iter->second.getScrAddress()))
+         return true;
+   }
+   return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// In DB_PRUNE_ALL mode, once a block is more than pruneDepth_ below the top, 
+// drop the tx it finished spending, along with their TxOuts and tx hints, 
+// and its own undo data, which we can't use anymore.  Each block's undo data
+// lists the TxOuts it spent, so those are the only tx we have to look at, 
+// and the undo entries still in the DB are exactly the blocks we haven't 
+// pruned after yet.  The deletes are written in the background;  nothing 
+// reads the dropped tx, and applyModsToDB waits for them before writing.
+uint32_t BlockDataManager_LevelDB::pruneBlkData(void)
+{
+   SCOPED_TIMER("pruneBlkData");
+   if(DBUtils.getDbPruneType() != DB_PRUNE_ALL)
+      return 0;
+
+   uint32_t topHgt = getTopBlockHeight();
+   if(topHgt == UINT32_MAX || topHgt < pruneDepth_)
+      return 0;
+   uint32_t pruneHgt = topHgt - pruneDepth_;
+
+   // The tx hints we update have to be read after the last prune is written
+   iface_->waitForBackgroundCommit(BLKDATA);
+
+   vector<StoredUndoData> sudList;
+   LDBIter ldbIter(*iface_, BLKDATA);
+   ldbIter.seekTo(DB_PREFIX_UNDODATA, BinaryData(0));
+   while(ldbIter.isValid(DB_PREFIX_UNDODATA))
+   {
+      BinaryData hgtX = ldbIter.getKeyRef().getSliceCopy(1,4);
+      if(DBUtils.hgtxToHeight(hgtX) > pruneHgt)
+         break;
+
+      sudList.push_back(StoredUndoData());
+      StoredUndoData & sud = sudList.back();
+      sud.unserializeDBValue(ldbIter.getValueReader());
+      sud.blockHeight_ = DBUtils.hgtxToHeight(hgtX);
+      sud.duplicateID_ = DBUtils.hgtxToDupID(hgtX);
+      ldbIter.advanceAndRead(DB_PREFIX_UNDODATA);
+   }
+
+   if(sudList.size() == 0)
+      return 0;
+
+   set<BinaryData>                keysToDelete;
+   set<BinaryData>                txChecked;
+   map<BinaryData, StoredTxHints> hintsToModify;
+   uint32_t numPruned = 0;
+   for(uint32_t i=0; i<sudList.size(); i++)
+   {
+      StoredUndoData & sud = sudList[i];
+      keysToDelete.insert(sud.getDBKey());
+
+      for(uint32_t j=0; j<sud.stxOutsRemovedByBlock_.size(); j++)
+      {
+         BinaryData txKey = 
+                  sud.stxOutsRemovedByBlock_[j].getDBKeyOfParentTx(false);
+         if(!txChecked.insert(txKey).second)
+            continue;
+
+         StoredTx stx;
+         if(!iface_->getStoredTx_byDBKey(stx, txKey) || 
+            !txIsPrunable(stx, pruneHgt) ||
+            txTouchesRegisteredScrAddr(stx))
+            continue;
+
+         keysToDelete.insert(stx.getDBKey(true));
+         map<uint16_t, StoredTxOut>::iterator iter;
+         for(iter = stx.stxoMap_.begin(); iter != stx.stxoMap_.end(); iter++)
+            keysToDelete.insert(iter->second.getDBKey(true));
+
+         // Several pruned tx may share a hint entry
+         BinaryData hashPrefix = stx.thisHash_.getSliceCopy(0,4);
+         map<BinaryData, StoredTxHints>::iterator iterHint;
+         iterHint = hintsToModify.find(hashPrefix);
+         if(ITER_NOT_IN_MAP(iterHint, hintsToModify))
+         {
+            iterHint = hintsToModify.insert(
+                  make_pair(hashPrefix, StoredTxHints())).first;
+            iface_->getStoredTxHints(iterHint->second, hashPrefix);
+         }
+
+         StoredTxHints & sths = iterHint->second;
+         vector<BinaryData>::iterator iterKey = find(sths.dbKeyList_.begin(),
+                                                     sths.dbKeyList_.end(),
+                                                     txKey);
+         if(iterKey != sths.dbKeyList_.end())
+            sths.dbKeyList_.erase(iterKey);
+         if(sths.preferredDBKey_ == txKey)
+            sths.preferredDBKey_ = (sths.getNumHints() > 0 ? 
+                                    sths.dbKeyList_[0] : BinaryData(0));
+         numPruned++;
+      }
+   }
+
+   iface_->startBatch(BLKDATA);
+
+   map<BinaryData, StoredTxHints>::iterator iterHint;
+   for(iterHint  = hintsToModify.begin(); 
+       iterHint != hintsToModify.end(); 
+       iterHint++)
+   {
+      if(iterHint->second.getNumHints() == 0)
+         iface_->deleteValue(BLKDATA, iterHint->second.getDBKey());
+      else
+         iface_->putStoredTxHints(iterHint->second);
+   }
+
+   set<BinaryData>::iterator iterDel;
+   for(iterDel = keysToDelete.begin(); iterDel != keysToDelete.end(); iterDel++)
+      iface_->deleteValue(BLKDATA, *iterDel);
 
+   iface_->commitBatchInBackground(BLKDATA);
+
+   LOGINFO << "Pruned " << numPruned << " spent tx up to block " << pruneHgt;
+   return numPruned;
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -6061,6 +8133,9 @@ StoredScriptHistory* BlockDataManager_LevelDB::makeSureSSHInMap(
    StoredScriptHistory * sshptr;
    StoredScriptHistory   sshTemp;
 
+   map<BinaryData, StoredScriptHistory>::iterator iterFlight;
+   iterFlight = sshInFlight_.find(uniqKey);
+
    // If already in Map
    map<BinaryData, StoredScriptHistory>::iterator iter = sshMap.find(uniqKey);
    if(ITER_IN_MAP(iter, sshMap))
@@ -6070,7 +8145,20 @@ StoredScriptHistory* BlockDataManager_LevelDB::makeSureSSHInMap(
    }
    else
    {
-      iface_->getStoredScriptHistorySummary(sshTemp, uniqKey);
+      // If it's in a batch that's still being written, the DB may have the
+      // old version, so take the summary from the in-flight copy.  Leave its
+      // sub-histories behind (swap them out so we don't copy them all), so
+      // we only rewrite the ones we touch again.
+      if(ITER_IN_MAP(iterFlight, sshInFlight_))
+      {
+         map<BinaryData, StoredSubHistory> subHists;
+         subHists.swap(iterFlight->second.subHistMap_);
+         sshTemp = iterFlight->second;
+         subHists.swap(iterFlight->second.subHistMap_);
+      }
+      else
+         iface_->getStoredScriptHistorySummary(sshTemp, uniqKey);
+
       dbUpdateSize_ += UPDATE_BYTES_SSH;
       if(sshTemp.isInitialized())
       {
@@ -6096,6 +8184,16 @@ StoredScriptHistory* BlockDataManager_LevelDB::makeSureSSHInMap(
    // returning the pointer to the SSH.  Since we haven't actually inserted
    // anything into the SubSSH, we don't need to adjust the totalTxioCount_
    uint32_t prevSize = sshptr->subHistMap_.size();
+   if(ITER_IN_MAP(iterFlight, sshInFlight_) && 
+      KEY_NOT_IN_MAP(hgtX, sshptr->subHistMap_))
+   {
+      map<BinaryData, StoredSubHistory> & flightSubs = 
+                                             iterFlight->second.subHistMap_;
+      map<BinaryData, StoredSubHistory>::iterator iterSub;
+      iterSub = flightSubs.find(hgtX);
+      if(ITER_IN_MAP(iterSub, flightSubs))
+         sshptr->subHistMap_[hgtX] = iterSub->second;
+   }
    iface_->fetchStoredSubHistory(*sshptr, hgtX, true, false);
    uint32_t newSize = sshptr->subHistMap_.size();
 
@@ -6107,7 +8205,7 @@ StoredScriptHistory* BlockDataManager_LevelDB::makeSureSSHInMap(
 ////////////////////////////////////////////////////////////////////////////////
 StoredTx* BlockDataManager_LevelDB::makeSureSTXInMap(
                                        BinaryDataRef txHash,
-                                       map<BinaryData, StoredTx> & stxMap)
+                                       map<HashKey, StoredTx> & stxMap)
 {
    // TODO:  If we are pruning, we may have completely removed this tx from
    //        the DB, which means that it won't be in the map or the DB.
@@ -6116,14 +8214,16 @@ StoredTx* BlockDataManager_LevelDB::makeSureSTXInMap(
    StoredTx   stxTemp;
 
    // Get the existing STX or make a new one
-   map<BinaryData, StoredTx>::iterator txIter = stxMap.find(txHash);
+   HashKey txKey(txHash);
+   map<HashKey, StoredTx>::iterator txIter = stxMap.find(txKey);
    if(ITER_IN_MAP(txIter, stxMap))
       stxptr = &(txIter->second);
    else
    {
-      iface_->getStoredTx(stxTemp, txHash);
-      stxMap[txHash] = stxTemp;
-      stxptr = &stxMap[txHash];
+      if(!getStoredTxInFlight(stxTemp, txKey))
+         iface_->getStoredTx(stxTemp, txHash);
+      applyStxoModsToStx(stxTemp, txHash);
+      stxptr = &(stxMap[txKey] = stxTemp);
       dbUpdateSize_ += stxptr->numBytes_;
    }
    
@@ -6140,20 +8240,22 @@ StoredTx* BlockDataManager_LevelDB::makeSureSTXInMap(
                                        uint8_t  dup,
                                        uint16_t txIdx,
                                        BinaryDataRef txHash,
-                                       map<BinaryData, StoredTx> & stxMap)
+                                       map<HashKey, StoredTx> & stxMap)
 {
    StoredTx * stxptr;
    StoredTx   stxTemp;
 
    // Get the existing STX or make a new one
-   map<BinaryData, StoredTx>::iterator txIter = stxMap.find(txHash);
+   HashKey txKey(txHash);
+   map<HashKey, StoredTx>::iterator txIter = stxMap.find(txKey);
    if(ITER_IN_MAP(txIter, stxMap))
       stxptr = &(txIter->second);
    else
    {
-      iface_->getStoredTx(stxTemp, hgt, dup, txIdx);
-      stxMap[txHash] = stxTemp;
-      stxptr = &stxMap[txHash];
+      if(!getStoredTxInFlight(stxTemp, txKey))
+         iface_->getStoredTx(stxTemp, hgt, dup, txIdx);
+      applyStxoModsToStx(stxTemp, txHash);
+      stxptr = &(stxMap[txKey] = stxTemp);
       dbUpdateSize_ += stxptr->numBytes_;
    }
    
@@ -6161,6 +8263,72 @@ StoredTx* BlockDataManager_LevelDB::makeSureSTXInMap(
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// If the tx is in a batch that's still being written in the background, the
+// DB may still have the old version, so we have to use our copy
+bool BlockDataManager_LevelDB::getStoredTxInFlight(StoredTx & stx,
+                                                   HashKey const & txKey)
+{
+   map<HashKey, StoredTx>::iterator iter = stxInFlight_.find(txKey);
+   if(ITER_NOT_IN_MAP(iter, stxInFlight_))
+      return false;
+
+   stx = iter->second;
+   return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TxOuts spent from the UTXO cache are written on their own, so the copy of
+// the tx in the DB (or the in-flight batch) doesn't have those changes yet
+void BlockDataManager_LevelDB::applyStxoModsToStx(StoredTx & stx,
+                                                  BinaryDataRef txHash)
+{
+   map<OutPointKey, StoredTxOut> * stxoMaps[2] = {&stxoInFlight_, 
+                                                  &stxoToModify_};
+   for(uint32_t m=0; m<2; m++)
+   {
+      // All the outpoints of one tx are next to each other in the map
+      map<OutPointKey, StoredTxOut>::iterator iter;
+      iter = stxoMaps[m]->lower_bound(getOutPointKey(txHash, 0));
+      while(iter != stxoMaps[m]->end() && 
+            iter->first.getRef().getSliceRef(0,32) == txHash)
+      {
+         uint16_t txoIdx = iter->second.txOutIndex_;
+         if(KEY_IN_MAP(txoIdx, stx.stxoMap_))
+            stx.stxoMap_[txoIdx] = iter->second;
+         iter++;
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::addUTXOToTrie(StoredTxOut const & stxo,
+                                             BinaryDataRef txHash)
+{
+   if(!iface_->utxoTrieIsAvailable())
+      return;
+
+   StoredTrieNode leaf;
+   leaf.setLeaf(stxo, txHash);
+   utxoTrieMods_[leaf.path_] = leaf;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Removing a leaf that was added since the last applyModsToDB is fine:  the
+// trie never sees either change
+void BlockDataManager_LevelDB::removeUTXOFromTrie(StoredTxOut const & stxo)
+{
+   if(!iface_->utxoTrieIsAvailable())
+      return;
+
+   BinaryData path = StoredTrieNode::getLeafPath(stxo.getScrAddress(),
+                                                 stxo.getDBKey(false));
+   utxoTrieMods_[path] = StoredTrieNode();
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 void BlockDataManager_LevelDB::findSSHEntriesToDelete( 
                      map<BinaryData, StoredScriptHistory> & sshMap,
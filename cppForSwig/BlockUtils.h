@@ -37,15 +37,51 @@
 #include "cryptlib.h"
 #include "sha.h"
 #include "UniversalTimer.h"
+#include "ThreadUtils.h"
+#include "ScrAddrFilter.h"
+#include "UTXOCache.h"
+#include "BlkFileWatcher.h"
 #include "leveldb/db.h"
 
 
 #define NUM_BLKS_BATCH_THRESH 30
 #define UPDATE_BYTES_SSH      25
 #define UPDATE_BYTES_SUBSSH   75
+#define UPDATE_BYTES_STXO     50
 #define UPDATE_BYTES_THRESH   96*1024*1024
 
 #define NUM_BLKS_IS_DIRTY 2016
+
+// Max number of raw blocks in flight per worker thread, when ingesting blk
+// files with more than one thread (see readRawBlocksPipelined)
+#define INGEST_QUEUE_BLKS_PER_THREAD 8
+
+// When scanning the DB for registered tx with more than one thread, the block
+// range is cut into about this many chunks per thread, but never more than
+// SCAN_CHUNK_MAX_BLKS blocks each (see scanDBForRegisteredTxParallel)
+#define SCAN_CHUNKS_PER_THREAD 16
+#define SCAN_CHUNK_MAX_BLKS    1000
+
+// Headers read from a blk file are hashed this many at a time (see
+// readHeadersInBlkFile)
+#define BLKFILE_HEADER_BATCH_SIZE 256
+
+// Tx that are read from the DB in bulk (registered tx, address book) are 
+// fetched this many at a time with InterfaceToLDB::getStoredTxBatch
+#define TX_BATCH_READ_SIZE 4096
+
+// In DB_PRUNE_ALL mode, blocks this far below the top can no longer be undone,
+// so the fully spent tx they leave behind are dropped (see pruneBlkData)
+#define DEFAULT_PRUNE_DEPTH 288
+
+// The zero-conf file is an append-only log:  removing a tx from the pool 
+// appends a tombstone for it instead of rewriting the file.  Once there are
+// at least this many dead records, and more dead than live ones, the file is
+// compacted (see compactZeroConfFileIfNeeded)
+#define ZC_FILE_COMPACT_MIN_DEAD 1000
+
+// In place of the tx time, marks a tombstone record in the zero-conf file
+#define ZC_FILE_TOMBSTONE        UINT64_MAX
 using namespace std;
 
 class BlockDataManager_LevelDB;
@@ -334,8 +370,9 @@ private:
 class BtcWallet
 {
 public:
-   BtcWallet(void) : bdmPtr_(NULL) {}
-   explicit BtcWallet(BlockDataManager_LevelDB* bdm) : bdmPtr_(bdm) {}
+   BtcWallet(void) : bdmPtr_(NULL) { resetZeroConfScan(); }
+   explicit BtcWallet(BlockDataManager_LevelDB* bdm) : bdmPtr_(bdm) 
+                                                     { resetZeroConfScan(); }
    ~BtcWallet(void);
 
    /////////////////////////////////////////////////////////////////////////////
@@ -374,6 +411,7 @@ public:
                       uint32_t      lastBlockNum);
 
    bool hasScrAddress(BinaryData const & scrAddr);
+   bool hasScrAddress(uint8_t prefix, uint8_t const * hash160) const;
 
 
    // Scan a Tx for our TxIns/TxOuts.  Override default blk vals if you think
@@ -382,7 +420,7 @@ public:
    pair<bool,bool> isMineBulkFilter( Tx & tx,   
                                      bool withMultiSig=false);
    pair<bool,bool> isMineBulkFilter( Tx & tx, 
-                                     map<OutPoint, TxIOPair> & txiomap,
+                                     map<OutPointKey, TxIOPair> & txiomap,
                                      bool withMultiSig=false);
 
    void scanTx(Tx & tx, 
@@ -412,6 +450,19 @@ public:
    vector<UnspentTxOut> getSpendableTxOutList(uint32_t currBlk=0);
    void clearZeroConfPool(void);
 
+   // BDM::rescanWalletZeroConf only scans the pool tx that came in after 
+   // the last one this wallet scanned, unless the wallet's confirmed ledger
+   // or address list changed since (those can change what a ZC tx means
+   // to it), or it was reset.  Then the whole pool is rescanned.  Pool tx
+   // that weren't final yet are left in the non-final list, and checked 
+   // again every time, since only the clock or a new block changes that.
+   uint32_t getZeroConfScannedUpToSeq(void) const { return zcScannedUpToSeq_; }
+   bool     zeroConfScanIsStale(void) const;
+   void     setZeroConfScannedUpToSeq(uint32_t seq);
+   void     resetZeroConfScan(void) { zcScannedUpToSeq_ = 0; 
+                                      zcNonFinalSeqs_.clear(); }
+   set<uint32_t> & getZeroConfNonFinalSeqs(void) { return zcNonFinalSeqs_; }
+
    
    uint32_t     getNumScrAddr(void) const {return scrAddrMap_.size();}
    ScrAddrObj & getScrAddrObjByIndex(uint32_t i) { return *(scrAddrPtrs_[i]); }
@@ -422,7 +473,7 @@ public:
 
    vector<LedgerEntry> &     getZeroConfLedger(BinaryData const * scrAddr=NULL);
    vector<LedgerEntry> &     getTxLedger(BinaryData const * scrAddr=NULL); 
-   map<OutPoint, TxIOPair> & getTxIOMap(void)    {return txioMap_;}
+   map<OutPointKey, TxIOPair> & getTxIOMap(void) {return txioMap_;}
    map<OutPoint, TxIOPair> & getNonStdTxIO(void) {return nonStdTxioMap_;}
 
    bool isOutPointMine(BinaryData const & hsh, uint32_t idx);
@@ -440,11 +491,18 @@ public:
 private:
    vector<ScrAddrObj*>          scrAddrPtrs_;
    map<BinaryData, ScrAddrObj>  scrAddrMap_;
-   map<OutPoint, TxIOPair>      txioMap_;
+   ScrAddrFilter                scrAddrFilter_;   // same keys, for isMine*
+   map<OutPointKey, TxIOPair>   txioMap_;
 
    vector<LedgerEntry>          ledgerAllAddr_;  
    vector<LedgerEntry>          ledgerAllAddrZC_;  
 
+   // Where rescanWalletZeroConf left off (see getZeroConfScannedUpToSeq)
+   uint32_t                     zcScannedUpToSeq_;
+   uint32_t                     zcScannedLedgerSize_;
+   uint32_t                     zcScannedNumAddr_;
+   set<uint32_t>                zcNonFinalSeqs_;
+
    // For non-std transactions
    map<OutPoint, TxIOPair>      nonStdTxioMap_;
    set<OutPoint>                nonStdUnspentOutPoints_;
@@ -462,7 +520,7 @@ struct ZeroConfData
 {
    Tx            txobj_;   
    uint32_t      txtime_;
-   list<BinaryData>::iterator iter_;
+   uint32_t      seq_;     // arrival order, key into zeroConfSeqMap_
 };
 
 
@@ -505,16 +563,23 @@ private:
    bool checkLdbStatus(leveldb::Status stat);
 
 
-   map<HashString, BlockHeader> headerMap_;
+   map<HashKey, BlockHeader> headerMap_;
 
    // This is our permanent link to the two databases used
    static InterfaceToLDB* iface_;
    
-   // Need a separate memory pool just for zero-confirmation transactions
-   // We need the second map to make sure we can find the data to remove
-   // it, when necessary
-   list<BinaryData>                   zeroConfRawTxList_;
-   map<HashString, ZeroConfData>      zeroConfMap_;
+   // Need a separate memory pool just for zero-confirmation transactions.
+   // The seq map keeps them in arrival order, which is also the order they 
+   // are in the ZC file, and lets rescanWalletZeroConf pick up only the tx
+   // a wallet hasn't seen yet.  The spent index maps each outpoint spent by
+   // a ZC tx to the ZC tx spending it, so that the tx in a new block can 
+   // knock out the ZC tx they conflict with.
+   map<HashKey, ZeroConfData>         zeroConfMap_;
+   map<uint32_t, HashKey>             zeroConfSeqMap_;
+   multimap<OutPointKey, HashKey>     zeroConfSpentIndex_;
+   uint32_t                           zcNextSeq_;
+   uint32_t                           zcFileDeadRecords_;
+   uint32_t                           zcCompactMinDead_;
    bool                               zcEnabled_;
    string                             zcFilename_;
 
@@ -557,6 +622,70 @@ private:
    uint64_t                           dbUpdateSize_;
    bool                               requestRescan_;
 
+   // Number of threads used to read the headers out of the blk files, and to
+   // parse raw blocks when building the DB.  1 means do everything on the
+   // calling thread, as before.
+   uint32_t                           numIngestThreads_;
+
+   // Number of threads used by scanDBForRegisteredTx.  1 means scan the
+   // blocks in order on the calling thread, as before.
+   uint32_t                           numScanThreads_;
+
+   // applyBlockRangeToDB writes out its updates every updateBytesThresh_
+   // bytes.  If doubleBufferedCommit_ is set, that write happens in the
+   // background while we apply the next blocks, and until it finishes, the
+   // STX/SSH objects in it are in stxInFlight_/sshInFlight_, since reading
+   // them from the DB might give us the old version.
+   uint64_t                           updateBytesThresh_;
+   bool                               doubleBufferedCommit_;
+
+   // Max reorg depth we can undo in DB_PRUNE_ALL mode
+   uint32_t                           pruneDepth_;
+   map<HashKey, StoredTx>             stxInFlight_;
+   map<BinaryData, StoredScriptHistory> sshInFlight_;
+
+   // Check every raw block's tx against the merkle root in its header before
+   // it goes into the DB, and leave out the ones that don't match.  The tx
+   // hashes are already computed by then, so this is cheap.  merkleTreeBuf_
+   // is reused so that the check doesn't allocate.  Neither a block in 
+   // corruptBlocks_ nor anything built on it goes into the DB or onto the
+   // main chain, so it can't leave a hole that we'd apply or scan right
+   // past.  corruptDescendants_ just remembers what we've found on top of 
+   // them (see isOnCorruptBranch).
+   bool                               verifyMerkleOnIngest_;
+   uint32_t                           numCorruptBlocks_;
+   set<HashKey>                       corruptBlocks_;
+   set<HashKey>                       corruptDescendants_;
+   BinaryData                         merkleTreeBuf_;
+
+   // On a full rebuild, load the raw blocks with LevelDB's compaction held
+   // back, and compact once at the end (see InterfaceToLDB::beginBulkLoad)
+   bool                               bulkLoadOnRebuild_;
+
+   // Recently created TxOuts, so that applyTxToBatchWriteData can mark them
+   // spent without reading their whole tx from the DB.  Those spends are
+   // written as just the one StoredTxOut, from stxoToModify_.
+   UTXOCache                          utxoCache_;
+   map<OutPointKey, StoredTxOut>      stxoToModify_;
+   map<OutPointKey, StoredTxOut>      stxoInFlight_;
+
+   // UTXO trie leaves to add or remove (an uninitialized node) at the next
+   // applyModsToDB, keyed by leaf path.  Only filled in if the DB has the 
+   // trie, see InterfaceToLDB::utxoTrieIsAvailable
+   map<BinaryData, StoredTrieNode>    utxoTrieMods_;
+
+   // Once started, readBlkFileUpdate() only reads the blocks this has found,
+   // instead of re-reading the end of the last blk file every time
+   BlkFileWatcher                     blkFileWatcher_;
+
+   // Headers added to (or overwritten in) headerMap_ since the last call to
+   // organizeChain(), so it only has to look at those.  numNewHeaders_ is how
+   // many of them weren't in the map before.  If the map size doesn't add up,
+   // something else changed headerMap_, and organizeChain() looks at it all.
+   vector<BlockHeader*>               headersToOrganize_;
+   uint32_t                           numNewHeaders_;
+   uint32_t                           numHeadersOrganized_;
+
    // These should be set after the blockchain is organized
    deque<BlockHeader*>                headersByHeight_;
    BlockHeader*                       topBlockPtr_;
@@ -606,10 +735,12 @@ private:
    // track those in RAM (maybe on a huge server...?)
    set<BtcWallet*>                    registeredWallets_;
    map<BinaryData, RegisteredScrAddr> registeredScrAddrMap_;
+   ScrAddrFilter                      registeredScrAddrFilter_;
    list<RegisteredTx>                 registeredTxList_;
    set<HashString>                    registeredTxSet_;
-   set<OutPoint>                      registeredOutPoints_;
+   set<OutPointKey>                   registeredOutPoints_;
    uint32_t                           allScannedUpToBlk_; // one past top
+   uint32_t                           rewoundToHgt_;      // see finishBlkFileUpdate
 
    // TODO: We eventually want to maintain some kind of master TxIO map, instead
    // of storing them in the individual wallets.  With the new DB, it makes more
@@ -728,7 +859,9 @@ public:
    void     updateRegisteredScrAddrs(uint32_t newTopBlk);
 
    bool     walletIsRegistered(BtcWallet & wlt);
-   bool     scrAddrIsRegistered(HashString scrAddr);
+   bool     scrAddrIsRegistered(HashString const & scrAddr) const;
+   bool     scrAddrIsRegistered(uint8_t prefix, uint8_t const * hash160) const;
+   void     rebuildRegisteredScrAddrFilter(void);
    void     insertRegisteredTxIfNew(HashString txHash);
    void     insertRegisteredTxIfNew(RegisteredTx & regTx);
    void     insertRegisteredTxIfNew(TxRef const & txref,
@@ -765,6 +898,7 @@ public:
    // These are the high-level methods for reading block files, and indexing
    // the blockfile data.
    bool     extractHeadersInBlkFile(uint32_t fnum, uint64_t offset=0);
+   void     addExtractedHeaders(vector<BlockHeader> const & headers);
    uint32_t detectAllBlkFiles(void);
    bool     processNewHeadersInBlkFiles(uint32_t fnumStart=0, uint64_t offset=0);
    //bool     processHeadersInFile(string filename);
@@ -774,6 +908,7 @@ public:
                                   bool skipFetch=false,
                                   bool initialLoad=false);
    void readRawBlocksInFile(uint32_t blkFileNum, uint32_t offset);
+   bool readRawBlocksPipelined(uint32_t blkFileStart, uint64_t offset);
    // These are wrappers around "buildAndScanDatabases"
    void doRebuildDatabases(void);
    void doFullRescanRegardlessOfSync(void);
@@ -783,6 +918,9 @@ public:
    void doInitialSyncOnLoad_Rebuild(void);
 
    bool     addRawBlockToDB(BinaryRefReader & brr);
+   void     reportCorruptBlock(StoredHeader const & sbh);
+   bool     isOnCorruptBranch(BlockHeader & bh);
+   bool     addParsedBlockToDB(StoredHeader & sbh);
    void     updateBlkDataHeader(StoredHeader const & sbh);
 
    // On the first pass through the blockchain data, we only write the raw
@@ -793,14 +931,14 @@ public:
    bool applyBlockToDB(StoredHeader & sbh);
    bool applyBlockToDB( 
          StoredHeader & sbh,
-         map<BinaryData, StoredTx> &            stxToModify,
+         map<HashKey, StoredTx> &            stxToModify,
          map<BinaryData, StoredScriptHistory> & sshToModify,
          set<BinaryData> &                      keysToDelete,
          bool                                   applyWhenDone=true);
    bool applyBlockToDB(
          uint32_t hgt, 
          uint8_t dup,
-         map<BinaryData, StoredTx> &            stxToModify,
+         map<HashKey, StoredTx> &            stxToModify,
          map<BinaryData, StoredScriptHistory> & sshToModify,
          set<BinaryData> &                      keysToDelete,
          bool                                   applyWhenDone=true);
@@ -810,11 +948,28 @@ public:
    // When we reorg, we have to undo blocks that have been applied.
    bool createUndoDataFromBlock(uint32_t hgt, uint8_t dup, StoredUndoData & sud);
    bool undoBlockFromDB(StoredUndoData & sud);
+   bool undoBlockFromDB(StoredUndoData & sud,
+                        map<HashKey, StoredTx> &            stxToModify,
+                        map<BinaryData, StoredScriptHistory> & sshToModify,
+                        set<BinaryData> &                      keysToDelete,
+                        bool                                   applyWhenDone);
+
+   // Only does anything in DB_PRUNE_ALL mode.  Returns the number of tx that
+   // were dropped.  Tx that registered wallets use are never dropped.
+   uint32_t pruneBlkData(void);
+   bool     txTouchesRegisteredScrAddr(StoredTx const & stx);
 
    // When we add new block data, we will need to store/copy it to its
    // permanent memory location before parsing it.
    // These methods return (blockAddSucceeded, newBlockIsTop, didCauseReorg)
    uint32_t       readBlkFileUpdate(void);
+   uint32_t       readBlkFileUpdateFromWatcher(void);
+   bool           processNewBlockData(BinaryRefReader & brrRawBlock, 
+                                      uint32_t fileIndex0Idx,
+                                      uint32_t thisHeaderOffset,
+                                      uint32_t blockSize);
+   void           finishBlkFileUpdate(uint32_t prevTopBlk,
+                                      bool prevRegisteredUpToDate);
    vector<bool> addNewBlockData(BinaryRefReader & brrRawBlock, 
                                 uint32_t fileIndex0Idx,
                                 uint32_t thisHeaderOffset,
@@ -827,6 +982,10 @@ public:
    void deleteHistories(void);
    void shutdownSaveScrAddrHistories(void);
 
+   // Not used in supernode, where every SSH is always up to date
+   void checkpointRegisteredScrAddrHistories(uint32_t blk0, uint32_t blk1);
+   void rewindRegisteredScrAddrHistories(uint32_t hgt);
+
    void fetchAllRegisteredScrAddrData(void);
    void fetchAllRegisteredScrAddrData(BtcWallet & myWlt);
    void fetchAllRegisteredScrAddrData(
@@ -870,6 +1029,13 @@ public:
                                    uint32_t blkEnd=UINT32_MAX);
 
    void scanDBForRegisteredTx(uint32_t blk0=0, uint32_t blk1=UINT32_MAX);
+   void scanDBForRegisteredTxParallel(uint32_t blk0, uint32_t blk1);
+   uint64_t scanBlocksForRegisteredTx(LDBIter & ldbIter,
+                                      uint32_t hgt0,
+                                      uint32_t hgt1,
+                                      set<OutPointKey> const & knownOutPoints,
+                                      set<OutPointKey> * newOutPoints,
+                                      vector<RegisteredTx> & relevantTx);
 
  
    /////////////////////////////////////////////////////////////////////////////
@@ -878,18 +1044,40 @@ public:
    uint64_t             getDBBalanceForHash160(BinaryDataRef addr160);
    uint64_t             getDBReceivedForHash160(BinaryDataRef addr160);
    vector<UnspentTxOut> getUTXOVectForHash160(BinaryDataRef addr160);
+   BinaryData           getUTXOTrieRootHash(void) 
+                                    { return iface_->getUTXOTrieRootHash(); }
    vector<TxIOPair>     getHistoryForScrAddr(BinaryDataRef uniqKey, 
                                              bool withMultiSig=false);
 
+   // Same, a page at a time (see InterfaceToLDB::getScriptHistoryPage), 
+   // for addresses with too much history to load all at once.  Returns 
+   // false for a bad cursor or page size, which isn't the same as a page
+   // with nothing in it.
+   bool                 getHistoryPageForScrAddr(BinaryDataRef uniqKey,
+                                                 uint32_t fromHeight,
+                                                 uint32_t toHeight,
+                                                 uint32_t maxTxio,
+                                                 BinaryData const & cursor,
+                                                 vector<TxIOPair> & txioList,
+                                                 BinaryData & nextCursor,
+                                                 bool withMultiSig=false);
+
    // For zero-confirmation tx-handling
    void enableZeroConf(string);
    void disableZeroConf(string);
    void readZeroConfFile(string);
    bool addNewZeroConfTx(BinaryData const & rawTx, uint32_t txtime, bool writeToFile);
    void purgeZeroConfPool(void);
+   void purgeZeroConfPool(uint32_t blk0, uint32_t blk1);
    void pprintZeroConfPool(void);
    void rewriteZeroConfFile(void);
    void rescanWalletZeroConf(BtcWallet & wlt);
+   uint32_t getZeroConfPoolSize(void) const { return zeroConfMap_.size(); }
+   void removeZeroConfTx(HashKey const & txHash, 
+                         bool withDescendants,
+                         vector<HashKey> & removed);
+   void writeZeroConfTombstones(vector<HashKey> const & removed);
+   bool compactZeroConfFileIfNeeded(void);
    bool isTxFinal(Tx & tx);
 
 
@@ -931,7 +1119,7 @@ public:
    // A couple random methods to expose internal data structures for testing.
    // These methods should not be used for nominal operation.
    //multimap<HashString, TxRef> &  getTxHintMapRef(void) { return txHintMap_; }
-   map<HashString, BlockHeader> & getHeaderMapRef(void) { return headerMap_; }
+   map<HashKey, BlockHeader> & getHeaderMapRef(void) { return headerMap_; }
    deque<BlockHeader*> &          getHeadersByHeightRef(void) { return headersByHeight_;}
 
 // These things should probably be private, but they also need to be test-able,
@@ -947,20 +1135,25 @@ public:
    // difficulties and difficultySum values.  Return the difficultySum of 
    // this block.
    double traceChainDown(BlockHeader & bhpStart);
+   void   addHeaderToOrganize(BlockHeader & bh, bool isNew);
+   void   clearHeadersToOrganize(void);
    void   markOrphanChain(BlockHeader & bhpStart);
 
    /////////////////////////////////////////////////////////////////////////////
    // Helper methods for updating the DB
    bool applyTxToBatchWriteData(
                         StoredTx &                             thisSTX,
-                        map<BinaryData, StoredTx> &            stxToModify,
+                        map<HashKey, StoredTx> &            stxToModify,
                         map<BinaryData, StoredScriptHistory> & sshToModify,
                         set<BinaryData> &                      keysToDelete,
                         StoredUndoData *                       sud);
 
-   void applyModsToDB(  map<BinaryData, StoredTx> &            stxToModify,
+   // With inBackground, the batch is written on a helper thread and the
+   // maps are kept in stxInFlight_/sshInFlight_ until it's done
+   void applyModsToDB(  map<HashKey, StoredTx> &            stxToModify,
                         map<BinaryData, StoredScriptHistory> & sshToModify,
-                        set<BinaryData> &                      keysToDelete);
+                        set<BinaryData> &                      keysToDelete,
+                        bool                                   inBackground=false);
 
 
    /////////////////////////////////////////////////////////////////////////////
@@ -971,13 +1164,19 @@ public:
                                bool createIfDNE=true);
 
    StoredTx* makeSureSTXInMap( BinaryDataRef txHash,
-                               map<BinaryData, StoredTx> & stxMap);
+                               map<HashKey, StoredTx> & stxMap);
 
    StoredTx* makeSureSTXInMap( uint32_t      height,
                                uint8_t       dupID,
                                uint16_t      txIndex,
                                BinaryDataRef txHash,
-                               map<BinaryData, StoredTx> & stxMap);
+                               map<HashKey, StoredTx> & stxMap);
+
+   bool getStoredTxInFlight( StoredTx & stx, HashKey const & txKey);
+   void applyStxoModsToStx(  StoredTx & stx, BinaryDataRef txHash);
+
+   void addUTXOToTrie(       StoredTxOut const & stxo, BinaryDataRef txHash);
+   void removeUTXOFromTrie(  StoredTxOut const & stxo);
 
    void findSSHEntriesToDelete( map<BinaryData, StoredScriptHistory> & sshMap,
                                 set<BinaryData> & keysToDelete);
@@ -986,6 +1185,69 @@ public:
    void     setMaxOpenFiles(uint32_t n) {iface_->setMaxOpenFiles(n);}
    uint32_t getMaxOpenFiles(void)       {return iface_->getMaxOpenFiles();}
 
+   // LevelDB tuning, applied the next time the databases are opened.  The 
+   // db arg is 0 for the headers DB and 1 for blkdata.  Sizes are in bytes,
+   // and 0 means "use LevelDB's default".  Bloom filters are on by default.
+   void   setDBBlockCacheSize( uint32_t db, uint32_t nBytes);
+   void   setDBBloomFilterBits(uint32_t db, uint32_t bitsPerKey);
+   void   setDBWriteBufferSize(uint32_t db, uint32_t nBytes);
+   void   setDBBlockSize(      uint32_t db, uint32_t nBytes);
+   void   setDBCompression(    uint32_t db, bool useSnappy);
+   string getDBSettings(       uint32_t db);
+   string getDBStats(          uint32_t db);
+
+   // Pass 0 to use one parser thread per core
+   void     setNumIngestThreads(uint32_t n);
+   uint32_t getNumIngestThreads(void)   {return numIngestThreads_;}
+
+   // Pass 0 to use one wallet-scan thread per core
+   void     setNumScanThreads(uint32_t n);
+   uint32_t getNumScanThreads(void)     {return numScanThreads_;}
+
+   // Write DB updates in the background while applying the next blocks
+   void     setDoubleBufferedCommit(bool b) {doubleBufferedCommit_ = b;}
+   bool     getDoubleBufferedCommit(void)   {return doubleBufferedCommit_;}
+
+   // In DB_PRUNE_ALL mode, how many blocks below the top we can still undo
+   void     setPruneDepth(uint32_t nBlocks) {pruneDepth_ = nBlocks;}
+   uint32_t getPruneDepth(void)             {return pruneDepth_;}
+
+   // Min number of dead records before the ZC file gets compacted
+   void     setZeroConfCompactMinDead(uint32_t n) {zcCompactMinDead_ = n;}
+   uint32_t getZeroConfCompactMinDead(void)       {return zcCompactMinDead_;}
+
+   // How many bytes of DB updates to accumulate before writing them out
+   void     setUpdateBytesThresh(uint64_t nBytes) {updateBytesThresh_ = nBytes;}
+   uint64_t getUpdateBytesThresh(void)            {return updateBytesThresh_;}
+
+   // Max number of unspent TxOuts to keep around for applying blocks, 0 to
+   // not cache any
+   void     setUtxoCacheSize(uint32_t nEntries) {utxoCache_.setMaxEntries(nEntries);}
+   uint32_t getUtxoCacheSize(void)      {return utxoCache_.getMaxEntries();}
+   uint64_t getUtxoCacheHits(void)      {return utxoCache_.getNumHits();}
+   uint64_t getUtxoCacheMisses(void)    {return utxoCache_.getNumMisses();}
+
+   // Skip raw blocks whose tx don't match their header's merkle root
+   void     setVerifyMerkleOnIngest(bool b) {verifyMerkleOnIngest_ = b;}
+   bool     getVerifyMerkleOnIngest(void)   {return verifyMerkleOnIngest_;}
+   uint32_t getNumCorruptBlocks(void)       {return numCorruptBlocks_;}
+   bool     isCorruptBlock(BinaryData const & hash) 
+                              {return corruptBlocks_.count(HashKey(hash)) > 0;}
+
+   // Defer BLKDATA compaction until all raw blocks are in on a rebuild
+   void     setBulkLoadOnRebuild(bool b)    {bulkLoadOnRebuild_ = b;}
+   bool     getBulkLoadOnRebuild(void)      {return bulkLoadOnRebuild_;}
+
+   // Watch the blk files for new blocks (Linux only;  returns false if it
+   // can't, and readBlkFileUpdate keeps polling).  Call it after the initial
+   // load.  waitForBlkFileUpdate blocks until there are new blocks for
+   // readBlkFileUpdate, or timeoutMs passes, and can be called from any thread.
+   bool     startBlkFileWatcher(void);
+   void     stopBlkFileWatcher(void)      {blkFileWatcher_.stop();}
+   bool     isBlkFileWatcherRunning(void) {return blkFileWatcher_.isRunning();}
+   bool     waitForBlkFileUpdate(uint32_t timeoutMs)
+                                 {return blkFileWatcher_.waitForBlocks(timeoutMs);}
+
    // Simple wrapper around the logger so that they are easy to access from SWIG
    void StartCppLogging(string fname, int lvl) { STARTLOGGING(fname, (LogLevel)lvl); }
    void ChangeCppLogLevel(int lvl) { SETLOGLEVEL((LogLevel)lvl); }
@@ -25,6 +25,7 @@
 #include "sha.h"
 #include "ripemd.h"
 #include "UniversalTimer.h"
+#include "SHA256Batch.h"
 #include "log.h"
 
 #define HEADER_SIZE 80
@@ -433,11 +434,14 @@ public:
 
 
    /////////////////////////////////////////////////////////////////////////////
+   // The hash objects below are deliberately not static:  these are called
+   // from the block-ingest worker threads, and a CryptoPP::SHA256 object
+   // carries its running state between calls.  They are cheap to construct.
    static void getHash256(uint8_t const * strToHash,
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
+      CryptoPP::SHA256 sha256_;
       if(hashOutput.getSize() != 32)
          hashOutput.resize(32);
 
@@ -451,7 +455,7 @@ public:
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
+      CryptoPP::SHA256 sha256_;
 
       sha256_.CalculateDigest(hashOutput.getPtr(), strToHash, nBytes);
       sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
@@ -461,7 +465,7 @@ public:
    static BinaryData getHash256(uint8_t const * strToHash,
                                 uint32_t        nBytes)
    {
-      static CryptoPP::SHA256 sha256_;
+      CryptoPP::SHA256 sha256_;
 
       BinaryData hashOutput(32);
       sha256_.CalculateDigest(hashOutput.getPtr(), strToHash, nBytes);
@@ -500,19 +504,50 @@ public:
       return hashOutput;
    }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Double-SHA256 of n messages of msgSize bytes each, all at once (see
+   // SHA256Batch.h).  Hash i goes to hashOutput+32*i.
+   static void getHash256Batch(uint8_t const * const * strsToHash,
+                               uint32_t                msgSize,
+                               uint32_t                n,
+                               uint8_t *               hashOutput)
+   {
+      SHA256Batch::hash256Fixed(strsToHash, msgSize, n, hashOutput);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Same, for messages of any size.  hashOutput is resized to 32 bytes per.
+   static void getHash256Batch(vector<BinaryDataRef> const & strsToHash,
+                               BinaryData &                  hashOutput)
+   {
+      uint32_t n = strsToHash.size();
+      hashOutput.resize(32*n);
+      if(n == 0)
+         return;
+
+      vector<uint8_t const *> ptrs(n);
+      vector<uint32_t>        sizes(n);
+      for(uint32_t i=0; i<n; i++)
+      {
+         ptrs[i]  = strsToHash[i].getPtr();
+         sizes[i] = strsToHash[i].getSize();
+      }
+      SHA256Batch::hash256(&ptrs[0], &sizes[0], n, hashOutput.getPtr());
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    static void getHash160(uint8_t const * strToHash,
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
-      static CryptoPP::RIPEMD160 ripemd160_;
-      static BinaryData bd32(32);
+      CryptoPP::SHA256    sha256_;
+      CryptoPP::RIPEMD160 ripemd160_;
+      uint8_t             hash32[32];
       if(hashOutput.getSize() != 20)
          hashOutput.resize(20);
 
-      sha256_.CalculateDigest(bd32.getPtr(), strToHash, nBytes);
-      ripemd160_.CalculateDigest(hashOutput.getPtr(), bd32.getPtr(), 32);
+      sha256_.CalculateDigest(hash32, strToHash, nBytes);
+      ripemd160_.CalculateDigest(hashOutput.getPtr(), hash32, 32);
    }
 
    /////////////////////////////////////////////////////////////////////////////
@@ -521,12 +556,12 @@ public:
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
-      static CryptoPP::RIPEMD160 ripemd160_;
-      static BinaryData bd32(32);
+      CryptoPP::SHA256    sha256_;
+      CryptoPP::RIPEMD160 ripemd160_;
+      uint8_t             hash32[32];
 
-      sha256_.CalculateDigest(bd32.getPtr(), strToHash, nBytes);
-      ripemd160_.CalculateDigest(hashOutput.getPtr(), bd32.getPtr(), 32);
+      sha256_.CalculateDigest(hash32, strToHash, nBytes);
+      ripemd160_.CalculateDigest(hashOutput.getPtr(), hash32, 32);
 
    }
 
@@ -583,61 +618,91 @@ public:
    }
 
 
+   /////////////////////////////////////////////////////////////////////////////
+   // The flat merkle tree:  all the 32-byte nodes back to back in one buffer,
+   // leaves first, then each level after the one below it.  A level with an
+   // odd number of nodes gets its last node repeated, so that every pair is
+   // 64 contiguous bytes, and the whole level is one batch hash.  This is
+   // the number of nodes in it, including the repeats.
+   static uint32_t getMerkleTreeFlatSize(uint32_t numLeaves)
+   {
+      if(numLeaves == 0)
+         return 0;
+
+      uint32_t numNodes = 1;
+      for(uint32_t levelSize=numLeaves; levelSize>1; levelSize=(levelSize+1)/2)
+         numNodes += levelSize + (levelSize & 1);
+      return numNodes;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // tree must start with the numLeaves leaf hashes.  The rest of the tree
+   // is appended, and the return value points at the root, which is the last
+   // 32 bytes.  Reuse the same tree buffer for every block, and it only ever
+   // allocates when it's bigger than it's ever been.
+   static BinaryDataRef calculateMerkleTreeFlat(BinaryData & tree, 
+                                                uint32_t     numLeaves)
+   {
+      if(numLeaves == 0)
+         return BinaryDataRef();
+
+      tree.resize(32*getMerkleTreeFlatSize(numLeaves));
+      uint8_t* level = tree.getPtr();
+      uint32_t levelSize = numLeaves;
+      while(levelSize > 1)
+      {
+         if(levelSize & 1)
+         {
+            memcpy(level + 32*levelSize, level + 32*(levelSize-1), 32);
+            levelSize++;
+         }
+
+         uint8_t* nextLevel = level + 32*levelSize;
+         SHA256Batch::hash256Packed(level, 64, levelSize/2, nextLevel);
+         level = nextLevel;
+         levelSize /= 2;
+      }
+      return BinaryDataRef(level, 32);
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    static BinaryData calculateMerkleRoot(vector<BinaryData> const & txhashlist)
    {
-      vector<BinaryData> mtree = calculateMerkleTree(txhashlist);
-      return mtree[mtree.size()-1];
+      uint32_t numTx = txhashlist.size();
+      BinaryData tree(32*numTx);
+      for(uint32_t i=0; i<numTx; i++)
+         txhashlist[i].copyTo(tree.getPtr() + 32*i, 32);
+
+      return BinaryData(calculateMerkleTreeFlat(tree, numTx));
    }
 
    /////////////////////////////////////////////////////////////////////////////
+   // Same tree as the flat one, without the repeated nodes
    static vector<BinaryData> calculateMerkleTree(vector<BinaryData> const & txhashlist)
    {
-      // Don't know in advance how big this list will be, make a list too big
-      // and copy the result to the right size list afterwards
       uint32_t numTx = txhashlist.size();
-      vector<BinaryData> merkleTree(3*numTx);
-      static CryptoPP::SHA256 sha256_;
-      BinaryData hashInput(64);
-      BinaryData hashOutput(32);
-   
+      BinaryData tree(32*numTx);
       for(uint32_t i=0; i<numTx; i++)
-         merkleTree[i] = txhashlist[i];
-   
-      uint32_t thisLevelStart = 0;
-      uint32_t nextLevelStart = numTx;
+         txhashlist[i].copyTo(tree.getPtr() + 32*i, 32);
+
+      calculateMerkleTreeFlat(tree, numTx);
+
+      vector<BinaryData> merkleTree;
+      merkleTree.reserve(2*numTx + 16);
+      uint8_t const * level = tree.getPtr();
       uint32_t levelSize = numTx;
-      while(levelSize>1)
+      while(levelSize > 0)
       {
-         for(uint32_t j=0; j<(levelSize+1)/2; j++)
-         {
-            uint8_t* half1Ptr = hashInput.getPtr();
-            uint8_t* half2Ptr = hashInput.getPtr()+32;
-         
-            if(j < levelSize/2)
-            {
-               merkleTree[thisLevelStart+(2*j)  ].copyTo(half1Ptr, 32);
-               merkleTree[thisLevelStart+(2*j)+1].copyTo(half2Ptr, 32);
-            }
-            else 
-            {
-               merkleTree[nextLevelStart-1].copyTo(half1Ptr, 32);
-               merkleTree[nextLevelStart-1].copyTo(half2Ptr, 32);
-            }
-            
-            sha256_.CalculateDigest(hashOutput.getPtr(), hashInput.getPtr(),  64);
-            sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
-            merkleTree[nextLevelStart+j] = hashOutput;
-         }
+         for(uint32_t i=0; i<levelSize; i++)
+            merkleTree.push_back(BinaryData(level + 32*i, 32));
+
+         if(levelSize == 1)
+            break;
+
+         level += 32*(levelSize + (levelSize & 1));
          levelSize = (levelSize+1)/2;
-         thisLevelStart = nextLevelStart;
-         nextLevelStart = nextLevelStart+levelSize;
       }
-
-      // nextLevelStart is the size of the merkle tree
-      merkleTree.erase(merkleTree.begin()+nextLevelStart, merkleTree.end());
       return merkleTree;
-   
    }
    
    /////////////////////////////////////////////////////////////////////////////
@@ -712,6 +777,54 @@ public:
    }
 
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Same as TxCalcLength, but for data that may end before the tx does (like
+   // the last record of a file cut short by a crash).  Never reads past 
+   // ptr+nBytes, and returns UINT32_MAX if the tx doesn't fit in it.
+   static uint32_t TxCalcLengthBounded(uint8_t const * ptr, uint32_t nBytes)
+   {
+      uint64_t pos = 4;
+      uint32_t viLen;
+
+      // TxIn list
+      if(pos >= nBytes || pos + readVarIntLength(ptr+pos) > nBytes)
+         return UINT32_MAX;
+      uint64_t nIn = readVarInt(ptr+pos, &viLen);
+      pos += viLen;
+      for(uint64_t i=0; i<nIn; i++)
+      {
+         if(pos + 36 >= nBytes || 
+            pos + 36 + readVarIntLength(ptr+pos+36) > nBytes)
+            return UINT32_MAX;
+         uint64_t scrLen = readVarInt(ptr+pos+36, &viLen);
+         pos += 36 + viLen + scrLen + 4;
+         if(pos > nBytes)
+            return UINT32_MAX;
+      }
+
+      // TxOut list
+      if(pos >= nBytes || pos + readVarIntLength(ptr+pos) > nBytes)
+         return UINT32_MAX;
+      uint64_t nOut = readVarInt(ptr+pos, &viLen);
+      pos += viLen;
+      for(uint64_t i=0; i<nOut; i++)
+      {
+         if(pos + 8 >= nBytes || 
+            pos + 8 + readVarIntLength(ptr+pos+8) > nBytes)
+            return UINT32_MAX;
+         uint64_t scrLen = readVarInt(ptr+pos+8, &viLen);
+         pos += 8 + viLen + scrLen;
+         if(pos > nBytes)
+            return UINT32_MAX;
+      }
+
+      // Lock time
+      if(pos + 4 > nBytes)
+         return UINT32_MAX;
+      return (uint32_t)(pos + 4);
+   }
+
+
    /////////////////////////////////////////////////////////////////////////////
    static uint32_t StoredTxCalcLength( 
                                 uint8_t const * ptr,
@@ -1440,38 +1553,61 @@ public:
    }
 
 
-   /*
+   /////////////////////////////////////////////////////////////////////////////
    static bool verifyProofOfWork(BinaryDataRef bh80)
    {
+      if(bh80.getSize() != HEADER_SIZE)
+         return false;
+
       BinaryData theHash = getHash256(bh80);
       return verifyProofOfWork(bh80, theHash.getRef());
    }
 
-   static bool verifyProofOfWork(BinaryData bh80,
-                                 BinaryData const & theHash)
-   {
-      return verifyProofOfWork(bh80.getRef(), theHash.getRef());
-   }
-
+   /////////////////////////////////////////////////////////////////////////////
+   // The hash has to be at or below the target encoded in the diff bits.  The
+   // old version of this went through convertDiffBitsToDouble and was only
+   // approximate.  Here we expand the target into 32 bytes and compare it to
+   // the hash as two 256-bit little-endian numbers, so it's exact.
    static bool verifyProofOfWork(BinaryDataRef bh80, BinaryDataRef bhrHash)
    {
-      // This is only approximate.  I can put in an exact verifier once 
-      // I figure out big integers better in C++, or another way to do
-      // the calculation.  I just want to make sure this isn't a completely
-      // bogus proof of work.
-      double diff = convertDiffBitsToDouble( BinaryDataRef(bh80.getPtr()+72, 4) );
-      double diffFactor = diff * (double)UINT32_MAX;
-      double nZeroBits  = int( log(diffFactor) / log(2.0));
-      int    nZeroBytes = int( log(diffFactor) / log(2.0) / 8.0);
-
-      // TODO: check that I'm comparing the correct end of the hash
-      for(uint32_t i=0; i<nZeroBytes; i++)
-         if(bhrHash[31-i]!=0)
-            return false;
+      if(bh80.getSize() != HEADER_SIZE || bhrHash.getSize() != 32)
+         return false;
+
+      // Diff bits are stored LE:  3 bytes of mantissa, then the exponent.
+      // target = mantissa * 256^(exponent-3)
+      uint8_t const * bits = bh80.getPtr() + 72;
+      uint32_t exponent = bits[3];
 
+      // Negative and zero targets can never be met
+      if((bits[2] & 0x80) != 0 || (bits[0] | bits[1] | bits[2]) == 0)
+         return false;
+
+      uint8_t target[32];
+      memset(target, 0, 32);
+      for(uint32_t i=0; i<3; i++)
+      {
+         // Bytes shifted off the bottom are dropped, but a target that
+         // doesn't fit in 256 bits is invalid
+         int32_t pos = (int32_t)exponent - 3 + (int32_t)i;
+         if(pos < 0)
+            continue;
+         if(pos >= 32)
+         {
+            if(bits[i] != 0)
+               return false;
+            continue;
+         }
+         target[pos] = bits[i];
+      }
+
+      uint8_t const * hash = bhrHash.getPtr();
+      for(int32_t i=31; i>=0; i--)
+      {
+         if(hash[i] != target[i])
+            return hash[i] < target[i];
+      }
       return true;
    }
-   */
 
 };
    
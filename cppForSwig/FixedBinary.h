@@ -0,0 +1,104 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// FixedBinary
+//
+// Fixed-width byte string with the bytes stored inline, for use as a map/set
+// key where every key is the same size:  tx and block hashes, and outpoints.
+// A BinaryData key is a vector<uint8_t> on the heap, so a map<BinaryData,...>
+// costs an extra allocation per entry and an extra pointer chase on every
+// compare.  With these, the key lives right in the map node.
+//
+// Converting from a BinaryData/BinaryDataRef has to be spelled out, since
+// one of the wrong size gives the all-zero key (which will never match a
+// real hash).  An implicit conversion would hide that at every map lookup.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _FIXEDBINARY_H_
+#define _FIXEDBINARY_H_
+
+#include <string.h>
+#include "BinaryData.h"
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+template<uint32_t N>
+class FixedBinary
+{
+public:
+   FixedBinary(void)                         { memset(data_, 0, N); }
+   explicit FixedBinary(uint8_t const * ptr) { memcpy(data_, ptr, N); }
+
+   explicit FixedBinary(BinaryData const & bd)     { copyFrom(bd.getRef()); }
+   explicit FixedBinary(BinaryDataRef const & bdr) { copyFrom(bdr); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint8_t const * getPtr(void) const      { return data_; }
+   uint32_t        getSize(void) const     { return N; }
+   BinaryDataRef   getRef(void) const      { return BinaryDataRef(data_, N); }
+   BinaryData      copy(void) const        { return BinaryData(data_, N); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool operator<(FixedBinary const & fb2) const
+   {
+      return memcmp(data_, fb2.data_, N) < 0;
+   }
+   bool operator==(FixedBinary const & fb2) const
+   {
+      return memcmp(data_, fb2.data_, N) == 0;
+   }
+   bool operator!=(FixedBinary const & fb2) const
+   {
+      return memcmp(data_, fb2.data_, N) != 0;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // All our keys start with a hash, so the first 4 bytes are as good a hash
+   // as any.  For bucketing these in a hash table.
+   uint32_t getHash(void) const { return READ_UINT32_LE(data_); }
+
+private:
+   /////////////////////////////////////////////////////////////////////////////
+   void copyFrom(BinaryDataRef const & bdr)
+   {
+      if(bdr.getSize() == N)
+         memcpy(data_, bdr.getPtr(), N);
+      else
+         memset(data_, 0, N);
+   }
+
+   uint8_t data_[N];
+};
+
+
+// Tx and block hashes
+typedef FixedBinary<32> HashKey;
+
+// Serialized OutPoint:  32-byte tx hash, then the 4-byte TxOut index (LE)
+typedef FixedBinary<36> OutPointKey;
+
+
+////////////////////////////////////////////////////////////////////////////////
+inline OutPointKey getOutPointKey(BinaryDataRef txHash, uint32_t txOutIndex)
+{
+   uint8_t op[36];
+   memset(op, 0, 36);
+   if(txHash.getSize() == 32)
+      memcpy(op, txHash.getPtr(), 32);
+
+   op[32] = (uint8_t)( txOutIndex        & 0xff);
+   op[33] = (uint8_t)((txOutIndex >>  8) & 0xff);
+   op[34] = (uint8_t)((txOutIndex >> 16) & 0xff);
+   op[35] = (uint8_t)((txOutIndex >> 24) & 0xff);
+   return OutPointKey(op);
+}
+
+
+#endif
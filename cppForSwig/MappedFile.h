@@ -0,0 +1,160 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// MappedFile
+//
+// Read-only memory map of an entire file, used for walking the blk*.dat
+// files.  Blocks can be parsed straight out of the mapped pages with a
+// BinaryRefReader, instead of being read into a buffer first.
+//
+// Since Bitcoin-Qt 0.8, blk files are capped at 128 MB, so mapping each one
+// in one shot is fine even on 32-bit systems.  On Windows, mmap() comes from
+// the leveldb_windows_port/win32_posix port, which has no madvise, so the
+// access hints are no-ops there.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+#include <string>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   #include <io.h>
+   #define MAPPEDFILE_OPEN(name)  _open((name), _O_RDONLY | _O_BINARY)
+   #define MAPPEDFILE_CLOSE(fd)   _close(fd)
+#else
+   #include <unistd.h>
+   #define MAPPEDFILE_OPEN(name)  ::open((name), O_RDONLY)
+   #define MAPPEDFILE_CLOSE(fd)   ::close(fd)
+#endif
+
+#include "BinaryData.h"
+
+// Don't bother giving pages back to the OS in anything smaller than this
+#define MAPPEDFILE_RELEASE_CHUNK (16*1024*1024)
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+class MappedFile
+{
+public:
+   MappedFile(void) : ptr_(NULL), size_(0), isOpen_(false), releasedTo_(0) {}
+   ~MappedFile(void) { close(); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Returns false if the file doesn't exist or couldn't be mapped.  An empty
+   // file opens fine, but getPtr() will be NULL.
+   bool open(string const & filename)
+   {
+      close();
+
+      int fd = MAPPEDFILE_OPEN(filename.c_str());
+      if(fd < 0)
+         return false;
+
+      struct stat st;
+      if(fstat(fd, &st) != 0)
+      {
+         MAPPEDFILE_CLOSE(fd);
+         return false;
+      }
+
+      size_ = (uint64_t)st.st_size;
+      if(size_ > 0)
+      {
+         void* ptr = mmap(NULL, (size_t)size_, PROT_READ, MAP_PRIVATE, fd, 0);
+         if(ptr == MAP_FAILED)
+         {
+            MAPPEDFILE_CLOSE(fd);
+            size_ = 0;
+            return false;
+         }
+         ptr_ = (uint8_t*)ptr;
+      }
+
+      // The mapping stays valid after the descriptor is closed
+      MAPPEDFILE_CLOSE(fd);
+      isOpen_ = true;
+      releasedTo_ = 0;
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void close(void)
+   {
+      if(ptr_ != NULL)
+         munmap(ptr_, (size_t)size_);
+
+      ptr_ = NULL;
+      size_ = 0;
+      isOpen_ = false;
+      releasedTo_ = 0;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool            isOpen(void) const  { return isOpen_; }
+   uint8_t const * getPtr(void) const  { return ptr_; }
+   uint64_t        getSize(void) const { return size_; }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // The caller must make sure [offset, offset+nBytes) is inside the file
+   BinaryRefReader getReaderAt(uint64_t offset, uint32_t nBytes) const
+   {
+      return BinaryRefReader(ptr_ + offset, nBytes);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // We're going to walk the file front to back:  read ahead aggressively
+   void adviseSequential(void)
+   {
+      #if !defined(_MSC_VER) && !defined(__MINGW32__)
+         if(ptr_ != NULL)
+            madvise(ptr_, (size_t)size_, MADV_SEQUENTIAL);
+      #endif
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Tell the OS we won't be coming back for anything before offset, so the
+   // pages behind the cursor don't crowd everything else out of the page
+   // cache while we walk a few GB of blk files.  Nothing is lost, the pages
+   // are just re-read from disk if they're touched again.
+   void releaseBefore(uint64_t offset)
+   {
+      #if !defined(_MSC_VER) && !defined(__MINGW32__)
+         if(ptr_ == NULL || offset < releasedTo_ + MAPPEDFILE_RELEASE_CHUNK)
+            return;
+
+         uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+         uint64_t releaseTo = (min(offset, size_) / pageSize) * pageSize;
+         if(releaseTo <= releasedTo_)
+            return;
+
+         madvise(ptr_ + releasedTo_, (size_t)(releaseTo - releasedTo_),
+                 MADV_DONTNEED);
+         releasedTo_ = releaseTo;
+      #endif
+   }
+
+private:
+   uint8_t*  ptr_;
+   uint64_t  size_;
+   bool      isOpen_;
+   uint64_t  releasedTo_;
+
+   MappedFile(MappedFile const &);
+   MappedFile & operator=(MappedFile const &);
+};
+
+
+#endif
@@ -0,0 +1,631 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include "SHA256Batch.h"
+
+// The SIMD kernels need per-function target attributes, so that this file
+// still builds (and runs) for CPUs without SSE4/AVX2/SHA
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || \
+     (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+   #define SHA256BATCH_X86
+   #define SHA256BATCH_TARGET(t) __attribute__((target(t)))
+   #include <cpuid.h>
+   #include <immintrin.h>
+#endif
+
+// Most lanes of any kernel
+#define SHA256BATCH_MAX_LANES 8
+
+
+static const uint32_t sha256K[64] =
+{
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+   0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+   0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+   0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+   0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+   0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256IV[8] =
+{
+   0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Every kernel runs one compression over W lanes at once.  state is 8*W
+// words and words is 16*W words, both lane-interleaved:  word i of lane l is
+// at [i*W + l].  The message words are already in host order.
+typedef void (*CompressFunc)(uint32_t* state, uint32_t const * words);
+
+
+////////////////////////////////////////////////////////////////////////////////
+#define ROTR32(x,n)  (((x) >> (n)) | ((x) << (32-(n))))
+
+static void compressScalar(uint32_t* state, uint32_t const * words)
+{
+   uint32_t w[64];
+   for(uint32_t t=0; t<16; t++)
+      w[t] = words[t];
+
+   for(uint32_t t=16; t<64; t++)
+   {
+      uint32_t s0 = ROTR32(w[t-15], 7) ^ ROTR32(w[t-15],18) ^ (w[t-15] >>  3);
+      uint32_t s1 = ROTR32(w[t- 2],17) ^ ROTR32(w[t- 2],19) ^ (w[t- 2] >> 10);
+      w[t] = w[t-16] + s0 + w[t-7] + s1;
+   }
+
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+   uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+   for(uint32_t t=0; t<64; t++)
+   {
+      uint32_t t1 = h + (ROTR32(e,6) ^ ROTR32(e,11) ^ ROTR32(e,25)) +
+                        ((e & f) ^ (~e & g)) + sha256K[t] + w[t];
+      uint32_t t2 = (ROTR32(a,2) ^ ROTR32(a,13) ^ ROTR32(a,22)) +
+                        ((a & b) | (c & (a | b)));
+      h = g;  g = f;  f = e;  e = d + t1;
+      d = c;  c = b;  b = a;  a = t1 + t2;
+   }
+
+   state[0] += a;  state[1] += b;  state[2] += c;  state[3] += d;
+   state[4] += e;  state[5] += f;  state[6] += g;  state[7] += h;
+}
+
+
+#ifdef SHA256BATCH_X86
+////////////////////////////////////////////////////////////////////////////////
+// 4 lanes.  SSE2 has everything this needs, so it runs on any x86-64.
+#define ADD4(x,y)     _mm_add_epi32(x,y)
+#define ROTR4(x,n)    _mm_or_si128(_mm_srli_epi32(x,n), _mm_slli_epi32(x,32-(n)))
+#define XOR4(x,y,z)   _mm_xor_si128(_mm_xor_si128(x,y),z)
+
+SHA256BATCH_TARGET("sse2")
+static void compressSSE2(uint32_t* state, uint32_t const * words)
+{
+   __m128i w[64];
+   for(uint32_t t=0; t<16; t++)
+      w[t] = _mm_loadu_si128((__m128i const *)(words + 4*t));
+
+   for(uint32_t t=16; t<64; t++)
+   {
+      __m128i s0 = XOR4(ROTR4(w[t-15], 7), ROTR4(w[t-15],18), _mm_srli_epi32(w[t-15], 3));
+      __m128i s1 = XOR4(ROTR4(w[t- 2],17), ROTR4(w[t- 2],19), _mm_srli_epi32(w[t- 2],10));
+      w[t] = ADD4(ADD4(w[t-16], s0), ADD4(w[t-7], s1));
+   }
+
+   __m128i s[8];
+   for(uint32_t i=0; i<8; i++)
+      s[i] = _mm_loadu_si128((__m128i const *)(state + 4*i));
+
+   __m128i a = s[0], b = s[1], c = s[2], d = s[3];
+   __m128i e = s[4], f = s[5], g = s[6], h = s[7];
+   for(uint32_t t=0; t<64; t++)
+   {
+      __m128i ch  = _mm_xor_si128(_mm_and_si128(e,f), _mm_andnot_si128(e,g));
+      __m128i maj = _mm_or_si128(_mm_and_si128(a,b),
+                                 _mm_and_si128(c, _mm_or_si128(a,b)));
+      __m128i t1 = ADD4(ADD4(h, XOR4(ROTR4(e,6), ROTR4(e,11), ROTR4(e,25))),
+                        ADD4(ADD4(ch, _mm_set1_epi32((int)sha256K[t])), w[t]));
+      __m128i t2 = ADD4(XOR4(ROTR4(a,2), ROTR4(a,13), ROTR4(a,22)), maj);
+      h = g;  g = f;  f = e;  e = ADD4(d, t1);
+      d = c;  c = b;  b = a;  a = ADD4(t1, t2);
+   }
+
+   s[0] = ADD4(s[0],a);  s[1] = ADD4(s[1],b);  s[2] = ADD4(s[2],c);  s[3] = ADD4(s[3],d);
+   s[4] = ADD4(s[4],e);  s[5] = ADD4(s[5],f);  s[6] = ADD4(s[6],g);  s[7] = ADD4(s[7],h);
+   for(uint32_t i=0; i<8; i++)
+      _mm_storeu_si128((__m128i*)(state + 4*i), s[i]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// 8 lanes, same thing as above with 256-bit registers
+#define ADD8(x,y)     _mm256_add_epi32(x,y)
+#define ROTR8(x,n)    _mm256_or_si256(_mm256_srli_epi32(x,n), _mm256_slli_epi32(x,32-(n)))
+#define XOR8(x,y,z)   _mm256_xor_si256(_mm256_xor_si256(x,y),z)
+
+SHA256BATCH_TARGET("avx2")
+static void compressAVX2(uint32_t* state, uint32_t const * words)
+{
+   __m256i w[64];
+   for(uint32_t t=0; t<16; t++)
+      w[t] = _mm256_loadu_si256((__m256i const *)(words + 8*t));
+
+   for(uint32_t t=16; t<64; t++)
+   {
+      __m256i s0 = XOR8(ROTR8(w[t-15], 7), ROTR8(w[t-15],18), _mm256_srli_epi32(w[t-15], 3));
+      __m256i s1 = XOR8(ROTR8(w[t- 2],17), ROTR8(w[t- 2],19), _mm256_srli_epi32(w[t- 2],10));
+      w[t] = ADD8(ADD8(w[t-16], s0), ADD8(w[t-7], s1));
+   }
+
+   __m256i s[8];
+   for(uint32_t i=0; i<8; i++)
+      s[i] = _mm256_loadu_si256((__m256i const *)(state + 8*i));
+
+   __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+   __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+   for(uint32_t t=0; t<64; t++)
+   {
+      __m256i ch  = _mm256_xor_si256(_mm256_and_si256(e,f), _mm256_andnot_si256(e,g));
+      __m256i maj = _mm256_or_si256(_mm256_and_si256(a,b),
+                                    _mm256_and_si256(c, _mm256_or_si256(a,b)));
+      __m256i t1 = ADD8(ADD8(h, XOR8(ROTR8(e,6), ROTR8(e,11), ROTR8(e,25))),
+                        ADD8(ADD8(ch, _mm256_set1_epi32((int)sha256K[t])), w[t]));
+      __m256i t2 = ADD8(XOR8(ROTR8(a,2), ROTR8(a,13), ROTR8(a,22)), maj);
+      h = g;  g = f;  f = e;  e = ADD8(d, t1);
+      d = c;  c = b;  b = a;  a = ADD8(t1, t2);
+   }
+
+   s[0] = ADD8(s[0],a);  s[1] = ADD8(s[1],b);  s[2] = ADD8(s[2],c);  s[3] = ADD8(s[3],d);
+   s[4] = ADD8(s[4],e);  s[5] = ADD8(s[5],f);  s[6] = ADD8(s[6],g);  s[7] = ADD8(s[7],h);
+   for(uint32_t i=0; i<8; i++)
+      _mm256_storeu_si256((__m256i*)(state + 8*i), s[i]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// One lane, using the SHA extensions.  The instructions want the state as
+// ABEF/CDGH instead of ABCD/EFGH, and do two rounds per sha256rnds2.
+SHA256BATCH_TARGET("sha,sse4.1")
+static void compressSHANI(uint32_t* state, uint32_t const * words)
+{
+   __m128i st0 = _mm_loadu_si128((__m128i const *)(state));
+   __m128i st1 = _mm_loadu_si128((__m128i const *)(state+4));
+   __m128i tmp = _mm_shuffle_epi32(st0, 0xB1);        // CDAB
+   st1 = _mm_shuffle_epi32(st1, 0x1B);                // EFGH
+   st0 = _mm_alignr_epi8(tmp, st1, 8);                // ABEF
+   st1 = _mm_blend_epi16(st1, tmp, 0xF0);             // CDGH
+
+   __m128i abefSave = st0;
+   __m128i cdghSave = st1;
+
+   // Four rounds per group, and the last four groups of message words
+   __m128i m[4];
+   for(uint32_t i=0; i<16; i++)
+   {
+      __m128i & mi = m[i&3];
+      if(i < 4)
+         mi = _mm_loadu_si128((__m128i const *)(words + 4*i));
+      else
+      {
+         mi = _mm_sha256msg1_epu32(mi, m[(i+1)&3]);
+         mi = _mm_add_epi32(mi, _mm_alignr_epi8(m[(i+3)&3], m[(i+2)&3], 4));
+         mi = _mm_sha256msg2_epu32(mi, m[(i+3)&3]);
+      }
+
+      __m128i msg = _mm_add_epi32(mi,
+                       _mm_loadu_si128((__m128i const *)(sha256K + 4*i)));
+      st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      st0 = _mm_sha256rnds2_epu32(st0, st1, msg);
+   }
+
+   st0 = _mm_add_epi32(st0, abefSave);
+   st1 = _mm_add_epi32(st1, cdghSave);
+
+   tmp = _mm_shuffle_epi32(st0, 0x1B);                // FEBA
+   st1 = _mm_shuffle_epi32(st1, 0xB1);                // DCHG
+   st0 = _mm_blend_epi16(tmp, st1, 0xF0);             // DCBA
+   st1 = _mm_alignr_epi8(st1, tmp, 8);                // HGFE
+
+   _mm_storeu_si128((__m128i*)(state),   st0);
+   _mm_storeu_si128((__m128i*)(state+4), st1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+class CpuFeatures
+{
+public:
+   CpuFeatures(void) : sse2_(false), avx2_(false), shani_(false)
+   {
+      unsigned int eax, ebx, ecx, edx;
+      if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+         return;
+
+      sse2_ = (edx & (1u << 26)) != 0;
+      bool sse41   = (ecx & (1u << 19)) != 0;
+      bool osxsave = (ecx & (1u << 27)) != 0;
+      bool avx     = (ecx & (1u << 28)) != 0;
+
+      // The OS has to save the YMM registers, too, or AVX2 isn't usable
+      bool ymmSaved = false;
+      if(osxsave && avx)
+      {
+         uint32_t xcr0Lo, xcr0Hi;
+         __asm__ __volatile__("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+         ymmSaved = (xcr0Lo & 6) == 6;
+      }
+
+      if(__get_cpuid_max(0, 0) < 7)
+         return;
+
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      avx2_  = ymmSaved && (ebx & (1u << 5)) != 0;
+      shani_ = sse41    && (ebx & (1u << 29)) != 0;
+   }
+
+   bool sse2_;
+   bool avx2_;
+   bool shani_;
+};
+
+static CpuFeatures const & getCpuFeatures(void)
+{
+   static CpuFeatures features;
+   return features;
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+static CompressFunc getCompressFunc(SHA256Batch::Kernel k, uint32_t & lanes)
+{
+   #ifdef SHA256BATCH_X86
+   switch(k)
+   {
+      case SHA256Batch::KERNEL_SSE2:   lanes = 4; return compressSSE2;
+      case SHA256Batch::KERNEL_AVX2:   lanes = 8; return compressAVX2;
+      case SHA256Batch::KERNEL_SHANI:  lanes = 1; return compressSHANI;
+      default: break;
+   }
+   #endif
+
+   lanes = 1;
+   return compressScalar;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+static SHA256Batch::Kernel getBestKernel(void)
+{
+   if(SHA256Batch::isSupported(SHA256Batch::KERNEL_SHANI))
+      return SHA256Batch::KERNEL_SHANI;
+   if(SHA256Batch::isSupported(SHA256Batch::KERNEL_AVX2))
+      return SHA256Batch::KERNEL_AVX2;
+   if(SHA256Batch::isSupported(SHA256Batch::KERNEL_SSE2))
+      return SHA256Batch::KERNEL_SSE2;
+   return SHA256Batch::KERNEL_SCALAR;
+}
+
+// Anything hashed before static init gets here uses the scalar kernel (0)
+static SHA256Batch::Kernel activeKernel_ = getBestKernel();
+
+
+////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t readBE32(uint8_t const * p)
+{
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+          ((uint32_t)p[2] <<  8) |  (uint32_t)p[3];
+}
+
+static inline void writeBE32(uint8_t* p, uint32_t v)
+{
+   p[0] = (uint8_t)(v >> 24);
+   p[1] = (uint8_t)(v >> 16);
+   p[2] = (uint8_t)(v >>  8);
+   p[3] = (uint8_t)(v      );
+}
+
+// Load one 64-byte block into lane l of the interleaved words
+static inline void loadBlock(uint32_t* words, uint32_t W, uint32_t l,
+                             uint8_t const * blk)
+{
+   for(uint32_t t=0; t<16; t++)
+      words[t*W + l] = readBE32(blk + 4*t);
+}
+
+static inline void initLane(uint32_t* state, uint32_t W, uint32_t l)
+{
+   for(uint32_t i=0; i<8; i++)
+      state[i*W + l] = sha256IV[i];
+}
+
+static inline void writeDigest(uint8_t* out, uint32_t const * state,
+                               uint32_t W, uint32_t l)
+{
+   for(uint32_t i=0; i<8; i++)
+      writeBE32(out + 4*i, state[i*W + l]);
+}
+
+// Second SHA256:  the 32-byte digest is a single block, with constant padding
+static inline void loadDigestBlock(uint32_t* words, uint32_t W, uint32_t l,
+                                   uint32_t const * digest, uint32_t dstride)
+{
+   for(uint32_t i=0; i<8; i++)
+      words[i*W + l] = digest[i*dstride];
+   words[8*W + l] = 0x80000000;
+   for(uint32_t i=9; i<15; i++)
+      words[i*W + l] = 0;
+   words[15*W + l] = 256;
+}
+
+// The padded tail of a message:  whatever is left past the last full 64-byte
+// block, then 0x80, zeros, and the bit length.  One block, or two if the
+// length doesn't fit.  Returns the number of tail blocks.
+static inline uint32_t makeTail(uint8_t* tail, uint8_t const * msg, uint32_t sz)
+{
+   uint32_t nFull   = sz / 64;
+   uint32_t tailLen = sz - 64*nFull;
+   uint32_t nTail   = (tailLen + 8 < 64 ? 1 : 2);
+
+   memset(tail, 0, 64*nTail);
+   if(msg != NULL)
+      memcpy(tail, msg + 64*nFull, tailLen);
+   tail[tailLen] = 0x80;
+
+   uint64_t nBits = (uint64_t)sz * 8;
+   writeBE32(tail + 64*nTail - 8, (uint32_t)(nBits >> 32));
+   writeBE32(tail + 64*nTail - 4, (uint32_t)(nBits      ));
+   return nTail;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Lock-step:  every lane is on the same block of a same-sized message.  The
+// padding is the same for all of them, so it's only built once.  The
+// messages are either in the msgs list, or back to back starting at packed.
+static void hashFixed(CompressFunc compress, uint32_t W,
+                      uint8_t const * const * msgs, uint8_t const * packed,
+                      uint32_t msgSize, uint32_t n, uint8_t* out)
+{
+   uint32_t state[8*SHA256BATCH_MAX_LANES];
+   uint32_t words[16*SHA256BATCH_MAX_LANES];
+
+   uint8_t  tailPad[128];
+   uint32_t nFull   = msgSize / 64;
+   uint32_t tailLen = msgSize - 64*nFull;
+   uint32_t nTail   = makeTail(tailPad, NULL, msgSize);
+
+   for(uint32_t g=0; g<n; g+=W)
+   {
+      // A short last group just hashes its last message a few extra times
+      uint32_t nLanes = (n-g < W ? n-g : W);
+      for(uint32_t l=0; l<W; l++)
+         initLane(state, W, l);
+
+      for(uint32_t b=0; b<nFull+nTail; b++)
+      {
+         for(uint32_t l=0; l<W; l++)
+         {
+            uint32_t idx = g + (l < nLanes ? l : nLanes-1);
+            uint8_t const * msg = (msgs != NULL ? msgs[idx] : 
+                                                  packed + (size_t)msgSize*idx);
+            if(b < nFull)
+               loadBlock(words, W, l, msg + 64*b);
+            else if(b > nFull || tailLen == 0)
+               loadBlock(words, W, l, tailPad + 64*(b-nFull));
+            else
+            {
+               uint8_t blk[64];
+               memcpy(blk, tailPad, 64);
+               memcpy(blk, msg + 64*nFull, tailLen);
+               loadBlock(words, W, l, blk);
+            }
+         }
+         compress(state, words);
+      }
+
+      for(uint32_t l=0; l<W; l++)
+      {
+         loadDigestBlock(words, W, l, state + l, W);
+         initLane(state, W, l);
+      }
+      compress(state, words);
+
+      for(uint32_t l=0; l<nLanes; l++)
+         writeDigest(out + 32*(g+l), state, W, l);
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Mixed sizes:  each lane works through its own message, and as soon as it
+// finishes one, it picks up the next one that nobody has started
+class LaneJob
+{
+public:
+   int64_t  msgIdx_;      // -1 if the lane has nothing left to do
+   uint32_t block_;       // next block to feed it
+   uint32_t nFull_;
+   uint32_t nTail_;
+   bool     secondHash_;
+   uint32_t digest_[8];
+   uint8_t  tail_[128];
+};
+
+static void hashVariable(CompressFunc compress, uint32_t W,
+                         uint8_t const * const * msgs, uint32_t const * sizes,
+                         uint32_t n, uint8_t* out)
+{
+   uint32_t state[8*SHA256BATCH_MAX_LANES];
+   uint32_t words[16*SHA256BATCH_MAX_LANES];
+   LaneJob  lanes[SHA256BATCH_MAX_LANES];
+
+   uint32_t nextMsg = 0;
+   uint32_t nActive = 0;
+   memset(words, 0, sizeof(words));
+   for(uint32_t l=0; l<W; l++)
+   {
+      lanes[l].msgIdx_ = -1;
+      initLane(state, W, l);
+   }
+
+   while(true)
+   {
+      for(uint32_t l=0; l<W; l++)
+      {
+         LaneJob & lane = lanes[l];
+         if(lane.msgIdx_ < 0 && nextMsg < n)
+         {
+            lane.msgIdx_     = nextMsg;
+            lane.block_      = 0;
+            lane.nFull_      = sizes[nextMsg] / 64;
+            lane.nTail_      = makeTail(lane.tail_, msgs[nextMsg], sizes[nextMsg]);
+            lane.secondHash_ = false;
+            initLane(state, W, l);
+            nextMsg++;
+            nActive++;
+         }
+
+         if(lane.msgIdx_ < 0)
+            continue;
+
+         if(lane.secondHash_)
+            loadDigestBlock(words, W, l, lane.digest_, 1);
+         else if(lane.block_ < lane.nFull_)
+            loadBlock(words, W, l, msgs[lane.msgIdx_] + 64*lane.block_);
+         else
+            loadBlock(words, W, l, lane.tail_ + 64*(lane.block_-lane.nFull_));
+      }
+
+      if(nActive == 0)
+         break;
+
+      compress(state, words);
+
+      for(uint32_t l=0; l<W; l++)
+      {
+         LaneJob & lane = lanes[l];
+         if(lane.msgIdx_ < 0)
+            continue;
+
+         if(lane.secondHash_)
+         {
+            writeDigest(out + 32*lane.msgIdx_, state, W, l);
+            lane.msgIdx_ = -1;
+            nActive--;
+         }
+         else if(++lane.block_ == lane.nFull_ + lane.nTail_)
+         {
+            for(uint32_t i=0; i<8; i++)
+               lane.digest_[i] = state[i*W + l];
+            lane.secondHash_ = true;
+            initLane(state, W, l);
+         }
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// SHA256Batch methods
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+static CompressFunc pickCompressFunc(uint32_t n, uint32_t & lanes)
+{
+   CompressFunc compress = getCompressFunc(activeKernel_, lanes);
+   if(lanes > 1 && n < SHA256BATCH_MIN_MULTILANE)
+      compress = getCompressFunc(SHA256Batch::KERNEL_SCALAR, lanes);
+   return compress;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void SHA256Batch::hash256(uint8_t const * const * msgs,
+                          uint32_t const *        msgSizes,
+                          uint32_t                n,
+                          uint8_t *               out)
+{
+   uint32_t lanes;
+   CompressFunc compress = pickCompressFunc(n, lanes);
+   hashVariable(compress, lanes, msgs, msgSizes, n, out);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void SHA256Batch::hash256Fixed(uint8_t const * const * msgs,
+                               uint32_t                msgSize,
+                               uint32_t                n,
+                               uint8_t *               out)
+{
+   uint32_t lanes;
+   CompressFunc compress = pickCompressFunc(n, lanes);
+   hashFixed(compress, lanes, msgs, NULL, msgSize, n, out);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void SHA256Batch::hash256Packed(uint8_t const * msgs,
+                                uint32_t        msgSize,
+                                uint32_t        n,
+                                uint8_t *       out)
+{
+   uint32_t lanes;
+   CompressFunc compress = pickCompressFunc(n, lanes);
+   hashFixed(compress, lanes, NULL, msgs, msgSize, n, out);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+bool SHA256Batch::isSupported(Kernel k)
+{
+   if(k == KERNEL_SCALAR)
+      return true;
+
+   #ifdef SHA256BATCH_X86
+   CpuFeatures const & cpu = getCpuFeatures();
+   switch(k)
+   {
+      case KERNEL_SSE2:   return cpu.sse2_;
+      case KERNEL_AVX2:   return cpu.avx2_;
+      case KERNEL_SHANI:  return cpu.shani_;
+      default: break;
+   }
+   #endif
+
+   return false;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+SHA256Batch::Kernel SHA256Batch::getKernel(void)
+{
+   return activeKernel_;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+char const * SHA256Batch::getKernelName(Kernel k)
+{
+   switch(k)
+   {
+      case KERNEL_SCALAR: return "Scalar";
+      case KERNEL_SSE2:   return "SSE2";
+      case KERNEL_AVX2:   return "AVX2";
+      case KERNEL_SHANI:  return "SHA-NI";
+      default:            return "Unknown";
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+bool SHA256Batch::setKernel(Kernel k)
+{
+   if(k >= KERNEL_COUNT || !isSupported(k))
+      return false;
+
+   activeKernel_ = k;
+   return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void SHA256Batch::resetKernel(void)
+{
+   activeKernel_ = getBestKernel();
+}
@@ -0,0 +1,88 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// SHA256Batch
+//
+// Double-SHA256 of many independent messages at once.  Every header, every
+// tx and every merkle node gets hashed on its own through Crypto++, which
+// makes hashing one of the biggest CPU costs of a rebuild.  But those hashes
+// almost always come in bunches (all the headers in a blk file, all the tx
+// in a block, one level of a merkle tree), and SHA256 of independent
+// messages vectorizes very well:  each SIMD lane runs its own message.
+//
+// Kernels, picked once at startup from what the CPU supports:
+//
+//    SHA-NI   Intel SHA extensions, one message at a time (fastest)
+//    AVX2     8 messages at a time
+//    SSE2     4 messages at a time
+//    Scalar   plain C, one at a time
+//
+// The SIMD kernels are only compiled in with GCC/clang on x86.  Everywhere
+// else (MSVC included) only the scalar kernel exists.
+//
+// Messages of all the same size go through a lock-step path, which is what
+// 80-byte headers and 64-byte merkle pairs use.  Mixed sizes (tx) go through
+// a scheduler that refills each lane with the next message as soon as its
+// current one is done.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _SHA256BATCH_H_
+#define _SHA256BATCH_H_
+
+#include <stdint.h>
+
+// Below this many messages, multi-lane kernels don't pay for their setup
+#define SHA256BATCH_MIN_MULTILANE  2
+
+
+////////////////////////////////////////////////////////////////////////////////
+class SHA256Batch
+{
+public:
+   enum Kernel
+   {
+      KERNEL_SCALAR = 0,
+      KERNEL_SSE2,
+      KERNEL_AVX2,
+      KERNEL_SHANI,
+      KERNEL_COUNT
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   // out must have room for 32*n bytes.  Hash i goes to out+32*i.
+   static void hash256(uint8_t const * const * msgs,
+                       uint32_t const *        msgSizes,
+                       uint32_t                n,
+                       uint8_t *               out);
+
+   // All n messages are msgSize bytes long
+   static void hash256Fixed(uint8_t const * const * msgs,
+                            uint32_t                msgSize,
+                            uint32_t                n,
+                            uint8_t *               out);
+
+   // Same, with the messages back to back:  message i is at msgs+msgSize*i.
+   // out must not overlap msgs.
+   static void hash256Packed(uint8_t const * msgs,
+                             uint32_t        msgSize,
+                             uint32_t        n,
+                             uint8_t *       out);
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool         isSupported(Kernel k);
+   static Kernel       getKernel(void);
+   static char const * getKernelName(Kernel k);
+
+   // Mainly for testing each kernel.  Returns false (and changes nothing)
+   // if this CPU or build doesn't support it.
+   static bool         setKernel(Kernel k);
+   static void         resetKernel(void);
+};
+
+
+#endif
@@ -0,0 +1,207 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// ScrAddrFilter
+//
+// Set of 21-byte scrAddrs (prefix byte + hash160), for the loops that check
+// every TxOut in the blockchain against the registered/wallet addresses.
+// Those used to do a map<BinaryData,...> lookup on HASH160PREFIX + addr160,
+// which means a heap allocation and ~20 BinaryData compares per TxOut, and
+// almost all of them are misses.
+//
+// Here, the keys are stored inline in one flat open-addressing table, so a
+// lookup is a probe or two into contiguous memory, and nothing is allocated.
+// In front of that is a small Bloom filter that answers most of the misses
+// without touching the table at all:  at 500k addresses, the table is about
+// 22 MB but the Bloom filter is only 1 MB, which mostly stays in cache.
+//
+// The hash160 is already uniformly distributed, so we just slice it up for
+// the table index and Bloom bits instead of hashing it again.
+//
+// Keys can only be added.  To remove one, clear() and re-insert the rest.
+// Anything that isn't 21 bytes (like multisig keys) doesn't go in here, so
+// callers must still check those against their own map.
+//
+// Lookups don't modify anything, so any number of threads can use contains()
+// at once, as long as nobody is inserting.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _SCRADDRFILTER_H_
+#define _SCRADDRFILTER_H_
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include "BinaryData.h"
+
+#define SCRADDR_FILTER_KEY_SIZE    21
+
+// One "used" byte, then the key
+#define SCRADDR_FILTER_SLOT_SIZE   (SCRADDR_FILTER_KEY_SIZE+1)
+
+// Table is at most half full.  With 16 Bloom bits per slot, that's at least
+// 32 bits per key, which with 3 bits set per key gives well under 1% false
+// positives.
+#define SCRADDR_FILTER_MIN_SLOTS   64
+#define SCRADDR_FILTER_BLOOM_BITS_PER_SLOT 16
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+class ScrAddrFilter
+{
+public:
+   ScrAddrFilter(void) : numKeys_(0), slotMask_(0), bloomMask_(0) {}
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool isFilterable(BinaryDataRef scrAddr)
+   {
+      return scrAddr.getSize() == SCRADDR_FILTER_KEY_SIZE;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Returns false if the key was already there, or isn't 21 bytes
+   bool insert(BinaryDataRef scrAddr)
+   {
+      if(!isFilterable(scrAddr))
+         return false;
+
+      return insert(scrAddr[0], scrAddr.getPtr()+1);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool insert(uint8_t prefix, uint8_t const * hash160)
+   {
+      if(contains(prefix, hash160))
+         return false;
+
+      if(2*(numKeys_+1) > numSlots())
+         resize(max(2*numSlots(), (uint32_t)SCRADDR_FILTER_MIN_SLOTS));
+
+      insertNoCheck(prefix, hash160);
+      numKeys_++;
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool contains(BinaryDataRef scrAddr) const
+   {
+      if(!isFilterable(scrAddr))
+         return false;
+
+      return contains(scrAddr[0], scrAddr.getPtr()+1);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool contains(uint8_t prefix, uint8_t const * hash160) const
+   {
+      if(numKeys_ == 0)
+         return false;
+
+      // Bloom filter first:  this is where almost every lookup ends
+      for(uint32_t i=0; i<3; i++)
+      {
+         uint32_t bit = bloomBit(prefix, hash160, i);
+         if((bloom_[bit>>3] & (1 << (bit&7))) == 0)
+            return false;
+      }
+
+      uint32_t slot = slotIndex(prefix, hash160);
+      while(true)
+      {
+         uint8_t const * ptr = &(table_[slot*SCRADDR_FILTER_SLOT_SIZE]);
+         if(ptr[0] == 0)
+            return false;
+
+         if(ptr[1] == prefix && memcmp(ptr+2, hash160, 20) == 0)
+            return true;
+
+         slot = (slot+1) & slotMask_;
+      }
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void clear(void)
+   {
+      table_.clear();
+      bloom_.clear();
+      numKeys_   = 0;
+      slotMask_  = 0;
+      bloomMask_ = 0;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint32_t size(void) const     { return numKeys_; }
+   uint32_t numSlots(void) const { return table_.size() / SCRADDR_FILTER_SLOT_SIZE; }
+
+private:
+   /////////////////////////////////////////////////////////////////////////////
+   uint32_t slotIndex(uint8_t prefix, uint8_t const * hash160) const
+   {
+      return (READ_UINT32_LE(hash160) ^ ((uint32_t)prefix * 0x9e3779b1))
+                                                                  & slotMask_;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Uses different bytes of the hash160 than slotIndex, so the Bloom filter
+   // and table misses are independent of each other
+   uint32_t bloomBit(uint8_t prefix, uint8_t const * hash160, uint32_t i) const
+   {
+      return (READ_UINT32_LE(hash160 + 4 + 4*i) ^ prefix) & bloomMask_;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void insertNoCheck(uint8_t prefix, uint8_t const * hash160)
+   {
+      for(uint32_t i=0; i<3; i++)
+      {
+         uint32_t bit = bloomBit(prefix, hash160, i);
+         bloom_[bit>>3] |= (uint8_t)(1 << (bit&7));
+      }
+
+      uint32_t slot = slotIndex(prefix, hash160);
+      while(table_[slot*SCRADDR_FILTER_SLOT_SIZE] != 0)
+         slot = (slot+1) & slotMask_;
+
+      uint8_t* ptr = &(table_[slot*SCRADDR_FILTER_SLOT_SIZE]);
+      ptr[0] = 1;
+      ptr[1] = prefix;
+      memcpy(ptr+2, hash160, 20);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // nSlots must be a power of 2
+   void resize(uint32_t nSlots)
+   {
+      vector<uint8_t> oldTable;
+      oldTable.swap(table_);
+      uint32_t oldSlots = oldTable.size() / SCRADDR_FILTER_SLOT_SIZE;
+
+      table_.assign(nSlots*SCRADDR_FILTER_SLOT_SIZE, 0);
+      bloom_.assign(nSlots*SCRADDR_FILTER_BLOOM_BITS_PER_SLOT/8, 0);
+      slotMask_  = nSlots-1;
+      bloomMask_ = nSlots*SCRADDR_FILTER_BLOOM_BITS_PER_SLOT - 1;
+
+      for(uint32_t s=0; s<oldSlots; s++)
+      {
+         uint8_t const * ptr = &(oldTable[s*SCRADDR_FILTER_SLOT_SIZE]);
+         if(ptr[0] != 0)
+            insertNoCheck(ptr[1], ptr+2);
+      }
+   }
+
+   vector<uint8_t>  table_;
+   vector<uint8_t>  bloom_;
+   uint32_t         numKeys_;
+   uint32_t         slotMask_;
+   uint32_t         bloomMask_;
+};
+
+
+#endif
@@ -191,7 +191,9 @@ void StoredHeader::createFromBlockHeader(BlockHeader & bh)
       return;
    } 
 
-   unserialize(bh.serialize());
+   // bh already hashed itself, no need to do it again
+   dataCopy_  = bh.serialize();
+   thisHash_  = bh.getThisHash();
 
    numTx_ = bh.getNumTx();
    numBytes_ = bh.getBlockSize();
@@ -254,7 +256,18 @@ void StoredHeader::unserializeFullBlock(BinaryRefReader brr,
       return;
    }
 
-   BtcUtils::getHash256(dataCopy_, thisHash_);
+   // Find where each tx is, and hash them all at once
+   vector<BinaryDataRef> rawTxList(nTx);
+   uint8_t const * txPtr = brr.getCurrPtr();
+   for(uint32_t tx=0; tx<nTx; tx++)
+   {
+      uint32_t txSize = BtcUtils::TxCalcLength(txPtr);
+      rawTxList[tx].setRef(txPtr, txSize);
+      txPtr += txSize;
+   }
+
+   BinaryData txHashes;
+   BtcUtils::getHash256Batch(rawTxList, txHashes);
 
    for(uint32_t tx=0; tx<nTx; tx++)
    {
@@ -262,7 +275,9 @@ void StoredHeader::unserializeFullBlock(BinaryRefReader brr,
       uint32_t txStart = brr.getPosition();
 
       // Read a regular tx and then convert it
-      Tx thisTx(brr);
+      Tx thisTx;
+      thisTx.unserializeWithHash(brr.getCurrPtr(), txHashes.getPtr() + 32*tx);
+      brr.advance(thisTx.getSize());
       numBytes_ += thisTx.getSize();
 
       // Now add it to the map
@@ -302,6 +317,35 @@ void StoredHeader::unserializeFullBlock(BinaryRefReader brr,
    }
 }
 
+/////////////////////////////////////////////////////////////////////////////
+bool StoredHeader::verifyMerkleRoot(BinaryData & treeBuf) const
+{
+   if(dataCopy_.getSize() != HEADER_SIZE || numTx_ == 0 || 
+      stxMap_.size() != numTx_)
+      return false;
+
+   treeBuf.resize(32*numTx_);
+   uint32_t i = 0;
+   map<uint16_t, StoredTx>::const_iterator iter;
+   for(iter = stxMap_.begin(); iter != stxMap_.end(); iter++, i++)
+   {
+      if(iter->first != i || iter->second.thisHash_.getSize() != 32)
+         return false;
+
+      memcpy(treeBuf.getPtr() + 32*i, iter->second.thisHash_.getPtr(), 32);
+   }
+
+   BinaryDataRef root = BtcUtils::calculateMerkleTreeFlat(treeBuf, numTx_);
+   return root == BinaryDataRef(dataCopy_.getPtr()+36, 32);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+bool StoredHeader::verifyMerkleRoot(void) const
+{
+   BinaryData treeBuf;
+   return verifyMerkleRoot(treeBuf);
+}
+
 /////////////////////////////////////////////////////////////////////////////
 void StoredHeader::unserializeFullBlock(BinaryDataRef block, 
                                         bool doFrag,
@@ -467,7 +511,7 @@ void StoredHeader::unserializeDBValue( DB_SELECT         db,
       numTx_    = brr.get_uint32_t();
       numBytes_ = brr.get_uint32_t();
 
-      if(unserArmVer_ != ARMORY_DB_VERSION)
+      if(unserArmVer_ > ARMORY_DB_VERSION)
          LOGWARN << "Version mismatch in unserialize DB header";
 
       if( !ignoreMerkle )
@@ -711,7 +755,7 @@ void StoredTx::unserializeDBValue(BinaryRefReader & brr)
    unserTxVer_   =                    bitunpack.getBits(2);
    unserTxType_  = (TX_SERIALIZE_TYPE)bitunpack.getBits(4);
 
-   if(unserArmVer_ != ARMORY_DB_VERSION)
+   if(unserArmVer_ > ARMORY_DB_VERSION)
       LOGWARN << "Version mismatch in unserialize DB tx";
    
    brr.get_BinaryData(thisHash_, 32);
@@ -952,7 +996,11 @@ void StoredTxOut::unserializeDBValue(BinaryRefReader & brr)
    spentness_   = (TXOUT_SPENTNESS)bitunpack.getBits(2);
    isCoinbase_  =                  bitunpack.getBit();
 
-   unserialize(brr);
+   // Entries written before the compact format are still read as they are
+   if(unserArmVer_ >= ARMORY_DB_VERSION_COMPACT_TXOUT)
+      unserializeCompactTxOut(brr, dataCopy_);
+   else
+      unserialize(brr);
    if(spentness_ == TXOUT_SPENT && brr.getSizeRemaining()>=8)
       spentByTxInKey_ = brr.get_BinaryData(8); 
 
@@ -999,7 +1047,7 @@ void StoredTxOut::serializeDBValue(BinaryWriter & bw,
    bitpack.putBit(           isCoinbase_);
 
    bw.put_BitPacker(bitpack);
-   bw.put_BinaryData(dataCopy_);  // 8-byte value, var_int sz, pkscript
+   serializeCompactTxOut(dataCopy_.getRef(), bw);
    
    if(writeSpent == TXOUT_SPENT)
    {
@@ -1165,6 +1213,216 @@ BinaryData StoredTxOut::getSerializedTxOut(void) const
    return dataCopy_;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Compact TxOut, as written by serializeCompactTxOut:
+//
+//    var_int  amount code:  1 + compressed value, or 0 if the value is too
+//                           big to compress and follows as a raw uint64
+//    var_int  script code, then:
+//                0     P2PKH               20-byte hash160
+//                1     P2SH                20-byte hash160
+//                2,3   P2PK (compressed)   32-byte x-coord (code-2 is parity)
+//                4     P2PK (uncompressed) 64-byte x and y coords
+//                5+N   anything else       the N-byte script
+//
+// Uncompressed keys are kept whole:  dropping y would mean an EC point
+// decompression every time one of these TxOuts is read back.
+#define COMPACT_SCRIPT_P2PKH     0
+#define COMPACT_SCRIPT_P2SH      1
+#define COMPACT_SCRIPT_P2PK_C    2
+#define COMPACT_SCRIPT_P2PK_U    4
+#define COMPACT_SCRIPT_RAW       5
+
+// compressAmount() can't overflow below this
+#define COMPACT_AMOUNT_MAX       0x0FFFFFFFFFFFFFFFULL
+
+////////////////////////////////////////////////////////////////////////////////
+// Most amounts are round numbers of BTC or mBTC, so trailing zeros go in an
+// exponent, and the last nonzero digit (which can't be 0) goes in base 9
+static uint64_t compressAmount(uint64_t n)
+{
+   if(n == 0)
+      return 0;
+
+   uint32_t e = 0;
+   while((n % 10) == 0 && e < 9)
+   {
+      n /= 10;
+      e++;
+   }
+
+   if(e < 9)
+   {
+      uint32_t d = (uint32_t)(n % 10);
+      n /= 10;
+      return 1 + (n*9 + d - 1)*10 + e;
+   }
+   else
+      return 1 + (n - 1)*10 + 9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t decompressAmount(uint64_t x)
+{
+   if(x == 0)
+      return 0;
+
+   x--;
+   uint32_t e = (uint32_t)(x % 10);
+   x /= 10;
+
+   uint64_t n;
+   if(e < 9)
+   {
+      uint32_t d = (uint32_t)(x % 9) + 1;
+      x /= 9;
+      n = x*10 + d;
+   }
+   else
+      n = x + 1;
+
+   for(; e > 0; e--)
+      n *= 10;
+
+   return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void StoredTxOut::serializeCompactTxOut(BinaryDataRef rawTxOut, 
+                                        BinaryWriter & bw)
+{
+   BinaryRefReader brr(rawTxOut);
+   uint64_t value   = brr.get_uint64_t();
+   uint32_t scrSize = (uint32_t)brr.get_var_int();
+   uint8_t const * scr = brr.getCurrPtr();
+
+   if(value <= COMPACT_AMOUNT_MAX)
+      bw.put_var_int(compressAmount(value) + 1);
+   else
+   {
+      bw.put_var_int(0);
+      bw.put_uint64_t(value);
+   }
+
+   if(scrSize==25 && scr[0]==0x76 && scr[1]==0xa9 && scr[2]==0x14 &&
+                     scr[23]==0x88 && scr[24]==0xac)
+   {
+      bw.put_var_int(COMPACT_SCRIPT_P2PKH);
+      bw.put_BinaryData(scr+3, 20);
+   }
+   else if(scrSize==23 && scr[0]==0xa9 && scr[1]==0x14 && scr[22]==0x87)
+   {
+      bw.put_var_int(COMPACT_SCRIPT_P2SH);
+      bw.put_BinaryData(scr+2, 20);
+   }
+   else if(scrSize==35 && scr[0]==0x21 && (scr[1]==0x02 || scr[1]==0x03) &&
+                          scr[34]==0xac)
+   {
+      bw.put_var_int(COMPACT_SCRIPT_P2PK_C + (scr[1]-0x02));
+      bw.put_BinaryData(scr+2, 32);
+   }
+   else if(scrSize==67 && scr[0]==0x41 && scr[1]==0x04 && scr[66]==0xac)
+   {
+      bw.put_var_int(COMPACT_SCRIPT_P2PK_U);
+      bw.put_BinaryData(scr+2, 64);
+   }
+   else
+   {
+      bw.put_var_int(COMPACT_SCRIPT_RAW + (uint64_t)scrSize);
+      bw.put_BinaryData(scr, scrSize);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool StoredTxOut::unserializeCompactTxOut(BinaryRefReader & brr, 
+                                          BinaryData & rawTxOut)
+{
+   if(brr.getSizeRemaining() < 2)
+   {
+      LOGERR << "Not enough bytes in BRR to unserialize compact TxOut";
+      return false;
+   }
+
+   uint64_t amtCode = brr.get_var_int();
+   uint64_t value;
+   if(amtCode != 0)
+      value = decompressAmount(amtCode - 1);
+   else if(brr.getSizeRemaining() >= 8)
+      value = brr.get_uint64_t();
+   else
+   {
+      LOGERR << "Not enough bytes in BRR to unserialize compact TxOut";
+      return false;
+   }
+
+   uint64_t scrCode = brr.get_var_int();
+   uint32_t payload;
+   uint32_t scrSize;
+   switch(scrCode)
+   {
+      case COMPACT_SCRIPT_P2PKH:    payload = 20;  scrSize = 25;  break;
+      case COMPACT_SCRIPT_P2SH:     payload = 20;  scrSize = 23;  break;
+      case COMPACT_SCRIPT_P2PK_C:  
+      case COMPACT_SCRIPT_P2PK_C+1: payload = 32;  scrSize = 35;  break;
+      case COMPACT_SCRIPT_P2PK_U:   payload = 64;  scrSize = 67;  break;
+      default: 
+         payload = scrSize = (uint32_t)(scrCode - COMPACT_SCRIPT_RAW);
+   }
+
+   if(brr.getSizeRemaining() < payload)
+   {
+      LOGERR << "Not enough bytes in BRR to unserialize compact TxOut";
+      return false;
+   }
+
+   // Write the regular TxOut straight into the output
+   uint32_t vsz = BtcUtils::calcVarIntSize(scrSize);
+   rawTxOut.resize(8 + vsz + scrSize);
+   uint8_t* ptr = rawTxOut.getPtr();
+   for(uint32_t i=0; i<8; i++)
+      *ptr++ = (uint8_t)(value >> (8*i));
+
+   if(vsz == 1)
+      *ptr++ = (uint8_t)scrSize;
+   else
+   {
+      *ptr++ = (vsz==3 ? 0xfd : 0xfe);
+      for(uint32_t i=0; i<vsz-1; i++)
+         *ptr++ = (uint8_t)(scrSize >> (8*i));
+   }
+
+   uint8_t const * src = brr.getCurrPtr();
+   switch(scrCode)
+   {
+      case COMPACT_SCRIPT_P2PKH:
+         ptr[0] = 0x76;  ptr[1] = 0xa9;  ptr[2] = 0x14;
+         memcpy(ptr+3, src, 20);
+         ptr[23] = 0x88; ptr[24] = 0xac;
+         break;
+      case COMPACT_SCRIPT_P2SH:
+         ptr[0] = 0xa9;  ptr[1] = 0x14;
+         memcpy(ptr+2, src, 20);
+         ptr[22] = 0x87;
+         break;
+      case COMPACT_SCRIPT_P2PK_C:
+      case COMPACT_SCRIPT_P2PK_C+1:
+         ptr[0] = 0x21;  ptr[1] = (uint8_t)(0x02 + scrCode - COMPACT_SCRIPT_P2PK_C);
+         memcpy(ptr+2, src, 32);
+         ptr[34] = 0xac;
+         break;
+      case COMPACT_SCRIPT_P2PK_U:
+         ptr[0] = 0x41;  ptr[1] = 0x04;
+         memcpy(ptr+2, src, 64);
+         ptr[66] = 0xac;
+         break;
+      default:
+         memcpy(ptr, src, scrSize);
+   }
+
+   brr.advance(payload);
+   return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TxOut StoredTxOut::getTxOutCopy(void) const
 {
@@ -1884,12 +2142,10 @@ void StoredSubHistory::serializeDBValue(BinaryWriter & bw ) const
       TxIOPair const & txio = iter->second;
       bool isSpent = txio.hasTxInInMain();
 
-      // If spent and only maintaining a pruned DB, skip it
+      // Spent TxIOs are kept even in DB_PRUNE_ALL:  only the StoredTx,
+      // hints and undo data are pruned, the script histories stay complete
       if(isSpent)
       {
-         if(DBUtils.getDbPruneType()==DB_PRUNE_ALL)
-            continue;
-
          if(!txio.getTxRefOfInput().isInitialized())
          {
             LOGERR << "TxIO is spent, but input is not initialized";
@@ -2128,13 +2384,6 @@ uint64_t StoredSubHistory::getSubHistoryBalance(bool withMultisig)
 uint64_t StoredSubHistory::markTxOutSpent(BinaryData txOutKey8B, 
                                                 BinaryData txInKey8B)
 {
-   // We found the TxIO we care about 
-   if(DBUtils.getDbPruneType() != DB_PRUNE_NONE)
-   {
-      LOGERR << "Have not yet implemented pruning logic yet!";
-      return UINT64_MAX;
-   }
-
    TxIOPair * txioptr = findTxio(txOutKey8B);
    if(txioptr==NULL)
    {
@@ -2192,12 +2441,6 @@ uint64_t StoredSubHistory::markTxOutUnspent(BinaryData txOutKey8B,
    TxIOPair* txioptr = findTxio(txOutKey8B);
    if(txioptr != NULL)
    {
-      if(DBUtils.getDbPruneType() != DB_PRUNE_NONE)
-      {
-         LOGERR << "Found STXO that we expected to already be pruned...";
-         return 0;
-      }
-
       if(!txioptr->hasTxInInMain())
       {
          LOGWARN << "STXO already marked unspent in SSH";
@@ -2292,7 +2535,7 @@ void StoredUndoData::unserializeDBValue(BinaryRefReader & brr)
 
    uint32_t nOpAdded = brr.get_uint32_t();
    outPointsAddedByBlock_.clear();
-   outPointsAddedByBlock_.resize(nStxoRmd);
+   outPointsAddedByBlock_.resize(nOpAdded);
    for(uint32_t i=0; i<nOpAdded; i++)
       outPointsAddedByBlock_[i].unserialize(brr);
     
@@ -2559,6 +2802,179 @@ BinaryData StoredHeadHgtList::getDBKey(bool withPrefix) const
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void StoredTrieNode::setLeaf(StoredTxOut const & stxo, BinaryDataRef txHash)
+{
+   path_    = getLeafPath(stxo.getScrAddress(), stxo.getDBKey(false));
+   isLeaf_  = true;
+   value_   = stxo.getValue();
+   txHash_  = txHash.copy();
+   script_  = stxo.getScriptRef().copy();
+   childMap_.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Leaves hash their path with their value, so the hash commits to the script,
+// the outpoint and the amount.  Branches hash their serialized child list.
+BinaryData StoredTrieNode::getNodeHash(void) const
+{
+   if(isLeaf_)
+      return BtcUtils::getHash256(path_ + serializeDBValue());
+
+   if(childMap_.size() == 0)
+      return BtcUtils::EmptyHash_;
+
+   return BtcUtils::getHash256(serializeDBValue());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t StoredTrieNode::getValueSum(void) const
+{
+   if(isLeaf_)
+      return value_;
+
+   uint64_t sum = 0;
+   map<uint8_t, StoredTrieChild>::const_iterator iter;
+   for(iter = childMap_.begin(); iter != childMap_.end(); iter++)
+      sum += iter->second.valueSum_;
+   return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t StoredTrieNode::getNumUtxo(void) const
+{
+   if(isLeaf_)
+      return 1;
+
+   uint32_t count = 0;
+   map<uint8_t, StoredTrieChild>::const_iterator iter;
+   for(iter = childMap_.begin(); iter != childMap_.end(); iter++)
+      count += iter->second.numUtxo_;
+   return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+StoredTrieChild StoredTrieNode::getChildRef(BinaryDataRef parentPath) const
+{
+   StoredTrieChild child;
+   child.label_    = path_.getSliceCopy(parentPath.getSize(), 
+                                        path_.getSize() - parentPath.getSize());
+   child.hash_     = getNodeHash();
+   child.valueSum_ = getValueSum();
+   child.numUtxo_  = getNumUtxo();
+   return child;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+UnspentTxOut StoredTrieNode::getUnspentTxOut(void) const
+{
+   BinaryDataRef txoKey = getTxOutKeyRef();
+   return UnspentTxOut(txHash_,
+                       READ_UINT16_BE(txoKey.getSliceCopy(6,2)),
+                       DBUtils.hgtxToHeight(txoKey.getSliceCopy(0,4)),
+                       value_,
+                       script_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void StoredTrieNode::unserializeDBValue(BinaryRefReader & brr)
+{
+   childMap_.clear();
+   isLeaf_ = (brr.get_uint8_t() == TRIE_NODE_LEAF);
+   if(isLeaf_)
+   {
+      value_ = brr.get_uint64_t();
+      brr.get_BinaryData(txHash_, 32);
+      uint32_t scriptSize = (uint32_t)brr.get_var_int();
+      brr.get_BinaryData(script_, scriptSize);
+      return;
+   }
+
+   uint32_t numChildren = (uint32_t)brr.get_var_int();
+   for(uint32_t i=0; i<numChildren; i++)
+   {
+      StoredTrieChild child;
+      uint32_t labelSize = (uint32_t)brr.get_var_int();
+      brr.get_BinaryData(child.label_, labelSize);
+      brr.get_BinaryData(child.hash_, 32);
+      child.valueSum_ = brr.get_uint64_t();
+      child.numUtxo_  = (uint32_t)brr.get_var_int();
+      childMap_[child.label_[0]] = child;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void StoredTrieNode::serializeDBValue(BinaryWriter & bw ) const
+{
+   if(isLeaf_)
+   {
+      bw.put_uint8_t((uint8_t)TRIE_NODE_LEAF);
+      bw.put_uint64_t(value_);
+      bw.put_BinaryData(txHash_);
+      bw.put_var_int(script_.getSize());
+      bw.put_BinaryData(script_);
+      return;
+   }
+
+   bw.put_uint8_t((uint8_t)TRIE_NODE_BRANCH);
+   bw.put_var_int(childMap_.size());
+   map<uint8_t, StoredTrieChild>::const_iterator iter;
+   for(iter = childMap_.begin(); iter != childMap_.end(); iter++)
+   {
+      StoredTrieChild const & child = iter->second;
+      bw.put_var_int(child.label_.getSize());
+      bw.put_BinaryData(child.label_);
+      bw.put_BinaryData(child.hash_);
+      bw.put_uint64_t(child.valueSum_);
+      bw.put_var_int(child.numUtxo_);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void StoredTrieNode::unserializeDBValue(BinaryData const & bd)
+{
+   BinaryRefReader brr(bd);
+   unserializeDBValue(brr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void StoredTrieNode::unserializeDBValue(BinaryDataRef bdr)
+{
+   BinaryRefReader brr(bdr);
+   unserializeDBValue(brr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryData StoredTrieNode::serializeDBValue(void) const
+{
+   BinaryWriter bw;
+   serializeDBValue(bw);
+   return bw.getData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void StoredTrieNode::unserializeDBKey(BinaryDataRef key, bool withPrefix)
+{
+   if(withPrefix)
+      path_ = key.getSliceCopy(1, key.getSize()-1);
+   else
+      path_ = key.copy();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryData StoredTrieNode::getDBKey(bool withPrefix) const
+{
+   if(!withPrefix)
+      return path_;
+
+   BinaryWriter bw(path_.getSize() + 1);
+   bw.put_uint8_t((uint8_t)DB_PREFIX_TRIENODES); 
+   bw.put_BinaryData(path_);
+   return bw.getData();
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 BLKDATA_TYPE GlobalDBUtilities::readBlkDataKey( BinaryRefReader & brr,
                                                 uint32_t & height,
@@ -15,9 +15,14 @@
 #include "BtcUtils.h"
 #include "BlockObj.h"
 
-#define ARMORY_DB_VERSION   0x00
+// Version 0x01:  StoredTxOut values use the compact TxOut encoding (see
+// StoredTxOut::serializeCompactTxOut).  Every entry carries the version 
+// that wrote it, so a 0x00 DB can be read as is, and upgraded in place
+// by InterfaceToLDB::upgradeDBFormat.
+#define ARMORY_DB_VERSION   0x01
+#define ARMORY_DB_VERSION_COMPACT_TXOUT  0x01
 #define ARMORY_DB_DEFAULT   ARMORY_DB_FULL
-#define UTXO_STORAGE        SCRIPT_UTXO_VECTOR
+#define UTXO_STORAGE        SCRIPT_UTXO_TREE
 
 enum BLKDATA_TYPE
 {
@@ -103,6 +108,12 @@ enum SCRIPT_UTXO_TYPE
   SCRIPT_UTXO_TREE
 };
 
+enum TRIE_NODE_TYPE
+{
+  TRIE_NODE_BRANCH,
+  TRIE_NODE_LEAF
+};
+
 class BlockHeader;
 class Tx;
 class TxIn;
@@ -321,6 +332,11 @@ public:
 
    bool serializeFullBlock( BinaryWriter & bw) const;
 
+   // Recomputes the merkle root from stxMap_ and checks it against the
+   // header.  Pass the same treeBuf every time to avoid reallocating it.
+   bool verifyMerkleRoot(BinaryData & treeBuf) const;
+   bool verifyMerkleRoot(void) const;
+
    void unserializeDBValue( DB_SELECT         db,
                             BinaryRefReader & brr,
                             bool              ignoreMerkle = false);
@@ -472,6 +488,13 @@ public:
 
    StoredTxOut & createFromTxOut(TxOut & txout); 
    BinaryData    getSerializedTxOut(void) const;
+
+   // How TxOuts are stored in the DB since ARMORY_DB_VERSION_COMPACT_TXOUT:
+   // the value is compressed the same way Bitcoin-Qt does it in its chain
+   // state, and P2PKH, P2SH and P2PK scripts are reduced to a one-byte code 
+   // plus the hash or the key.  Lossless for any TxOut.
+   static void serializeCompactTxOut(BinaryDataRef rawTxOut, BinaryWriter & bw);
+   static bool unserializeCompactTxOut(BinaryRefReader & brr, BinaryData & rawTxOut);
    TxOut         getTxOutCopy(void) const;
 
    BinaryData    getScrAddress(void) const;
@@ -745,6 +768,73 @@ public:
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+// One node of the UTXO trie (UTXO_STORAGE == SCRIPT_UTXO_TREE, supernode
+// only).  Every unspent TxOut is a leaf at path scrAddr + 8-byte TxOut key,
+// so all the UTXOs of one script are a single subtree.  The trie is path-
+// compressed:  every branch except the root (the empty path) has at least 
+// two children, and each node is stored under DB_PREFIX_TRIENODES + path.
+// A branch keeps the label, hash, value sum and UTXO count of each child, 
+// so a node's summary can be read without touching its children, and the 
+// root hash commits to the whole UTXO set.
+class StoredTrieChild
+{
+public:
+   StoredTrieChild(void) : valueSum_(0), numUtxo_(0) {}
+
+   BinaryData  label_;      // path of the child, minus the parent's path
+   BinaryData  hash_;
+   uint64_t    valueSum_;
+   uint32_t    numUtxo_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+class StoredTrieNode
+{
+public:
+   StoredTrieNode(void) : isLeaf_(false), value_(0) {}
+
+   bool isInitialized(void) const { return (isLeaf_ || childMap_.size() > 0); }
+
+   static BinaryData getLeafPath(BinaryDataRef scrAddr, BinaryDataRef txoKey8B)
+                           { return scrAddr.copy() + txoKey8B.copy(); }
+
+   void setLeaf(StoredTxOut const & stxo, BinaryDataRef txHash);
+
+   BinaryData getNodeHash(void) const;
+   uint64_t   getValueSum(void) const;
+   uint32_t   getNumUtxo(void) const;
+   StoredTrieChild getChildRef(BinaryDataRef parentPath) const;
+
+   // Leaves only
+   BinaryDataRef getScrAddrRef(void) const 
+                  { return path_.getSliceRef(0, path_.getSize()-8); }
+   BinaryDataRef getTxOutKeyRef(void) const 
+                  { return path_.getSliceRef(path_.getSize()-8, 8); }
+   UnspentTxOut  getUnspentTxOut(void) const;
+
+   void       unserializeDBValue(BinaryRefReader & brr);
+   void         serializeDBValue(BinaryWriter    & bw ) const;
+   void       unserializeDBValue(BinaryData const & bd);
+   void       unserializeDBValue(BinaryDataRef      bd);
+   BinaryData   serializeDBValue(void) const;
+   void       unserializeDBKey(BinaryDataRef key, bool withPrefix=true);
+
+   BinaryData getDBKey(bool withPrefix=true) const;
+
+   BinaryData  path_;
+   bool        isLeaf_;
+
+   // Leaf data:  enough to build the UnspentTxOut without reading the tx
+   uint64_t    value_;
+   BinaryData  txHash_;
+   BinaryData  script_;
+
+   // Branch data, keyed by the first byte of each child's label
+   map<uint8_t, StoredTrieChild>  childMap_;
+};
+
+
 
 
 #endif
@@ -0,0 +1,299 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// ThreadUtils
+//
+// A few small threading primitives for the parts of the BDM that farm work
+// out to helper threads.  These are thin wrappers around pthreads.  On
+// Windows, the leveldb_windows_port/win32_posix directory supplies the subset
+// of the pthread API that we use here:  mutexes, condition variables and
+// pthread_create.  There is no pthread_join in that port, which is why the
+// ThreadGroup keeps its own count of running threads instead of joining them.
+//
+// None of the existing BDM/LevelDB code is thread-safe.  Anything that runs
+// in a helper thread must only touch data it owns, or data protected by one
+// of these Mutex objects.  In particular, only one thread should ever use
+// the InterfaceToLDB.  The exceptions are reading blocks through separate
+// LDBIter cursors (readStoredBlockAtIter), which is fine from any number of
+// threads as long as nothing is writing to the DB in the meantime, and
+// commitBatchInBackground, whose helper thread only touches the WriteBatch
+// it was handed and the leveldb::DB, which does its own locking.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _THREADUTILS_H_
+#define _THREADUTILS_H_
+
+#include <pthread.h>
+#include <deque>
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   // pthread.h from the win32_posix port already pulled in Windows.h
+#else
+   #include <unistd.h>
+   #include <stdint.h>
+   #include <errno.h>
+   #include <sys/time.h>
+#endif
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+class Mutex
+{
+public:
+   Mutex(void)          { pthread_mutex_init(&mu_, 0); }
+   ~Mutex(void)         { pthread_mutex_destroy(&mu_); }
+   void lock(void)      { pthread_mutex_lock(&mu_); }
+   void unlock(void)    { pthread_mutex_unlock(&mu_); }
+
+private:
+   friend class CondVar;
+   pthread_mutex_t mu_;
+
+   // No copying
+   Mutex(Mutex const &);
+   Mutex & operator=(Mutex const &);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Lock the mutex for the lifetime of this object
+class ScopedLock
+{
+public:
+   ScopedLock(Mutex & mu) : mu_(mu) { mu_.lock(); }
+   ~ScopedLock(void)                 { mu_.unlock(); }
+
+private:
+   Mutex & mu_;
+
+   ScopedLock(ScopedLock const &);
+   ScopedLock & operator=(ScopedLock const &);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+class CondVar
+{
+public:
+   CondVar(void)            { pthread_cond_init(&cv_, NULL); }
+   ~CondVar(void)           { pthread_cond_destroy(&cv_); }
+
+   // The mutex must already be locked by the calling thread
+   void wait(Mutex & mu)    { pthread_cond_wait(&cv_, &mu.mu_); }
+   void signal(void)        { pthread_cond_signal(&cv_); }
+   void broadcast(void)     { pthread_cond_broadcast(&cv_); }
+
+   #if !defined(_MSC_VER) && !defined(__MINGW32__)
+   // Same as wait(), but gives up after ms milliseconds.  Returns false if
+   // it timed out.  The win32_posix port has no pthread_cond_timedwait.
+   bool waitFor(Mutex & mu, uint32_t ms)
+   {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      uint64_t nsec = (uint64_t)now.tv_usec*1000 + (uint64_t)(ms%1000)*1000000;
+      struct timespec until;
+      until.tv_sec  = now.tv_sec + ms/1000 + (time_t)(nsec/1000000000);
+      until.tv_nsec = (long)(nsec%1000000000);
+      return pthread_cond_timedwait(&cv_, &mu.mu_, &until) != ETIMEDOUT;
+   }
+   #endif
+
+private:
+   pthread_cond_t cv_;
+
+   CondVar(CondVar const &);
+   CondVar & operator=(CondVar const &);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Start any number of threads, then wait for all of them to finish.  The
+// destructor waits, too, so a ThreadGroup going out of scope will never leave
+// threads running with pointers into the stack frame that created them.
+class ThreadGroup
+{
+public:
+   typedef void (*ThreadFunc)(void*);
+
+   ThreadGroup(void) : numRunning_(0) {}
+   ~ThreadGroup(void) { waitForAll(); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool start(ThreadFunc func, void* arg)
+   {
+      ThreadArgs* targs = new ThreadArgs;
+      targs->group_ = this;
+      targs->func_  = func;
+      targs->arg_   = arg;
+
+      {
+         ScopedLock lock(mu_);
+         numRunning_++;
+      }
+
+      pthread_t tid;
+      if(pthread_create(&tid, NULL, threadEntry, targs) != 0)
+      {
+         delete targs;
+         ScopedLock lock(mu_);
+         numRunning_--;
+         allDone_.broadcast();
+         return false;
+      }
+
+      #if !defined(_MSC_VER) && !defined(__MINGW32__)
+         // We never join, we wait on numRunning_ instead
+         pthread_detach(tid);
+      #endif
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void waitForAll(void)
+   {
+      ScopedLock lock(mu_);
+      while(numRunning_ > 0)
+         allDone_.wait(mu_);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint32_t getNumRunning(void)
+   {
+      ScopedLock lock(mu_);
+      return numRunning_;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Used to pick a sensible default number of worker threads
+   static uint32_t getNumCores(void)
+   {
+      #if defined(_MSC_VER) || defined(__MINGW32__)
+         SYSTEM_INFO sysinfo;
+         GetSystemInfo(&sysinfo);
+         long n = (long)sysinfo.dwNumberOfProcessors;
+      #else
+         long n = sysconf(_SC_NPROCESSORS_ONLN);
+      #endif
+      return (n < 1 ? 1 : (uint32_t)n);
+   }
+
+private:
+   struct ThreadArgs
+   {
+      ThreadGroup* group_;
+      ThreadFunc   func_;
+      void*        arg_;
+   };
+
+   static void* threadEntry(void* ptr)
+   {
+      ThreadArgs* targs = (ThreadArgs*)ptr;
+      ThreadGroup* group = targs->group_;
+      targs->func_(targs->arg_);
+      delete targs;
+
+      ScopedLock lock(group->mu_);
+      group->numRunning_--;
+      group->allDone_.broadcast();
+      return NULL;
+   }
+
+   Mutex    mu_;
+   CondVar  allDone_;
+   uint32_t numRunning_;
+
+   ThreadGroup(ThreadGroup const &);
+   ThreadGroup & operator=(ThreadGroup const &);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FIFO for handing objects between threads.  If maxSize is non-zero, push()
+// will block while the queue is full, which is how the producer side gets
+// throttled when the consumers can't keep up.  Once close() is called, pop()
+// keeps returning whatever is left, and then returns false.
+template<typename T>
+class BlockingQueue
+{
+public:
+   BlockingQueue(uint32_t maxSize=0) : maxSize_(maxSize), isClosed_(false) {}
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool push(T const & obj)
+   {
+      ScopedLock lock(mu_);
+      while(maxSize_ > 0 && queue_.size() >= maxSize_ && !isClosed_)
+         notFull_.wait(mu_);
+
+      if(isClosed_)
+         return false;
+
+      queue_.push_back(obj);
+      notEmpty_.signal();
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool pop(T & obj)
+   {
+      ScopedLock lock(mu_);
+      while(queue_.size() == 0 && !isClosed_)
+         notEmpty_.wait(mu_);
+
+      if(queue_.size() == 0)
+         return false;
+
+      obj = queue_.front();
+      queue_.pop_front();
+      notFull_.signal();
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Non-blocking version of pop:  returns false immediately if empty
+   bool tryPop(T & obj)
+   {
+      ScopedLock lock(mu_);
+      if(queue_.size() == 0)
+         return false;
+
+      obj = queue_.front();
+      queue_.pop_front();
+      notFull_.signal();
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void close(void)
+   {
+      ScopedLock lock(mu_);
+      isClosed_ = true;
+      notEmpty_.broadcast();
+      notFull_.broadcast();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint32_t size(void)
+   {
+      ScopedLock lock(mu_);
+      return queue_.size();
+   }
+
+private:
+   Mutex     mu_;
+   CondVar   notEmpty_;
+   CondVar   notFull_;
+   deque<T>  queue_;
+   uint32_t  maxSize_;
+   bool      isClosed_;
+};
+
+
+#endif
@@ -0,0 +1,399 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// TxHashFilter
+//
+// Cuckoo filter over the hashes of every tx in BLKDATA.  Finding a tx by
+// hash means reading the TXHINTS entry for its 4-byte prefix, and then the
+// candidate txs until one has the full hash.  Most of the hashes we look up
+// aren't in there at all (every new zero-conf tx, for one), and the filter
+// answers those without touching LevelDB.
+//
+// Each tx takes one 16-bit fingerprint, in buckets of 4, so about 2 bytes per
+// tx, with roughly 0.01% false positives.  A false positive only costs the
+// DB lookup we would have done anyway, but there are never false negatives,
+// so every tx put in BLKDATA must be inserted.  Nothing is ever removed:  tx
+// from blocks that get reorged out stay in BLKDATA too.
+//
+// When 4-byte prefixes collide, the tx is also inserted keyed by its DB key,
+// and mayHaveTxAtKey() says which of the candidates to try first.
+//
+// A cuckoo filter can't be resized, since it doesn't keep the keys.  When one
+// table fills up, another twice its size is started, and lookups check all
+// of them.
+//
+// Lookups don't modify anything, so any number of threads can use them at
+// once, as long as nobody is inserting.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _TXHASHFILTER_H_
+#define _TXHASHFILTER_H_
+
+#include <vector>
+#include <fstream>
+#include <string.h>
+#include "BinaryData.h"
+
+#define TXHASH_FILTER_BUCKET_SIZE   4
+#define TXHASH_FILTER_MAX_KICKS     500
+#define TXHASH_FILTER_MIN_BUCKETS   1024
+
+// Cuckoo filters don't do well past ~95% full
+#define TXHASH_FILTER_LOAD_PCT      95
+
+#define TXHASH_FILTER_FILE_MAGIC    0x46485854  // "TXHF"
+#define TXHASH_FILTER_FILE_VERSION  1
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+class TxHashFilter
+{
+public:
+   TxHashFilter(void) : numItems_(0), reserveBuckets_(TXHASH_FILTER_MIN_BUCKETS) {}
+
+   /////////////////////////////////////////////////////////////////////////////
+   void clear(void)
+   {
+      tables_.clear();
+      numItems_ = 0;
+      reserveBuckets_ = TXHASH_FILTER_MIN_BUCKETS;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Size the first table for this many items.  Only does anything if the
+   // filter is still empty.
+   void reserve(uint64_t nItems)
+   {
+      if(tables_.size() > 0)
+         return;
+
+      uint64_t nBuckets = TXHASH_FILTER_MIN_BUCKETS;
+      while(nBuckets*TXHASH_FILTER_BUCKET_SIZE*TXHASH_FILTER_LOAD_PCT/100 < nItems)
+         nBuckets *= 2;
+      reserveBuckets_ = nBuckets;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void insertTx(BinaryDataRef txHash)   { insertKey(keyForHash(txHash)); }
+   bool mayHaveTx(BinaryDataRef txHash) const
+                                         { return containsKey(keyForHash(txHash)); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Same tx, but keyed by where it is in BLKDATA too (6-byte hgtx+txIdx)
+   void insertTxAtKey(BinaryDataRef txHash, BinaryDataRef dbKey6)
+                              { insertKey(keyForHashAndDBKey(txHash, dbKey6)); }
+   bool mayHaveTxAtKey(BinaryDataRef txHash, BinaryDataRef dbKey6) const
+                       { return containsKey(keyForHashAndDBKey(txHash, dbKey6)); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint64_t getNumItems(void) const  { return numItems_; }
+   uint32_t getNumTables(void) const { return tables_.size(); }
+   uint64_t getNumBytes(void) const
+   {
+      uint64_t nBytes = 0;
+      for(uint32_t t=0; t<tables_.size(); t++)
+         nBytes += tables_[t].slots_.size() * sizeof(uint16_t);
+      return nBytes;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // The tag is whatever the caller wants to check the filter still goes
+   // with (like the top block hash of the DB).  readFromFile fails if it
+   // doesn't match.
+   bool writeToFile(string filename, BinaryData const & tag) const
+   {
+      ofstream os(filename.c_str(), ios::out | ios::binary | ios::trunc);
+      if(!os.is_open())
+         return false;
+
+      BinaryWriter bw;
+      bw.put_uint32_t(TXHASH_FILTER_FILE_MAGIC);
+      bw.put_uint32_t(TXHASH_FILTER_FILE_VERSION);
+      bw.put_var_int(tag.getSize());
+      bw.put_BinaryData(tag);
+      bw.put_uint64_t(numItems_);
+      bw.put_uint32_t(tables_.size());
+      os.write((char*)bw.getData().getPtr(), bw.getSize());
+
+      for(uint32_t t=0; t<tables_.size(); t++)
+      {
+         Table const & tbl = tables_[t];
+         BinaryWriter bwt;
+         bwt.put_uint64_t(tbl.slots_.size());
+         bwt.put_uint64_t(tbl.numItems_);
+         bwt.put_uint16_t(tbl.victimFp_);
+         bwt.put_uint64_t(tbl.victimIdx_);
+         os.write((char*)bwt.getData().getPtr(), bwt.getSize());
+
+         // Slots are written in host order, same as we read them
+         os.write((char*)&(tbl.slots_[0]), tbl.slots_.size()*sizeof(uint16_t));
+      }
+
+      return os.good();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool readFromFile(string filename, BinaryData const & tag)
+   {
+      BinaryData fileTag;
+      return readFile(filename, &tag, fileTag);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Takes whatever tag the file has, for callers that store something in 
+   // it they need back (and check themselves)
+   bool readFromFileGetTag(string filename, BinaryData & fileTag)
+   {
+      return readFile(filename, NULL, fileTag);
+   }
+
+private:
+   /////////////////////////////////////////////////////////////////////////////
+   bool readFile(string filename, BinaryData const * tag, BinaryData & fileTag)
+   {
+      clear();
+      ifstream is(filename.c_str(), ios::in | ios::binary);
+      if(!is.is_open())
+         return false;
+
+      uint32_t magic=0, version=0;
+      is.read((char*)&magic,   4);
+      is.read((char*)&version, 4);
+      if(!is.good() || magic   != TXHASH_FILTER_FILE_MAGIC
+                    || version != TXHASH_FILTER_FILE_VERSION)
+         return false;
+
+      // The tag is never long, so its var_int is one byte
+      uint8_t tagSize = 0;
+      is.read((char*)&tagSize, 1);
+      fileTag.resize(tagSize);
+      if(tagSize > 0)
+         is.read((char*)fileTag.getPtr(), tagSize);
+      if(!is.good() || (tag != NULL && fileTag != *tag))
+         return false;
+
+      uint32_t nTables = 0;
+      is.read((char*)&numItems_, 8);
+      is.read((char*)&nTables,   4);
+      if(!is.good())
+      {
+         clear();
+         return false;
+      }
+
+      tables_.resize(nTables);
+      for(uint32_t t=0; t<nTables; t++)
+      {
+         Table & tbl = tables_[t];
+         uint64_t nSlots = 0;
+         is.read((char*)&nSlots,          8);
+         is.read((char*)&tbl.numItems_,   8);
+         is.read((char*)&tbl.victimFp_,   2);
+         is.read((char*)&tbl.victimIdx_,  8);
+         if(!is.good() || nSlots < TXHASH_FILTER_BUCKET_SIZE ||
+            (nSlots & (nSlots-1)) != 0)
+         {
+            clear();
+            return false;
+         }
+
+         tbl.slots_.resize(nSlots);
+         tbl.bucketMask_ = nSlots/TXHASH_FILTER_BUCKET_SIZE - 1;
+         is.read((char*)&(tbl.slots_[0]), nSlots*sizeof(uint16_t));
+         if(!is.good())
+         {
+            clear();
+            return false;
+         }
+      }
+
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Fingerprint 0 means an empty slot.  victimFp_ is the one fingerprint
+   // left over when an insert ran out of kicks, which also means the table
+   // is full.
+   struct Table
+   {
+      Table(void) : bucketMask_(0), numItems_(0), victimFp_(0), victimIdx_(0) {}
+
+      vector<uint16_t>  slots_;
+      uint64_t          bucketMask_;
+      uint64_t          numItems_;
+      uint16_t          victimFp_;
+      uint64_t          victimIdx_;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   static uint64_t mix64(uint64_t x)
+   {
+      x ^= x >> 33;
+      x *= 0xff51afd7ed558ccdULL;
+      x ^= x >> 33;
+      x *= 0xc4ceb9fe1a85ec53ULL;
+      x ^= x >> 33;
+      return x;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Real tx hashes are random already, but plenty of test data isn't
+   static uint64_t keyForHash(BinaryDataRef txHash)
+   {
+      uint8_t const * ptr = txHash.getPtr();
+      uint32_t sz = txHash.getSize();
+      uint64_t key = sz;
+      for(uint32_t i=0; i+8<=sz; i+=8)
+      {
+         uint64_t word;
+         memcpy(&word, ptr+i, 8);
+         key = mix64(key ^ word);
+      }
+      return key;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static uint64_t keyForHashAndDBKey(BinaryDataRef txHash, BinaryDataRef dbKey6)
+   {
+      uint64_t word = 0;
+      memcpy(&word, dbKey6.getPtr(), min((size_t)8, (size_t)dbKey6.getSize()));
+      return mix64(keyForHash(txHash) ^ mix64(word + 0x9e3779b97f4a7c15ULL));
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static uint16_t fingerprint(uint64_t key)
+   {
+      uint16_t fp = (uint16_t)(key >> 48);
+      return (fp==0 ? 1 : fp);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static uint64_t altIndex(Table const & tbl, uint64_t idx, uint16_t fp)
+   {
+      return (idx ^ ((uint64_t)fp * 0x5bd1e995)) & tbl.bucketMask_;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool bucketHas(Table const & tbl, uint64_t idx, uint16_t fp)
+   {
+      uint16_t const * bucket = &(tbl.slots_[idx*TXHASH_FILTER_BUCKET_SIZE]);
+      for(uint32_t i=0; i<TXHASH_FILTER_BUCKET_SIZE; i++)
+         if(bucket[i] == fp)
+            return true;
+      return false;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool bucketAdd(Table & tbl, uint64_t idx, uint16_t fp)
+   {
+      uint16_t* bucket = &(tbl.slots_[idx*TXHASH_FILTER_BUCKET_SIZE]);
+      for(uint32_t i=0; i<TXHASH_FILTER_BUCKET_SIZE; i++)
+      {
+         if(bucket[i] == 0)
+         {
+            bucket[i] = fp;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool tableHas(Table const & tbl, uint64_t key)
+   {
+      uint16_t fp   = fingerprint(key);
+      uint64_t idx1 = key & tbl.bucketMask_;
+      uint64_t idx2 = altIndex(tbl, idx1, fp);
+
+      if(bucketHas(tbl, idx1, fp) || bucketHas(tbl, idx2, fp))
+         return true;
+
+      return (tbl.victimFp_ == fp &&
+             (tbl.victimIdx_ == idx1 || tbl.victimIdx_ == idx2));
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static bool tableIsFull(Table const & tbl)
+   {
+      return tbl.victimFp_ != 0 ||
+             tbl.numItems_*100 >= tbl.slots_.size()*TXHASH_FILTER_LOAD_PCT;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   static void tableAdd(Table & tbl, uint64_t key)
+   {
+      uint16_t fp  = fingerprint(key);
+      uint64_t idx = key & tbl.bucketMask_;
+      tbl.numItems_++;
+
+      if(bucketAdd(tbl, idx, fp))
+         return;
+
+      idx = altIndex(tbl, idx, fp);
+      if(bucketAdd(tbl, idx, fp))
+         return;
+
+      // Both full:  kick a fingerprint out to its other bucket, and so on
+      for(uint32_t kick=0; kick<TXHASH_FILTER_MAX_KICKS; kick++)
+      {
+         uint16_t & slot = tbl.slots_[idx*TXHASH_FILTER_BUCKET_SIZE +
+                                      kick%TXHASH_FILTER_BUCKET_SIZE];
+         uint16_t kicked = slot;
+         slot = fp;
+         fp  = kicked;
+         idx = altIndex(tbl, idx, fp);
+         if(bucketAdd(tbl, idx, fp))
+            return;
+      }
+
+      tbl.victimFp_  = fp;
+      tbl.victimIdx_ = idx;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   bool containsKey(uint64_t key) const
+   {
+      for(uint32_t t=0; t<tables_.size(); t++)
+         if(tableHas(tables_[t], key))
+            return true;
+      return false;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void insertKey(uint64_t key)
+   {
+      // Nothing is ever removed, so a key that seems to be here already
+      // always will, even if it's a false positive
+      if(containsKey(key))
+         return;
+
+      if(tables_.size()==0 || tableIsFull(tables_.back()))
+      {
+         uint64_t nBuckets = reserveBuckets_;
+         if(tables_.size() > 0)
+            nBuckets = 2*(tables_.back().bucketMask_+1);
+
+         tables_.push_back(Table());
+         Table & tbl = tables_.back();
+         tbl.slots_.assign(nBuckets*TXHASH_FILTER_BUCKET_SIZE, 0);
+         tbl.bucketMask_ = nBuckets-1;
+      }
+
+      tableAdd(tables_.back(), key);
+      numItems_++;
+   }
+
+   vector<Table>  tables_;
+   uint64_t       numItems_;
+   uint64_t       reserveBuckets_;
+};
+
+
+#endif
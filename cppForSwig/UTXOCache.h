@@ -0,0 +1,138 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright(C) 2011-2013, Armory Technologies, Inc.                         //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// UTXOCache
+//
+// Recently created, still-unspent TxOuts, keyed by outpoint.  When applying
+// blocks to the DB, every TxIn used to read the whole StoredTx it spends from
+// just to mark one TxOut spent.  Most outputs are spent within a few hundred
+// blocks of being created, so if we hang on to the StoredTxOuts of the most
+// recent outputs, most spends never have to touch the disk.
+//
+// The only reason to look up an output is to spend it, so take() removes it.
+// That means entries are never touched twice, and LRU order is just the
+// order they were added:  once we're over maxEntries, the oldest outputs
+// are dropped, and spending one of those will go to the DB like before.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _UTXOCACHE_H_
+#define _UTXOCACHE_H_
+
+#include <list>
+#include <map>
+#include "BinaryData.h"
+#include "FixedBinary.h"
+#include "StoredBlockObj.h"
+
+// About 250 bytes per entry, with the map and list overhead
+#define UTXO_CACHE_DEFAULT_ENTRIES  500000
+
+using namespace std;
+
+
+////////////////////////////////////////////////////////////////////////////////
+class UTXOCache
+{
+public:
+   UTXOCache(uint32_t maxEntries=UTXO_CACHE_DEFAULT_ENTRIES) :
+      maxEntries_(maxEntries), numHits_(0), numMisses_(0), numEvictions_(0) {}
+
+   /////////////////////////////////////////////////////////////////////////////
+   void insert(OutPointKey const & opKey, StoredTxOut const & stxo)
+   {
+      if(maxEntries_ == 0)
+         return;
+
+      map<OutPointKey, CacheEntry>::iterator iter = entries_.find(opKey);
+      if(iter != entries_.end())
+      {
+         // Same outpoint again (duplicate tx):  newest one wins
+         iter->second.stxo_ = stxo;
+         ageList_.splice(ageList_.end(), ageList_, iter->second.age_);
+         return;
+      }
+
+      CacheEntry & entry = entries_[opKey];
+      entry.stxo_ = stxo;
+      entry.age_  = ageList_.insert(ageList_.end(), opKey);
+      evictToSize(maxEntries_);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Returns false (a miss) if it's not in the cache.  Otherwise, copies the
+   // StoredTxOut and removes it from the cache.
+   bool take(OutPointKey const & opKey, StoredTxOut & stxo)
+   {
+      map<OutPointKey, CacheEntry>::iterator iter = entries_.find(opKey);
+      if(iter == entries_.end())
+      {
+         numMisses_++;
+         return false;
+      }
+
+      numHits_++;
+      stxo = iter->second.stxo_;
+      ageList_.erase(iter->second.age_);
+      entries_.erase(iter);
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void setMaxEntries(uint32_t n)
+   {
+      maxEntries_ = n;
+      evictToSize(maxEntries_);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Drops the entries but keeps the counters
+   void clear(void)
+   {
+      entries_.clear();
+      ageList_.clear();
+   }
+
+   void resetCounters(void) { numHits_ = numMisses_ = numEvictions_ = 0; }
+
+   /////////////////////////////////////////////////////////////////////////////
+   uint32_t size(void) const            { return entries_.size(); }
+   uint32_t getMaxEntries(void) const   { return maxEntries_;     }
+   uint64_t getNumHits(void) const      { return numHits_;        }
+   uint64_t getNumMisses(void) const    { return numMisses_;      }
+   uint64_t getNumEvictions(void) const { return numEvictions_;   }
+
+private:
+   /////////////////////////////////////////////////////////////////////////////
+   void evictToSize(uint32_t n)
+   {
+      while(entries_.size() > n)
+      {
+         entries_.erase(ageList_.front());
+         ageList_.pop_front();
+         numEvictions_++;
+      }
+   }
+
+   class CacheEntry
+   {
+   public:
+      StoredTxOut                    stxo_;
+      list<OutPointKey>::iterator    age_;
+   };
+
+   map<OutPointKey, CacheEntry>   entries_;
+   list<OutPointKey>              ageList_;   // oldest first
+
+   uint32_t   maxEntries_;
+   uint64_t   numHits_;
+   uint64_t   numMisses_;
+   uint64_t   numEvictions_;
+};
+
+
+#endif
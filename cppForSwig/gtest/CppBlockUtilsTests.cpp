@@ -11,6 +11,9 @@
 #include "../PartialMerkle.h"
 #include "../leveldb_wrapper.h"
 #include "../BlockUtils.h"
+#include "../MappedFile.h"
+#include "../ScrAddrFilter.h"
+#include "../UTXOCache.h"
 
 #ifdef _MSC_VER
    #include "win32_posix.h"
@@ -439,6 +442,52 @@ TEST_F(BinaryDataTest, Append)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BinaryDataTest, InlineStorage)
+{
+   // Hashes and keys stay inside the object
+   BinaryData a = READHEX(
+      "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff");
+   EXPECT_TRUE(a.isInline());
+   EXPECT_TRUE(BinaryData(BINARYDATA_INLINE_SIZE).isInline());
+   EXPECT_FALSE(BinaryData(BINARYDATA_INLINE_SIZE+1).isInline());
+
+   // Growing past the inline buffer moves to the heap and keeps the data
+   BinaryData b = a;
+   b.append(a);
+   EXPECT_FALSE(b.isInline());
+   EXPECT_EQ(b.getSize(), 64);
+   EXPECT_EQ(b.getSliceCopy(0,32),  a);
+   EXPECT_EQ(b.getSliceCopy(32,32), a);
+
+   // Copies and assignment don't share buffers
+   BinaryData c(b);
+   BinaryData d;
+   d = a;
+   c[0] = 0xff;
+   d[0] = 0xff;
+   EXPECT_EQ(b[0], 0x00);
+   EXPECT_EQ(a[0], 0x00);
+
+   // Appending to itself, and copying from a slice of itself
+   BinaryData e = a;
+   e.append(e);
+   EXPECT_EQ(e, b);
+   e.copyFrom(e.getSliceRef(32,32));
+   EXPECT_EQ(e, a);
+
+   // New bytes from resize are zero, the old ones are kept
+   a.resize(48);
+   EXPECT_EQ(a.getSliceCopy(0,32), b.getSliceCopy(0,32));
+   EXPECT_EQ(a.getSliceCopy(32,16), BinaryData(16));
+
+   a.clear();
+   EXPECT_EQ(a.getSize(), 0);
+   EXPECT_TRUE(a.isInline());
+   EXPECT_TRUE(a.getPtr() == NULL);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BinaryDataTest, Inequality)
 {
@@ -1428,6 +1477,211 @@ TEST(BinaryReadWriteTest, ReaderEndian)
    EXPECT_EQ(brrBE2.get_var_int(), 0x00ff00ff00ff00ffULL);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST(ScrAddrFilterTest, InsertAndLookup)
+{
+   ScrAddrFilter filt;
+   EXPECT_EQ(filt.size(), 0);
+   EXPECT_FALSE(filt.contains(HASH160PREFIX + BtcUtils::getHash160(READHEX("00"))));
+
+   // Enough keys to go through a few resizes
+   vector<BinaryData> keys;
+   for(uint32_t i=0; i<1000; i++)
+   {
+      BinaryData prefix = (i%2==0 ? HASH160PREFIX : P2SHPREFIX);
+      keys.push_back(prefix + BtcUtils::getHash160(WRITE_UINT32_LE(i)));
+      EXPECT_TRUE(filt.insert(keys.back()));
+   }
+   EXPECT_EQ(filt.size(), 1000);
+   EXPECT_FALSE(filt.insert(keys[10]));
+   EXPECT_EQ(filt.size(), 1000);
+
+   for(uint32_t i=0; i<1000; i++)
+   {
+      EXPECT_TRUE(filt.contains(keys[i]));
+      EXPECT_TRUE(filt.contains(keys[i][0], keys[i].getPtr()+1));
+   }
+
+   // Same hash160s with the other prefix, and ones we never added
+   for(uint32_t i=0; i<1000; i++)
+   {
+      BinaryData prefix = (i%2==0 ? P2SHPREFIX : HASH160PREFIX);
+      EXPECT_FALSE(filt.contains(prefix + BtcUtils::getHash160(WRITE_UINT32_LE(i))));
+      EXPECT_FALSE(filt.contains(HASH160PREFIX + 
+                                 BtcUtils::getHash160(WRITE_UINT32_LE(i+1000))));
+   }
+
+   // Only 21-byte scrAddrs go in the filter
+   BinaryData msigKey = MSIGPREFIX + READHEX("0102") + keys[0].getSliceCopy(1,20);
+   EXPECT_FALSE(ScrAddrFilter::isFilterable(msigKey));
+   EXPECT_FALSE(filt.insert(msigKey));
+   EXPECT_FALSE(filt.contains(msigKey));
+
+   filt.clear();
+   EXPECT_EQ(filt.size(), 0);
+   EXPECT_FALSE(filt.contains(keys[0]));
+   EXPECT_TRUE(filt.insert(keys[0]));
+   EXPECT_TRUE(filt.contains(keys[0]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(UTXOCacheTest, TakeAndEvict)
+{
+   UTXOCache cache(3);
+   BinaryData hashA = BtcUtils::getHash256(READHEX("00"));
+   BinaryData hashB = BtcUtils::getHash256(READHEX("01"));
+
+   vector<StoredTxOut> stxos(4);
+   for(uint32_t i=0; i<4; i++)
+   {
+      stxos[i].blockHeight_ = 100+i;
+      stxos[i].txOutIndex_  = i;
+      cache.insert(getOutPointKey(hashA, i), stxos[i]);
+   }
+
+   // Only room for 3, so the oldest one is gone
+   EXPECT_EQ(cache.size(), 3);
+   EXPECT_EQ(cache.getNumEvictions(), 1);
+
+   StoredTxOut stxo;
+   EXPECT_FALSE(cache.take(getOutPointKey(hashA, 0), stxo));
+   EXPECT_FALSE(cache.take(getOutPointKey(hashB, 1), stxo));
+   EXPECT_TRUE( cache.take(getOutPointKey(hashA, 2), stxo));
+   EXPECT_EQ(stxo.blockHeight_, 102);
+   EXPECT_EQ(stxo.txOutIndex_,  2);
+
+   // Taking it removes it
+   EXPECT_FALSE(cache.take(getOutPointKey(hashA, 2), stxo));
+   EXPECT_EQ(cache.size(), 2);
+   EXPECT_EQ(cache.getNumHits(),   1);
+   EXPECT_EQ(cache.getNumMisses(), 3);
+
+   // Re-inserting an outpoint replaces it and makes it the newest
+   stxos[1].blockHeight_ = 200;
+   cache.insert(getOutPointKey(hashA, 1), stxos[1]);
+   cache.insert(getOutPointKey(hashB, 0), stxos[0]);
+   cache.setMaxEntries(2);
+   EXPECT_EQ(cache.size(), 2);
+   EXPECT_FALSE(cache.take(getOutPointKey(hashA, 3), stxo));
+   EXPECT_TRUE( cache.take(getOutPointKey(hashA, 1), stxo));
+   EXPECT_EQ(stxo.blockHeight_, 200);
+
+   cache.clear();
+   EXPECT_EQ(cache.size(), 0);
+   EXPECT_EQ(cache.getNumHits(), 2);
+   cache.resetCounters();
+   EXPECT_EQ(cache.getNumHits(), 0);
+
+   // Size 0 means don't cache anything
+   cache.setMaxEntries(0);
+   cache.insert(getOutPointKey(hashB, 0), stxos[0]);
+   EXPECT_EQ(cache.size(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(TxHashFilterTest, InsertAndLookup)
+{
+   TxHashFilter filt;
+   EXPECT_EQ(filt.getNumItems(), 0);
+   EXPECT_FALSE(filt.mayHaveTx(BtcUtils::getHash256(READHEX("00"))));
+
+   // Sequential "hashes" like the tests use, and enough of them to fill
+   // the first table a few times over
+   vector<BinaryData> hashes;
+   for(uint32_t i=0; i<20000; i++)
+   {
+      hashes.push_back(BinaryData(32));
+      memset(hashes.back().getPtr(), 0, 32);
+      memcpy(hashes.back().getPtr(), WRITE_UINT32_BE(i).getPtr(), 4);
+      filt.insertTx(hashes.back());
+   }
+   // A hash that looks like it's already there (a false positive) doesn't
+   // get inserted again, so there may be a few less than we put in
+   uint64_t nItems = filt.getNumItems();
+   EXPECT_LE(nItems, 20000);
+   EXPECT_GT(nItems, 19900);
+   EXPECT_GT(filt.getNumTables(), 1);
+   filt.insertTx(hashes[10]);
+   EXPECT_EQ(filt.getNumItems(), nItems);
+
+   // Never any false negatives, and not many false positives
+   uint32_t nFalsePos = 0;
+   for(uint32_t i=0; i<20000; i++)
+   {
+      EXPECT_TRUE(filt.mayHaveTx(hashes[i]));
+      BinaryData other = hashes[i];
+      other[31] = 0x01;
+      if(filt.mayHaveTx(other))
+         nFalsePos++;
+   }
+   EXPECT_LT(nFalsePos, 50);
+
+   BinaryData key0 = READHEX("0001e0780f00");
+   BinaryData key1 = READHEX("0001e0790f00");
+   filt.insertTxAtKey(hashes[0], key0);
+   EXPECT_TRUE( filt.mayHaveTxAtKey(hashes[0], key0));
+   EXPECT_FALSE(filt.mayHaveTxAtKey(hashes[0], key1));
+   EXPECT_FALSE(filt.mayHaveTxAtKey(hashes[1], key0));
+
+   // Only reads back with the same tag it was written with
+   string fname("txhashfilter_test.bin");
+   BinaryData tag = BtcUtils::getHash256(READHEX("01"));
+   ASSERT_TRUE(filt.writeToFile(fname, tag));
+
+   TxHashFilter filt2;
+   EXPECT_FALSE(filt2.readFromFile(fname, BtcUtils::getHash256(READHEX("02"))));
+   EXPECT_EQ(filt2.getNumItems(), 0);
+   ASSERT_TRUE(filt2.readFromFile(fname, tag));
+   EXPECT_EQ(filt2.getNumItems(),  filt.getNumItems());
+   EXPECT_EQ(filt2.getNumTables(), filt.getNumTables());
+   for(uint32_t i=0; i<20000; i++)
+      EXPECT_TRUE(filt2.mayHaveTx(hashes[i]));
+   EXPECT_TRUE(filt2.mayHaveTxAtKey(hashes[0], key0));
+   remove(fname.c_str());
+
+   filt.clear();
+   EXPECT_EQ(filt.getNumItems(), 0);
+   EXPECT_FALSE(filt.mayHaveTx(hashes[0]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(FixedBinaryTest, KeysAndOrdering)
+{
+   BinaryData hashA = READHEX(
+      "0000000000000000000000000000000000000000000000000000000000000001");
+   BinaryData hashB = READHEX(
+      "0000000000000000000000000000000000000000000000000000000000000002");
+
+   HashKey keyA(hashA);
+   EXPECT_EQ(keyA.getSize(), 32);
+   EXPECT_EQ(keyA.copy(), hashA);
+   EXPECT_TRUE(keyA.getRef() == hashA.getRef());
+   EXPECT_TRUE(keyA == HashKey(hashA.getPtr()));
+   EXPECT_TRUE(keyA <  HashKey(hashB));
+   EXPECT_TRUE(keyA != HashKey(hashB));
+
+   // Wrong size gives the all-zero key
+   EXPECT_TRUE(HashKey(READHEX("0102")) == HashKey());
+   EXPECT_TRUE(HashKey() < keyA);
+
+   // Outpoint keys are the serialized OutPoint
+   OutPoint op(hashA, 7);
+   EXPECT_EQ(getOutPointKey(hashA, 7).copy(), op.serialize());
+   EXPECT_TRUE(op.getKey() == OutPointKey(op.serialize()));
+   EXPECT_TRUE(getOutPointKey(hashA, 7) < getOutPointKey(hashA, 8));
+   EXPECT_TRUE(getOutPointKey(hashA, 8) < getOutPointKey(hashB, 0));
+
+   map<OutPointKey, uint32_t> opMap;
+   opMap[getOutPointKey(hashB, 0)] = 2;
+   opMap[getOutPointKey(hashA, 1)] = 1;
+   opMap[getOutPointKey(hashA, 0)] = 0;
+   EXPECT_EQ(opMap.size(), 3);
+   EXPECT_EQ(opMap.begin()->second, 0);
+   EXPECT_EQ(opMap[op.getKey()], 0);
+   EXPECT_TRUE(opMap.find(OutPoint(hashB, 0).getKey()) != opMap.end());
+   EXPECT_TRUE(opMap.find(OutPoint(hashB, 1).getKey()) == opMap.end());
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 class BtcUtilsTest : public ::testing::Test
@@ -1980,6 +2234,145 @@ TEST_F(BtcUtilsTest, BitsToDifficulty)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BtcUtilsTest, VerifyProofOfWork)
+{
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(rawHead_.getRef()));
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(rawHead_.getRef(), headHashLE_.getRef()));
+
+   // Any other nonce gives a hash that's nowhere near the target
+   BinaryData badNonce = rawHead_;
+   badNonce[76] ^= 0x01;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(badNonce.getRef()));
+
+   // Diff bits 0x1d00ffff:  target is 0xffff * 256^26, so in LE the hash 
+   // can be at most ff ff at bytes 26 and 27, and zeros above that
+   BinaryData head = rawHead_.getSliceCopy(0,72) + READHEX("ffff001d") + 
+          rawHead_.getSliceCopy(76,4);
+   BinaryData hash(32);
+   memset(hash.getPtr(), 0, 32);
+   hash[26] = 0xff;
+   hash[27] = 0xff;
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(head.getRef(), hash.getRef()));
+   hash[0] = 0x01;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(head.getRef(), hash.getRef()));
+   hash[0] = 0x00;
+   hash[27] = 0xfe;
+   hash[25] = 0xff;
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(head.getRef(), hash.getRef()));
+   hash[28] = 0x01;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(head.getRef(), hash.getRef()));
+
+   // Negative and zero targets can't be met by anything
+   memset(hash.getPtr(), 0, 32);
+   head = rawHead_.getSliceCopy(0,72) + READHEX("ffff801d") + 
+          rawHead_.getSliceCopy(76,4);
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(head.getRef(), hash.getRef()));
+   head = rawHead_.getSliceCopy(0,72) + READHEX("0000001d") + 
+          rawHead_.getSliceCopy(76,4);
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(head.getRef(), hash.getRef()));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BtcUtilsTest, Hash256Batch)
+{
+   // Big enough for the last of the fixed-size messages below (11*18+137)
+   BinaryData data(400);
+   for(uint32_t i=0; i<400; i++)
+      data[i] = (uint8_t)(i*7 + 3);
+
+   // Every size up to a few blocks, so every padding case gets hit
+   vector<BinaryDataRef> msgs;
+   for(uint32_t sz=0; sz<=200; sz++)
+      msgs.push_back(BinaryDataRef(data.getPtr() + sz%50, sz));
+
+   vector<uint8_t const *> ptrs;
+   for(uint32_t i=0; i<19; i++)
+      ptrs.push_back(data.getPtr() + 11*i);
+
+   vector<uint8_t const *> headPtrs(3, rawHead_.getPtr());
+
+   for(uint32_t k=0; k<SHA256Batch::KERNEL_COUNT; k++)
+   {
+      SHA256Batch::Kernel kernel = (SHA256Batch::Kernel)k;
+      if(!SHA256Batch::setKernel(kernel))
+         continue;
+      SCOPED_TRACE(SHA256Batch::getKernelName(kernel));
+
+      BinaryData hashes;
+      BtcUtils::getHash256Batch(msgs, hashes);
+      ASSERT_EQ(hashes.getSize(), 32*msgs.size());
+      for(uint32_t i=0; i<msgs.size(); i++)
+         EXPECT_EQ(hashes.getSliceCopy(32*i, 32), BtcUtils::getHash256(msgs[i]));
+
+      // The fixed-size path, with batches that don't fill all the lanes
+      hashes.resize(32*ptrs.size());
+      uint32_t fixedSizes[3] = {64, 80, 137};
+      for(uint32_t f=0; f<3; f++)
+      {
+         for(uint32_t n=1; n<=ptrs.size(); n+=3)
+         {
+            BtcUtils::getHash256Batch(&ptrs[0], fixedSizes[f], n, hashes.getPtr());
+            for(uint32_t i=0; i<n; i++)
+               EXPECT_EQ(hashes.getSliceCopy(32*i, 32),
+                         BtcUtils::getHash256(ptrs[i], fixedSizes[f]));
+         }
+      }
+
+      BtcUtils::getHash256Batch(&headPtrs[0], HEADER_SIZE, 3, hashes.getPtr());
+      EXPECT_EQ(hashes.getSliceCopy(64, 32), headHashLE_);
+
+      // 5 leaves:  the odd one out on each level gets paired with itself
+      vector<BinaryData> leaves;
+      for(uint32_t i=0; i<5; i++)
+         leaves.push_back(BtcUtils::getHash256(msgs[i]));
+      BinaryData n01 = BtcUtils::getHash256(leaves[0] + leaves[1]);
+      BinaryData n23 = BtcUtils::getHash256(leaves[2] + leaves[3]);
+      BinaryData n44 = BtcUtils::getHash256(leaves[4] + leaves[4]);
+      BinaryData n0123 = BtcUtils::getHash256(n01 + n23);
+      BinaryData n4444 = BtcUtils::getHash256(n44 + n44);
+      EXPECT_EQ(BtcUtils::calculateMerkleRoot(leaves), 
+                BtcUtils::getHash256(n0123 + n4444));
+   }
+
+   SHA256Batch::resetKernel();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BtcUtilsTest, MerkleTreeFlat)
+{
+   vector<BinaryData> leaves;
+   BinaryData flat;
+   for(uint32_t n=1; n<=20; n++)
+   {
+      leaves.push_back(BtcUtils::getHash256(WRITE_UINT32_LE(n)));
+
+      // The flat tree has the same nodes, plus the repeats on odd levels
+      vector<BinaryData> tree = BtcUtils::calculateMerkleTree(leaves);
+      flat.resize(32*n);
+      for(uint32_t i=0; i<n; i++)
+         leaves[i].copyTo(flat.getPtr() + 32*i, 32);
+      BinaryDataRef root = BtcUtils::calculateMerkleTreeFlat(flat, n);
+
+      EXPECT_EQ(flat.getSize(), 32*BtcUtils::getMerkleTreeFlatSize(n));
+      EXPECT_EQ(root, tree.back().getRef());
+      EXPECT_EQ(BtcUtils::calculateMerkleRoot(leaves), tree.back());
+   }
+
+   // 3 leaves:  the third is paired with itself
+   BinaryData n01 = BtcUtils::getHash256(leaves[0] + leaves[1]);
+   BinaryData n22 = BtcUtils::getHash256(leaves[2] + leaves[2]);
+   vector<BinaryData> three(leaves.begin(), leaves.begin()+3);
+   vector<BinaryData> tree = BtcUtils::calculateMerkleTree(three);
+   ASSERT_EQ(tree.size(), 6);
+   EXPECT_EQ(tree[3], n01);
+   EXPECT_EQ(tree[4], n22);
+   EXPECT_EQ(tree[5], BtcUtils::getHash256(n01 + n22));
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BtcUtilsTest, ScriptToOpCodes)
 {
@@ -2472,6 +2865,25 @@ TEST_F(BlockObjTest, TxUnserialize)
    }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockObjTest, TxCalcLengthBounded)
+{
+   uint32_t len = rawTx0_.getSize();
+   EXPECT_EQ(BtcUtils::TxCalcLength(rawTx0_.getPtr()), len);
+   EXPECT_EQ(BtcUtils::TxCalcLengthBounded(rawTx0_.getPtr(), len), len);
+
+   // Extra bytes after the tx don't matter
+   BinaryData padded = rawTx0_ + READHEX("ffffffff");
+   EXPECT_EQ(BtcUtils::TxCalcLengthBounded(padded.getPtr(), len+4), len);
+
+   // Every truncation must be caught, without reading past the end
+   for(uint32_t i=0; i<len; i++)
+   {
+      BinaryData cut = rawTx0_.getSliceCopy(0, i);
+      EXPECT_EQ(BtcUtils::TxCalcLengthBounded(cut.getPtr(), i), UINT32_MAX);
+   }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockObjTest, DISABLED_FullBlock)
 {
@@ -2653,6 +3065,11 @@ protected:
          "19"
          // Script
          "76""a9""14""6a59ac0e8f553f292dfe5e9f3aaa1da93499c15e""88""ac");
+      compactTxOut0_ = READHEX(
+         // Compressed value (var_int)
+         "fe""cb9130c0"
+         // Script code (P2PKH), hash160
+         "00""8dce8946f1c7763bb60ea5cf16ef514cbed0633b");
 
       bh_.unserialize(rawHead_);
       tx1_.unserialize(rawTx0_);
@@ -2690,6 +3107,7 @@ protected:
    BinaryData rawTxFragged_;
    BinaryData rawTxOut0_;
    BinaryData rawTxOut1_;
+   BinaryData compactTxOut0_;
 
 
 
@@ -3088,7 +3506,7 @@ TEST_F(StoredBlockObjTest, SHeaderDBSerFull_B1)
    sbh_.numBytes_         = 65535;
 
    // SetUp already contains sbh_.unserialize(rawHead_);
-   BinaryData flags = READHEX("01340000");
+   BinaryData flags = READHEX("11340000");
    BinaryData ntx   = READHEX("0f000000");
    BinaryData nbyte = READHEX("ffff0000");
 
@@ -3115,7 +3533,7 @@ TEST_F(StoredBlockObjTest, SHeaderDBSerFull_B2)
    sbh_.numBytes_         = 65535;
 
    // SetUp already contains sbh_.unserialize(rawHead_);
-   BinaryData flags = READHEX("01260000");
+   BinaryData flags = READHEX("11260000");
    BinaryData ntx   = READHEX("0f000000");
    BinaryData nbyte = READHEX("ffff0000");
 
@@ -3140,7 +3558,7 @@ TEST_F(StoredBlockObjTest, SHeaderDBSerFull_B3)
    sbh_.numBytes_         = 65535;
 
    // SetUp already contains sbh_.unserialize(rawHead_);
-   BinaryData flags = READHEX("01100000");
+   BinaryData flags = READHEX("11100000");
    BinaryData ntx   = READHEX("0f000000");
    BinaryData nbyte = READHEX("ffff0000");
 
@@ -3346,9 +3764,9 @@ TEST_F(StoredBlockObjTest, STxSerDBValue_1)
    //  |----| |--| |-- --|
    //   DBVer TxVer TxSer
    //
-   // For this example:  DBVer=0, TxVer=1, TxSer=FRAGGED[1]
-   //   0000   01   00 01  -- ----
-   BinaryData  first2  = READHEX("0440"); // little-endian, of course
+   // For this example:  DBVer=1, TxVer=1, TxSer=FRAGGED[1]
+   //   0001   01   00 01  -- ----
+   BinaryData  first2  = READHEX("1440"); // little-endian, of course
    BinaryData  txHash  = origTx.getThisHash();
    BinaryData  fragged = stx.getSerializedTxFragged();
    BinaryData  output  = first2 + txHash + fragged;
@@ -3506,9 +3924,9 @@ TEST_F(StoredBlockObjTest, STxOutSerDBValue_1)
    //  |----| |--|  |--| |-|
    //   DBVer TxVer Spnt  CB
    //
-   // For this example:  DBVer=0, TxVer=1, TxSer=FRAGGED[1]
-   //   0000   01    00   0  --- ----
-   EXPECT_EQ(stxo0.serializeDBValue(),  READHEX("0400") + rawTxOut0_);
+   // For this example:  DBVer=1, TxVer=1, TxSer=FRAGGED[1]
+   //   0001   01    00   0  --- ----
+   EXPECT_EQ(stxo0.serializeDBValue(),  READHEX("1400") + compactTxOut0_);
 }
    
 
@@ -3524,11 +3942,11 @@ TEST_F(StoredBlockObjTest, STxOutSerDBValue_2)
    stxo0.spentness_ = TXOUT_UNSPENT;
 
    // Test a spent TxOut
-   //   0000   01    01   0  --- ----
+   //   0001   01    01   0  --- ----
    BinaryData spentStr = DBUtils.getBlkDataKeyNoPrefix( 100000, 1, 127, 15);
    stxo0.spentness_ = TXOUT_SPENT;
    stxo0.spentByTxInKey_ = spentStr;
-   EXPECT_EQ(stxo0.serializeDBValue(), READHEX("0500")+rawTxOut0_+spentStr);
+   EXPECT_EQ(stxo0.serializeDBValue(), READHEX("1500")+compactTxOut0_+spentStr);
 }
 
 
@@ -3545,13 +3963,13 @@ TEST_F(StoredBlockObjTest, STxOutSerDBValue_3)
    stxo0.isCoinbase_ = true;
 
    // Test a spent TxOut but in lite mode where we don't record spentness
-   //   0000   01    01   1  --- ----
+   //   0001   01    01   1  --- ----
    DBUtils.setArmoryDbType(ARMORY_DB_LITE);
    DBUtils.setDbPruneType(DB_PRUNE_NONE);
    BinaryData spentStr = DBUtils.getBlkDataKeyNoPrefix( 100000, 1, 127, 15);
    stxo0.spentness_ = TXOUT_SPENT;
    stxo0.spentByTxInKey_ = spentStr;
-   EXPECT_EQ(stxo0.serializeDBValue(), READHEX("0680")+rawTxOut0_);
+   EXPECT_EQ(stxo0.serializeDBValue(), READHEX("1680")+compactTxOut0_);
 }
 
 
@@ -3619,6 +4037,110 @@ TEST_F(StoredBlockObjTest, STxOutUnserDBValue_3)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(StoredBlockObjTest, STxOutCompactEncoding)
+{
+   // P2PKH:  compressed value, then script code 0 and the hash160
+   BinaryWriter bw;
+   StoredTxOut::serializeCompactTxOut(rawTxOut0_.getRef(), bw);
+   EXPECT_EQ(bw.getData(), compactTxOut0_);
+
+   BinaryRefReader brr(compactTxOut0_);
+   BinaryData raw;
+   EXPECT_TRUE(StoredTxOut::unserializeCompactTxOut(brr, raw));
+   EXPECT_EQ(raw, rawTxOut0_);
+   EXPECT_EQ(brr.getSizeRemaining(), 0);
+
+   // Every kind of script, with values that do and don't compress well
+   vector<BinaryData> scripts;
+   scripts.push_back(READHEX("a914""8dce8946f1c7763bb60ea5cf16ef514cbed0633b""87"));
+   scripts.push_back(READHEX("21""02""5d74feae58c4c36d7c35beac05eddddc"
+                             "78b3ce4b02491a2eea72043978056a8b""ac"));
+   scripts.push_back(READHEX("21""03""5d74feae58c4c36d7c35beac05eddddc"
+                             "78b3ce4b02491a2eea72043978056a8b""ac"));
+   scripts.push_back(READHEX("41""04""5d74feae58c4c36d7c35beac05eddddc"
+                             "78b3ce4b02491a2eea72043978056a8b"
+                             "c439b99ddaad327207b09ef16a891082"
+                             "8e805b0cc8c11fba5caea2ee939346d7""ac"));
+   scripts.push_back(READHEX("41""06""5d74feae58c4c36d7c35beac05eddddc"
+                             "78b3ce4b02491a2eea72043978056a8b"
+                             "c439b99ddaad327207b09ef16a891082"
+                             "8e805b0cc8c11fba5caea2ee939346d7""ac"));
+   scripts.push_back(READHEX("6a""04""deadbeef"));
+   scripts.push_back(READHEX(""));
+   scripts.push_back(BinaryData(300));
+
+   vector<uint64_t> values;
+   values.push_back(0);
+   values.push_back(1);
+   values.push_back(5000000000ULL);
+   values.push_back(2100000000000000ULL);
+   values.push_back(123456789);
+   values.push_back(UINT64_MAX);
+
+   // Compact sizes of the scripts above (not counting the amount)
+   uint32_t expScrSize[] = { 21, 33, 33, 65, 68, 7, 1, 303 };
+
+   for(uint32_t i=0; i<scripts.size(); i++)
+   {
+      for(uint32_t j=0; j<values.size(); j++)
+      {
+         BinaryWriter bwRaw;
+         bwRaw.put_uint64_t(values[j]);
+         bwRaw.put_var_int(scripts[i].getSize());
+         bwRaw.put_BinaryData(scripts[i]);
+
+         BinaryWriter bwCompact;
+         StoredTxOut::serializeCompactTxOut(bwRaw.getDataRef(), bwCompact);
+         BinaryRefReader brrCompact(bwCompact.getDataRef());
+         uint32_t amtSize = (uint32_t)brrCompact.get_var_int();
+         if(values[j] <= 0x0FFFFFFFFFFFFFFFULL)
+            amtSize = BtcUtils::calcVarIntSize(amtSize);
+         else
+            amtSize = 9;
+         EXPECT_EQ(bwCompact.getSize(), amtSize + expScrSize[i]);
+
+         BinaryRefReader brrBack(bwCompact.getDataRef());
+         BinaryData rawBack;
+         EXPECT_TRUE(StoredTxOut::unserializeCompactTxOut(brrBack, rawBack));
+         EXPECT_EQ(rawBack, bwRaw.getData());
+         EXPECT_EQ(brrBack.getSizeRemaining(), 0);
+      }
+   }
+
+   // Round numbers of BTC are tiny
+   StoredTxOut stxo;
+   stxo.unserialize(READHEX("00f2052a01000000""19""76a914"
+                            "8dce8946f1c7763bb60ea5cf16ef514cbed0633b88ac"));
+   stxo.txVersion_ = 1;
+   stxo.spentness_ = TXOUT_UNSPENT;
+   EXPECT_EQ(stxo.serializeDBValue(), 
+             READHEX("1400""33""00""8dce8946f1c7763bb60ea5cf16ef514cbed0633b"));
+
+   // Truncated input fails instead of reading past the end
+   BinaryData trunc = compactTxOut0_.getSliceCopy(0, 10);
+   BinaryRefReader brrTrunc(trunc);
+   EXPECT_FALSE(StoredTxOut::unserializeCompactTxOut(brrTrunc, raw));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(StoredBlockObjTest, STxOutUnserDBValue_Compact)
+{
+   BinaryData input = READHEX( "1500fecb9130c0008dce8946f1c7763bb60ea5cf16ef"
+                               "514cbed0633b01a086017f000f00");
+   StoredTxOut stxo;
+   stxo.unserializeDBValue(input);
+
+   EXPECT_TRUE( stxo.isInitialized());
+   EXPECT_EQ(   stxo.txVersion_,    1);
+   EXPECT_EQ(   stxo.dataCopy_,     rawTxOut0_);
+   EXPECT_EQ(   stxo.spentness_,    TXOUT_SPENT);
+   EXPECT_FALSE(stxo.isCoinbase_);
+   EXPECT_EQ(   stxo.spentByTxInKey_, READHEX("01a086017f000f00"));
+   EXPECT_EQ(   stxo.unserArmVer_,  1);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(StoredBlockObjTest, SHeaderFullBlock)
 {
@@ -4018,7 +4540,7 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    /////////////////////////////////////////////////////////////////////////////
    // Empty SSH (probably shouldn't even be serialized/written, in the future)
    BinaryData expect, expSub1, expSub2;
-   expect = READHEX("0400""ffff0000""00");
+   expect = READHEX("1400""ffff0000""00");
    EXPECT_EQ(ssh.serializeDBValue(), expect);
 
    /////////////////////////////////////////////////////////////////////////////
@@ -4029,14 +4551,14 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    txio0.setMultisig(false);
    ssh.insertTxio(txio0);
 
-   expect = READHEX("0400""ffff0000""01""00""0100000000000000""0000ff00""0001""0001");
+   expect = READHEX("1400""ffff0000""01""00""0100000000000000""0000ff00""0001""0001");
    EXPECT_EQ(ssh.serializeDBValue(), expect);
 
    /////////////////////////////////////////////////////////////////////////////
    // Added a second one, different subSSH
    TxIOPair txio1(READHEX("00010000""0002""0002"), READ_UINT64_HEX_LE("0002000000000000"));
    ssh.insertTxio(txio1);
-   expect  = READHEX("0480""ffff0000""02""0102000000000000");
+   expect  = READHEX("1480""ffff0000""02""0102000000000000");
    expSub1 = READHEX("01""00""0100000000000000""0001""0001");
    expSub2 = READHEX("01""00""0002000000000000""0002""0002");
    EXPECT_EQ(ssh.serializeDBValue(), expect);
@@ -4047,7 +4569,7 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    // Added another TxIO to the second subSSH
    TxIOPair txio2(READHEX("00010000""0004""0004"), READ_UINT64_HEX_LE("0000030000000000"));
    ssh.insertTxio(txio2);
-   expect  = READHEX("0480""ffff0000""03""0102030000000000");
+   expect  = READHEX("1480""ffff0000""03""0102030000000000");
    expSub1 = READHEX("01"
                        "00""0100000000000000""0001""0001");
    expSub2 = READHEX("02"
@@ -4062,7 +4584,7 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    // equivalent to marking it spent, but we are DB-mode-agnostic here, testing
    // just the base insert/erase operations)
    ssh.eraseTxio(txio1);
-   expect  = READHEX("0480""ffff0000""02""0100030000000000");
+   expect  = READHEX("1480""ffff0000""02""0100030000000000");
    expSub1 = READHEX("01"
                        "00""0100000000000000""0001""0001");
    expSub2 = READHEX("01"
@@ -4077,7 +4599,7 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    TxIOPair txio3(READHEX("00010000""0006""0006"), READ_UINT64_HEX_LE("0000000400000000"));
    txio3.setMultisig(true);
    ssh.insertTxio(txio3);
-   expect  = READHEX("0480""ffff0000""03""0100030000000000");
+   expect  = READHEX("1480""ffff0000""03""0100030000000000");
    expSub1 = READHEX("01"
                        "00""0100000000000000""0001""0001");
    expSub2 = READHEX("02"
@@ -4090,7 +4612,7 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    /////////////////////////////////////////////////////////////////////////////
    // Remove the multisig
    ssh.eraseTxio(txio3);
-   expect  = READHEX("0480""ffff0000""02""0100030000000000");
+   expect  = READHEX("1480""ffff0000""02""0100030000000000");
    expSub1 = READHEX("01"
                        "00""0100000000000000""0001""0001");
    expSub2 = READHEX("01"
@@ -4103,7 +4625,7 @@ TEST_F(StoredBlockObjTest, SScriptHistorySer)
    // Remove a full subSSH (it shouldn't be deleted, though, that will be done
    // by BlockUtils in a post-processing step
    ssh.eraseTxio(txio0);
-   expect  = READHEX("0480""ffff0000""01""0000030000000000");
+   expect  = READHEX("1480""ffff0000""01""0000030000000000");
    expSub1 = READHEX("00");
    expSub2 = READHEX("01"
                        "00""0000030000000000""0004""0004");
@@ -4587,6 +5109,15 @@ protected:
       expectOutH_.push_back( pair<BinaryData,BinaryData>(key,val));
    }
 
+   /////
+   // STXO values are stored with the compact TxOut encoding
+   BinaryData compactTxOut(BinaryData const & rawTxOut)
+   {
+      BinaryWriter bw;
+      StoredTxOut::serializeCompactTxOut(rawTxOut.getRef(), bw);
+      return bw.getData();
+   }
+
    /////
    void addOutPairB(BinaryData key, BinaryData val)
    { 
@@ -4681,7 +5212,7 @@ protected:
                              ARMORY_DB_FULL, DB_PRUNE_NONE);
 
       BinaryData DBINFO = StoredDBInfo().getDBKey();
-      BinaryData flags = READHEX("03100000");
+      BinaryData flags = READHEX("13100000");
       BinaryData val0 = magic_+flags+zeros_+zeros_+ghash_;
       addOutPairH(DBINFO, val0);
       addOutPairB(DBINFO, val0);
@@ -4737,7 +5268,7 @@ TEST_F(LevelDBTest, OpenClose)
 
    // 0123 4567 0123 4567
    // 0000 0010 0001 ---- ---- ---- ---- ----
-   BinaryData flags = READHEX("03100000");
+   BinaryData flags = READHEX("13100000");
 
    for(uint32_t i=0; i<HList.size(); i++)
    {
@@ -4755,12 +5286,30 @@ TEST_F(LevelDBTest, OpenClose)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(LevelDBTest, OpenFailsCleanly)
+{
+   // A file where the BLKDATA directory should be:  LevelDB can't open it
+   ofstream os("ldbtestdir/leveldb_blkdata");
+   os << "not a database";
+   os.close();
+
+   EXPECT_FALSE(iface_->openDatabases( string("ldbtestdir"),
+                                       ghash_,
+                                       gentx_,
+                                       magic_,
+                                       ARMORY_DB_FULL,
+                                       DB_PRUNE_NONE));
+   EXPECT_FALSE(iface_->databasesAreOpen());
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(LevelDBTest, OpenCloseOpenNominal)
 {
    // 0123 4567 0123 4567
    // 0000 0010 0001 ---- ---- ---- ---- ----
-   BinaryData flags = READHEX("03100000");
+   BinaryData flags = READHEX("13100000");
 
    iface_->openDatabases( string("ldbtestdir"),
                           ghash_,
@@ -4858,10 +5407,57 @@ TEST_F(LevelDBTest, DISABLED_OpenCloseOpenMismatch)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(LevelDBTest, DBTuning)
+{
+   // Defaults:  only the bloom filter is changed from LevelDB's defaults
+   LDBTuning tune;
+   EXPECT_EQ(tune.blockCacheSize_,  0);
+   EXPECT_EQ(tune.bloomFilterBits_, 10);
+   EXPECT_FALSE(tune.useCompression_);
+
+   LDBTuning blkTune;
+   blkTune.blockCacheSize_  = 32*1048576;
+   blkTune.bloomFilterBits_ = 12;
+   blkTune.writeBufferSize_ = 16*1048576;
+   blkTune.blockSize_       = 8192;
+   iface_->setDBTuning(BLKDATA, blkTune);
+
+   LDBTuning headTune;
+   headTune.bloomFilterBits_ = 0;
+   iface_->setDBTuning(HEADERS, headTune);
+
+   bool isOpen = standardOpenDBs();
+
+   // This is a singleton, so put it back before anything can fail
+   iface_->setDBTuning(BLKDATA, LDBTuning());
+   iface_->setDBTuning(HEADERS, LDBTuning());
+   ASSERT_TRUE(isOpen);
+
+   string blkSettings  = iface_->getDBSettingsStr(BLKDATA);
+   string headSettings = iface_->getDBSettingsStr(HEADERS);
+   EXPECT_NE(blkSettings.find("block_cache=33554432"),  string::npos);
+   EXPECT_NE(blkSettings.find("bloom_bits=12"),         string::npos);
+   EXPECT_NE(blkSettings.find("write_buffer=16777216"), string::npos);
+   EXPECT_NE(blkSettings.find("block_size=8192"),       string::npos);
+   EXPECT_NE(blkSettings.find("compression=none"),      string::npos);
+   EXPECT_NE(headSettings.find("block_cache=8388608"),  string::npos);
+   EXPECT_NE(headSettings.find("bloom_bits=0"),         string::npos);
+   EXPECT_NE(headSettings.find("block_size=4096"),      string::npos);
+
+   // Gets (including misses) still work with the filter in place
+   iface_->putValue(BLKDATA, READHEX("0501"), READHEX("abcd"));
+   EXPECT_EQ(iface_->getValue(BLKDATA, READHEX("0501")), READHEX("abcd"));
+   EXPECT_EQ(iface_->getValue(BLKDATA, READHEX("0502")).getSize(), 0);
+
+   EXPECT_GT(iface_->getDBStatsStr(BLKDATA).size(), 0);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(LevelDBTest, PutGetDelete)
 {
-   BinaryData flags = READHEX("03100000");
+   BinaryData flags = READHEX("13100000");
 
    iface_->openDatabases( string("ldbtestdir"),
                           ghash_,
@@ -4915,7 +5511,7 @@ TEST_F(LevelDBTest, PutGetDelete)
 TEST_F(LevelDBTest, STxOutPutGet)
 {
    BinaryData TXP     = WRITE_UINT8_BE((uint8_t)DB_PREFIX_TXDATA);
-   BinaryData stxoVal = READHEX("0400") + rawTxOut0_;
+   BinaryData stxoVal = READHEX("1400") + compactTxOut(rawTxOut0_);
    BinaryData stxoKey = TXP + READHEX("01e078""0f""0007""0001");
    
    ASSERT_TRUE(standardOpenDBs());
@@ -4950,7 +5546,7 @@ TEST_F(LevelDBTest, STxOutPutGet)
    stxo1.txIndex_     = 7;
    stxo1.txOutIndex_  = 1;
    stxo1.unserialize(rawTxOut1_);
-   stxoVal = READHEX("0400") + rawTxOut1_;
+   stxoVal = READHEX("1400") + compactTxOut(rawTxOut1_);
    stxoKey = TXP + READHEX("030e8d""03""00070001");
    iface_->putStoredTxOut(stxo1);
 
@@ -4964,6 +5560,68 @@ TEST_F(LevelDBTest, STxOutPutGet)
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(LevelDBTest, UpgradeDBFormat)
+{
+   BinaryData TXP = WRITE_UINT8_BE((uint8_t)DB_PREFIX_TXDATA);
+   BinaryData stxoKey0 = TXP + READHEX("01e078""0f""0007""0000");
+   BinaryData stxoKey1 = TXP + READHEX("01e078""0f""0007""0001");
+   BinaryData spentBy  = READHEX("01a086017f000f00");
+   
+   ASSERT_TRUE(standardOpenDBs());
+
+   // Make it look like a version-0 DB:  old-style TxOut entries, one spent
+   StoredDBInfo sdbi;
+   iface_->getStoredDBInfo(BLKDATA, sdbi);
+   sdbi.armoryVer_ = 0;
+   iface_->putStoredDBInfo(BLKDATA, sdbi);
+   iface_->putValue(BLKDATA, stxoKey0, READHEX("0400") + rawTxOut0_);
+   iface_->putValue(BLKDATA, stxoKey1, READHEX("0500") + rawTxOut1_ + spentBy);
+
+   // Readable as it is
+   StoredTxOut stxoOld0, stxoOld1;
+   EXPECT_TRUE(iface_->getStoredTxOut(stxoOld0, 123000, 15, 7, 0));
+   EXPECT_TRUE(iface_->getStoredTxOut(stxoOld1, 123000, 15, 7, 1));
+   EXPECT_EQ(stxoOld0.getSerializedTxOut(), rawTxOut0_);
+   EXPECT_EQ(stxoOld1.spentByTxInKey_, spentBy);
+   EXPECT_EQ(iface_->getTxOutCopy(READHEX("01e078""0f""0007"), 1).serialize(),
+             rawTxOut1_);
+
+   // One entry per batch, to make sure we cross batches
+   EXPECT_EQ(iface_->upgradeDBFormat(1), 2);
+   EXPECT_EQ(iface_->getValue(BLKDATA, stxoKey0), 
+             READHEX("1400") + compactTxOut(rawTxOut0_));
+   EXPECT_EQ(iface_->getValue(BLKDATA, stxoKey1), 
+             READHEX("1500") + compactTxOut(rawTxOut1_) + spentBy);
+
+   StoredTxOut stxoNew0, stxoNew1;
+   EXPECT_TRUE(iface_->getStoredTxOut(stxoNew0, 123000, 15, 7, 0));
+   EXPECT_TRUE(iface_->getStoredTxOut(stxoNew1, 123000, 15, 7, 1));
+   EXPECT_EQ(stxoNew0.getSerializedTxOut(), rawTxOut0_);
+   EXPECT_EQ(stxoNew1.getSerializedTxOut(), rawTxOut1_);
+   EXPECT_EQ(stxoNew1.spentness_, TXOUT_SPENT);
+   EXPECT_EQ(stxoNew1.spentByTxInKey_, spentBy);
+   EXPECT_EQ(iface_->getTxOutCopy(READHEX("01e078""0f""0007"), 1).serialize(),
+             rawTxOut1_);
+
+   iface_->getStoredDBInfo(BLKDATA, sdbi);
+   EXPECT_EQ(sdbi.armoryVer_, ARMORY_DB_VERSION);
+   iface_->getStoredDBInfo(HEADERS, sdbi);
+   EXPECT_EQ(sdbi.armoryVer_, ARMORY_DB_VERSION);
+
+   // Nothing left to do
+   EXPECT_EQ(iface_->upgradeDBFormat(), 0);
+
+   // And a DB from the future is refused
+   iface_->getStoredDBInfo(BLKDATA, sdbi);
+   sdbi.armoryVer_ = ARMORY_DB_VERSION + 1;
+   iface_->putStoredDBInfo(BLKDATA, sdbi);
+   iface_->closeDatabases();
+   EXPECT_FALSE(iface_->openDatabases( string("ldbtestdir"), 
+                                       ghash_, gentx_, magic_, 
+                                       ARMORY_DB_FULL, DB_PRUNE_NONE));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(LevelDBTest, PutFullTxNoOuts)
 {
@@ -4978,7 +5636,7 @@ TEST_F(LevelDBTest, PutFullTxNoOuts)
 
    BinaryData TXP     = WRITE_UINT8_BE((uint8_t)DB_PREFIX_TXDATA);
    BinaryData stxKey  = TXP + READHEX("01e078""0f""0007");
-   BinaryData stxVal  = READHEX("0440") + stx.thisHash_ + rawTxFragged_;
+   BinaryData stxVal  = READHEX("1440") + stx.thisHash_ + rawTxFragged_;
 
    iface_->putStoredTx(stx, false);
    addOutPairB(stxKey,  stxVal);
@@ -4992,7 +5650,7 @@ TEST_F(LevelDBTest, PutFullTx)
    DBUtils.setDbPruneType(DB_PRUNE_NONE);
 
    BinaryData TXP     = WRITE_UINT8_BE((uint8_t)DB_PREFIX_TXDATA);
-   BinaryData stxoVal = READHEX("0400") + rawTxOut0_;
+   BinaryData stxoVal = READHEX("1400") + compactTxOut(rawTxOut0_);
    BinaryData stxKey   = TXP + READHEX("01e078""0f""0007");
    BinaryData stxo0Key = TXP + READHEX("01e078""0f""0007""0000");
    BinaryData stxo1Key = TXP + READHEX("01e078""0f""0007""0001");
@@ -5020,9 +5678,9 @@ TEST_F(LevelDBTest, PutFullTx)
       ASSERT_EQ(stx.stxoMap_[i].isCoinbase_,   false);
    }
 
-   BinaryData stxVal = READHEX("0440") + stx.thisHash_ + rawTxFragged_;
-   BinaryData stxo0Val = READHEX("0400") + stxo0raw;
-   BinaryData stxo1Val = READHEX("0400") + stxo1raw;
+   BinaryData stxVal = READHEX("1440") + stx.thisHash_ + rawTxFragged_;
+   BinaryData stxo0Val = READHEX("1400") + compactTxOut(stxo0raw);
+   BinaryData stxo1Val = READHEX("1400") + compactTxOut(stxo1raw);
 
    iface_->putStoredTx(stx);
    addOutPairB(stxKey,  stxVal);
@@ -5032,6 +5690,129 @@ TEST_F(LevelDBTest, PutFullTx)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(LevelDBTest, TxHashFilterLookups)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_FULL);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   ASSERT_TRUE(standardOpenDBs());
+   ASSERT_TRUE(iface_->txHashFilterIsReady());
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 0);
+
+   StoredTx stx;
+   stx.createFromTx(rawTxUnfrag_);
+   stx.setKeyData(123000, 15, 7);
+   BinaryData hash0 = stx.thisHash_;
+   iface_->putStoredTx(stx, false);
+
+   // Same 4-byte prefix, different tx
+   BinaryData hash1 = hash0;
+   hash1[31] ^= 0xff;
+   stx.thisHash_ = hash1;
+   stx.setKeyData(123001, 0, 2);
+   iface_->putStoredTx(stx, false);
+
+   // 2 tx, and the second one also by its DB key
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 3);
+   EXPECT_TRUE(iface_->getTxHashFilter().mayHaveTxAtKey(hash1, 
+                             DBUtils.getBlkDataKeyNoPrefix(123001, 0, 2)));
+
+   BinaryData missing = hash0;
+   missing[0] ^= 0xff;
+
+   EXPECT_EQ(iface_->getTxRef(hash0).getDBKey(), READHEX("01e0780f""0007"));
+   EXPECT_EQ(iface_->getTxRef(hash1).getDBKey(), READHEX("01e07900""0002"));
+   EXPECT_FALSE(iface_->getTxRef(missing).isInitialized());
+
+   StoredTx stxGet;
+   ASSERT_TRUE(iface_->getStoredTx(stxGet, hash1));
+   EXPECT_EQ(stxGet.blockHeight_, 123001);
+   EXPECT_EQ(stxGet.txIndex_, 2);
+
+   // Saved on close, loaded on open
+   string fname("ldbtestdir/leveldb_blkdata/txhashfilter.bin");
+   iface_->closeDatabases();
+   EXPECT_NE(BtcUtils::GetFileSize(fname), FILE_DOES_NOT_EXIST);
+   iface_->openDatabases( string("ldbtestdir"), ghash_, gentx_, magic_,
+                          ARMORY_DB_FULL, DB_PRUNE_NONE);
+   EXPECT_NE(BtcUtils::GetFileSize(fname), FILE_DOES_NOT_EXIST);
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 3);
+   EXPECT_TRUE(iface_->getTxRef(hash0).isInitialized());
+   EXPECT_FALSE(iface_->getTxRef(missing).isInitialized());
+
+   // No file (as after a crash) means it gets rebuilt from BLKDATA.  This
+   // time both tx sharing the prefix get keyed by their DB key.
+   iface_->closeDatabases();
+   remove(fname.c_str());
+   iface_->openDatabases( string("ldbtestdir"), ghash_, gentx_, magic_,
+                          ARMORY_DB_FULL, DB_PRUNE_NONE);
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 4);
+   EXPECT_TRUE(iface_->getTxHashFilter().mayHaveTxAtKey(hash0, 
+                             DBUtils.getBlkDataKeyNoPrefix(123000, 15, 7)));
+   EXPECT_TRUE(iface_->getTxHashFilter().mayHaveTxAtKey(hash1, 
+                             DBUtils.getBlkDataKeyNoPrefix(123001, 0, 2)));
+   EXPECT_EQ(iface_->getTxRef(hash1).getDBKey(), READHEX("01e07900""0002"));
+   EXPECT_FALSE(iface_->getTxRef(missing).isInitialized());
+
+   // It's also saved every 10 blocks now, with the height below the tx that
+   // set it off
+   iface_->closeDatabases();
+   iface_->setTxHashFilterSaveInterval(10);
+   iface_->openDatabases( string("ldbtestdir"), ghash_, gentx_, magic_,
+                          ARMORY_DB_FULL, DB_PRUNE_NONE);
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 4);
+
+   BinaryData hash3 = hash0;
+   hash3[0] ^= 0x0f;
+   stx.thisHash_ = hash3;
+   stx.setKeyData(123010, 0, 1);
+   iface_->putStoredTx(stx, false);
+
+   BinaryData hash4 = hash0;
+   hash4[0] ^= 0xf0;
+   stx.thisHash_ = hash4;
+   stx.setKeyData(123020, 0, 1);
+   iface_->putStoredTx(stx, false);
+
+   // Shares hash3's prefix, so it's keyed and hash3 isn't
+   BinaryData hash5 = hash3;
+   hash5[31] ^= 0xff;
+   stx.thisHash_ = hash5;
+   stx.setKeyData(123025, 0, 1);
+   iface_->putStoredTx(stx, false);
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 8);
+
+   // Crash with the file from 123019:  only 123020 and up are read back, 
+   // so hash3 is still not keyed (a rebuild would key it)
+   string fnameSaved("ldbtestdir/txhashfilter_saved.bin");
+   BtcUtils::copyFile(fname, fnameSaved);
+   iface_->closeDatabases();
+   BtcUtils::copyFile(fnameSaved, fname);
+   remove(fnameSaved.c_str());
+   iface_->openDatabases( string("ldbtestdir"), ghash_, gentx_, magic_,
+                          ARMORY_DB_FULL, DB_PRUNE_NONE);
+   EXPECT_EQ(iface_->getTxHashFilter().getNumItems(), 8);
+   EXPECT_FALSE(iface_->getTxHashFilter().mayHaveTxAtKey(hash3, 
+                             DBUtils.getBlkDataKeyNoPrefix(123010, 0, 1)));
+   EXPECT_TRUE(iface_->getTxHashFilter().mayHaveTxAtKey(hash5, 
+                             DBUtils.getBlkDataKeyNoPrefix(123025, 0, 1)));
+   EXPECT_EQ(iface_->getTxRef(hash5).getDBKey(), READHEX("01e09100""0001"));
+   EXPECT_TRUE(iface_->getTxRef(hash4).isInitialized());
+
+   // A tx below the height of the file means the file is no good
+   EXPECT_NE(BtcUtils::GetFileSize(fname), FILE_DOES_NOT_EXIST);
+   BinaryData hash6 = hash0;
+   hash6[1] ^= 0xff;
+   stx.thisHash_ = hash6;
+   stx.setKeyData(123001, 0, 3);
+   iface_->putStoredTx(stx, false);
+   EXPECT_EQ(BtcUtils::GetFileSize(fname), FILE_DOES_NOT_EXIST);
+   iface_->closeDatabases();
+   EXPECT_NE(BtcUtils::GetFileSize(fname), FILE_DOES_NOT_EXIST);
+   iface_->setTxHashFilterSaveInterval(TXHASH_FILTER_SAVE_INTERVAL);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(LevelDBTest, PutFullBlockNoTx)
 {
@@ -5201,7 +5982,7 @@ TEST_F(LevelDBTest, PutFullBlock)
    StoredTx & stx0 = sbh.stxMap_[0];
    StoredTx & stx1 = sbh.stxMap_[1];
    StoredTx & stx2 = sbh.stxMap_[2];
-   BinaryData hflags = READHEX("01340000");
+   BinaryData hflags = READHEX("11340000");
    BinaryData ntx    = READHEX("03000000");
    BinaryData nbyte  = READHEX("46040000");
 
@@ -5209,18 +5990,18 @@ TEST_F(LevelDBTest, PutFullBlock)
    addOutPairB(sbhKey, hflags + rawHeader + ntx + nbyte);
 
    // Add Tx0 to BLKDATA
-   addOutPairB(stx0Key,   READHEX("0440") + stx0.thisHash_ + stx0.getSerializedTxFragged());
-   addOutPairB(stxo00Key, READHEX("0480") + stxo00Raw); // is coinbase
+   addOutPairB(stx0Key,   READHEX("1440") + stx0.thisHash_ + stx0.getSerializedTxFragged());
+   addOutPairB(stxo00Key, READHEX("1480") + compactTxOut(stxo00Raw)); // is coinbase
 
    // Add Tx1 to BLKDATA
-   addOutPairB(stx1Key,   READHEX("0440") + stx1.thisHash_ + stx1.getSerializedTxFragged());
-   addOutPairB(stxo10Key, READHEX("0400") + stxo10Raw);
-   addOutPairB(stxo11Key, READHEX("0400") + stxo11Raw);
+   addOutPairB(stx1Key,   READHEX("1440") + stx1.thisHash_ + stx1.getSerializedTxFragged());
+   addOutPairB(stxo10Key, READHEX("1400") + compactTxOut(stxo10Raw));
+   addOutPairB(stxo11Key, READHEX("1400") + compactTxOut(stxo11Raw));
 
    // Add Tx2 to BLKDATA
-   addOutPairB(stx2Key,   READHEX("0440") + stx2.thisHash_ + stx2.getSerializedTxFragged());
-   addOutPairB(stxo20Key, READHEX("0400") + stxo20Raw);
-   addOutPairB(stxo21Key, READHEX("0400") + stxo21Raw);
+   addOutPairB(stx2Key,   READHEX("1440") + stx2.thisHash_ + stx2.getSerializedTxFragged());
+   addOutPairB(stxo20Key, READHEX("1400") + compactTxOut(stxo20Raw));
+   addOutPairB(stxo21Key, READHEX("1400") + compactTxOut(stxo21Raw));
 
    // DuplicateID values get set when we putStoredHeader since we don't know
    // what dupIDs have been taken until we try to put it in the database.
@@ -5312,7 +6093,7 @@ TEST_F(LevelDBTest, GetFullBlock)
       EXPECT_EQ(   sbhGet.duplicateID_, 0);
       EXPECT_EQ(   sbhGet.merkle_.getSize(), 0);
       EXPECT_FALSE(sbhGet.merkleIsPartial_);
-      EXPECT_EQ(   sbhGet.unserArmVer_, 0);
+      EXPECT_EQ(   sbhGet.unserArmVer_, 1);
       EXPECT_EQ(   sbhGet.unserBlkVer_, 1);
       EXPECT_EQ(   sbhGet.unserDbType_, ARMORY_DB_FULL);
       EXPECT_EQ(   sbhGet.unserPrType_, DB_PRUNE_NONE);
@@ -5340,6 +6121,58 @@ TEST_F(LevelDBTest, GetFullBlock)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(LevelDBTest, LDBIterIndependentSnapshot)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_FULL);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   ASSERT_TRUE(standardOpenDBs());
+
+   StoredHeader sbh;
+   BinaryRefReader brr(rawBlock_);
+   sbh.unserializeFullBlock(brr);
+   sbh.setKeyData(123000);
+   sbh.isMainBranch_ = true;
+   iface_->putStoredHeader(sbh);
+
+   BinaryData blkKey = DBUtils.getBlkDataKey(123000, 0);
+   LDBIter ldbIter(*iface_, BLKDATA);
+   EXPECT_TRUE(ldbIter.seekTo(blkKey));
+   EXPECT_TRUE(ldbIter.isValid(DB_PREFIX_TXDATA));
+   EXPECT_EQ(ldbIter.getKey(), blkKey);
+
+   // Move the shared iterator somewhere else entirely
+   iface_->seekTo(BLKDATA, DB_PREFIX_DBINFO, BinaryData(0));
+   StoredTx stx;
+   EXPECT_TRUE(iface_->getStoredTx(stx, 123000, (uint8_t)0, (uint16_t)2));
+   EXPECT_EQ(ldbIter.getKey(), blkKey);
+
+   // Reading the block through the LDBIter gives the same as the shared one
+   StoredHeader sbhIter, sbhGet;
+   EXPECT_TRUE(iface_->readStoredBlockAtIter(ldbIter, sbhIter));
+   EXPECT_TRUE(iface_->getStoredHeader(sbhGet, 123000, 0, true));
+   EXPECT_EQ(sbhIter.thisHash_,      sbhGet.thisHash_);
+   EXPECT_EQ(sbhIter.numBytes_,      sbhGet.numBytes_);
+   EXPECT_EQ(sbhIter.stxMap_.size(), 3);
+   EXPECT_EQ(sbhIter.stxMap_[1].thisHash_, sbhGet.stxMap_[1].thisHash_);
+   EXPECT_EQ(sbhIter.stxMap_[1].stxoMap_.size(), 2);
+   EXPECT_FALSE(iface_->advanceToNextBlock(ldbIter));
+
+   // Writes after the LDBIter was created are not visible until refresh()
+   BinaryData newKey = DBUtils.getBlkDataKey(123001, 0);
+   BinaryData newVal = READHEX("abcd");
+   iface_->putValue(BLKDATA, newKey, newVal);
+   EXPECT_EQ(iface_->getValue(BLKDATA, newKey), newVal);
+   EXPECT_EQ(ldbIter.getValueAtSnapshot(newKey).getSize(), 0);
+   EXPECT_FALSE(ldbIter.seekTo(newKey));
+
+   ldbIter.refresh();
+   EXPECT_EQ(ldbIter.getValueAtSnapshot(newKey), newVal);
+   EXPECT_TRUE(ldbIter.seekTo(newKey));
+   EXPECT_EQ(ldbIter.getValue(), newVal);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(LevelDBTest, PutGetStoredTxHints)
 {
@@ -6018,63 +6851,448 @@ TEST_F(BlockUtilsBare, Load4Blocks_Plus1)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-TEST_F(BlockUtilsBare, Load5Blocks_FullReorg)
+TEST_F(BlockUtilsBare, Load4Blocks_Plus1_HistoriesSurviveKill)
 {
-   BtcWallet wlt;
-   wlt.addScrAddress(scrAddrA_);
-   wlt.addScrAddress(scrAddrB_);
-   wlt.addScrAddress(scrAddrC_);
-   TheBDM.registerWallet(&wlt);
-   TheBDM.registerNewScrAddr(scrAddrD_);
+   StoredScriptHistory ssh;
 
-   BtcWallet wlt2;
-   wlt2.addScrAddress(scrAddrD_);
-   
-   TheBDM.doInitialSyncOnLoad(); 
-   TheBDM.scanBlockchainForTx(wlt);
-   TheBDM.scanBlockchainForTx(wlt2);
+   // The wallet has to be gone before the BDM it's registered with
+   {
+      BtcWallet wlt;
+      wlt.addScrAddress(scrAddrA_);
+      wlt.addScrAddress(scrAddrB_);
+      wlt.addScrAddress(scrAddrC_);
+      TheBDM.registerWallet(&wlt);
+
+      BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1596);
+      TheBDM.doInitialSyncOnLoad(); 
+      TheBDM.scanBlockchainForTx(wlt);
+
+      // The histories are checkpointed with the scan, not at shutdown
+      iface_->getStoredScriptHistory(ssh, scrAddrA_);
+      EXPECT_TRUE(ssh.isInitialized());
+      EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 4);
+      EXPECT_EQ(ssh.getScriptBalance(), 50*COIN);
+   }
 
-   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
+   // Kill it without shutdownSaveScrAddrHistories, then add a block and load
+   BlockDataManager_LevelDB::DestroyInstance();
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
 
-   TheBDM.scanBlockchainForTx(wlt);
+   TheBDM.SelectNetwork("Main");
+   TheBDM.SetBlkFileLocation(blkdir_);
+   TheBDM.SetHomeDirLocation(homedir_);
+   TheBDM.SetLevelDBLocation(ldbdir_);
+   iface_ = LevelDBWrapper::GetInterfacePtr();
+
+   BtcWallet wlt2;
+   wlt2.addScrAddress(scrAddrA_);
+   wlt2.addScrAddress(scrAddrB_);
+   wlt2.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt2);
+   TheBDM.doInitialSyncOnLoad(); 
    TheBDM.scanBlockchainForTx(wlt2);
 
    ScrAddrObj * scrobj;
-   scrobj = &wlt.getScrAddrObjByKey(scrAddrA_);
-   EXPECT_EQ(scrobj->getFullBalance(),150*COIN);
-   scrobj = &wlt.getScrAddrObjByKey(scrAddrB_);
-   EXPECT_EQ(scrobj->getFullBalance(), 10*COIN);
-   scrobj = &wlt.getScrAddrObjByKey(scrAddrC_);
+   scrobj = &wlt2.getScrAddrObjByKey(scrAddrA_);
+   EXPECT_EQ(scrobj->getFullBalance(),100*COIN);
+   scrobj = &wlt2.getScrAddrObjByKey(scrAddrB_);
    EXPECT_EQ(scrobj->getFullBalance(),  0*COIN);
-   //scrobj = &wlt.getScrAddrObjByKey(scrAddrD_);
-   //EXPECT_EQ(scrobj->getFullBalance(),140*COIN);
+   scrobj = &wlt2.getScrAddrObjByKey(scrAddrC_);
+   EXPECT_EQ(scrobj->getFullBalance(), 50*COIN);
 
-   EXPECT_EQ(wlt.getFullBalance(), 160*COIN);
+   // Block 4 was added to the stored histories, without redoing 0-3
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 5);
+   EXPECT_EQ(ssh.getScriptBalance(), 100*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 5);
+   EXPECT_EQ(ssh.getScriptBalance(),   0*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrC_);
+   EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 5);
+   EXPECT_EQ(ssh.getScriptBalance(),  50*COIN);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Unsigned one-in, one-out tx paying to a hash160.  Nothing checks the
+// scripts of zero-conf tx, so this is all the ZC tests need
+static BinaryData makeTestZCTx(BinaryData const & prevHash, 
+                               uint32_t prevIndex,
+                               BinaryData const & payTo160,
+                               uint64_t value)
+{
+   BinaryWriter bw;
+   bw.put_uint32_t(1);
+   bw.put_var_int(1);
+   bw.put_BinaryData(prevHash);
+   bw.put_uint32_t(prevIndex);
+   bw.put_var_int(0);
+   bw.put_uint32_t(UINT32_MAX);
+   bw.put_var_int(1);
+   bw.put_uint64_t(value);
+   bw.put_var_int(25);
+   bw.put_BinaryData(READHEX("76a914"));
+   bw.put_BinaryData(payTo160);
+   bw.put_BinaryData(READHEX("88ac"));
+   bw.put_uint32_t(0);
+   return bw.getData();
+}
 
 ////////////////////////////////////////////////////////////////////////////////
-TEST_F(BlockUtilsBare, Load5Blocks_RescanOps)
+TEST_F(BlockUtilsBare, Load4Blocks_Plus1_ZeroConfPurgeAndLog)
 {
-   ScrAddrObj * scrobj;
    BtcWallet wlt;
    wlt.addScrAddress(scrAddrA_);
    wlt.addScrAddress(scrAddrB_);
    wlt.addScrAddress(scrAddrC_);
    TheBDM.registerWallet(&wlt);
 
-   // Regular sync
-   TheBDM.doInitialSyncOnLoad();
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1596);
+   TheBDM.doInitialSyncOnLoad(); 
    TheBDM.scanBlockchainForTx(wlt);
 
-   scrobj = &wlt.getScrAddrObjByKey(scrAddrA_);
-   EXPECT_EQ(scrobj->getFullBalance(),100*COIN);
-   scrobj = &wlt.getScrAddrObjByKey(scrAddrB_);
+   string zcFile = homedir_ + string("/mempool.bin");
+   TheBDM.enableZeroConf(zcFile);
+
+   // Block 4 has the first of these, the second double-spends it, and the 
+   // third spends the second.  The last one has nothing to do with block 4.
+   BinaryData cbHash0 = READHEX(
+      "3ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a");
+   BinaryData cbHash2 = READHEX(
+      "9b2468285fc191b7a033b2f32b3de8f0c39d1eac622f5132565f1ea8ca74ec8d");
+   BinaryData zcMined = READHEX(
+     "01000000019b2468285fc191b7a033b2f32b3de8f0c39d1eac622f5132565f1e"
+     "a8ca74ec8d000000004a4930460221007a284fa21364d749389ff62328e837dd"
+     "2676cbe4e202c0766e3950cbd0a911e40221005ac1541e381b6d358df08cce6a"
+     "2869b76d5ffe05b6aaca5c03ebcba8559c4ede01ffffffff0100f2052a010000"
+     "001976a914c522664fb0e55cdc5c0cea73b4aad97ec834323288ac00000000");
+   BinaryData zcConflict = makeTestZCTx(cbHash2, 0, addrB_, 50*COIN);
+   BinaryData zcChild    = makeTestZCTx(BtcUtils::getHash256(zcConflict), 0, 
+                                        addrA_, 50*COIN);
+   BinaryData zcOther    = makeTestZCTx(cbHash0, 0, addrB_, 50*COIN);
+
+   EXPECT_TRUE(TheBDM.addNewZeroConfTx(zcMined,    1300000000, true));
+   EXPECT_TRUE(TheBDM.addNewZeroConfTx(zcConflict, 1300000001, true));
+   EXPECT_TRUE(TheBDM.addNewZeroConfTx(zcChild,    1300000002, true));
+   EXPECT_FALSE(TheBDM.addNewZeroConfTx(zcChild,   1300000002, true));
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 3);
+
+   // The wallet scans the pool a piece at a time.  It ignores the double-
+   // spend, and doesn't know the child spends anything of ours.
+   TheBDM.rescanWalletZeroConf(wlt);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 2);
+   uint32_t scannedUpTo = wlt.getZeroConfScannedUpToSeq();
+
+   EXPECT_TRUE(TheBDM.addNewZeroConfTx(zcOther, 1300000003, true));
+   TheBDM.rescanWalletZeroConf(wlt);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 3);
+   EXPECT_EQ(wlt.getZeroConfScannedUpToSeq(), scannedUpTo+1);
+
+   // Block 4 takes out the first three, and they're tombstoned in the file
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate(); 
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(TheBDM.getTxHashAvail(BtcUtils::getHash256(zcOther)), 
+             TX_ZEROCONF);
+   EXPECT_EQ(TheBDM.getTxHashAvail(BtcUtils::getHash256(zcConflict)), 
+             TX_DNE);
+   EXPECT_EQ(TheBDM.getTxHashAvail(BtcUtils::getHash256(zcChild)), TX_DNE);
+
+   uint64_t fileSize = BtcUtils::GetFileSize(zcFile);
+   uint64_t liveSize = 8 + zcOther.getSize();
+   uint64_t allSize  = 4*8 + zcMined.getSize() + zcConflict.getSize() + 
+                             zcChild.getSize() + zcOther.getSize();
+   EXPECT_EQ(fileSize, allSize + 3*40);
+
+   BinaryData fileData((size_t)fileSize);
+   ifstream is(zcFile.c_str(), ios::in | ios::binary);
+   is.read((char*)fileData.getPtr(), fileSize);
+   is.close();
+   BinaryRefReader brr(fileData);
+   brr.advance(allSize);
+   set<BinaryData> tombstones;
+   while(brr.getSizeRemaining() > 0)
+   {
+      EXPECT_EQ(brr.get_uint64_t(), UINT64_MAX);
+      tombstones.insert(brr.get_BinaryData(32));
+   }
+   EXPECT_EQ(tombstones.size(), 3);
+   EXPECT_EQ(tombstones.count(BtcUtils::getHash256(zcMined)), 1);
+   EXPECT_EQ(tombstones.count(BtcUtils::getHash256(zcConflict)), 1);
+   EXPECT_EQ(tombstones.count(BtcUtils::getHash256(zcChild)), 1);
+
+   // The wallet lost ZC tx, so it rebuilds from what's left.  Block 4 pays
+   // A 50, but the other 50 it had is spent by the ZC tx still in the pool.
+   TheBDM.scanBlockchainForTx(wlt);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 1);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrB_).getZeroConfLedger().size(), 1);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrA_).getFullBalance(), 50*COIN);
+
+   // Reading the log back replays the tombstones
+   TheBDM.readZeroConfFile(zcFile);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcFile), fileSize);
+
+   // Six dead records to one live one
+   TheBDM.setZeroConfCompactMinDead(6);
+   TheBDM.readZeroConfFile(zcFile);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcFile), liveSize);
+
+   TheBDM.readZeroConfFile(zcFile);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcFile), liveSize);
+   TheBDM.rescanWalletZeroConf(wlt);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 1);
+
+   // A record cut short by a crash is compacted away when the file is read,
+   // so the records added after it can be read back
+   BinaryWriter bwTorn;
+   bwTorn.put_uint64_t(1300000004);
+   bwTorn.put_BinaryData(zcConflict.getSliceCopy(0, 20));
+   ofstream osTorn(zcFile.c_str(), ios::app | ios::binary);
+   osTorn.write((char*)bwTorn.getData().getPtr(), bwTorn.getSize());
+   osTorn.close();
+
+   TheBDM.readZeroConfFile(zcFile);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcFile), liveSize);
+
+   BinaryData zcLater = makeTestZCTx(cbHash2, 1, addrC_, 1*COIN);
+   EXPECT_TRUE(TheBDM.addNewZeroConfTx(zcLater, 1300000005, true));
+   TheBDM.readZeroConfFile(zcFile);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 2);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcFile), liveSize + 8 + zcLater.getSize());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load4Blocks_Plus1_ZeroConfNonFinal)
+{
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1596);
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.scanBlockchainForTx(wlt);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 3);
+
+   string zcFile = homedir_ + string("/mempool.bin");
+   TheBDM.enableZeroConf(zcFile);
+
+   // Locked until the chain is past height 3:  sequence 0, lockTime 3
+   BinaryData cbHash0 = READHEX(
+      "3ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a");
+   BinaryData zcLocked = makeTestZCTx(cbHash0, 0, addrB_, 50*COIN);
+   memset(zcLocked.getPtr()+42, 0, 4);
+   zcLocked[zcLocked.getSize()-4] = 3;
+
+   EXPECT_TRUE(TheBDM.addNewZeroConfTx(zcLocked, 1300000000, true));
+   TheBDM.rescanWalletZeroConf(wlt);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 0);
+   EXPECT_EQ(wlt.getZeroConfNonFinalSeqs().size(), 1);
+   uint32_t scannedUpTo = wlt.getZeroConfScannedUpToSeq();
+
+   // Block 4 makes it final.  The scan is past its seq, but it's picked
+   // up anyway, once.
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate(); 
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+   TheBDM.rescanWalletZeroConf(wlt);
+   EXPECT_EQ(wlt.getZeroConfScannedUpToSeq(), scannedUpTo);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 1);
+   EXPECT_EQ(wlt.getZeroConfNonFinalSeqs().size(), 0);
+   TheBDM.rescanWalletZeroConf(wlt);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A wallet rescan after each new ZC tx, the way the GUI does it, with the
+// pool building up to the size it gets to in a fee spike
+TEST_F(BlockUtilsBare, DISABLED_ZeroConfPoolGrowth_usuallydisabled)
+{
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1596);
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.scanBlockchainForTx(wlt);
+   TheBDM.enableZeroConf(homedir_ + string("/mempool.bin"));
+
+   // One in a hundred pays us.  The first of those double-spends block 4,
+   // so the wallet has to rebuild its ZC list when that comes in.
+   BinaryData cbHash2 = READHEX(
+      "9b2468285fc191b7a033b2f32b3de8f0c39d1eac622f5132565f1ea8ca74ec8d");
+   BinaryData fakeHash = READHEX(
+      "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff");
+
+   uint32_t nTx = 20000;
+   TIMER_START("ZeroConfAddAndRescan");
+   for(uint32_t i=0; i<nTx; i++)
+   {
+      BinaryData rawTx;
+      if(i == 0)
+         rawTx = makeTestZCTx(cbHash2, 0, addrB_, i);
+      else if(i%100 == 0)
+         rawTx = makeTestZCTx(fakeHash, i, addrB_, i);
+      else
+         rawTx = makeTestZCTx(fakeHash, i, addrD_, i);
+
+      TheBDM.addNewZeroConfTx(rawTx, 1300000000+i, true);
+      TheBDM.rescanWalletZeroConf(wlt);
+   }
+   TIMER_STOP("ZeroConfAddAndRescan");
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), nTx);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), nTx/100);
+
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TIMER_START("ZeroConfNewBlock");
+   TheBDM.readBlkFileUpdate(); 
+   TheBDM.rescanWalletZeroConf(wlt);
+   TIMER_STOP("ZeroConfNewBlock");
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), nTx-1);
+   EXPECT_EQ(wlt.getZeroConfLedger().size(), nTx/100-1);
+
+   cout << "Add+rescan: " 
+        << 1000000.0*TIMER_READ_SEC("ZeroConfAddAndRescan")/nTx 
+        << " us per ZC tx (" << nTx << " tx)" << endl;
+   cout << "New block:  " << 1000.0*TIMER_READ_SEC("ZeroConfNewBlock") 
+        << " ms" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load5Blocks_FullReorg)
+{
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+   TheBDM.registerNewScrAddr(scrAddrD_);
+
+   BtcWallet wlt2;
+   wlt2.addScrAddress(scrAddrD_);
+   
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.scanBlockchainForTx(wlt);
+   TheBDM.scanBlockchainForTx(wlt2);
+
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   TheBDM.scanBlockchainForTx(wlt);
+   TheBDM.scanBlockchainForTx(wlt2);
+
+   ScrAddrObj * scrobj;
+   scrobj = &wlt.getScrAddrObjByKey(scrAddrA_);
+   EXPECT_EQ(scrobj->getFullBalance(),150*COIN);
+   scrobj = &wlt.getScrAddrObjByKey(scrAddrB_);
+   EXPECT_EQ(scrobj->getFullBalance(), 10*COIN);
+   scrobj = &wlt.getScrAddrObjByKey(scrAddrC_);
+   EXPECT_EQ(scrobj->getFullBalance(),  0*COIN);
+   //scrobj = &wlt.getScrAddrObjByKey(scrAddrD_);
+   //EXPECT_EQ(scrobj->getFullBalance(),140*COIN);
+
+   EXPECT_EQ(wlt.getFullBalance(), 160*COIN);
+
+   // The stored histories were rewound to the branch point, and then caught
+   // up with the new branch
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 6);
+   EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 6);
+   EXPECT_EQ(ssh.getScriptBalance(),   10*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrC_);
+   EXPECT_EQ(ssh.alreadyScannedUpToBlk_, 6);
+   EXPECT_EQ(ssh.getScriptBalance(),    0*COIN);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// In FULL mode, only the scanned addresses have histories in the DB
+TEST_F(BlockUtilsBare, Load5Blocks_ScriptHistoryPages)
+{
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.scanBlockchainForTx(wlt);
+
+   vector<BinaryData> scrAddrs;
+   scrAddrs.push_back(scrAddrA_);
+   scrAddrs.push_back(scrAddrB_);
+   scrAddrs.push_back(scrAddrC_);
+
+   for(uint32_t a=0; a<scrAddrs.size(); a++)
+   {
+      vector<TxIOPair> fullHist = TheBDM.getHistoryForScrAddr(scrAddrs[a]);
+      ASSERT_GT(fullHist.size(), 0);
+
+      // All of it, one at a time
+      vector<TxIOPair> paged, page;
+      BinaryData cursor, nextCursor;
+      do
+      {
+         ASSERT_TRUE(TheBDM.getHistoryPageForScrAddr(scrAddrs[a], 0, 
+                          UINT32_MAX, 1, cursor, page, nextCursor));
+         EXPECT_LE(page.size(), 1);
+         paged.insert(paged.end(), page.begin(), page.end());
+         cursor = nextCursor;
+      } while(cursor.getSize() > 0 && paged.size() <= fullHist.size());
+
+      ASSERT_EQ(paged.size(), fullHist.size());
+      for(uint32_t i=0; i<paged.size(); i++)
+      {
+         EXPECT_EQ(paged[i].getDBKeyOfOutput(), fullHist[i].getDBKeyOfOutput());
+         EXPECT_EQ(paged[i].getDBKeyOfInput(),  fullHist[i].getDBKeyOfInput());
+         EXPECT_EQ(paged[i].getValue(),         fullHist[i].getValue());
+      }
+   }
+
+   // Never scanned, so there's nothing there, but that's not an error
+   vector<TxIOPair> page;
+   BinaryData nextCursor;
+   EXPECT_TRUE(TheBDM.getHistoryPageForScrAddr(scrAddrD_, 0, UINT32_MAX, 10, 
+                                       BinaryData(0), page, nextCursor));
+   EXPECT_EQ(page.size(), 0);
+   EXPECT_EQ(nextCursor.getSize(), 0);
+
+   // A bad cursor is
+   EXPECT_FALSE(TheBDM.getHistoryPageForScrAddr(scrAddrA_, 0, UINT32_MAX, 10, 
+                                       READHEX("0102"), page, nextCursor));
+   EXPECT_EQ(page.size(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load5Blocks_RescanOps)
+{
+   ScrAddrObj * scrobj;
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   // Regular sync
+   TheBDM.doInitialSyncOnLoad();
+   TheBDM.scanBlockchainForTx(wlt);
+
+   scrobj = &wlt.getScrAddrObjByKey(scrAddrA_);
+   EXPECT_EQ(scrobj->getFullBalance(),100*COIN);
+   scrobj = &wlt.getScrAddrObjByKey(scrAddrB_);
    EXPECT_EQ(scrobj->getFullBalance(),  0*COIN);
    scrobj = &wlt.getScrAddrObjByKey(scrAddrC_);
    EXPECT_EQ(scrobj->getFullBalance(), 50*COIN);
@@ -6485,6 +7703,36 @@ protected:
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, MappedBlkFile)
+{
+   MappedFile blkMap;
+   EXPECT_FALSE(blkMap.open(blkdir_ + string("/doesnotexist.dat")));
+   EXPECT_FALSE(blkMap.isOpen());
+
+   ASSERT_TRUE(blkMap.open(blk0dat_));
+   uint64_t filesize = BtcUtils::GetFileSize(blk0dat_);
+   ASSERT_EQ(blkMap.getSize(), filesize);
+
+   BinaryData fileData((uint32_t)filesize);
+   ifstream is(blk0dat_.c_str(), ios::in | ios::binary);
+   is.read((char*)fileData.getPtr(), filesize);
+   is.close();
+
+   blkMap.adviseSequential();
+   EXPECT_EQ(BinaryDataRef(blkMap.getPtr(), (uint32_t)filesize), fileData);
+
+   // Releasing pages must not change what we read back
+   blkMap.releaseBefore(filesize);
+   BinaryRefReader brr = blkMap.getReaderAt(0, 4);
+   EXPECT_EQ(brr.get_BinaryDataRef(4), fileData.getSliceRef(0,4));
+
+   blkMap.close();
+   EXPECT_FALSE(blkMap.isOpen());
+   EXPECT_EQ(blkMap.getSize(), 0);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockUtilsSuper, HeadersOnly)
 {
@@ -6540,6 +7788,49 @@ TEST_F(BlockUtilsSuper, HeadersOnly_Reorg)
    SETLOGLEVEL(LogLvlDebug2);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, HeadersOnly_ParallelFiles)
+{
+   // blk_5A.dat is blk_0_to_4.dat followed by blocks 3A, 4A and 5A.  Put 3A
+   // in blk00001.dat and 4A+5A in blk00002.dat
+   BinaryData allBlocks((uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_5A.dat"));
+   ifstream is("../reorgTest/blk_5A.dat", ios::in | ios::binary);
+   is.read((char*)allBlocks.getPtr(), allBlocks.getSize());
+   is.close();
+
+   uint32_t end4  = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_0_to_4.dat");
+   uint32_t end3A = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_3A.dat");
+   uint32_t end4A = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_4A.dat");
+
+   ofstream os(BtcUtils::getBlkFilename(blkdir_, 1).c_str(), ios::out | ios::binary);
+   os.write((char*)allBlocks.getPtr() + end4, end3A - end4);
+   os.close();
+   os.open(BtcUtils::getBlkFilename(blkdir_, 2).c_str(), ios::out | ios::binary);
+   os.write((char*)allBlocks.getPtr() + end3A, allBlocks.getSize() - end3A);
+   os.close();
+
+   TheBDM.setNumIngestThreads(3);
+   TheBDM.processNewHeadersInBlkFiles(0);
+   
+   EXPECT_EQ(TheBDM.getNumBlocks(), 8);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash5A);
+   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash5A);
+   EXPECT_FALSE(TheBDM.getHeaderByHash(blkHash4 )->isMainBranch());
+   EXPECT_TRUE( TheBDM.getHeaderByHash(blkHash4A)->isMainBranch());
+
+   // Each header knows where it came from
+   BlockHeader* bh = TheBDM.getHeaderByHash(blkHash3);
+   EXPECT_EQ(bh->getBlockFileNum(), 0);
+   bh = TheBDM.getHeaderByHash(blkHash3A);
+   EXPECT_EQ(bh->getBlockFileNum(),    1);
+   EXPECT_EQ(bh->getBlockFileOffset(), 0);
+   bh = TheBDM.getHeaderByHash(blkHash5A);
+   EXPECT_EQ(bh->getBlockFileNum(),    2);
+   EXPECT_EQ(bh->getBlockFileOffset(), end4A - end3A);
+   EXPECT_EQ(bh->getBlockSize()+8,     allBlocks.getSize() - end4A);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockUtilsSuper, Load5Blocks)
 {
@@ -6570,6 +7861,634 @@ TEST_F(BlockUtilsSuper, Load5Blocks)
    EXPECT_EQ(ssh.totalTxioCount_,       3);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_PipelinedIngest)
+{
+   // Spread the blocks over a few files, so the reader has to cross files
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", BtcUtils::getBlkFilename(blkdir_, 1));
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", BtcUtils::getBlkFilename(blkdir_, 2));
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", BtcUtils::getBlkFilename(blkdir_, 3));
+
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   TheBDM.setNumIngestThreads(1);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST serialHeaders = iface_->getAllDatabaseEntries(HEADERS);
+   KVLIST serialBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   TheBDM.setNumIngestThreads(4);
+   EXPECT_EQ(TheBDM.getNumIngestThreads(), 4);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST pipedHeaders = iface_->getAllDatabaseEntries(HEADERS);
+   KVLIST pipedBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash5A);
+
+   // Should produce exactly the same DB as the single-threaded build
+   ASSERT_EQ(pipedHeaders.size(), serialHeaders.size());
+   ASSERT_EQ(pipedBlkData.size(), serialBlkData.size());
+   for(uint32_t i=0; i<serialHeaders.size(); i++)
+   {
+      EXPECT_EQ(pipedHeaders[i].first,  serialHeaders[i].first);
+      EXPECT_EQ(pipedHeaders[i].second, serialHeaders[i].second);
+   }
+   for(uint32_t i=0; i<serialBlkData.size(); i++)
+   {
+      EXPECT_EQ(pipedBlkData[i].first,  serialBlkData[i].first);
+      EXPECT_EQ(pipedBlkData[i].second, serialBlkData[i].second);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_BulkLoadRebuild)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   TheBDM.setBulkLoadOnRebuild(false);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST plainHeaders = iface_->getAllDatabaseEntries(HEADERS);
+   KVLIST plainBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   TheBDM.setBulkLoadOnRebuild(true);
+   EXPECT_TRUE(TheBDM.getBulkLoadOnRebuild());
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST bulkHeaders = iface_->getAllDatabaseEntries(HEADERS);
+   KVLIST bulkBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   // Back to the regular settings once it's done
+   EXPECT_FALSE(iface_->isBulkLoading());
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash4);
+
+   // Can't start one with a batch open
+   iface_->startBatch(BLKDATA);
+   EXPECT_FALSE(iface_->beginBulkLoad());
+   iface_->commitBatch(BLKDATA);
+
+   ASSERT_EQ(bulkHeaders.size(), plainHeaders.size());
+   ASSERT_EQ(bulkBlkData.size(), plainBlkData.size());
+   for(uint32_t i=0; i<plainHeaders.size(); i++)
+   {
+      EXPECT_EQ(bulkHeaders[i].first,  plainHeaders[i].first);
+      EXPECT_EQ(bulkHeaders[i].second, plainHeaders[i].second);
+   }
+   for(uint32_t i=0; i<plainBlkData.size(); i++)
+   {
+      EXPECT_EQ(bulkBlkData[i].first,  plainBlkData[i].first);
+      EXPECT_EQ(bulkBlkData[i].second, plainBlkData[i].second);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_DoubleBufferedCommit)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   // Write out the updates after every block, so that each block spends
+   // TxOuts from a batch that may still be in flight
+   TheBDM.setUpdateBytesThresh(1);
+
+   TheBDM.setDoubleBufferedCommit(false);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST serialBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   TheBDM.setDoubleBufferedCommit(true);
+   EXPECT_TRUE(TheBDM.getDoubleBufferedCommit());
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST bufferedBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   // Should produce exactly the same DB as writing each batch in place
+   ASSERT_EQ(bufferedBlkData.size(), serialBlkData.size());
+   for(uint32_t i=0; i<serialBlkData.size(); i++)
+   {
+      EXPECT_EQ(bufferedBlkData[i].first,  serialBlkData[i].first);
+      EXPECT_EQ(bufferedBlkData[i].second, serialBlkData[i].second);
+   }
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),    0*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 140*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       3);
+
+   iface_->getStoredScriptHistory(ssh, scrAddrD_);
+   EXPECT_EQ(ssh.getScriptBalance(),  100*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 100*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_UtxoCache)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   // Flush after every block, so spends from the cache get mixed in with
+   // whole STXs read back from the DB and from the in-flight batch
+   TheBDM.setUpdateBytesThresh(1);
+
+   TheBDM.setUtxoCacheSize(0);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST noCacheBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+   EXPECT_EQ(TheBDM.getUtxoCacheHits(), 0);
+   uint64_t noCacheMisses = TheBDM.getUtxoCacheMisses();
+   EXPECT_GT(noCacheMisses, 0);
+
+   TheBDM.setUtxoCacheSize(1000);
+   EXPECT_EQ(TheBDM.getUtxoCacheSize(), 1000);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   KVLIST cacheBlkData = iface_->getAllDatabaseEntries(BLKDATA);
+
+   // Every TxIn in these blocks spends an output from an earlier one
+   EXPECT_EQ(TheBDM.getUtxoCacheHits(), noCacheMisses);
+   EXPECT_EQ(TheBDM.getUtxoCacheMisses(), noCacheMisses);
+
+   ASSERT_EQ(cacheBlkData.size(), noCacheBlkData.size());
+   for(uint32_t i=0; i<noCacheBlkData.size(); i++)
+   {
+      EXPECT_EQ(cacheBlkData[i].first,  noCacheBlkData[i].first);
+      EXPECT_EQ(cacheBlkData[i].second, noCacheBlkData[i].second);
+   }
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  100*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 100*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       2);
+
+   iface_->getStoredScriptHistory(ssh, scrAddrC_);
+   EXPECT_EQ(ssh.getScriptBalance(),   50*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(),  60*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_StoredTxBatch)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   // Every tx in the chain by hash and by DB key, newest first so nothing
+   // is in key order, and a couple that aren't there
+   vector<BinaryData> keys;
+   vector<StoredTx>   expect;
+   for(uint32_t h=5; h>0; h--)
+   {
+      StoredHeader sbh;
+      ASSERT_TRUE(iface_->getStoredHeader(sbh, h-1, 0, true));
+      map<uint16_t, StoredTx>::iterator iter;
+      for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      {
+         keys.push_back(iter->second.thisHash_);
+         keys.push_back(iter->second.getDBKey(false));
+         expect.push_back(iter->second);
+         expect.push_back(iter->second);
+      }
+   }
+   keys.push_back(READHEX("0000ff000001"));
+   keys.push_back(BtcUtils::getHash256(READHEX("00")));
+   uint32_t nTx = expect.size();
+   ASSERT_GT(nTx, 10);
+
+   vector<StoredTx> stxList;
+   for(uint32_t nThreads=1; nThreads<=3; nThreads++)
+   {
+      EXPECT_EQ(iface_->getStoredTxBatch(keys, stxList, true, nThreads), nTx);
+      ASSERT_EQ(stxList.size(), keys.size());
+      for(uint32_t i=0; i<nTx; i++)
+      {
+         EXPECT_EQ(stxList[i].thisHash_,    expect[i].thisHash_);
+         EXPECT_EQ(stxList[i].blockHeight_, expect[i].blockHeight_);
+         EXPECT_EQ(stxList[i].txIndex_,     expect[i].txIndex_);
+         EXPECT_EQ(stxList[i].stxoMap_.size(), expect[i].stxoMap_.size());
+      }
+      EXPECT_FALSE(stxList[nTx].isInitialized());
+      EXPECT_FALSE(stxList[nTx+1].isInitialized());
+   }
+
+   // Without the TxOuts, and as full Tx
+   EXPECT_EQ(iface_->getStoredTxBatch(keys, stxList, false), nTx);
+   EXPECT_EQ(stxList[0].thisHash_, expect[0].thisHash_);
+   EXPECT_EQ(stxList[0].stxoMap_.size(), 0);
+
+   vector<Tx> txList;
+   EXPECT_EQ(iface_->getFullTxCopyBatch(keys, txList, 2), nTx);
+   for(uint32_t i=0; i<nTx; i++)
+      EXPECT_EQ(txList[i].getThisHash(), expect[i].thisHash_);
+   EXPECT_FALSE(txList[nTx].isInitialized());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_ScriptHistoryPages)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   vector<BinaryData> scrAddrs;
+   scrAddrs.push_back(scrAddrA_);
+   scrAddrs.push_back(scrAddrB_);
+   scrAddrs.push_back(scrAddrC_);
+   scrAddrs.push_back(scrAddrD_);
+
+   for(uint32_t a=0; a<scrAddrs.size(); a++)
+   {
+      vector<TxIOPair> fullHist = TheBDM.getHistoryForScrAddr(scrAddrs[a]);
+      ASSERT_GT(fullHist.size(), 1);
+
+      // All of it, one or two at a time
+      for(uint32_t pageSize=1; pageSize<=2; pageSize++)
+      {
+         vector<TxIOPair> paged, page;
+         BinaryData cursor, nextCursor;
+         do
+         {
+            ASSERT_TRUE(iface_->getScriptHistoryPage(scrAddrs[a], 0, UINT32_MAX,
+                                   pageSize, cursor, page, nextCursor));
+            EXPECT_LE(page.size(), pageSize);
+            paged.insert(paged.end(), page.begin(), page.end());
+            cursor = nextCursor;
+         } while(cursor.getSize() > 0 && paged.size() <= fullHist.size());
+
+         ASSERT_EQ(paged.size(), fullHist.size());
+         for(uint32_t i=0; i<paged.size(); i++)
+         {
+            EXPECT_EQ(paged[i].getDBKeyOfOutput(), fullHist[i].getDBKeyOfOutput());
+            EXPECT_EQ(paged[i].getDBKeyOfInput(),  fullHist[i].getDBKeyOfInput());
+            EXPECT_EQ(paged[i].getValue(),         fullHist[i].getValue());
+         }
+      }
+
+      // Only the TxOuts from blocks 1 to 3
+      vector<TxIOPair> expect;
+      for(uint32_t i=0; i<fullHist.size(); i++)
+      {
+         uint32_t hgt = DBUtils.hgtxToHeight(
+                              fullHist[i].getDBKeyOfOutput().getSliceCopy(0,4));
+         if(hgt >= 1 && hgt <= 3)
+            expect.push_back(fullHist[i]);
+      }
+
+      BinaryData nextCursor;
+      vector<TxIOPair> page;
+      ASSERT_TRUE(TheBDM.getHistoryPageForScrAddr(scrAddrs[a], 1, 3, 100, 
+                                       BinaryData(0), page, nextCursor));
+      EXPECT_EQ(nextCursor.getSize(), 0);
+      ASSERT_EQ(page.size(), expect.size());
+      for(uint32_t i=0; i<page.size(); i++)
+         EXPECT_EQ(page[i].getDBKeyOfOutput(), expect[i].getDBKeyOfOutput());
+   }
+
+   // Nothing there, and a cursor that isn't one
+   vector<TxIOPair> page;
+   BinaryData nextCursor;
+   EXPECT_TRUE(iface_->getScriptHistoryPage(HASH160PREFIX + READHEX(
+         "0000000000000000000000000000000000000000"), 0, UINT32_MAX, 10, 
+         BinaryData(0), page, nextCursor));
+   EXPECT_EQ(page.size(), 0);
+   EXPECT_FALSE(iface_->getScriptHistoryPage(scrAddrA_, 0, UINT32_MAX, 10, 
+                                       READHEX("0102"), page, nextCursor));
+   EXPECT_FALSE(TheBDM.getHistoryPageForScrAddr(scrAddrA_, 0, UINT32_MAX, 10, 
+                                       READHEX("0102"), page, nextCursor));
+
+   // Zero-size pages would never end
+   EXPECT_FALSE(iface_->getScriptHistoryPage(scrAddrA_, 0, UINT32_MAX, 0, 
+                                       BinaryData(0), page, nextCursor));
+   EXPECT_EQ(page.size(), 0);
+   EXPECT_EQ(nextCursor.getSize(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Check every branch's child entries against the children themselves, and 
+// return the number of leaves under the node
+static uint32_t checkUTXOTrieNode(InterfaceToLDB* iface, 
+                                  StoredTrieNode const & node,
+                                  uint64_t & valueSum)
+{
+   if(node.isLeaf_)
+   {
+      valueSum += node.value_;
+      return 1;
+   }
+
+   if(node.path_.getSize() > 0)
+   {
+      EXPECT_GE(node.childMap_.size(), 2);
+   }
+
+   uint32_t numLeaves = 0;
+   map<uint8_t, StoredTrieChild>::const_iterator iter;
+   for(iter = node.childMap_.begin(); iter != node.childMap_.end(); iter++)
+   {
+      StoredTrieNode child;
+      EXPECT_TRUE(iface->getStoredTrieNode(child, 
+                                           node.path_ + iter->second.label_));
+      EXPECT_EQ(iter->second.hash_,     child.getNodeHash());
+      EXPECT_EQ(iter->second.valueSum_, child.getValueSum());
+      EXPECT_EQ(iter->second.numUtxo_,  child.getNumUtxo());
+      numLeaves += checkUTXOTrieNode(iface, child, valueSum);
+   }
+   return numLeaves;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_UTXOTrie)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+   ASSERT_TRUE(iface_->utxoTrieIsAvailable());
+
+   vector<BinaryData> scrAddrs;
+   scrAddrs.push_back(scrAddrA_);
+   scrAddrs.push_back(scrAddrB_);
+   scrAddrs.push_back(scrAddrC_);
+   scrAddrs.push_back(scrAddrD_);
+
+   // Same balances and UTXOs as the script histories
+   for(uint32_t a=0; a<scrAddrs.size(); a++)
+   {
+      StoredScriptHistory ssh;
+      iface_->getStoredScriptHistory(ssh, scrAddrs[a]);
+      BinaryData a160 = scrAddrs[a].getSliceCopy(1,20);
+      EXPECT_EQ(TheBDM.getDBBalanceForHash160(a160), ssh.getScriptBalance());
+
+      map<BinaryData, UnspentTxOut> utxoMap;
+      iface_->getFullUTXOMapForSSH(ssh, utxoMap);
+      vector<UnspentTxOut> utxos = TheBDM.getUTXOVectForHash160(a160);
+      ASSERT_EQ(utxos.size(), utxoMap.size());
+
+      map<BinaryData, UnspentTxOut>::iterator iter = utxoMap.begin();
+      for(uint32_t i=0; i<utxos.size(); i++, iter++)
+      {
+         EXPECT_EQ(utxos[i].getTxHash(),     iter->second.getTxHash());
+         EXPECT_EQ(utxos[i].getTxOutIndex(), iter->second.getTxOutIndex());
+         EXPECT_EQ(utxos[i].getValue(),      iter->second.getValue());
+         EXPECT_EQ(utxos[i].getScript(),     iter->second.getScript());
+      }
+   }
+
+   StoredTrieNode root, top;
+   uint64_t valueSum = 0;
+   ASSERT_TRUE(iface_->getStoredTrieNode(root, BinaryData(0)));
+   EXPECT_EQ(checkUTXOTrieNode(iface_, root, valueSum), root.getNumUtxo());
+   EXPECT_EQ(valueSum, root.getValueSum());
+   BinaryData rootHash = TheBDM.getUTXOTrieRootHash();
+   EXPECT_EQ(rootHash, root.getNodeHash());
+
+   // B has nothing left
+   EXPECT_FALSE(iface_->getUTXOTrieSubtree(scrAddrB_, top));
+   EXPECT_TRUE(iface_->getUTXOTrieSubtree(scrAddrD_, top));
+   EXPECT_EQ(top.getValueSum(), 100*COIN);
+
+   // Undo and redo blocks through the reorg, the trie has to follow
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(scrAddrA_.getSliceCopy(1,20)), 
+                                                                  150*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(scrAddrB_.getSliceCopy(1,20)), 
+                                                                   10*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(scrAddrC_.getSliceCopy(1,20)), 
+                                                                    0*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(scrAddrD_.getSliceCopy(1,20)), 
+                                                                  140*COIN);
+
+   valueSum = 0;
+   ASSERT_TRUE(iface_->getStoredTrieNode(root, BinaryData(0)));
+   EXPECT_EQ(checkUTXOTrieNode(iface_, root, valueSum), root.getNumUtxo());
+   EXPECT_EQ(valueSum, root.getValueSum());
+   EXPECT_NE(TheBDM.getUTXOTrieRootHash(), rootHash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_PruneAll)
+{
+   // The fixture's DB isn't pruned, and the mode can't change on a DB
+   TheBDM.SetDatabaseModes(ARMORY_DB_SUPER, DB_PRUNE_ALL);
+   iface_->destroyAndResetDatabases();
+
+   // Nothing is deep enough to prune on the first pass
+   TheBDM.setPruneDepth(100);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   vector<BinaryData> txHashes;
+   vector<uint32_t>   txHeights;
+   for(uint32_t h=0; h<=4; h++)
+   {
+      StoredUndoData sud;
+      EXPECT_TRUE(iface_->getStoredUndoData(sud, h));
+
+      StoredHeader sbh;
+      ASSERT_TRUE(iface_->getStoredHeader(sbh, h, 
+                                       iface_->getValidDupIDForHeight(h)));
+      for(uint32_t i=0; i<sbh.numTx_; i++)
+      {
+         txHashes.push_back(sbh.stxMap_[i].thisHash_);
+         txHeights.push_back(h);
+      }
+   }
+
+   // Now only blocks 3 and 4 can be undone
+   TheBDM.setPruneDepth(2);
+   EXPECT_GT(TheBDM.pruneBlkData(), 0);
+   EXPECT_EQ(TheBDM.pruneBlkData(), 0);
+   iface_->waitForBackgroundCommit(BLKDATA);
+
+   StoredUndoData sud;
+   EXPECT_FALSE(iface_->getStoredUndoData(sud, 2));
+   EXPECT_TRUE( iface_->getStoredUndoData(sud, 3));
+   EXPECT_TRUE( iface_->getStoredUndoData(sud, 4));
+
+   // Pruned tx are gone along with their hints, and nothing above the 
+   // window was touched
+   for(uint32_t i=0; i<txHashes.size(); i++)
+   {
+      StoredTx stx;
+      if(iface_->getStoredTx(stx, txHashes[i]))
+         continue;
+
+      EXPECT_LE(txHeights[i], 2);
+      EXPECT_FALSE(iface_->getTxRef(txHashes[i]).isInitialized());
+   }
+
+   // Balances come from the script histories and the UTXO trie
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrA_), 100*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrB_),   0*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrC_),  50*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrD_), 100*COIN);
+
+   // Undo blocks 4 and 3 from the stored undo data
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   iface_->waitForBackgroundCommit(BLKDATA);
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),   10*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrC_);
+   EXPECT_EQ(ssh.getScriptBalance(),    0*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrD_);
+   EXPECT_EQ(ssh.getScriptBalance(),  140*COIN);
+
+   // Top is 5 now, so we keep 4 and 5, and the old blocks 3 and 4 are gone
+   EXPECT_FALSE(iface_->getStoredUndoData(sud, 3));
+   EXPECT_TRUE( iface_->getStoredUndoData(sud, 4));
+   EXPECT_TRUE( iface_->getStoredUndoData(sud, 5));
+
+   // Start over with a wallet registered.  All the tx that could be pruned
+   // belong to it, so none of them are, and it can still read them back.
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   TheBDM.setPruneDepth(100);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   TheBDM.setPruneDepth(2);
+   EXPECT_EQ(TheBDM.pruneBlkData(), 0);
+   iface_->waitForBackgroundCommit(BLKDATA);
+
+   TheBDM.scanBlockchainForTx(wlt);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrA_).getFullBalance(), 150*COIN);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrB_).getFullBalance(),  10*COIN);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrC_).getFullBalance(),   0*COIN);
+   EXPECT_EQ(wlt.getTxLedger().size(), 9);
+   EXPECT_EQ(wlt.getFullTxOutList(5).size(), 4);
+   EXPECT_EQ(wlt.getSpendableTxOutList(5+COINBASE_MATURITY).size(), 4);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_CorruptBlockRejected)
+{
+   // Flip a bit in the lockTime of the last tx in block 2.  The header and
+   // its proof-of-work are fine, but the tx no longer match the merkle root.
+   BinaryData blkFile((uint32_t)BtcUtils::GetFileSize(blk0dat_));
+   ifstream is(blk0dat_.c_str(), ios::in | ios::binary);
+   is.read((char*)blkFile.getPtr(), blkFile.getSize());
+   is.close();
+
+   blkFile[925] ^= 0x01;
+   ofstream os(blk0dat_.c_str(), ios::out | ios::binary);
+   os.write((char*)blkFile.getPtr(), blkFile.getSize());
+   os.close();
+
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   EXPECT_TRUE(TheBDM.getVerifyMerkleOnIngest());
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_EQ(TheBDM.getNumCorruptBlocks(), 1);
+
+   StoredHeader sbh1, sbh2;
+   EXPECT_TRUE(iface_->getStoredHeader(sbh1, 1, 0));
+   EXPECT_EQ(sbh1.stxMap_.size(), 1);
+   EXPECT_TRUE(sbh1.verifyMerkleRoot());
+   EXPECT_FALSE(iface_->getStoredHeader(sbh2, 2, 0));
+   // Blocks 3 and 4 build on the corrupt block, so they stay out too, and
+   // the chain stops at block 1 instead of running over the hole
+   EXPECT_FALSE(iface_->getStoredHeader(sbh2, 3, 0));
+   EXPECT_FALSE(iface_->getStoredHeader(sbh2, 4, 0));
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 1);
+   EXPECT_EQ(TheBDM.getTopBlockHeader().getThisHash(), blkHash1);
+   EXPECT_FALSE(TheBDM.getHeaderByHash(blkHash2)->isMainBranch());
+   EXPECT_FALSE(TheBDM.getHeaderByHash(blkHash4)->isMainBranch());
+   EXPECT_TRUE(TheBDM.isCorruptBlock(blkHash2));
+   EXPECT_FALSE(TheBDM.isCorruptBlock(blkHash3));
+
+   // Only the first two coinbases got applied.  C and D don't show up
+   // until block 2 and 4.
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  50*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       1);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),  50*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       1);
+   StoredScriptHistory sshC, sshD;
+   iface_->getStoredScriptHistory(sshC, scrAddrC_);
+   EXPECT_FALSE(sshC.isInitialized());
+   iface_->getStoredScriptHistory(sshD, scrAddrD_);
+   EXPECT_FALSE(sshD.isInitialized());
+
+   // Same thing with the pipelined ingest
+   TheBDM.setNumIngestThreads(2);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   EXPECT_EQ(TheBDM.getNumCorruptBlocks(), 2);
+   EXPECT_FALSE(iface_->getStoredHeader(sbh2, 2, 0));
+   EXPECT_FALSE(iface_->getStoredHeader(sbh2, 4, 0));
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 1);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),  50*COIN);
+   iface_->getStoredScriptHistory(sshD, scrAddrD_);
+   EXPECT_FALSE(sshD.isInitialized());
+
+   // With the check off, it goes in like before
+   TheBDM.setVerifyMerkleOnIngest(false);
+   TheBDM.doInitialSyncOnLoad_Rebuild(); 
+   EXPECT_EQ(TheBDM.getNumCorruptBlocks(), 2);
+   EXPECT_TRUE(iface_->getStoredHeader(sbh2, 2, 0));
+   EXPECT_EQ(sbh2.stxMap_.size(), 2);
+   EXPECT_FALSE(sbh2.verifyMerkleRoot());
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+   TheBDM.setVerifyMerkleOnIngest(true);
+   TheBDM.setNumIngestThreads(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_CorruptSideBlockThenIntact)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+
+   // Block 3A shows up corrupt first (lockTime of its last tx flipped), and
+   // then intact, followed by 4A and 5A
+   uint32_t sz0to4 = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_0_to_4.dat");
+   uint32_t sz3A   = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_3A.dat");
+   BinaryData blk5A((uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_5A.dat"));
+   ifstream is("../reorgTest/blk_5A.dat", ios::in | ios::binary);
+   is.read((char*)blk5A.getPtr(), blk5A.getSize());
+   is.close();
+
+   BinaryData corrupt3A = blk5A.getSliceCopy(sz0to4, sz3A-sz0to4);
+   corrupt3A[corrupt3A.getSize()-4] ^= 0x01;
+   BinaryData blkFile = blk5A.getSliceCopy(0, sz0to4) + corrupt3A + 
+                        blk5A.getSliceCopy(sz0to4, blk5A.getSize()-sz0to4);
+   ofstream os(blk0dat_.c_str(), ios::out | ios::binary);
+   os.write((char*)blkFile.getPtr(), blkFile.getSize());
+   os.close();
+
+   // A corrupt block off the main chain doesn't hold the chain back, and 
+   // the intact copy clears it, so we reorg onto 5A like usual
+   TheBDM.readBlkFileUpdate();
+   EXPECT_EQ(TheBDM.getNumCorruptBlocks(), 1);
+   EXPECT_FALSE(TheBDM.isCorruptBlock(blkHash3A));
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash5A);
+   EXPECT_TRUE(TheBDM.getHeaderByHash(blkHash3A)->isMainBranch());
+
+   StoredHeader sbh;
+   EXPECT_TRUE(iface_->getStoredHeader(sbh, blkHash3A));
+   EXPECT_TRUE(sbh.verifyMerkleRoot());
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockUtilsSuper, Load4BlocksPlus1)
 {
@@ -6648,6 +8567,243 @@ TEST_F(BlockUtilsSuper, Load5Blocks_FullReorg)
    EXPECT_EQ(ssh.totalTxioCount_,       3);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_FullReorg_OneBatch)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   // Both old blocks were undone and all three new ones applied together
+   StoredHeader sbh;
+   iface_->getStoredHeader(sbh, blkHash3);
+   EXPECT_FALSE(sbh.blockAppliedToDB_);
+   iface_->getStoredHeader(sbh, blkHash4);
+   EXPECT_FALSE(sbh.blockAppliedToDB_);
+   iface_->getStoredHeader(sbh, blkHash3A);
+   EXPECT_TRUE(sbh.blockAppliedToDB_);
+   iface_->getStoredHeader(sbh, blkHash4A);
+   EXPECT_TRUE(sbh.blockAppliedToDB_);
+   iface_->getStoredHeader(sbh, blkHash5A);
+   EXPECT_TRUE(sbh.blockAppliedToDB_);
+
+   StoredDBInfo sdbi;
+   iface_->getStoredDBInfo(BLKDATA, sdbi);
+   EXPECT_EQ(sdbi.appliedToHgt_, 5);
+
+   // The UTXO trie was updated in the same batch
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrA_), 150*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrB_),  10*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrC_),   0*COIN);
+   EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrD_), 140*COIN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Latency of the block that causes the reorg in the reorgTest files:  two 
+// blocks undone and three applied, from a freshly built DB each time
+TEST_F(BlockUtilsSuper, DISABLED_ReorgLatency_usuallydisabled)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   uint32_t nRuns = 50;
+   for(uint32_t i=0; i<nRuns; i++)
+   {
+      BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+      TheBDM.doInitialSyncOnLoad_Rebuild(); 
+
+      BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+      TheBDM.readBlkFileUpdate();
+      BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+      TheBDM.readBlkFileUpdate();
+      BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+
+      TIMER_START("ReorgLatency");
+      TheBDM.readBlkFileUpdate();
+      TIMER_STOP("ReorgLatency");
+
+      EXPECT_EQ(TheBDM.getDBBalanceForHash160(addrD_), 140*COIN);
+   }
+
+   double total = TIMER_READ_SEC("ReorgLatency");
+   cout << "Reorg latency: " << 1000.0*total/nRuns << " ms per reorg ("
+        << nRuns << " runs)" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_IncrementalOrganize)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   // Each of these only organizes the new block, and the last one reorgs
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_TRUE(TheBDM.isLastBlockReorg());
+   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash5A);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+
+   // Save what the incremental updates came up with...
+   map<HashKey, BlockHeader> & headMap = TheBDM.getHeaderMapRef();
+   map<HashKey, BlockHeader>::iterator iter;
+   vector<bool>       isMain;
+   vector<BinaryData> nextHash;
+   vector<uint32_t>   height;
+   for(iter = headMap.begin(); iter != headMap.end(); iter++)
+   {
+      isMain.push_back(iter->second.isMainBranch());
+      nextHash.push_back(iter->second.getNextHash());
+      height.push_back(iter->second.getBlockHeight());
+   }
+   deque<BlockHeader*> byHeight = TheBDM.getHeadersByHeightRef();
+
+   // ...and compare it to organizing everything from scratch
+   EXPECT_TRUE(TheBDM.organizeChain(true));
+   ASSERT_EQ(headMap.size(), 8);
+   uint32_t i = 0;
+   for(iter = headMap.begin(); iter != headMap.end(); iter++, i++)
+   {
+      EXPECT_EQ(isMain[i],   iter->second.isMainBranch());
+      EXPECT_EQ(nextHash[i], iter->second.getNextHash());
+      EXPECT_EQ(height[i],   iter->second.getBlockHeight());
+   }
+   ASSERT_EQ(byHeight.size(), TheBDM.getHeadersByHeightRef().size());
+   for(i=0; i<byHeight.size(); i++)
+      EXPECT_EQ(byHeight[i], TheBDM.getHeadersByHeightRef()[i]);
+
+   EXPECT_FALSE(TheBDM.getHeaderByHash(blkHash3)->isMainBranch());
+   EXPECT_FALSE(TheBDM.getHeaderByHash(blkHash4)->isMainBranch());
+   EXPECT_TRUE( TheBDM.getHeaderByHash(blkHash4A)->isMainBranch());
+   EXPECT_EQ(TheBDM.getHeaderByHash(blkHash2)->getNextHash(), blkHash3A);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_BlkFileWatcher)
+{
+   if(!BlkFileWatcher::isSupported())
+      return;
+
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+   ASSERT_TRUE(TheBDM.startBlkFileWatcher());
+
+   // Nothing new yet
+   EXPECT_FALSE(TheBDM.waitForBlkFileUpdate(50));
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 0);
+
+   // blk_5A.dat is blk_0_to_4.dat followed by blocks 3A, 4A and 5A
+   BinaryData allBlocks((uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_5A.dat"));
+   ifstream is("../reorgTest/blk_5A.dat", ios::in | ios::binary);
+   is.read((char*)allBlocks.getPtr(), allBlocks.getSize());
+   is.close();
+
+   uint32_t end4  = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_0_to_4.dat");
+   uint32_t end3A = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_3A.dat");
+   string blk1dat = BtcUtils::getBlkFilename(blkdir_, 1);
+
+   // Block 3A goes in a new file:  a blk file split
+   ofstream os(blk1dat.c_str(), ios::out | ios::binary);
+   os.write((char*)allBlocks.getPtr() + end4, end3A - end4);
+   os.close();
+
+   ASSERT_TRUE(TheBDM.waitForBlkFileUpdate(5000));
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 1);
+   EXPECT_EQ(TheBDM.getTotalBlkFiles(), 2);
+   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash4);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+
+   // Then 4A and 5A are appended to it, causing the reorg
+   os.open(blk1dat.c_str(), ios::out | ios::binary | ios::app);
+   os.write((char*)allBlocks.getPtr() + end3A, allBlocks.getSize() - end3A);
+   os.close();
+
+   ASSERT_TRUE(TheBDM.waitForBlkFileUpdate(5000));
+   uint32_t nBlk = TheBDM.readBlkFileUpdate();
+
+   // In case we caught the watcher before it saw all of the write
+   if(nBlk < 2 && TheBDM.waitForBlkFileUpdate(5000))
+      nBlk += TheBDM.readBlkFileUpdate();
+
+   EXPECT_EQ(nBlk, 2);
+   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash5A);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_FALSE(TheBDM.getHeaderByHash(blkHash4)->isMainBranch());
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
+
+   TheBDM.stopBlkFileWatcher();
+   EXPECT_FALSE(TheBDM.isBlkFileWatcherRunning());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_BlkFileWatcher_ReadFailure)
+{
+   if(!BlkFileWatcher::isSupported())
+      return;
+
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+   ASSERT_TRUE(TheBDM.startBlkFileWatcher());
+
+   // blk_5A.dat is blk_0_to_4.dat followed by blocks 3A, 4A and 5A
+   BinaryData allBlocks((uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_5A.dat"));
+   ifstream is("../reorgTest/blk_5A.dat", ios::in | ios::binary);
+   is.read((char*)allBlocks.getPtr(), allBlocks.getSize());
+   is.close();
+
+   uint32_t end4  = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_0_to_4.dat");
+   uint32_t end3A = (uint32_t)BtcUtils::GetFileSize("../reorgTest/blk_3A.dat");
+   string blk1dat = BtcUtils::getBlkFilename(blkdir_, 1);
+
+   ofstream os(blk1dat.c_str(), ios::out | ios::binary);
+   os.write((char*)allBlocks.getPtr() + end4, end3A - end4);
+   os.close();
+   ASSERT_TRUE(TheBDM.waitForBlkFileUpdate(5000));
+
+   // The watcher found 3A, but it's gone by the time we read it
+   os.open(blk1dat.c_str(), ios::out | ios::binary | ios::trunc);
+   os.close();
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 0);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+
+   // It's still queued, so once it's back we get it
+   os.open(blk1dat.c_str(), ios::out | ios::binary | ios::trunc);
+   os.write((char*)allBlocks.getPtr() + end4, end3A - end4);
+   os.close();
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 1);
+   EXPECT_EQ(TheBDM.getTotalBlkFiles(), 2);
+
+   // Without the watcher, polling picks up right after 3A
+   TheBDM.stopBlkFileWatcher();
+   os.open(blk1dat.c_str(), ios::out | ios::binary | ios::app);
+   os.write((char*)allBlocks.getPtr() + end3A, allBlocks.getSize() - end3A);
+   os.close();
+
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 2);
+   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash5A);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // These next two tests disabled because they broke after ARMORY_DB_BARE impl
 TEST_F(BlockUtilsSuper, DISABLED_RestartDBAfterBuild)
@@ -7015,6 +9171,37 @@ TEST_F(BlockUtilsWithWalletTest, PostRegisterScrAddr)
    EXPECT_EQ(balanceDB,   100*COIN);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// The registered-tx scan only runs on sync outside of SUPER mode.  With only
+// 5 blocks and 4 threads, every block gets its own chunk, so all the spends of
+// outpoints from earlier blocks have to be caught by the second pass.  Use 
+// scanRegisteredTxForWallet, which goes straight to the registered tx list 
+// without scanning again.
+TEST_F(BlockUtilsWithWalletTest, PreRegisterScrAddrs_ParallelScan)
+{
+   TheBDM.SetDatabaseModes(ARMORY_DB_FULL, DB_PRUNE_NONE);
+   TheBDM.setNumScanThreads(4);
+   EXPECT_EQ(TheBDM.getNumScanThreads(), 4);
+
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.doInitialSyncOnLoad();
+   TheBDM.scanRegisteredTxForWallet(wlt);
+
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrA_).getFullBalance(), 100*COIN);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrB_).getFullBalance(),   0*COIN);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrC_).getFullBalance(),  50*COIN);
+
+   // B sent everything it received, so a missed spend would show up here
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrB_).getTxLedger().size(), 6);
+   EXPECT_EQ(wlt.getTxLedger().size(), 9);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /* Never got around to finishing this...
 class TestMainnetBlkchain: public ::testing::Test
@@ -20,6 +20,184 @@
 
 vector<InterfaceToLDB*> LevelDBWrapper::ifaceVect_(0);
 
+
+////////////////////////////////////////////////////////////////////////////////
+LDBIter::LDBIter(InterfaceToLDB & iface, DB_SELECT db, bool fillCache) :
+   db_(iface.dbs_[db]),
+   fillCache_(fillCache),
+   ownsIter_(true),
+   currKey_(&ownKey_),
+   currValue_(&ownValue_)
+{
+   snapshot_ = db_->GetSnapshot();
+
+   leveldb::ReadOptions opts;
+   opts.snapshot   = snapshot_;
+   opts.fill_cache = fillCache_;
+   iter_ = db_->NewIterator(opts);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LDBIter::LDBIter(leveldb::Iterator* iter, 
+                 BinaryRefReader & keyReader, 
+                 BinaryRefReader & valueReader) :
+   db_(NULL),
+   iter_(iter),
+   snapshot_(NULL),
+   fillCache_(true),
+   ownsIter_(false),
+   currKey_(&keyReader),
+   currValue_(&valueReader)
+{
+   // Nothing else to do, this is just a view of someone else's iterator
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LDBIter::~LDBIter(void)
+{
+   if(!ownsIter_)
+      return;
+
+   // The iterator must be gone before the snapshot is released
+   delete iter_;
+   iter_ = NULL;
+   db_->ReleaseSnapshot(snapshot_);
+   snapshot_ = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void LDBIter::refresh(void)
+{
+   if(!ownsIter_)
+      return;
+
+   BinaryData currKey;
+   bool wasValid = iter_->Valid();
+   if(wasValid)
+      currKey = getKey();
+
+   delete iter_;
+   db_->ReleaseSnapshot(snapshot_);
+   snapshot_ = db_->GetSnapshot();
+
+   leveldb::ReadOptions opts;
+   opts.snapshot   = snapshot_;
+   opts.fill_cache = fillCache_;
+   iter_ = db_->NewIterator(opts);
+
+   // A new iterator isn't valid until it's positioned, which is what we 
+   // want if the old one had already run off the end
+   if(wasValid)
+      seekTo(currKey);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void LDBIter::readIterData(void)
+{
+   currKey_->setNewData(  (uint8_t*)(iter_->key().data()),   
+                                     iter_->key().size());
+   currValue_->setNewData((uint8_t*)(iter_->value().data()), 
+                                     iter_->value().size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::isValid(DB_PREFIX prefix)
+{
+   if(!iter_->Valid())
+      return false;
+
+   if(currKey_->getSize() == 0)
+   {
+      LOGERR << "Iter is valid but somehow key is zero length...?";
+      return false;
+   }
+
+   return (currKey_->getRawRef()[0] == (uint8_t)prefix);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::seekTo(BinaryDataRef key)
+{
+   iter_->Seek(leveldb::Slice((char*)key.getPtr(), key.getSize()));
+   if(!iter_->Valid())
+      return false;
+
+   readIterData();
+   return (currKey_->getRawRef() == key);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::seekTo(DB_PREFIX prefix, BinaryDataRef key)
+{
+   BinaryWriter bw(key.getSize() + 1);
+   bw.put_uint8_t((uint8_t)prefix);
+   bw.put_BinaryData(key);
+   return seekTo(bw.getData());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::seekToFirst(void)
+{
+   iter_->SeekToFirst();
+   if(!iter_->Valid())
+      return false;
+
+   readIterData();
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::advanceAndRead(void)
+{
+   if(!iter_->Valid())
+      return false; 
+
+   iter_->Next();
+   if(!iter_->Valid())
+      return false;
+
+   readIterData();
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::advanceAndRead(DB_PREFIX prefix)
+{
+   if(!advanceAndRead())
+      return false;
+
+   return checkPrefixByte(prefix, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool LDBIter::checkPrefixByte(DB_PREFIX prefix, bool rewindWhenDone)
+{
+   return DBUtils.checkPrefixByte(*currKey_, prefix, rewindWhenDone);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryData LDBIter::getValueAtSnapshot(BinaryDataRef key)
+{
+   if(db_ == NULL)
+   {
+      LOGERR << "No snapshot available for the shared DB iterator";
+      return BinaryData(0);
+   }
+
+   leveldb::ReadOptions opts;
+   opts.snapshot   = snapshot_;
+   opts.fill_cache = fillCache_;
+
+   string value;
+   leveldb::Slice ldbKey((char*)key.getPtr(), key.getSize());
+   leveldb::Status stat = db_->Get(opts, ldbKey, &value);
+   if(!stat.ok())
+      return BinaryData(0);
+
+   return BinaryData(value);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::checkStatus(leveldb::Status stat, bool warn)
 {
@@ -84,10 +262,22 @@ void InterfaceToLDB::init()
       dbs_[i] = NULL;
       dbPaths_[i] = string("");
       batchStarts_[i] = 0;
-      //dbFilterPolicy_[i] = NULL;
+      bgCommits_[i] = LDBBackgroundCommit();
+      dbCache_[i] = NULL;
+      dbFilterPolicy_[i] = NULL;
+      dbTuning_[i] = LDBTuning();
+      dbTuningInUse_[i] = LDBTuning();
    }
 
    maxOpenFiles_ = 0;
+   bulkLoad_ = false;
+   txHashFilterReady_ = false;
+   useTxHashFilter_ = true;
+   txHashFilterFileHgt_ = UINT32_MAX;
+   txHashFilterSaveHgt_ = UINT32_MAX;
+   txHashFilterTopHgt_ = 0;
+   txHashFilterSaveInterval_ = TXHASH_FILTER_SAVE_INTERVAL;
+   utxoTrieAvailable_ = false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -160,32 +350,12 @@ bool InterfaceToLDB::openDatabases(string basedir,
    {
 
       DB_SELECT CURRDB = (DB_SELECT)db;
-      leveldb::Options opts;
-      opts.create_if_missing = true;
-      opts.compression = leveldb::kNoCompression;
-
-      if(maxOpenFiles_ != 0)
+      if(!openOneDatabase(CURRDB))
       {
-         LOGINFO << "Using custom max_open_files option: " << maxOpenFiles_;
-         opts.max_open_files = maxOpenFiles_;
+         closeDatabases();
+         return false;
       }
 
-      //opts.block_cache = leveldb::NewLRUCache(100 * 1048576);
-      //dbFilterPolicy_[db] = leveldb::NewBloomFilterPolicy(10);
-      //opts.filter_policy = leveldb::NewBloomFilterPolicy(10);
-      leveldb::Status stat = leveldb::DB::Open(opts, dbPaths_[db],  &dbs_[db]);
-      if(!checkStatus(stat))
-         LOGERR << "Failed to open database! DB: " << db;
-
-      //LOGINFO << "LevelDB directories:";
-      //LOGINFO << "LDB BLKDATA: " << dbPaths_[BLKDATA].c_str();
-      //LOGINFO << "LDB HEADERS: " << dbPaths_[HEADERS].c_str();
-
-      // Create an iterator that we'll use for ust about all DB seek ops
-      iters_[db] = dbs_[db]->NewIterator(leveldb::ReadOptions());
-      batches_[db] = NULL;
-      batchStarts_[db] = 0;
-
       StoredDBInfo sdbi;
       getStoredDBInfo(CURRDB, sdbi, false); 
       if(!sdbi.isInitialized())
@@ -198,6 +368,12 @@ bool InterfaceToLDB::openDatabases(string basedir,
          sdbi.topBlkHgt_  = 0;
          sdbi.topBlkHash_ = genesisBlkHash_;
          putStoredDBInfo(CURRDB, sdbi);
+
+         // Only a DB that has the UTXO trie from the start can keep it
+         if(CURRDB == BLKDATA &&
+            UTXO_STORAGE == SCRIPT_UTXO_TREE &&
+            DBUtils.getArmoryDbType() == ARMORY_DB_SUPER)
+            putStoredTrieNode(StoredTrieNode());
       }
       else
       {
@@ -222,6 +398,17 @@ bool InterfaceToLDB::openDatabases(string basedir,
             return false;
          }
 
+         // Older versions get upgraded in place (upgradeDBFormat), but we
+         // have no idea what a newer one looks like
+         if(sdbi.armoryVer_ > ARMORY_DB_VERSION)
+         {
+            LOGERR << "DB was written by a newer version of Armory";
+            LOGERR << "DB version: " << sdbi.armoryVer_ 
+                   << ", expecting: " << ARMORY_DB_VERSION;
+            closeDatabases();
+            return false;
+         }
+
          if(DBUtils.getDbPruneType() == DB_PRUNE_WHATEVER)
          {
             DBUtils.setDbPruneType(sdbi.pruneType_);
@@ -241,6 +428,86 @@ bool InterfaceToLDB::openDatabases(string basedir,
    validDupByHeight_.resize(getTopBlockHeight(HEADERS)+1);
    dbIsOpen_ = true;
 
+   StoredTrieNode trieRoot;
+   utxoTrieAvailable_ = (UTXO_STORAGE == SCRIPT_UTXO_TREE &&
+                         DBUtils.getArmoryDbType() == ARMORY_DB_SUPER &&
+                         getStoredTrieNode(trieRoot, BinaryDataRef()));
+
+   // Whatever we put in BLKDATA without the filter won't be in the file
+   if(useTxHashFilter_)
+      loadTxHashFilter();
+   else
+      remove(getTxHashFilterPath().c_str());
+
+   return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Opens just the LevelDB object for one of the DBs, with its current tuning.
+// Doesn't look at the DB info at all:  that's up to openDatabases().
+bool InterfaceToLDB::openOneDatabase(DB_SELECT db)
+{
+   LDBTuning & tune = dbTuningInUse_[db];
+   tune = dbTuning_[db];
+   leveldb::Options & opts = dbOpts_[db];
+   opts = leveldb::Options();
+   opts.create_if_missing = true;
+   opts.compression = (tune.useCompression_ ? leveldb::kSnappyCompression :
+                                              leveldb::kNoCompression);
+
+   if(maxOpenFiles_ != 0)
+   {
+      LOGINFO << "Using custom max_open_files option: " << maxOpenFiles_;
+      opts.max_open_files = maxOpenFiles_;
+   }
+
+   // The cache and filter policy must outlive the DB, so we hold onto 
+   // them and delete them in closeDatabases()
+   if(tune.blockCacheSize_ != 0)
+   {
+      dbCache_[db] = leveldb::NewLRUCache(tune.blockCacheSize_);
+      opts.block_cache = dbCache_[db];
+   }
+
+   // Most of our gets are for keys that aren't there (tx hints, SSH 
+   // lookups for new addresses), which is exactly what bloom filters 
+   // are good for:  they let LevelDB skip reading the block at all.
+   if(tune.bloomFilterBits_ != 0)
+   {
+      dbFilterPolicy_[db] = 
+                  leveldb::NewBloomFilterPolicy(tune.bloomFilterBits_);
+      opts.filter_policy = dbFilterPolicy_[db];
+   }
+
+   if(tune.writeBufferSize_ != 0)
+      opts.write_buffer_size = tune.writeBufferSize_;
+
+   // See beginBulkLoad()
+   if(bulkLoad_ && db == BLKDATA && 
+      opts.write_buffer_size < LDB_BULKLOAD_WRITE_BUFFER)
+      opts.write_buffer_size = LDB_BULKLOAD_WRITE_BUFFER;
+
+   if(tune.blockSize_ != 0)
+      opts.block_size = tune.blockSize_;
+
+   leveldb::Status stat = leveldb::DB::Open(opts, dbPaths_[db],  &dbs_[db]);
+   if(!checkStatus(stat))
+   {
+      LOGERR << "Failed to open database! DB: " << db;
+      return false;
+   }
+
+   LOGINFO << "DB " << db << " settings: " << getDBSettingsStr(db);
+
+   //LOGINFO << "LevelDB directories:";
+   //LOGINFO << "LDB BLKDATA: " << dbPaths_[BLKDATA].c_str();
+   //LOGINFO << "LDB HEADERS: " << dbPaths_[HEADERS].c_str();
+
+   // Create an iterator that we'll use for ust about all DB seek ops
+   iters_[db] = dbs_[db]->NewIterator(leveldb::ReadOptions());
+   batches_[db] = NULL;
+   batchStarts_[db] = 0;
    return true;
 }
 
@@ -283,29 +550,92 @@ void InterfaceToLDB::nukeHeadersDB(void)
 void InterfaceToLDB::closeDatabases(void)
 {
    SCOPED_TIMER("closeDatabases");
+   if(dbIsOpen_ && txHashFilterReady_ && 
+      txHashFilterFileHgt_ != txHashFilterTopHgt_)
+      saveTxHashFilter(txHashFilterTopHgt_);
+
+   txHashFilter_.clear();
+   txHashFilterReady_ = false;
+   txHashFilterFileHgt_ = UINT32_MAX;
+   utxoTrieAvailable_ = false;
+
    for(uint32_t db=0; db<DB_COUNT; db++)
+      closeOneDatabase((DB_SELECT)db);
+
+   dbIsOpen_ = false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::closeOneDatabase(DB_SELECT db)
+{
+   waitForBackgroundCommit(db);
+
+   if( iters_[db] != NULL )
    {
-      if( iters_[db] != NULL )
-      {
-         delete iters_[db];
-         iters_[db] = NULL;
-      }
-      
-      if( batches_[db] != NULL )
-      {
-         delete batches_[db];
-         batches_[db] = NULL;
-      }
+      delete iters_[db];
+      iters_[db] = NULL;
+   }
+   
+   if( batches_[db] != NULL )
+   {
+      delete batches_[db];
+      batches_[db] = NULL;
+   }
 
-      if( dbs_[db] != NULL)
-      {
-         delete dbs_[db];
-         dbs_[db] = NULL;
-      }
+   if( dbs_[db] != NULL)
+   {
+      delete dbs_[db];
+      dbs_[db] = NULL;
+   }
 
+   // These can only go away after the DB that uses them
+   if( dbCache_[db] != NULL)
+   {
+      delete dbCache_[db];
+      dbCache_[db] = NULL;
    }
-   dbIsOpen_ = false;
 
+   if( dbFilterPolicy_[db] != NULL)
+   {
+      delete dbFilterPolicy_[db];
+      dbFilterPolicy_[db] = NULL;
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+string InterfaceToLDB::getDBSettingsStr(DB_SELECT db)
+{
+   leveldb::Options const & opts = dbOpts_[db];
+
+   // LevelDB makes its own 8 MB cache if we don't give it one
+   uint64_t cacheSize = (dbCache_[db]==NULL ? 8*1048576 : 
+                                         dbTuningInUse_[db].blockCacheSize_);
+
+   stringstream ss;
+   ss << "block_cache="     << cacheSize
+      << " bloom_bits="     << (dbFilterPolicy_[db]==NULL ? 0 : 
+                                      dbTuningInUse_[db].bloomFilterBits_)
+      << " write_buffer="   << opts.write_buffer_size
+      << " block_size="     << opts.block_size
+      << " compression="    << (opts.compression==leveldb::kNoCompression ? 
+                                                         "none" : "snappy")
+      << " max_open_files=" << opts.max_open_files;
+   return ss.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+string InterfaceToLDB::getDBStatsStr(DB_SELECT db)
+{
+   if(dbs_[db] == NULL)
+      return string("");
+
+   string stats;
+   if(!dbs_[db]->GetProperty("leveldb.stats", &stats))
+      return string("");
+
+   return stats;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -318,7 +648,11 @@ void InterfaceToLDB::destroyAndResetDatabases(void)
    ARMORY_DB_TYPE atype = DBUtils.getArmoryDbType();
    DB_PRUNE_TYPE  dtype = DBUtils.getDbPruneType();
 
+   // No point saving the tx hash filter for a DB we're about to delete
+   txHashFilterReady_ = false;
    closeDatabases();
+   remove(getTxHashFilterPath().c_str());
+
    leveldb::Options options;
    leveldb::DestroyDB(dbPaths_[HEADERS], options);
    leveldb::DestroyDB(dbPaths_[BLKDATA], options);
@@ -329,6 +663,331 @@ void InterfaceToLDB::destroyAndResetDatabases(void)
                                                                atype, dtype);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::beginBulkLoad(void)
+{
+   SCOPED_TIMER("beginBulkLoad");
+   if(!dbIsOpen_ || bulkLoad_)
+      return false;
+
+   if(batchStarts_[BLKDATA] > 0)
+   {
+      LOGERR << "Cannot start bulk load with a batch in progress";
+      return false;
+   }
+
+   LOGINFO << "Reopening BLKDATA for bulk load";
+   bulkLoad_ = true;
+   closeOneDatabase(BLKDATA);
+   if(!openOneDatabase(BLKDATA))
+   {
+      bulkLoad_ = false;
+      if(!openOneDatabase(BLKDATA))
+      {
+         LOGERR << "Could not reopen BLKDATA, closing the databases";
+         closeDatabases();
+      }
+      return false;
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::endBulkLoad(void)
+{
+   SCOPED_TIMER("endBulkLoad");
+   if(!bulkLoad_)
+      return true;
+
+   if(batchStarts_[BLKDATA] > 0)
+      LOGERR << "Ending bulk load with a batch in progress!";
+
+   waitForBackgroundCommit(BLKDATA);
+
+   // One full compaction now, instead of the many partial ones we skipped
+   LOGINFO << "Compacting BLKDATA after bulk load";
+   TIMER_START("compactAfterBulkLoad");
+   dbs_[BLKDATA]->CompactRange(NULL, NULL);
+   TIMER_STOP("compactAfterBulkLoad");
+   LOGINFO << "Compaction took " 
+           << TIMER_READ_SEC("compactAfterBulkLoad") << " seconds";
+
+   bulkLoad_ = false;
+   closeOneDatabase(BLKDATA);
+   if(!openOneDatabase(BLKDATA))
+   {
+      LOGERR << "Could not reopen BLKDATA after bulk load, closing the "
+             << "databases";
+      closeDatabases();
+      return false;
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Every entry says which DB version wrote it, so a DB that's only partly 
+// converted reads just fine, and if this gets interrupted the next call 
+// picks up where it left off.  The DB info only gets the new version once
+// everything's been rewritten.  Returns the number of entries converted.
+uint32_t InterfaceToLDB::upgradeDBFormat(uint32_t entriesPerBatch)
+{
+   SCOPED_TIMER("upgradeDBFormat");
+   StoredDBInfo sdbi;
+   getStoredDBInfo(BLKDATA, sdbi);
+   if(!sdbi.isInitialized() || sdbi.armoryVer_ >= ARMORY_DB_VERSION)
+      return 0;
+
+   LOGINFO << "Upgrading DB from version " << sdbi.armoryVer_ 
+           << " to " << ARMORY_DB_VERSION;
+
+   uint32_t nConverted = 0;
+   uint32_t nInBatch   = 0;
+
+   // Only the TxOut entries changed format in version 1
+   LDBIter ldbIter(*this, BLKDATA, false);
+   ldbIter.seekTo(DB_PREFIX_TXDATA, BinaryData(0));
+   startBatch(BLKDATA);
+   while(ldbIter.isValid(DB_PREFIX_TXDATA))
+   {
+      if(ldbIter.getKeyRef().getSize() == 9)
+      {
+         StoredTxOut stxo;
+         stxo.unserializeDBValue(ldbIter.getValueReader());
+         if(stxo.unserArmVer_ < ARMORY_DB_VERSION_COMPACT_TXOUT)
+         {
+            // Keep the spentness exactly as it was stored
+            putValue(BLKDATA, ldbIter.getKey(), stxo.serializeDBValue(true));
+            nConverted++;
+            nInBatch++;
+         }
+      }
+
+      if(nInBatch >= entriesPerBatch)
+      {
+         commitBatch(BLKDATA);
+         startBatch(BLKDATA);
+         ldbIter.refresh();
+         nInBatch = 0;
+      }
+
+      ldbIter.advanceAndRead();
+   }
+   commitBatch(BLKDATA);
+
+   for(uint32_t db=0; db<DB_COUNT; db++)
+   {
+      getStoredDBInfo((DB_SELECT)db, sdbi);
+      sdbi.armoryVer_ = ARMORY_DB_VERSION;
+      putStoredDBInfo((DB_SELECT)db, sdbi);
+   }
+
+   LOGINFO << "Converted " << nConverted << " TxOuts to the new format";
+   return nConverted;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// It lives in the BLKDATA directory (LevelDB ignores files it doesn't know)
+// so whatever deletes that DB deletes the filter with it.
+string InterfaceToLDB::getTxHashFilterPath(void)
+{
+   stringstream ss;
+   ss << dbPaths_[BLKDATA] << "/" << "txhashfilter.bin";
+   return ss.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The saved filter is tagged with the height it has every tx up to.  Nothing
+// is ever removed from BLKDATA behind its back, so it's still good for all
+// of those, and we only need to read back the tx above it.  The file gets 
+// deleted when a tx goes in at or below that height (see 
+// addedTxToHashFilter), so a crash at any point costs us at most the blocks
+// since the last save, not a full rebuild.
+void InterfaceToLDB::loadTxHashFilter(void)
+{
+   SCOPED_TIMER("loadTxHashFilter");
+   string path = getTxHashFilterPath();
+   BinaryData tag;
+   if(txHashFilter_.readFromFileGetTag(path, tag) && tag.getSize() == 4)
+   {
+      txHashFilterFileHgt_ = READ_UINT32_BE(tag);
+      txHashFilterTopHgt_  = txHashFilterFileHgt_;
+      txHashFilterSaveHgt_ = txHashFilterFileHgt_ + 1 + txHashFilterSaveInterval_;
+      LOGINFO << "Loaded tx hash filter: " << txHashFilter_.getNumItems()
+              << " entries, " << txHashFilter_.getNumBytes() << " bytes,"
+              << " up to height " << txHashFilterFileHgt_;
+
+      if(replayTxHashFilter(txHashFilterFileHgt_+1) > 0)
+         saveTxHashFilter(txHashFilterTopHgt_);
+   }
+   else
+   {
+      rebuildTxHashFilter();
+      saveTxHashFilter(txHashFilterTopHgt_);
+   }
+
+   txHashFilterReady_ = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::rebuildTxHashFilter(void)
+{
+   SCOPED_TIMER("rebuildTxHashFilter");
+   LOGINFO << "Building tx hash filter from BLKDATA";
+   txHashFilter_.clear();
+   txHashFilterTopHgt_ = 0;
+
+   // The hints say roughly how many tx there are, and which prefixes are
+   // shared by more than one of them
+   uint64_t nHints = 0;
+   set<BinaryData> sharedPrefixes;
+   LDBIter ldbIter(*this, BLKDATA, false);
+   ldbIter.seekTo(DB_PREFIX_TXHINTS, BinaryData(0));
+   while(ldbIter.isValid(DB_PREFIX_TXHINTS))
+   {
+      StoredTxHints sths;
+      sths.unserializeDBValue(ldbIter.getValueReader());
+      nHints += sths.getNumHints();
+      if(sths.getNumHints() > 1)
+         sharedPrefixes.insert(ldbIter.getKeyRef().getSliceCopy(1,4));
+
+      ldbIter.advanceAndRead();
+   }
+   txHashFilter_.reserve(nHints);
+
+   // 7-byte keys are the tx themselves, 9-byte keys are their TxOuts
+   ldbIter.seekTo(DB_PREFIX_TXDATA, BinaryData(0));
+   while(ldbIter.isValid(DB_PREFIX_TXDATA))
+   {
+      BinaryDataRef key = ldbIter.getKeyRef();
+      BinaryDataRef val = ldbIter.getValueRef();
+      if(key.getSize() == 7 && val.getSize() >= 34)
+      {
+         BinaryDataRef txHash = val.getSliceRef(2,32);
+         txHashFilter_.insertTx(txHash);
+         if(sharedPrefixes.count(txHash.getSliceCopy(0,4)) > 0)
+            txHashFilter_.insertTxAtKey(txHash, key.getSliceRef(1,6));
+
+         // Keys are in height order, so the last one is the top
+         txHashFilterTopHgt_ = DBUtils.hgtxToHeight(key.getSliceCopy(1,4));
+      }
+
+      ldbIter.advanceAndRead();
+   }
+
+   LOGINFO << "Tx hash filter: " << txHashFilter_.getNumItems()
+           << " entries, " << txHashFilter_.getNumBytes() << " bytes";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Puts every tx from fromHgt up back in the filter, the same way 
+// putStoredTx would have.  Tx that are in it already don't change anything.
+// Returns how many tx we read.
+uint32_t InterfaceToLDB::replayTxHashFilter(uint32_t fromHgt)
+{
+   SCOPED_TIMER("replayTxHashFilter");
+   uint32_t nTx = 0;
+   LDBIter ldbIter(*this, BLKDATA, false);
+   ldbIter.seekTo(DB_PREFIX_TXDATA, DBUtils.heightAndDupToHgtx(fromHgt, 0));
+   while(ldbIter.isValid(DB_PREFIX_TXDATA))
+   {
+      BinaryDataRef key = ldbIter.getKeyRef();
+      BinaryDataRef val = ldbIter.getValueRef();
+      if(key.getSize() == 7 && val.getSize() >= 34)
+      {
+         BinaryDataRef txHash = val.getSliceRef(2,32);
+         txHashFilter_.insertTx(txHash);
+         if(getHintsForTxHash(txHash).getNumHints() > 1)
+            txHashFilter_.insertTxAtKey(txHash, key.getSliceRef(1,6));
+
+         txHashFilterTopHgt_ = DBUtils.hgtxToHeight(key.getSliceCopy(1,4));
+         nTx++;
+      }
+
+      ldbIter.advanceAndRead();
+   }
+
+   if(nTx > 0)
+      LOGINFO << "Added " << nTx << " tx to the tx hash filter, up to height "
+              << txHashFilterTopHgt_;
+   return nTx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The file must have every tx up to hgt.  It's written next to the old one
+// and moved over it, so a crash in the middle never leaves half a filter.
+void InterfaceToLDB::saveTxHashFilter(uint32_t hgt)
+{
+   SCOPED_TIMER("saveTxHashFilter");
+   string path = getTxHashFilterPath();
+   string tmpPath = path + ".tmp";
+   txHashFilterSaveHgt_ = hgt + 1 + txHashFilterSaveInterval_;
+
+   // rename() won't replace a file on Windows
+   bool saved = txHashFilter_.writeToFile(tmpPath, WRITE_UINT32_BE(hgt));
+   remove(path.c_str());
+   if(!saved || rename(tmpPath.c_str(), path.c_str()) != 0)
+   {
+      // Not a big deal, it'll be rebuilt on the next open
+      LOGERR << "Could not write tx hash filter to " << path;
+      remove(tmpPath.c_str());
+      txHashFilterFileHgt_ = UINT32_MAX;
+      return;
+   }
+
+   txHashFilterFileHgt_ = hgt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Called by putStoredTx for each tx it puts in the filter.  Tx mostly come 
+// in height order, and then every so often we save the filter with 
+// everything below this one.  One below the height of the file (reorgs, 
+// blocks out of order) means the file doesn't have everything it says, so
+// it goes, until the next save.
+void InterfaceToLDB::addedTxToHashFilter(uint32_t hgt)
+{
+   if(txHashFilterFileHgt_ != UINT32_MAX && hgt <= txHashFilterFileHgt_)
+   {
+      remove(getTxHashFilterPath().c_str());
+      txHashFilterFileHgt_ = UINT32_MAX;
+   }
+
+   txHashFilterTopHgt_ = max(txHashFilterTopHgt_, hgt);
+   if(hgt >= txHashFilterSaveHgt_)
+      saveTxHashFilter(hgt-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns false without touching the DB if the filter knows the tx isn't 
+// there.  If more than one tx shares its 4-byte prefix, the ones the filter
+// says are at that DB key go first.  That only changes the order the hints
+// are tried in, so a filter false positive costs us a read, nothing more.
+bool InterfaceToLDB::getTxHintsToSearch(BinaryDataRef txHash,
+                                        vector<BinaryData> & hints)
+{
+   hints.clear();
+   if(txHashFilterReady_ && !txHashFilter_.mayHaveTx(txHash))
+      return false;
+
+   StoredTxHints sths = getHintsForTxHash(txHash);
+   uint32_t numHints = sths.getNumHints();
+   if(numHints < 2 || !txHashFilterReady_)
+   {
+      hints = sths.dbKeyList_;
+      return (numHints > 0);
+   }
+
+   hints.reserve(numHints);
+   for(uint32_t i=0; i<numHints; i++)
+      if(txHashFilter_.mayHaveTxAtKey(txHash, sths.getHint(i)))
+         hints.push_back(sths.dbKeyList_[i]);
+
+   for(uint32_t i=0; i<numHints; i++)
+      if(!txHashFilter_.mayHaveTxAtKey(txHash, sths.getHint(i)))
+         hints.push_back(sths.dbKeyList_[i]);
+
+   return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 void InterfaceToLDB::startBatch(DB_SELECT db)
 {
@@ -400,6 +1059,58 @@ void InterfaceToLDB::commitBatch(DB_SELECT db)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+static void writeBatchThread(void* arg)
+{
+   LDBBackgroundCommit* bgc = (LDBBackgroundCommit*)arg;
+   bgc->status_ = bgc->db_->Write(leveldb::WriteOptions(), bgc->batch_);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::commitBatchInBackground(DB_SELECT db)
+{
+   SCOPED_TIMER("commitBatchInBackground");
+
+   // Only the outermost commit writes anything, same as commitBatch
+   if(batchStarts_[db] != 1 || batches_[db] == NULL || dbs_[db] == NULL)
+   {
+      commitBatch(db);
+      return;
+   }
+
+   waitForBackgroundCommit(db);
+
+   batchStarts_[db] = 0;
+   bgCommits_[db].db_    = dbs_[db];
+   bgCommits_[db].batch_ = batches_[db];
+   batches_[db] = NULL;
+   iterIsDirty_[db] = true;
+
+   // If we can't get a thread, just write it here
+   if(!bgCommitThreads_[db].start(writeBatchThread, &bgCommits_[db]))
+      writeBatchThread(&bgCommits_[db]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::waitForBackgroundCommit(DB_SELECT db)
+{
+   if(bgCommits_[db].batch_ == NULL)
+      return;
+
+   SCOPED_TIMER("waitForBackgroundCommit");
+   bgCommitThreads_[db].waitForAll();
+   checkStatus(bgCommits_[db].status_);
+
+   delete bgCommits_[db].batch_;
+   bgCommits_[db].batch_ = NULL;
+
+   // The shared iterator may have been refreshed before the write landed
+   iterIsDirty_[db] = true;
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Get value using pre-created slice
 BinaryData InterfaceToLDB::getValue(DB_SELECT db, leveldb::Slice ldbKey)
@@ -648,10 +1359,14 @@ bool InterfaceToLDB::startBlkDataIteration(DB_PREFIX prefix)
 // because we checked it and decide we don't care, so we want to skip it.
 bool InterfaceToLDB::advanceToNextBlock(bool skip)
 {
-   char prefix = DB_PREFIX_TXDATA;
+   LDBIter ldbIter(iters_[BLKDATA], currReadKey_, currReadValue_);
+   return advanceToNextBlock(ldbIter, skip);
+}
 
-   leveldb::Iterator* it = iters_[BLKDATA];
-   BinaryData key;
+/////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::advanceToNextBlock(LDBIter & ldbIter, bool skip)
+{
+   leveldb::Iterator* it = ldbIter.iter_;
    while(1) 
    {
       if(skip) 
@@ -661,7 +1376,7 @@ bool InterfaceToLDB::advanceToNextBlock(bool skip)
          return false;
       else if( it->key().size() == 5)
       {
-         iteratorToRefReaders(it, currReadKey_, currReadValue_);
+         ldbIter.readIterData();
          return true;
       }
 
@@ -733,11 +1448,13 @@ bool InterfaceToLDB::seekTo(DB_SELECT db,
 bool InterfaceToLDB::seekToTxByHash(BinaryDataRef txHash)
 {
    SCOPED_TIMER("seekToTxByHash");
-   StoredTxHints sths = getHintsForTxHash(txHash);
+   vector<BinaryData> hints;
+   if(!getTxHintsToSearch(txHash, hints))
+      return false;
 
-   for(uint32_t i=0; i<sths.getNumHints(); i++)
+   for(uint32_t i=0; i<hints.size(); i++)
    {
-      BinaryDataRef hint = sths.getHint(i);
+      BinaryDataRef hint = hints[i].getRef();
       seekTo(BLKDATA, DB_PREFIX_TXDATA, hint);
       
       // We don't actually know for sure whether the seekTo() found a Tx or TxOut
@@ -979,6 +1696,130 @@ uint64_t InterfaceToLDB::getBalanceForScrAddr(BinaryDataRef scrAddr, bool withMu
    }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Adds the TxIOs from one sub-history, starting at startKey8B (if it's in 
+// this block).  Returns false, with nextCursor set, once the page is full.
+static bool addSubHistoryToPage(StoredSubHistory const & subssh,
+                                BinaryData const & startKey8B,
+                                uint32_t maxTxio,
+                                bool withMultisig,
+                                vector<TxIOPair> & txioList,
+                                BinaryData & nextCursor)
+{
+   map<BinaryData, TxIOPair>::const_iterator iter = subssh.txioSet_.begin();
+   if(startKey8B.startsWith(subssh.hgtX_))
+      iter = subssh.txioSet_.lower_bound(startKey8B);
+
+   for( ; iter != subssh.txioSet_.end(); iter++)
+   {
+      if(!withMultisig && iter->second.isMultisig())
+         continue;
+
+      if(txioList.size() >= maxTxio)
+      {
+         nextCursor = iter->first;
+         return false;
+      }
+
+      txioList.push_back(iter->second);
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The cursor is just the 8-byte TxOut key of the first TxIO on the next page.
+// Sub-histories are keyed by scrAddr+hgtX, so we can seek straight to it.
+// Each sub-history is one block's worth of TxIOs, which is the most we ever
+// hold in RAM besides the page itself.
+bool InterfaceToLDB::getScriptHistoryPage(BinaryDataRef      scrAddr,
+                                          uint32_t           fromHeight,
+                                          uint32_t           toHeight,
+                                          uint32_t           maxTxio,
+                                          BinaryDataRef      cursor,
+                                          vector<TxIOPair> & txioList,
+                                          BinaryData &       nextCursor,
+                                          bool               withMultisig)
+{
+   SCOPED_TIMER("getScriptHistoryPage");
+   txioList.clear();
+   nextCursor.resize(0);
+
+   // An empty page would always have a next one
+   if(maxTxio == 0)
+   {
+      LOGERR << "Script history page size must be at least 1";
+      return false;
+   }
+
+   BinaryData startKey8B = DBUtils.heightAndDupToHgtx(fromHeight, 0) +
+                           WRITE_UINT32_BE(0);
+   if(cursor.getSize() == 8)
+   {
+      // The cursor can't take us back before fromHeight
+      if(startKey8B < cursor.copy())
+         startKey8B = cursor.copy();
+   }
+   else if(cursor.getSize() != 0)
+   {
+      LOGERR << "Invalid script history cursor: " << cursor.toHexStr();
+      return false;
+   }
+   BinaryData startHgtX = startKey8B.getSliceCopy(0,4);
+
+   // Use our own iterator (and snapshot), so the pages we hand out all come
+   // from one consistent view even if the caller interleaves other DB ops
+   LDBIter ldbIter(*this, BLKDATA);
+   if(!ldbIter.seekTo(DB_PREFIX_SCRIPT, scrAddr))
+      return true;
+
+   StoredScriptHistory ssh;
+   ssh.unserializeDBKey(ldbIter.getKeyRef());
+   ssh.unserializeDBValue(ldbIter.getValueReader());
+
+   // Single-TxIO histories keep it in the base entry, no sub-histories
+   if(!ssh.useMultipleEntries_)
+   {
+      map<BinaryData, StoredSubHistory>::iterator iter;
+      for(iter  = ssh.subHistMap_.begin(); 
+          iter != ssh.subHistMap_.end(); 
+          iter++)
+      {
+         if(iter->first < startHgtX || 
+            DBUtils.hgtxToHeight(iter->first) > toHeight)
+            continue;
+
+         if(!addSubHistoryToPage(iter->second, startKey8B, maxTxio, 
+                                 withMultisig, txioList, nextCursor))
+            break;
+      }
+      return true;
+   }
+
+   uint32_t subKeySize = 1 + scrAddr.getSize() + 4;
+   ldbIter.seekTo(DB_PREFIX_SCRIPT, scrAddr.copy() + startHgtX);
+   while(ldbIter.isValid(DB_PREFIX_SCRIPT))
+   {
+      BinaryDataRef key = ldbIter.getKeyRef();
+      if(key.getSize() != subKeySize || 
+         key.getSliceRef(1, scrAddr.getSize()) != scrAddr)
+         break;
+
+      StoredSubHistory subssh;
+      subssh.unserializeDBKey(key);
+      if(DBUtils.hgtxToHeight(subssh.hgtX_) > toHeight)
+         break;
+
+      subssh.unserializeDBValue(ldbIter.getValueReader());
+      if(!addSubHistoryToPage(subssh, startKey8B, maxTxio, 
+                              withMultisig, txioList, nextCursor))
+         break;
+
+      ldbIter.advanceAndRead(DB_PREFIX_SCRIPT);
+   }
+
+   return true;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // We need the block hashes and scripts, which need to be retrieved from the
@@ -1099,7 +1940,7 @@ void InterfaceToLDB::addRegisteredScript(BinaryDataRef rawScript,
 //       sorting that is saved in the DB.  But right now, I'm not sure what
 //       that would get us since we are reading all the headers and doing
 //       a fresh organize/sort anyway.
-void InterfaceToLDB::readAllHeaders(map<HashString, BlockHeader> & headerMap,
+void InterfaceToLDB::readAllHeaders(map<HashKey, BlockHeader> & headerMap,
                                     map<HashString, StoredHeader> & storedMap)
 {
    seekTo(HEADERS, DB_PREFIX_HEADHASH, BinaryData(0));
@@ -1129,7 +1970,7 @@ void InterfaceToLDB::readAllHeaders(map<HashString, BlockHeader> & headerMap,
       sbh.unserializeDBValue(HEADERS, currReadValue_);
       regHead.unserialize(sbh.dataCopy_);
 
-      headerMap[sbh.thisHash_] = regHead;
+      headerMap[HashKey(sbh.thisHash_)] = regHead;
       storedMap[sbh.thisHash_] = sbh;
 
    } while(advanceIterAndRead(HEADERS, DB_PREFIX_HEADHASH));
@@ -1539,6 +2380,16 @@ void InterfaceToLDB::putStoredTx( StoredTx & stx, bool withTxOut)
    {
       sths.dbKeyList_.push_back(ldbKey);
       sths.preferredDBKey_ = ldbKey;
+
+      // Only the tx that find their prefix already taken get the second 
+      // entry, see getTxHintsToSearch()
+      if(txHashFilterReady_)
+      {
+         txHashFilter_.insertTx(stx.thisHash_);
+         if(sths.dbKeyList_.size() > 1)
+            txHashFilter_.insertTxAtKey(stx.thisHash_, ldbKey);
+         addedTxToHashFilter(stx.blockHeight_);
+      }
    }
 
    // Batch update the DB
@@ -1612,23 +2463,37 @@ void InterfaceToLDB::updatePreferredTxHint( BinaryDataRef hashOrPrefix,
 ////////////////////////////////////////////////////////////////////////////////
 // We assume we have a valid iterator left at the header entry for this block
 bool InterfaceToLDB::readStoredBlockAtIter(StoredHeader & sbh)
+{
+   if(iterIsDirty_[BLKDATA])
+      LOGERR << "DB has been changed since this iterator was created";
+
+   LDBIter ldbIter(iters_[BLKDATA], currReadKey_, currReadValue_);
+   return readStoredBlockAtIter(ldbIter, sbh);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::readStoredBlockAtIter(LDBIter & ldbIter, StoredHeader & sbh)
 {
    SCOPED_TIMER("readStoredBlockAtIter");
 
-   resetIterReaders();
-   BinaryData blkDataKey(currReadKey_.getCurrPtr(), 5);
+   if(!ldbIter.isValid(DB_PREFIX_TXDATA))
+      return false;
+
+   ldbIter.resetReaders();
+   BinaryRefReader & keyReader = ldbIter.getKeyReader();
+   BinaryData blkDataKey(keyReader.getCurrPtr(), 5);
 
-   BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(currReadKey_,
+   BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(keyReader,
                                                 sbh.blockHeight_,
                                                 sbh.duplicateID_);
 
    
    // Grab the header first, then iterate over 
-   sbh.unserializeDBValue(BLKDATA, currReadValue_, false);
+   sbh.unserializeDBValue(BLKDATA, ldbIter.getValueReader(), false);
    sbh.isMainBranch_ = (sbh.duplicateID_==getValidDupIDForHeight(sbh.blockHeight_));
 
    // If for some reason we hit the end of the DB without any tx, bail
-   bool iterValid = advanceIterAndRead(BLKDATA, DB_PREFIX_TXDATA);
+   bool iterValid = ldbIter.advanceAndRead(DB_PREFIX_TXDATA);
    if(!iterValid)
       return true;  // this isn't an error, it's an block w/o any StoredTx
 
@@ -1636,14 +2501,14 @@ bool InterfaceToLDB::readStoredBlockAtIter(StoredHeader & sbh)
    uint32_t tempHgt;
    uint8_t  tempDup;
    uint16_t currIdx;
-   while(iters_[BLKDATA]->Valid())
+   while(ldbIter.isValid())
    {
-      if(!currReadKey_.getRawRef().startsWith(blkDataKey))
+      if(!ldbIter.getKeyRef().startsWith(blkDataKey))
          break;
 
       // We can't just read the the tx, because we have to guarantee 
       // there's a place for it in the sbh.stxMap_
-      BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(currReadKey_, 
+      BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(keyReader, 
                                                    tempHgt, 
                                                    tempDup,
                                                    currIdx);
@@ -1659,7 +2524,8 @@ bool InterfaceToLDB::readStoredBlockAtIter(StoredHeader & sbh)
       if(KEY_NOT_IN_MAP(currIdx, sbh.stxMap_))
          sbh.stxMap_[currIdx] = StoredTx();
 
-      readStoredTxAtIter(sbh.blockHeight_, 
+      readStoredTxAtIter(ldbIter,
+                         sbh.blockHeight_, 
                          sbh.duplicateID_, 
                          sbh.stxMap_[currIdx]);
    } 
@@ -1674,13 +2540,26 @@ bool InterfaceToLDB::readStoredBlockAtIter(StoredHeader & sbh)
 bool InterfaceToLDB::readStoredTxAtIter( uint32_t height,
                                          uint8_t  dupID,
                                          StoredTx & stx)
+{
+   if(iterIsDirty_[BLKDATA])
+      LOGERR << "DB has been changed since this iterator was created";
+
+   LDBIter ldbIter(iters_[BLKDATA], currReadKey_, currReadValue_);
+   return readStoredTxAtIter(ldbIter, height, dupID, stx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::readStoredTxAtIter( LDBIter & ldbIter,
+                                         uint32_t height,
+                                         uint8_t  dupID,
+                                         StoredTx & stx)
 {
    SCOPED_TIMER("readStoredTxAtIter");
    BinaryData blkPrefix = DBUtils.getBlkDataKey(height, dupID);
 
    // Make sure that we are still within the desired block (but beyond header)
-   resetIterReaders();
-   BinaryDataRef key = currReadKey_.getRawRef();
+   ldbIter.resetReaders();
+   BinaryDataRef key = ldbIter.getKeyRef();
    if(!key.startsWith(blkPrefix) || key.getSize() < 7)
       return false;
 
@@ -1688,7 +2567,7 @@ bool InterfaceToLDB::readStoredTxAtIter( uint32_t height,
    uint32_t storedHgt;
    uint8_t  storedDup;
    uint16_t storedIdx;
-   DBUtils.readBlkDataKey(currReadKey_, storedHgt, storedDup, storedIdx);
+   DBUtils.readBlkDataKey(ldbIter.getKeyReader(), storedHgt, storedDup, storedIdx);
 
    if(storedHgt != height || storedDup != dupID)
       return false;
@@ -1709,16 +2588,16 @@ bool InterfaceToLDB::readStoredTxAtIter( uint32_t height,
    // Reset the key again, and then cycle through entries until no longer
    // on an entry with the correct prefix.  Use do-while because we've 
    // already verified the iterator is at a valid tx entry
-   resetIterReaders();
+   ldbIter.resetReaders();
    do
    {
       // Stop if key doesn't start with [PREFIX | HGT | DUP | TXIDX]
-      if(!currReadKey_.getRawRef().startsWith(txPrefix))
+      if(!ldbIter.getKeyRef().startsWith(txPrefix))
          break;
 
       // Read the prefix, height and dup 
       uint16_t txOutIdx;
-      BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(currReadKey_,
+      BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(ldbIter.getKeyReader(),
                                            stx.blockHeight_,
                                            stx.duplicateID_,
                                            stx.txIndex_,
@@ -1728,14 +2607,14 @@ bool InterfaceToLDB::readStoredTxAtIter( uint32_t height,
       if(bdtype == BLKDATA_TX)
       {
          // Get everything else from the iter value
-         stx.unserializeDBValue(currReadValue_);
+         stx.unserializeDBValue(ldbIter.getValueReader());
          nbytes += stx.dataCopy_.getSize();
       }
       else if(bdtype == BLKDATA_TXOUT)
       {
          stx.stxoMap_[txOutIdx] = StoredTxOut();
          StoredTxOut & stxo = stx.stxoMap_[txOutIdx];
-         readStoredTxOutAtIter(height, dupID, stx.txIndex_, stxo);
+         readStoredTxOutAtIter(ldbIter, height, dupID, stx.txIndex_, stxo);
          stxo.parentHash_ = stx.thisHash_;
          stxo.txVersion_  = stx.version_;
          nbytes += stxo.dataCopy_.getSize();
@@ -1745,7 +2624,7 @@ bool InterfaceToLDB::readStoredTxAtIter( uint32_t height,
          LOGERR << "Unexpected BLKDATA entry while iterating";
          return false;
       }
-   } while(advanceIterAndRead(BLKDATA, DB_PREFIX_TXDATA));
+   } while(ldbIter.advanceAndRead(DB_PREFIX_TXDATA));
 
    // If have the correct size, save it, otherwise ignore the computation
    stx.numBytes_ = stx.haveAllTxOut() ? nbytes : UINT32_MAX;
@@ -1761,17 +2640,30 @@ bool InterfaceToLDB::readStoredTxOutAtIter(
                                        uint16_t txIndex,
                                        StoredTxOut & stxo)
 {
-   if(currReadKey_.getSize() < 9)
+   LDBIter ldbIter(iters_[BLKDATA], currReadKey_, currReadValue_);
+   return readStoredTxOutAtIter(ldbIter, height, dupID, txIndex, stxo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::readStoredTxOutAtIter(
+                                       LDBIter & ldbIter,
+                                       uint32_t height,
+                                       uint8_t  dupID,
+                                       uint16_t txIndex,
+                                       StoredTxOut & stxo)
+{
+   BinaryRefReader & keyReader = ldbIter.getKeyReader();
+   if(keyReader.getSize() < 9)
       return false;
 
-   currReadKey_.resetPosition();
+   keyReader.resetPosition();
 
    // Check that we are at a tx with the correct height & dup & txIndex
    uint32_t keyHgt;
    uint8_t  keyDup;
    uint16_t keyTxIdx;
    uint16_t keyTxOutIdx;
-   DBUtils.readBlkDataKey(currReadKey_, keyHgt, keyDup, keyTxIdx, keyTxOutIdx);
+   DBUtils.readBlkDataKey(keyReader, keyHgt, keyDup, keyTxIdx, keyTxOutIdx);
 
    if(keyHgt != height || keyDup != dupID || keyTxIdx != txIndex)
       return false;
@@ -1781,7 +2673,7 @@ bool InterfaceToLDB::readStoredTxOutAtIter(
    stxo.txIndex_     = txIndex;
    stxo.txOutIndex_  = keyTxOutIdx;
 
-   stxo.unserializeDBValue(currReadValue_);
+   stxo.unserializeDBValue(ldbIter.getValueReader());
 
    return true;
 }
@@ -1837,6 +2729,215 @@ Tx InterfaceToLDB::getFullTxCopy( uint32_t hgt, uint8_t dup, uint16_t txIndex)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// One tx for getStoredTxBatch to read.  If we got here from a hash, the hash
+// is kept to check that the hint really pointed at that tx.
+class TxBatchLookup
+{
+public:
+   TxBatchLookup(void) : index_(0) {}
+   TxBatchLookup(BinaryData const & dbKey6, uint32_t index, 
+                 BinaryData const & txHash) :
+      dbKey6_(dbKey6), txHash_(txHash), index_(index) {}
+
+   bool operator<(TxBatchLookup const & rhs) const
+      { return (dbKey6_==rhs.dbKey6_ ? index_<rhs.index_ : dbKey6_<rhs.dbKey6_); }
+
+   BinaryData  dbKey6_;
+   BinaryData  txHash_;
+   uint32_t    index_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// A contiguous (in key order) range of the lookups, for one thread.  Every
+// lookup is for a different index, so the threads never write to the same 
+// StoredTx.
+class TxBatchRead
+{
+public:
+   TxBatchRead(void) : iface_(NULL), lookups_(NULL), stxList_(NULL),
+                       withTxOut_(true), start_(0), end_(0), nFound_(0) {}
+
+   InterfaceToLDB*                 iface_;
+   vector<TxBatchLookup> const *   lookups_;
+   vector<StoredTx>*               stxList_;
+   bool                            withTxOut_;
+   uint32_t                        start_;
+   uint32_t                        end_;
+   uint32_t                        nFound_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+static void readTxBatchRange(TxBatchRead & job)
+{
+   LDBIter ldbIter(*job.iface_, BLKDATA);
+   for(uint32_t i=job.start_; i<job.end_; i++)
+   {
+      TxBatchLookup const & lookup = (*job.lookups_)[i];
+      StoredTx & stx = (*job.stxList_)[lookup.index_];
+
+      // The keys are sorted, so this only ever moves the iterator forward
+      if(!ldbIter.seekTo(DB_PREFIX_TXDATA, lookup.dbKey6_))
+         continue;
+
+      uint32_t hgt;
+      uint8_t  dup;
+      uint16_t txi;
+      BinaryRefReader brrKey(lookup.dbKey6_);
+      DBUtils.readBlkDataKeyNoPrefix(brrKey, hgt, dup, txi);
+
+      if(job.withTxOut_)
+      {
+         if(!job.iface_->readStoredTxAtIter(ldbIter, hgt, dup, stx))
+            continue;
+      }
+      else
+      {
+         stx.blockHeight_ = hgt;
+         stx.duplicateID_ = dup;
+         stx.txIndex_     = txi;
+         stx.unserializeDBValue(ldbIter.getValueReader());
+      }
+
+      if(lookup.txHash_.getSize() > 0 && stx.thisHash_ != lookup.txHash_)
+      {
+         stx = StoredTx();
+         continue;
+      }
+
+      job.nFound_++;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void readTxBatchThread(void* arg)
+{
+   readTxBatchRange(*(TxBatchRead*)arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t InterfaceToLDB::getStoredTxBatch(
+                                 vector<BinaryData> const & hashesOrDBKeys,
+                                 vector<StoredTx> & stxList,
+                                 bool withTxOut,
+                                 uint32_t nThreads)
+{
+   SCOPED_TIMER("getStoredTxBatch");
+   stxList.clear();
+   stxList.resize(hashesOrDBKeys.size());
+
+   vector<TxBatchLookup> lookups;
+   lookups.reserve(hashesOrDBKeys.size());
+
+   // Hashes go through their TXHINTS entries first, which are also read 
+   // in key (prefix) order
+   vector<pair<BinaryData, uint32_t> > hashList;
+   for(uint32_t i=0; i<hashesOrDBKeys.size(); i++)
+   {
+      BinaryData const & key = hashesOrDBKeys[i];
+      if(key.getSize() == 6)
+         lookups.push_back(TxBatchLookup(key, i, BinaryData(0)));
+      else if(key.getSize() == 32)
+         hashList.push_back(pair<BinaryData, uint32_t>(key, i));
+      else
+         LOGERR << "Unrecognized input string: " << key.toHexStr();
+   }
+   sort(hashList.begin(), hashList.end());
+
+   if(hashList.size() > 0)
+   {
+      LDBIter ldbIter(*this, BLKDATA);
+      for(uint32_t i=0; i<hashList.size(); i++)
+      {
+         BinaryData const & txHash = hashList[i].first;
+         if(txHashFilterReady_ && !txHashFilter_.mayHaveTx(txHash))
+            continue;
+
+         if(!ldbIter.seekTo(DB_PREFIX_TXHINTS, txHash.getSliceRef(0,4)))
+            continue;
+
+         StoredTxHints sths;
+         sths.unserializeDBValue(ldbIter.getValueReader());
+         if(sths.getNumHints() == 1)
+         {
+            lookups.push_back(TxBatchLookup(sths.dbKeyList_[0], 
+                                            hashList[i].second, txHash));
+            continue;
+         }
+
+         // Prefix collisions are rare enough to just look up one at a time
+         TxRef ref = getTxRef(txHash);
+         if(ref.isInitialized())
+            lookups.push_back(TxBatchLookup(ref.getDBKey(), 
+                                            hashList[i].second, txHash));
+      }
+   }
+
+   sort(lookups.begin(), lookups.end());
+
+   nThreads = max((uint32_t)1, min(nThreads, (uint32_t)lookups.size()));
+   vector<TxBatchRead> jobs(nThreads);
+   uint32_t perThread = (lookups.size() + nThreads - 1) / nThreads;
+   for(uint32_t t=0; t<nThreads; t++)
+   {
+      TxBatchRead & job = jobs[t];
+      job.iface_     = this;
+      job.lookups_   = &lookups;
+      job.stxList_   = &stxList;
+      job.withTxOut_ = withTxOut;
+      job.start_     = min(t*perThread,     (uint32_t)lookups.size());
+      job.end_       = min((t+1)*perThread, (uint32_t)lookups.size());
+   }
+
+   {
+      ThreadGroup threads;
+      for(uint32_t t=1; t<nThreads; t++)
+         threads.start(readTxBatchThread, &jobs[t]);
+
+      // This thread does the first range
+      readTxBatchRange(jobs[0]);
+      threads.waitForAll();
+   }
+
+   uint32_t nFound = 0;
+   for(uint32_t t=0; t<nThreads; t++)
+      nFound += jobs[t].nFound_;
+
+   return nFound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t InterfaceToLDB::getFullTxCopyBatch(
+                                 vector<BinaryData> const & hashesOrDBKeys,
+                                 vector<Tx> & txList,
+                                 uint32_t nThreads)
+{
+   SCOPED_TIMER("getFullTxCopyBatch");
+   vector<StoredTx> stxList;
+   getStoredTxBatch(hashesOrDBKeys, stxList, true, nThreads);
+
+   uint32_t nFound = 0;
+   txList.clear();
+   txList.resize(stxList.size());
+   for(uint32_t i=0; i<stxList.size(); i++)
+   {
+      if(!stxList[i].isInitialized())
+         continue;
+
+      if(!stxList[i].haveAllTxOut())
+      {
+         LOGERR << "Requested full Tx but not all TxOut available";
+         continue;
+      }
+
+      txList[i] = stxList[i].getTxCopy();
+      nFound++;
+   }
+
+   return nFound;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TxOut InterfaceToLDB::getTxOutCopy( BinaryData ldbKey6B, uint16_t txOutIdx)
 {
@@ -1856,8 +2957,10 @@ TxOut InterfaceToLDB::getTxOutCopy( BinaryData ldbKey6B, uint16_t txOutIdx)
 
    TxRef parent(ldbKey6B, this);
 
-   brr.advance(2);
-   txoOut.unserialize(brr.getCurrPtr(), 0, parent, (uint32_t)txOutIdx);
+   // The DB value may be in the compact format, let STXO sort it out
+   StoredTxOut stxo;
+   stxo.unserializeDBValue(brr);
+   txoOut.unserialize(stxo.dataCopy_.getPtr(), 0, parent, (uint32_t)txOutIdx);
    return txoOut;
 }
 
@@ -2013,24 +3116,19 @@ bool InterfaceToLDB::getStoredTx_byHash( StoredTx & stx,
                                          BinaryDataRef txHash)
 {
    SCOPED_TIMER("getStoredTx");
-   BinaryData hash4(txHash.getSliceRef(0,4));
-   BinaryData hintsDBVal = getValue(BLKDATA, DB_PREFIX_TXHINTS, hash4);
-   uint32_t valSize = hintsDBVal.getSize();
-
-   if(valSize < 2)
+   vector<BinaryData> hints;
+   if(!getTxHintsToSearch(txHash, hints))
    {
       LOGERR << "No tx in DB with hash: " << txHash.toHexStr();
       return false;
    }
 
-   BinaryRefReader brrHints(hintsDBVal);
-   uint32_t numHints = (uint32_t)brrHints.get_var_int();
    uint32_t height;
    uint8_t  dup;
    uint16_t txIdx;
-   for(uint32_t i=0; i<numHints; i++)
+   for(uint32_t i=0; i<hints.size(); i++)
    {
-      BinaryDataRef hint = brrHints.get_BinaryDataRef(6);
+      BinaryDataRef hint = hints[i].getRef();
       seekTo(BLKDATA, DB_PREFIX_TXDATA, hint);
 
       BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(currReadKey_, height, dup, txIdx);
@@ -2218,15 +3316,21 @@ bool InterfaceToLDB::getStoredTxOut(
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::putStoredUndoData(StoredUndoData const & sud)
 {
-   LOGERR << "putStoredUndoData not implemented yet!!!";
-   return false;
+   SCOPED_TIMER("putStoredUndoData");
+   if(sud.blockHeight_ == UINT32_MAX || sud.duplicateID_ == UINT8_MAX)
+   {
+      LOGERR << "SUD does not have a valid hgt & dup to be put into DB";
+      return false;
+   }
+
+   putValue(BLKDATA, sud.getDBKey(), sud.serializeDBValue());
+   return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::getStoredUndoData(StoredUndoData & sud, uint32_t height)
 {
-   LOGERR << "getStoredUndoData not implemented yet!!!";
-   return false;
+   return getStoredUndoData(sud, height, getValidDupIDForHeight(height));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2234,33 +3338,27 @@ bool InterfaceToLDB::getStoredUndoData(StoredUndoData & sud,
                                        uint32_t         height, 
                                        uint8_t          dup)
 {
-   LOGERR << "getStoredUndoData not implemented yet!!!";
-   return false;
-
-   /*
+   SCOPED_TIMER("getStoredUndoData");
    BinaryData key = DBUtils.getBlkDataKeyNoPrefix(height, dup); 
-   BinaryRefReader brr = getValueReader(BLKDATA, DB_PREFIX_UNDODATA, key);
-
-   if(brr.getSize() == 0)
-   {
-      LOGERR << " 
-   }
+   BinaryDataRef bdr = getValueRef(BLKDATA, DB_PREFIX_UNDODATA, key);
+   if(bdr.getSize() == 0)
+      return false;
 
-   for(uint32_t i=0; i<sud.stxOutsRemovedByBlock_.size(); i++)
-   {
-      sud.stxOutsRemovedByBlock_[i].blockHeight_ = height;
-      sud.stxOutsRemovedByBlock_[i].duplicateID_ = dup;
-   }
-   */
+   sud.unserializeDBValue(bdr);
+   sud.blockHeight_ = height;
+   sud.duplicateID_ = dup;
+   return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::getStoredUndoData(StoredUndoData & sud, 
                                        BinaryDataRef    headHash)
 {
-   SCOPED_TIMER("getStoredUndoData");
-   LOGERR << "getStoredUndoData not implemented yet!!!";
-   return false;
+   StoredHeader sbh;
+   if(!getStoredHeader(sbh, headHash, false))
+      return false;
+
+   return getStoredUndoData(sud, sbh.blockHeight_, sbh.duplicateID_);
 }
 
 
@@ -2339,6 +3437,336 @@ bool InterfaceToLDB::getStoredHeadHgtList(StoredHeadHgtList & hhl, uint32_t heig
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::putStoredTrieNode(StoredTrieNode const & node)
+{
+   SCOPED_TIMER("putStoredTrieNode");
+   putValue(BLKDATA, node.getDBKey(), node.serializeDBValue());
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns true if the node is in the DB, even if it's the empty root
+bool InterfaceToLDB::getStoredTrieNode(StoredTrieNode & node, 
+                                       BinaryDataRef path)
+{
+   node.path_ = path.copy();
+   BinaryDataRef bdr = getValueRef(BLKDATA, DB_PREFIX_TRIENODES, path);
+   if(bdr.getSize() > 0)
+   {
+      node.unserializeDBValue(bdr);
+      return true;
+   }
+   else
+   {
+      node.isLeaf_ = false;
+      node.childMap_.clear();
+      return false;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryData InterfaceToLDB::getUTXOTrieRootHash(void)
+{
+   StoredTrieNode root;
+   getStoredTrieNode(root, BinaryDataRef());
+   return root.getNodeHash();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Node paths sort before everything under them, so the first node at or 
+// after the scrAddr is the top of its subtree, if it has one
+bool InterfaceToLDB::getUTXOTrieSubtree(BinaryDataRef scrAddr, 
+                                        StoredTrieNode & top)
+{
+   SCOPED_TIMER("getUTXOTrieSubtree");
+   top = StoredTrieNode();
+
+   LDBIter ldbIter(*this, BLKDATA);
+   ldbIter.seekTo(DB_PREFIX_TRIENODES, scrAddr);
+   if(!ldbIter.isValid(DB_PREFIX_TRIENODES))
+      return false;
+
+   BinaryDataRef key = ldbIter.getKeyRef();
+   if(key.getSize() <= scrAddr.getSize() || 
+      key.getSliceRef(1, scrAddr.getSize()) != scrAddr)
+      return false;
+
+   top.unserializeDBKey(key);
+   top.unserializeDBValue(ldbIter.getValueReader());
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t InterfaceToLDB::getUTXOsFromTrie(BinaryDataRef scrAddr, 
+                                          vector<UnspentTxOut> & utxoList)
+{
+   SCOPED_TIMER("getUTXOsFromTrie");
+   utxoList.clear();
+
+   uint32_t leafKeySize = 1 + scrAddr.getSize() + 8;
+   LDBIter ldbIter(*this, BLKDATA);
+   ldbIter.seekTo(DB_PREFIX_TRIENODES, scrAddr);
+   while(ldbIter.isValid(DB_PREFIX_TRIENODES))
+   {
+      BinaryDataRef key = ldbIter.getKeyRef();
+      if(key.getSize() <= scrAddr.getSize() || 
+         key.getSliceRef(1, scrAddr.getSize()) != scrAddr)
+         break;
+
+      // Branches of the subtree are in the same range, skip them
+      if(key.getSize() == leafKeySize)
+      {
+         StoredTrieNode leaf;
+         leaf.unserializeDBKey(key);
+         leaf.unserializeDBValue(ldbIter.getValueReader());
+         if(leaf.isLeaf_)
+            utxoList.push_back(leaf.getUnspentTxOut());
+      }
+
+      ldbIter.advanceAndRead(DB_PREFIX_TRIENODES);
+   }
+
+   return utxoList.size();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// All the nodes touched by one updateUTXOTrie call.  Every node on the path 
+// to a changed leaf is marked dirty, and the hashes and sums are recomputed
+// bottom-up once all the leaves are in, so a node shared by many changes is
+// only hashed and written once per batch.
+class UTXOTrieUpdate
+{
+public:
+   UTXOTrieUpdate(InterfaceToLDB & iface) : iface_(iface) {}
+
+   void insertLeaf(StoredTrieNode const & leaf);
+   void eraseLeaf(BinaryData const & path);
+   void writeChanges(void);
+
+private:
+   StoredTrieNode & getNode(BinaryData const & path);
+   void addNode(StoredTrieNode const & node);
+   void removeNode(BinaryData const & path);
+   void recomputeNode(StoredTrieNode & node);
+
+   InterfaceToLDB &                 iface_;
+   map<BinaryData, StoredTrieNode>  nodes_;
+   set<BinaryData>                  dirty_;
+   set<BinaryData>                  deleted_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+StoredTrieNode & UTXOTrieUpdate::getNode(BinaryData const & path)
+{
+   map<BinaryData, StoredTrieNode>::iterator iter = nodes_.find(path);
+   if(ITER_IN_MAP(iter, nodes_))
+      return iter->second;
+
+   StoredTrieNode & node = nodes_[path];
+   iface_.getStoredTrieNode(node, path);
+   return node;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UTXOTrieUpdate::addNode(StoredTrieNode const & node)
+{
+   nodes_[node.path_] = node;
+   dirty_.insert(node.path_);
+   deleted_.erase(node.path_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UTXOTrieUpdate::removeNode(BinaryData const & path)
+{
+   nodes_.erase(path);
+   dirty_.erase(path);
+   deleted_.insert(path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static uint32_t commonPrefixSize(BinaryData const & a, BinaryData const & b)
+{
+   uint32_t sz = min(a.getSize(), b.getSize());
+   uint32_t i = 0;
+   while(i<sz && a[i]==b[i])
+      i++;
+   return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UTXOTrieUpdate::insertLeaf(StoredTrieNode const & leaf)
+{
+   BinaryData const & key = leaf.path_;
+   StoredTrieNode * node = &getNode(BinaryData(0));
+   while(true)
+   {
+      dirty_.insert(node->path_);
+      uint32_t depth = node->path_.getSize();
+      if(node->isLeaf_ || depth >= key.getSize())
+      {
+         LOGERR << "UTXO trie leaf path is a prefix of another: " 
+                << key.toHexStr();
+         return;
+      }
+
+      map<uint8_t, StoredTrieChild>::iterator iter;
+      iter = node->childMap_.find(key[depth]);
+      if(ITER_NOT_IN_MAP(iter, node->childMap_))
+      {
+         // Nothing down this way yet, hang the leaf right here.  The hash 
+         // and sums of the new child are filled in by recomputeNode
+         StoredTrieChild & child = node->childMap_[key[depth]];
+         child.label_ = key.getSliceCopy(depth, key.getSize()-depth);
+         addNode(leaf);
+         return;
+      }
+
+      StoredTrieChild & child = iter->second;
+      BinaryData childPath = node->path_ + child.label_;
+      uint32_t common = commonPrefixSize(key, childPath);
+      if(common == childPath.getSize())
+      {
+         // Either the leaf itself (rewrite it) or a branch to descend into
+         if(common == key.getSize())
+         {
+            addNode(leaf);
+            return;
+         }
+         node = &getNode(childPath);
+         continue;
+      }
+
+      // The key leaves the child's label part way through:  split the edge
+      // with a new branch holding the old child and the new leaf
+      StoredTrieNode branch;
+      branch.path_ = key.getSliceCopy(0, common);
+
+      StoredTrieChild oldChild = child;
+      oldChild.label_ = childPath.getSliceCopy(common, 
+                                               childPath.getSize()-common);
+      branch.childMap_[oldChild.label_[0]] = oldChild;
+
+      StoredTrieChild & newChild = branch.childMap_[key[common]];
+      newChild.label_ = key.getSliceCopy(common, key.getSize()-common);
+
+      child.label_ = key.getSliceCopy(depth, common-depth);
+      addNode(branch);
+      addNode(leaf);
+      return;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UTXOTrieUpdate::eraseLeaf(BinaryData const & key)
+{
+   vector<BinaryData> pathStack;
+   StoredTrieNode * node = &getNode(BinaryData(0));
+   while(true)
+   {
+      uint32_t depth = node->path_.getSize();
+      if(node->isLeaf_ || depth >= key.getSize())
+         return;
+
+      map<uint8_t, StoredTrieChild>::iterator iter;
+      iter = node->childMap_.find(key[depth]);
+      if(ITER_NOT_IN_MAP(iter, node->childMap_))
+         return;
+
+      BinaryData childPath = node->path_ + iter->second.label_;
+      if(commonPrefixSize(key, childPath) < childPath.getSize())
+         return;
+
+      if(childPath.getSize() < key.getSize())
+      {
+         pathStack.push_back(node->path_);
+         node = &getNode(childPath);
+         continue;
+      }
+
+      // Found it
+      for(uint32_t i=0; i<pathStack.size(); i++)
+         dirty_.insert(pathStack[i]);
+      dirty_.insert(node->path_);
+
+      node->childMap_.erase(iter);
+      removeNode(key);
+
+      // A branch (other than the root) with one child left is folded into
+      // its parent's edge, to keep the trie compressed
+      if(depth == 0 || node->childMap_.size() != 1)
+         return;
+
+      StoredTrieNode & parent = getNode(pathStack.back());
+      uint32_t parentDepth = parent.path_.getSize();
+      StoredTrieChild & edge = parent.childMap_[node->path_[parentDepth]];
+      StoredTrieChild const & only = node->childMap_.begin()->second;
+      BinaryData onlyPath = node->path_ + only.label_;
+
+      edge = only;
+      edge.label_ = onlyPath.getSliceCopy(parentDepth, 
+                                          onlyPath.getSize()-parentDepth);
+      BinaryData nodePath = node->path_;
+      removeNode(nodePath);
+      return;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UTXOTrieUpdate::recomputeNode(StoredTrieNode & node)
+{
+   if(node.isLeaf_)
+      return;
+
+   map<uint8_t, StoredTrieChild>::iterator iter;
+   for(iter = node.childMap_.begin(); iter != node.childMap_.end(); iter++)
+   {
+      BinaryData childPath = node.path_ + iter->second.label_;
+      if(dirty_.count(childPath) == 0)
+         continue;
+
+      StoredTrieNode & child = getNode(childPath);
+      recomputeNode(child);
+      iter->second = child.getChildRef(node.path_);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UTXOTrieUpdate::writeChanges(void)
+{
+   recomputeNode(getNode(BinaryData(0)));
+
+   set<BinaryData>::iterator iter;
+   for(iter = dirty_.begin(); iter != dirty_.end(); iter++)
+      iface_.putStoredTrieNode(nodes_[*iter]);
+
+   for(iter = deleted_.begin(); iter != deleted_.end(); iter++)
+      iface_.deleteValue(BLKDATA, DB_PREFIX_TRIENODES, *iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::updateUTXOTrie(
+                           map<BinaryData, StoredTrieNode> const & leafMods)
+{
+   SCOPED_TIMER("updateUTXOTrie");
+   if(leafMods.size() == 0)
+      return;
+
+   UTXOTrieUpdate trieUpdate(*this);
+   map<BinaryData, StoredTrieNode>::const_iterator iter;
+   for(iter = leafMods.begin(); iter != leafMods.end(); iter++)
+   {
+      if(iter->second.isInitialized())
+         trieUpdate.insertLeaf(iter->second);
+      else
+         trieUpdate.eraseLeaf(iter->first);
+   }
+
+   trieUpdate.writeChanges();
+}
+
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -16,11 +16,13 @@
 #include "BtcUtils.h"
 #include "BlockObj.h"
 #include "StoredBlockObj.h"
+#include "ThreadUtils.h"
+#include "TxHashFilter.h"
 
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/cache.h"
-//#include "leveldb/filter_policy.h"
+#include "leveldb/filter_policy.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -34,6 +36,13 @@
 
 #define KVLIST vector<pair<BinaryData,BinaryData> > 
 
+// Memtable size for BLKDATA while bulk loading (see beginBulkLoad)
+#define LDB_BULKLOAD_WRITE_BUFFER  (128*1024*1024)
+
+// How many blocks of tx go by between saves of the tx hash filter, which is
+// at most how many we have to read back after a crash
+#define TXHASH_FILTER_SAVE_INTERVAL  2016
+
 class BlockHeader;
 class Tx;
 class TxIn;
@@ -46,6 +55,128 @@ class StoredHeader;
 class StoredTx;
 class StoredTxOut;
 class StoredScriptHistory;
+class InterfaceToLDB;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LevelDB tuning for one database.  Zero means "use LevelDB's default" for
+// all the size fields.  These are only applied when the DB is opened, so set
+// them before openDatabases() (or close and re-open to change them).
+class LDBTuning
+{
+public:
+   LDBTuning(void) :
+      blockCacheSize_(0),
+      bloomFilterBits_(10),
+      writeBufferSize_(0),
+      blockSize_(0),
+      useCompression_(false) {}
+
+   uint32_t blockCacheSize_;   // bytes of uncompressed blocks kept in RAM
+   uint32_t bloomFilterBits_;  // bits per key, 0 for no bloom filter
+   uint32_t writeBufferSize_;  // bytes in the memtable before flushing
+   uint32_t blockSize_;        // bytes of user data per on-disk block
+   bool     useCompression_;   // snappy, if LevelDB was built with it
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// A batch being written by InterfaceToLDB::commitBatchInBackground.  The
+// helper thread only touches this, never the InterfaceToLDB itself.
+class LDBBackgroundCommit
+{
+public:
+   LDBBackgroundCommit(void) : db_(NULL), batch_(NULL) {}
+
+   leveldb::DB*          db_;
+   leveldb::WriteBatch*  batch_;   // NULL if nothing is being written
+   leveldb::Status       status_;  // only valid after the thread is done
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LDBIter
+//
+// A DB iterator that belongs to the caller instead of to the InterfaceToLDB.
+// Each one has its own key/value readers and its own LevelDB snapshot, so
+// you can hold as many of them as you want, and nothing that goes through
+// the shared iterator (getStoredTx, seekToTxByHash, etc) will move them.  
+// It's just a regular object:  the iterator and snapshot are released when
+// it goes out of scope.
+//
+// Because of the snapshot, an LDBIter never sees anything written to the DB
+// after it was created, and getValueAtSnapshot() reads the DB as of that 
+// same moment.  Create a new one if you need to see newer data.
+//
+// Same rule as the shared iterator:  the refs and readers you get from it 
+// are invalid as soon as it moves.
+//
+class LDBIter
+{
+public:
+   LDBIter(InterfaceToLDB & iface, DB_SELECT db, bool fillCache=true);
+   ~LDBIter(void);
+
+   bool isValid(void) { return iter_->Valid(); }
+   bool isValid(DB_PREFIX prefix);
+
+   // Move to the lowest entry with key >= inputKey
+   bool seekTo(BinaryDataRef key);
+   bool seekTo(DB_PREFIX prefix, BinaryDataRef key);
+   bool seekToFirst(void);
+
+   // Move to the next entry.  With a prefix, returns false if the next entry
+   // has a different prefix (but the iterator is still moved)
+   bool advanceAndRead(void);
+   bool advanceAndRead(DB_PREFIX prefix);
+
+   BinaryRefReader & getKeyReader(void)   { return *currKey_; }
+   BinaryRefReader & getValueReader(void) { return *currValue_; }
+   BinaryDataRef     getKeyRef(void)      { return currKey_->getRawRef(); }
+   BinaryDataRef     getValueRef(void)    { return currValue_->getRawRef(); }
+   BinaryData        getKey(void)         { return currKey_->getRawRef().copy(); }
+   BinaryData        getValue(void)       { return currValue_->getRawRef().copy(); }
+
+   void resetReaders(void) 
+               { currKey_->resetPosition(); currValue_->resetPosition(); }
+
+   bool checkPrefixByte(DB_PREFIX prefix, bool rewindWhenDone=false);
+
+   // Point lookup that sees exactly what this iterator sees
+   BinaryData getValueAtSnapshot(BinaryDataRef key);
+
+   // Take a new snapshot and re-seek to the current key.  Holding the same
+   // snapshot for a long time keeps LevelDB from compacting away anything 
+   // that was overwritten since, so long loops should call this once in a 
+   // while, like whenever they commit a batch.
+   void refresh(void);
+
+private:
+   friend class InterfaceToLDB;
+
+   // Wraps the InterfaceToLDB's own iterator and readers, so that the old
+   // *AtIter methods can share code with the LDBIter versions.  Nothing is
+   // owned or released in this case.
+   LDBIter(leveldb::Iterator* iter, 
+           BinaryRefReader & keyReader, 
+           BinaryRefReader & valueReader);
+
+   void readIterData(void);
+
+   leveldb::DB*              db_;
+   leveldb::Iterator*        iter_;
+   leveldb::Snapshot const * snapshot_;
+   bool                      fillCache_;
+   bool                      ownsIter_;
+
+   BinaryRefReader           ownKey_;
+   BinaryRefReader           ownValue_;
+   BinaryRefReader*          currKey_;
+   BinaryRefReader*          currValue_;
+
+   LDBIter(LDBIter const &);
+   LDBIter & operator=(LDBIter const &);
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -231,6 +362,26 @@ public:
    // Sometimes, we just need to nuke everything and start over
    void destroyAndResetDatabases(void);
 
+   /////////////////////////////////////////////////////////////////////////////
+   // For filling an empty BLKDATA DB from scratch (i.e. right after 
+   // destroyAndResetDatabases).  LevelDB compacts in the background as it 
+   // goes, and with a small memtable it ends up rewriting the same raw 
+   // block data several times on its way down the levels, stalling writes 
+   // whenever it falls behind.  In bulk-load mode BLKDATA is reopened with 
+   // a much bigger memtable so it spills far fewer level-0 files, then 
+   // endBulkLoad() compacts the whole thing once and reopens it with the 
+   // regular tuning.  Refuses to start with a batch open on BLKDATA.  If
+   // BLKDATA can't be reopened, the databases are closed and these return
+   // false.
+   bool beginBulkLoad(void);
+   bool endBulkLoad(void);
+   bool isBulkLoading(void) { return bulkLoad_; }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Bring a DB written by an older ARMORY_DB_VERSION up to date, in place.
+   // The DB can be used as normal before, during and after.
+   uint32_t upgradeDBFormat(uint32_t entriesPerBatch=100000);
+
    /////////////////////////////////////////////////////////////////////////////
    bool databasesAreOpen(void) { return dbIsOpen_; }
 
@@ -306,13 +457,14 @@ public:
    // have finished before it started.  Alternatively, we may be on this block 
    // because we checked it and decide we don't care, so we want to skip it.
    bool advanceToNextBlock(bool skip=false);
+   bool advanceToNextBlock(LDBIter & ldbIter, bool skip=false);
    bool advanceIterAndRead(leveldb::Iterator* iter);
    bool advanceIterAndRead(DB_SELECT, DB_PREFIX);
 
    bool dbIterIsValid(DB_SELECT db, DB_PREFIX prefix=DB_PREFIX_COUNT);
 
    /////////////////////////////////////////////////////////////////////////////
-   void readAllHeaders(map<HashString, BlockHeader>  & headerMap,
+   void readAllHeaders(map<HashKey, BlockHeader>  & headerMap,
                        map<HashString, StoredHeader> & storedMap);
 
    /////////////////////////////////////////////////////////////////////////////
@@ -344,7 +496,7 @@ public:
    /////////////////////////////////////////////////////////////////////////////
    void loadAllStoredHistory(void); 
 
-   map<HashString, BlockHeader> getHeaderMap(void);
+   map<HashKey, BlockHeader> getHeaderMap(void);
    BinaryData getRawHeader(BinaryData const & headerHash);
    //bool addHeader(BinaryData const & headerHash, BinaryData const & headerRaw);
 
@@ -360,6 +512,18 @@ public:
    void commitBatch(DB_SELECT db);
    bool isBatchOn(DB_SELECT db)   { return batchStarts_[db] > 0; }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Same as commitBatch, except that the batch is written on a helper thread
+   // and this returns right away, so the caller can get on with the next one
+   // while LevelDB is busy with the write (and any compaction stall).  Only
+   // one can be in flight per DB:  calling this again waits for the last one.
+   //
+   // Until waitForBackgroundCommit returns, reads may or may not see what's
+   // in the batch.  The caller has to keep its own copy of anything it might
+   // need to read back before then.
+   void commitBatchInBackground(DB_SELECT db);
+   void waitForBackgroundCommit(DB_SELECT db);
+
 
    /////////////////////////////////////////////////////////////////////////////
    uint8_t getValidDupIDForHeight_fromDB(uint32_t blockHgt);
@@ -474,14 +638,28 @@ public:
                                  bool withMultisig=false);
 
    uint64_t getBalanceForScrAddr(BinaryDataRef scrAddr, bool withMulti=false);
+
+   // One page of a script history, in (height, txIndex, txOutIndex) order,
+   // read one sub-history at a time instead of loading the whole SSH.  At
+   // most maxTxio TxIOs with TxOuts in blocks fromHeight..toHeight 
+   // (inclusive) are returned.  nextCursor is where the next page starts 
+   // (pass it back in as cursor), or empty if there's nothing left.  
+   // Returns false if the cursor is bad or maxTxio is 0.
+   bool getScriptHistoryPage(BinaryDataRef      scrAddr,
+                             uint32_t           fromHeight,
+                             uint32_t           toHeight,
+                             uint32_t           maxTxio,
+                             BinaryDataRef      cursor,
+                             vector<TxIOPair> & txioList,
+                             BinaryData &       nextCursor,
+                             bool               withMultisig=false);
    
    // TODO: We should probably implement some kind of method for accessing or 
    //       running calculations on an SSH without ever loading the entire
    //       thing into RAM.  
 
-   // None of the SUD methods are implemented because we don't actually need
-   // to read/write SUD to the database -- our only mode is ARMORY_DB_SUPER
-   // which doesn't require storing undo data
+   // Undo data is only written in DB_PRUNE_ALL mode, and only kept for the
+   // blocks inside the undo window (see BlockDataManager::pruneBlkData)
    bool putStoredUndoData(StoredUndoData const & sud);
    bool getStoredUndoData(StoredUndoData & sud, uint32_t height);
    bool getStoredUndoData(StoredUndoData & sud, uint32_t height, uint8_t dup);
@@ -494,6 +672,26 @@ public:
    bool putStoredHeadHgtList(StoredHeadHgtList const & hhl);
    bool getStoredHeadHgtList(StoredHeadHgtList & hhl, uint32_t height);
 
+   // The UTXO trie (see StoredTrieNode).  The empty root is written when a
+   // new supernode BLKDATA DB is created, so a DB built before the trie 
+   // existed doesn't have one, and utxoTrieIsAvailable() returns false.
+   bool       putStoredTrieNode(StoredTrieNode const & node);
+   bool       getStoredTrieNode(StoredTrieNode & node, BinaryDataRef path);
+   bool       utxoTrieIsAvailable(void) { return utxoTrieAvailable_; }
+   BinaryData getUTXOTrieRootHash(void);
+
+   // Top node of the scrAddr's subtree:  its getValueSum() is the balance,
+   // getNumUtxo() the number of UTXOs.  False if it has no UTXOs.
+   bool       getUTXOTrieSubtree(BinaryDataRef scrAddr, StoredTrieNode & top);
+   uint32_t   getUTXOsFromTrie(BinaryDataRef scrAddr, 
+                               vector<UnspentTxOut> & utxoList);
+
+   // Apply a batch of leaf changes, keyed by leaf path, and put every node
+   // that changed into the BLKDATA batch.  An uninitialized node in the map
+   // means "remove this leaf".  Reads the trie from the DB, so the previous
+   // batch of changes must already be committed.
+   void       updateUTXOTrie(map<BinaryData, StoredTrieNode> const & leafMods);
+
    ////////////////////////////////////////////////////////////////////////////
    // Some methods to grab data at the current iterator location.  Return
    // false if reading fails (maybe because we were expecting to find the
@@ -505,6 +703,16 @@ public:
    bool readStoredTxOutAtIter(uint32_t height, uint8_t  dupID, uint16_t txIndex,
                                                             StoredTxOut & stxo);
 
+   // Same as above, but using an LDBIter instead of the shared iterator
+   bool readStoredBlockAtIter(LDBIter & ldbIter, StoredHeader & sbh);
+
+   bool readStoredTxAtIter(LDBIter & ldbIter, 
+                           uint32_t height, uint8_t dupID, StoredTx & stx);
+
+   bool readStoredTxOutAtIter(LDBIter & ldbIter,
+                              uint32_t height, uint8_t  dupID, uint16_t txIndex,
+                                                            StoredTxOut & stxo);
+
    bool readStoredScriptHistoryAtIter( StoredScriptHistory & ssh);
 
 
@@ -521,6 +729,20 @@ public:
    TxOut getTxOutCopy(  BinaryData ldbKey6B, uint16_t txOutIdx);
    TxIn  getTxInCopy(   BinaryData ldbKey6B, uint16_t txInIdx );
 
+   // Batch versions of the above, for when there are many tx to read.  Each
+   // key can be a 32-byte tx hash or a 6-byte DB key.  Instead of a random
+   // seek per tx, they're sorted into DB key order and read in one forward
+   // pass (split into nThreads contiguous ranges, each with its own LDBIter,
+   // if nThreads > 1).  Results come back in the same order as the keys;
+   // anything not found is left uninitialized.  Returns how many were found.
+   uint32_t getStoredTxBatch(vector<BinaryData> const & hashesOrDBKeys,
+                             vector<StoredTx> & stxList,
+                             bool withTxOut=true,
+                             uint32_t nThreads=1);
+   uint32_t getFullTxCopyBatch(vector<BinaryData> const & hashesOrDBKeys,
+                               vector<Tx> & txList,
+                               uint32_t nThreads=1);
+
 
    // Sometimes we already know where the Tx is, but we don't know its hash
    BinaryData getTxHashForLdbKey( BinaryDataRef ldbKey6B );
@@ -561,6 +783,24 @@ public:
    void     setMaxOpenFiles(uint32_t n) {  maxOpenFiles_ = n;   }
    uint32_t getMaxOpenFiles(void)       { return maxOpenFiles_; }
 
+   // The filter over every tx hash in BLKDATA (see TxHashFilter.h) is
+   // loaded or rebuilt by openDatabases(), so set this before opening.
+   void     setUseTxHashFilter(bool b)  { useTxHashFilter_ = b;    }
+   bool     getUseTxHashFilter(void)    { return useTxHashFilter_; }
+   bool     txHashFilterIsReady(void)   { return txHashFilterReady_; }
+   TxHashFilter const & getTxHashFilter(void) { return txHashFilter_; }
+   void     setTxHashFilterSaveInterval(uint32_t n) { txHashFilterSaveInterval_ = n; }
+
+   void      setDBTuning(DB_SELECT db, LDBTuning const & tune) 
+                                                  { dbTuning_[db] = tune; }
+   LDBTuning getDBTuning(DB_SELECT db)            { return dbTuning_[db]; }
+
+   // What the DB was actually opened with, with LevelDB defaults filled in
+   string    getDBSettingsStr(DB_SELECT db);
+
+   // LevelDB's own per-level file counts, sizes and compaction stats
+   string    getDBStatsStr(DB_SELECT db);
+
 
    KVLIST getAllDatabaseEntries(DB_SELECT db);
    void   printAllDatabaseEntries(DB_SELECT db);
@@ -573,6 +813,20 @@ public:
 
 
 private:
+   friend class LDBIter;
+
+   // Open/close just the LevelDB side of one DB, no DB-info checks
+   bool openOneDatabase(DB_SELECT db);
+   void closeOneDatabase(DB_SELECT db);
+
+   string getTxHashFilterPath(void);
+   void   loadTxHashFilter(void);
+   void   rebuildTxHashFilter(void);
+   uint32_t replayTxHashFilter(uint32_t fromHgt);
+   void   saveTxHashFilter(uint32_t hgt);
+   void   addedTxToHashFilter(uint32_t hgt);
+   bool   getTxHintsToSearch(BinaryDataRef txHash, vector<BinaryData> & hints);
+
    string               baseDir_;
 
    BinaryData           genesisBlkHash_;
@@ -587,12 +841,20 @@ private:
    leveldb::DB*           dbs_[2];  
    string                 dbPaths_[2];
    bool                   iterIsDirty_[2];
-   //leveldb::FilterPolicy* dbFilterPolicy_[2];
+
+   LDBTuning                       dbTuning_[2];
+   LDBTuning                       dbTuningInUse_[2];
+   leveldb::Options                dbOpts_[2];
+   leveldb::Cache*                 dbCache_[2];
+   leveldb::FilterPolicy const *   dbFilterPolicy_[2];
 
    // This will be incremented every time startBatch is called, decremented
    // every time commitBatch is called.  We will only *actually* start a new
    // batch when the value starts at zero, or commit when it ends at zero.
    uint32_t             batchStarts_[2];
+
+   LDBBackgroundCommit  bgCommits_[2];
+   ThreadGroup          bgCommitThreads_[2];
    
 
    vector<uint8_t>      validDupByHeight_;
@@ -608,6 +870,22 @@ private:
    leveldb::Status      lastStatus_;
 
    uint32_t             maxOpenFiles_;
+   bool                 bulkLoad_;
+
+   TxHashFilter         txHashFilter_;
+   bool                 txHashFilterReady_;
+   bool                 useTxHashFilter_;
+
+   // The file has every tx up to txHashFilterFileHgt_ (UINT32_MAX if there
+   // isn't one), and gets saved again when a tx at txHashFilterSaveHgt_ or
+   // above goes in.  txHashFilterTopHgt_ is the highest tx in the filter.
+   uint32_t             txHashFilterFileHgt_;
+   uint32_t             txHashFilterSaveHgt_;
+   uint32_t             txHashFilterTopHgt_;
+   uint32_t             txHashFilterSaveInterval_;
+
+   // Set by openDatabases() if BLKDATA has the UTXO trie root
+   bool                 utxoTrieAvailable_;
 
    // In this case, a address is any TxOut script, which is usually
    // just a 25-byte script.  But this generically captures all types